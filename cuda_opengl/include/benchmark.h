@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace benchmark {
+/// <summary>
+/// Scenes of the assets folder rendered when none is given.
+/// </summary>
+extern const std::vector<std::string> BUNDLED_SCENES;
+
+struct Resolution
+{
+  unsigned int width;
+  unsigned int height;
+};
+
+/// <summary>
+/// What a benchmark renders. Every scene is rendered from the camera of its
+/// file, at each resolution, with each kernel, always drawing the same
+/// samples, so that runs of two versions render the same images.
+/// </summary>
+struct Settings
+{
+  std::string asset_folder;
+  std::vector<std::string> scenes = BUNDLED_SCENES;
+  std::vector<Resolution> resolutions = { { 960, 540 }, { 1920, 1080 } };
+
+  /// <summary>
+  /// Samples per pixel of each render, after a few frames of warm up.
+  /// </summary>
+  unsigned int spp = 64;
+
+  /// <summary>
+  /// Folder of the reference images, named after the scene and the
+  /// resolution, against which the error of each render is measured.
+  /// With `update_references', they are rendered instead, with
+  /// `reference_spp' samples per pixel.
+  /// </summary>
+  std::string references;
+  bool update_references = false;
+  unsigned int reference_spp = 4096;
+
+  /// <summary>
+  /// JSON report written once every render is done.
+  /// </summary>
+  std::string report = "benchmark.json";
+};
+
+/// <summary>
+/// Renders every scene headless, prints a summary of each render, and writes
+/// the report: ms per frame, Mrays/s when the device counters are compiled
+/// in (Mpaths/s otherwise), peak VRAM, load time per phase, and RMSE against
+/// the reference.
+/// </summary>
+/// <returns>The exit code of the program.</returns>
+int run(const Settings& settings);
+}
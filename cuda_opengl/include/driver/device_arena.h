@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include <cstddef>
+#include <vector>
+
+namespace driver {
+/// <summary>
+/// Device memory owned by a single object, a scene for instance: aligned
+/// ranges are sub-allocated from a few large blocks, and released all at
+/// once. Ranges can be staged on the CPU when allocated, so that each block
+/// is copied to the GPU with a single copy.
+/// </summary>
+class DeviceArena
+{
+public:
+  /// <summary>
+  /// Alignment of every range, enough for any vector type, and for the
+  /// accesses of a warp to start on a segment.
+  /// </summary>
+  static constexpr size_t ALIGNMENT = 256;
+
+  /// <summary>
+  /// Size taken in an arena by a range of `size' bytes.
+  /// </summary>
+  static inline size_t alignedSize(size_t size)
+  {
+    return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+  }
+
+  /// <summary>
+  /// Allocates a block of `size' bytes, from which the next ranges are
+  /// taken. A range not fitting in the last block gets a block of its own,
+  /// so reserving the whole size up front makes a single allocation.
+  /// </summary>
+  void reserve(size_t size);
+
+  /// <summary>
+  /// Allocates an uninitialized range of `size' bytes.
+  /// </summary>
+  /// <returns>Null if `size' is 0.</returns>
+  void* allocate(size_t size);
+
+  /// <summary>
+  /// Allocates a range, to which `size' bytes of `data' are copied by the
+  /// next call to `upload'.
+  /// </summary>
+  void* stage(const void* data, size_t size);
+
+  /// <summary>
+  /// Copies the staged ranges to the GPU, one copy per block. Ranges of
+  /// these blocks allocated before the staged ones, without being staged,
+  /// are zeroed.
+  /// </summary>
+  void upload();
+
+  /// <summary>
+  /// Frees every block, along with all the ranges allocated from them.
+  /// </summary>
+  void release();
+
+  /// <summary>
+  /// VRAM taken by the blocks, in bytes.
+  /// </summary>
+  size_t capacity() const;
+
+private:
+  struct Block
+  {
+    char* data;
+    size_t size;
+    size_t offset;
+
+    /// <summary>
+    /// Content of the start of the block, up to the end of the last
+    /// staged range.
+    /// </summary>
+    std::vector<char> staged;
+  };
+
+  std::vector<Block> _blocks;
+};
+} // namespace driver
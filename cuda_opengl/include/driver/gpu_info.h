@@ -8,10 +8,12 @@
 
 namespace driver {
 /// <summary>
-/// Encapsulates information about an used GPU.
+/// Encapsulates information about an used GPU, the one current when
+/// it is created.
 /// </summary>
 class GPUInfo
 {
+public:
   struct GPU
   {
     int device_id;
@@ -45,6 +47,18 @@ public:
     return free_byte / (1024 * 1024);
   }
 
+  /// <summary>
+  /// VRAM used on the GPU, by every process, in MB.
+  /// </summary>
+  inline size_t getUsedMo()
+  {
+    size_t free_byte = 0;
+    size_t total_byte = 0;
+
+    cudaMemGetInfo(&free_byte, &total_byte);
+    return (total_byte - free_byte) / (1024 * 1024);
+  }
+
 private:
   static GPUInfo* _instance;
 
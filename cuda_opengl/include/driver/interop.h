@@ -17,7 +17,12 @@ namespace driver {
 class Interop
 {
 public:
-  Interop(unsigned int w, unsigned int h);
+  /// <summary>
+  /// Creates the framebuffers. Offscreen ones are plain CUDA arrays, which
+  /// do not need an OpenGL context: mapping, clearing and blitting them
+  /// does nothing.
+  /// </summary>
+  Interop(unsigned int w, unsigned int h, bool offscreen = false);
   Interop();
   ~Interop();
 
@@ -35,6 +40,20 @@ public:
 
   void clear();
 
+  /// <summary>
+  /// Starts a pipelined frame: swaps the framebuffers, waits for the GL
+  /// commands still reading the new back one, and maps it.
+  /// </summary>
+  cudaError_t mapNext(cudaStream_t stream);
+
+  /// <summary>
+  /// Ends a pipelined frame, whose CUDA work has been queued on `stream'.
+  /// The previous frame is presented instead: it is unmapped on a stream
+  /// of its own once rendered, so that presenting it does not wait for
+  /// the frame being rendered.
+  /// </summary>
+  cudaError_t presentPrevious(cudaStream_t stream);
+
   /// <summary>
   /// Copies the data of the front framebuffer
   /// to the framebuffer 0 (the screen)
@@ -43,10 +62,38 @@ public:
 
   cudaError_t setSize(const unsigned int w, const unsigned int h);
 
+  /// <summary>
+  /// Makes the framebuffers fp16 RGBA instead of RGBA8, keeping the colors
+  /// brighter than white. Recreates them when the format changes.
+  /// </summary>
+  cudaError_t setHalfFloat(bool half_float);
+
+  inline bool isHalfFloat() const { return _half_float; }
+
+  /// <summary>
+  /// Sets the size of the frame rendered into the front framebuffer, in
+  /// its top left corner. Blitting it stretches it to the whole screen,
+  /// filtering it when it is smaller than the framebuffer.
+  /// </summary>
+  void setRenderSize(unsigned int w, unsigned int h);
+
   inline int getIndex() { return _index; }
 
+  /// <summary>
+  /// Copies the front framebuffer to the CPU, as RGBA8 rows starting
+  /// from the top of the image. Half float framebuffers are clamped.
+  /// </summary>
+  /// <param name="out_rgba">Contains width * height texels.</param>
+  cudaError_t read(unsigned char* out_rgba);
+
   inline cudaArray_const_t getArray() { return _d_ca[_index]; }
 
+  /// <summary>
+  /// Surface object writing to the front framebuffer, created along
+  /// with it.
+  /// </summary>
+  inline cudaSurfaceObject_t getSurface() { return _surfaces[_index]; }
+
   void getSize(unsigned int& w, unsigned int& h);
 
   inline unsigned width() const { return _width; }
@@ -54,6 +101,22 @@ public:
   inline unsigned height() const { return _height; }
   inline unsigned half_height() const { return _half_height; }
 
+private:
+  void blitBuffer(int index);
+
+  /// <summary>
+  /// Unmaps the framebuffers still mapped by the pipeline.
+  /// </summary>
+  void flush();
+
+  /// <summary>
+  /// Creates the surface objects of the framebuffers, once their
+  /// arrays are known.
+  /// </summary>
+  cudaError_t createSurfaces();
+
+  void releaseSurfaces();
+
 private:
   unsigned int _width;
   unsigned int _half_width;
@@ -61,9 +124,17 @@ private:
   unsigned int _half_height;
 
   bool _allocated;
+  bool _offscreen;
+  bool _half_float;
 
   int _index;
 
+  /// <summary>
+  /// Size of the frame rendered into each framebuffer.
+  /// </summary>
+  unsigned int _render_width[2];
+  unsigned int _render_height[2];
+
   /// <summary>
   /// Framebuffers for double buffering.
   /// </summary>
@@ -79,5 +150,16 @@ private:
   /// </summary>
   cudaGraphicsResource* _d_cgr[2];
   cudaArray* _d_ca[2];
+  cudaSurfaceObject_t _surfaces[2];
+
+  /// <summary>
+  /// Pipelining: whether each framebuffer is still mapped, the event
+  /// recorded once it is rendered, and the fence signaled once GL is done
+  /// reading it.
+  /// </summary>
+  bool _mapped[2];
+  cudaEvent_t _rendered[2];
+  GLsync _presented[2];
+  cudaStream_t _present_stream;
 };
 } // namespace driver
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace scene {
+class Scene;
+}
+
+namespace driver {
+/// <summary>
+/// Hardware ray tracing through OptiX, on the GPU current when it is
+/// initialized. Each uploaded scene gets a geometry acceleration structure
+/// (GAS) per mesh, built from the same buffers as the software BVHs, and an
+/// instance acceleration structure (IAS) over its instances, traversed by
+/// the RT cores. The pipeline runs the ray generation program of
+/// raytrace.cu, compiled to PTX, which shades the hits with the same code
+/// as the kernels.
+///
+/// OptiX is only compiled in with ARTRACER_OPTIX. Without it, or when the
+/// driver does not support it, the backend is not available and frames
+/// fall back on the software traversal.
+/// </summary>
+class OptixBackend
+{
+public:
+  OptixBackend();
+  ~OptixBackend();
+
+  OptixBackend(const OptixBackend&) = delete;
+  OptixBackend& operator=(const OptixBackend&) = delete;
+
+  /// <summary>
+  /// Creates the OptiX context on the current GPU, and the pipeline from
+  /// the PTX file of the programs.
+  /// </summary>
+  /// <returns>False if OptiX is not available, the reason being
+  /// printed.</returns>
+  bool init(const std::string& ptx_path);
+
+  inline bool available() const { return _state != nullptr; }
+
+  /// <summary>
+  /// Builds the acceleration structures of an uploaded scene, replacing the
+  /// previous ones. To call again whenever its faces are modified on the
+  /// GPU, `Scene::refit' only refitting the software BVHs.
+  /// </summary>
+  void build(unsigned int scene_id, const scene::Scene& scene);
+
+  /// <summary>
+  /// Releases the acceleration structures of a scene.
+  /// </summary>
+  void release(unsigned int scene_id);
+
+  /// <summary>
+  /// Handle of the IAS of a scene, 0 if it has none: rays then miss.
+  /// </summary>
+  unsigned long long traversable(unsigned int scene_id) const;
+
+  /// <summary>
+  /// Launches the ray generation program, one thread per pixel, with the
+  /// `size' bytes of `params' as its launch parameters.
+  /// </summary>
+  void launch(const void* params, size_t size, unsigned int width,
+              unsigned int height, cudaStream_t stream);
+
+  /// <summary>
+  /// Releases every acceleration structure, the pipeline and the context.
+  /// </summary>
+  void release();
+
+private:
+  /// <summary>
+  /// OptiX objects, only defined when OptiX is compiled in.
+  /// </summary>
+  struct State;
+
+  State* _state;
+};
+} // namespace driver
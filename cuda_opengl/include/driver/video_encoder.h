@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include <vector>
+
+namespace driver {
+enum VideoCodec
+{
+  VIDEO_H264 = 0,
+  VIDEO_HEVC
+};
+
+/// <summary>
+/// Hardware video encoding through NVENC, on the GPU current when it is
+/// initialized. Frames are read from the surface the kernels write to,
+/// converted on the GPU to a buffer NVENC reads directly, and encoded with
+/// low latency settings: a single reference, no B-frame and an infinite
+/// GOP, key frames being only sent when requested. Nothing but the
+/// compressed stream goes back to the host.
+///
+/// NVENC is only compiled in with ARTRACER_NVENC. Without it, or when the
+/// GPU has no encoder, the encoder is not available.
+/// </summary>
+class VideoEncoder
+{
+public:
+  VideoEncoder();
+  ~VideoEncoder();
+
+  VideoEncoder(const VideoEncoder&) = delete;
+  VideoEncoder& operator=(const VideoEncoder&) = delete;
+
+  /// <summary>
+  /// Opens an encoding session on the current GPU, for frames of the given
+  /// size, rounded down to even sizes.
+  /// </summary>
+  /// <param name="bitrate">Target bitrate, in bits per second.</param>
+  /// <param name="fps">Expected frame rate, setting the size of the
+  /// frames the rate control targets.</param>
+  /// <returns>False if NVENC is not available, the reason being
+  /// printed.</returns>
+  bool init(unsigned int width, unsigned int height, VideoCodec codec,
+            unsigned int bitrate, unsigned int fps);
+
+  inline bool available() const { return _state != nullptr; }
+
+  /// <summary>
+  /// Reopens the session for frames of a new size, with the same settings.
+  /// </summary>
+  bool resize(unsigned int width, unsigned int height);
+
+  /// <summary>
+  /// Makes the next frame a key frame, preceded by the parameter sets, for
+  /// a decoder joining the stream.
+  /// </summary>
+  void requestKeyframe();
+
+  /// <summary>
+  /// Encodes the frame written to the top left corner of `surface', of
+  /// `render_width' by `render_height' pixels, scaled to the size of the
+  /// stream. Waits for the encoded frame.
+  /// </summary>
+  /// <param name="half_float">Whether the surface holds fp16 RGBA texels,
+  /// which are clamped, instead of RGBA8 ones.</param>
+  /// <param name="out_packet">Filled with the frame, as an Annex B
+  /// bitstream.</param>
+  /// <returns>False if the frame could not be encoded.</returns>
+  bool encode(cudaSurfaceObject_t surface, bool half_float,
+              unsigned int render_width, unsigned int render_height,
+              cudaStream_t stream, std::vector<unsigned char>& out_packet);
+
+  /// <summary>
+  /// Closes the session and releases its buffers.
+  /// </summary>
+  void release();
+
+private:
+  /// <summary>
+  /// NVENC objects, only defined when NVENC is compiled in.
+  /// </summary>
+  struct State;
+
+  State* _state;
+
+  VideoCodec _codec;
+  unsigned int _bitrate;
+  unsigned int _fps;
+};
+} // namespace driver
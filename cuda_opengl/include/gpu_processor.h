@@ -1,24 +1,80 @@
 #pragma once
 
 #include <cuda.h>
+#include <future>
+#include <memory>
 #include <vector>
 
 #include <driver/gpu_info.h>
 #include <driver/interop.h>
+#include <driver/optix_backend.h>
+#include <driver/video_encoder.h>
 
 #include <scene/scene.h>
 #include <shaders/cutils_math.h>
+#include <shaders/raytrace.h>
+#include <utils/accumulation.h>
+#include <utils/file_watcher.h>
+#include <utils/profiler.h>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
 namespace processor {
+/// <summary>
+/// Time spent in each phase of the loading, in seconds. The phases of the
+/// scenes add up the loading of every scene made resident.
+/// </summary>
+struct LoadTimes
+{
+  /// <summary>
+  /// Parsing the scene files, and uploading the cubemaps.
+  /// </summary>
+  double scene_files = 0.0;
+  double cubemaps = 0.0;
+
+  /// <summary>
+  /// Creating the processors of the other GPUs, which load the same.
+  /// </summary>
+  double peers = 0.0;
+
+  /// <summary>
+  /// Loading the meshes from the OBJ files or their cache, uploading them
+  /// along with their BVH and materials, and uploading the textures.
+  /// </summary>
+  double meshes = 0.0;
+  double upload = 0.0;
+  double textures = 0.0;
+};
+
+/// <summary>
+/// Frames accumulated offscreen by `accumulate'.
+/// </summary>
+struct OfflineStats
+{
+  /// <summary>
+  /// Samples per pixel rendered by every GPU, and the time they took.
+  /// </summary>
+  unsigned int nb_samples = 0;
+  double seconds = 0.0;
+
+  /// <summary>
+  /// Work of the kernels of every GPU, if the counters are compiled in.
+  /// </summary>
+  bool has_counters = false;
+  RenderCounters counters = RenderCounters();
+};
+
 class GPUProcessor
 {
 public:
+  /// <summary>
+  /// Creates the processor, rendering on the current GPU. Headless ones
+  /// render offscreen, and can be used without any OpenGL context.
+  /// </summary>
   GPUProcessor(const std::string& folder, std::vector<std::string> scene_names,
-               int w, int h);
+               int w, int h, bool headless = false);
 
   ~GPUProcessor();
 
@@ -37,6 +93,45 @@ public:
   /// </summary>
   void render();
 
+  /// <summary>
+  /// Renders the current scene offscreen, accumulating frames until
+  /// `spp' samples per pixel are done or `time_budget' seconds passed,
+  /// and writes the result. EXR files get the accumulated linear
+  /// radiance, .acc files its sum and sample count, to be merged with
+  /// the ones of other nodes, and any other extension the tone mapped
+  /// image as a PNG.
+  /// </summary>
+  /// <param name="spp">Samples per pixel to render, 0 for no limit.</param>
+  /// <param name="time_budget">Rendering time, in seconds, 0 for no
+  /// limit.</param>
+  /// <param name="path">Path of the image to write.</param>
+  /// <returns>False if the image could not be written.</returns>
+  bool renderOffline(unsigned int spp, double time_budget,
+                     const std::string& path);
+
+  /// <summary>
+  /// Accumulates frames of the current scene offscreen, from the first
+  /// sample, until `spp' samples per pixel are done or `time_budget'
+  /// seconds passed. Every GPU renders frames as long as some are left.
+  /// </summary>
+  OfflineStats accumulate(unsigned int spp, double time_budget);
+
+  /// <summary>
+  /// Sums the frames accumulated by every GPU. Each pixel holds the sum of
+  /// its samples, rows starting from the top of the image.
+  /// </summary>
+  image::Accumulation readAccumulation();
+
+  /// <summary>
+  /// Renders `spp' samples per pixel of several views of the current scene
+  /// offscreen, at the size of the screen. Each frame traces every view
+  /// with a single launch, on the GPU of this processor only.
+  /// </summary>
+  /// <returns>The sum of the samples of each view, rows starting from the
+  /// top of the image.</returns>
+  std::vector<image::Accumulation> accumulateViews(
+    const std::vector<scene::Camera>& cameras, unsigned int spp);
+
   /// <summary>
   /// Whenever a resize event occurs, we should resize
   /// the OpenGL interop buffers.
@@ -69,11 +164,263 @@ public:
 
   bool isKeyPressed(const unsigned int key);
 
+  /// <summary>
+  /// Renders like `render', but presents the previous frame instead of
+  /// waiting for this one, so that the GPU keeps rendering while GL
+  /// presents and the GUI is drawn.
+  /// </summary>
+  void renderPipelined();
+
+  /// <summary>
+  /// Attaches the device counters of the frame to the profiler, which
+  /// waits for the frame when they are compiled in.
+  /// </summary>
+  void readFrameCounters();
+
+  /// <summary>
+  /// Runs the selected kernel on the current framebuffer.
+  /// </summary>
+  void trace();
+
+  /// <summary>
+  /// Encodes the current framebuffer to the video packet when streaming.
+  /// </summary>
+  void encodeFrame();
+
+  /// <summary>
+  /// Creates a headless processor on each of the other GPUs, with the
+  /// same scenes, to render the same frames with other samples.
+  /// </summary>
+  void createPeers();
+
+  /// <summary>
+  /// Sends the state of the frame to the peers, and starts their frames.
+  /// </summary>
+  void tracePeers();
+
+  /// <summary>
+  /// Copies the frames accumulated by the peers to this GPU, and writes
+  /// the average of all of them to the current framebuffer.
+  /// </summary>
+  void mergePeers();
+
+  /// <summary>
+  /// Uploads a scene and its textures if they are not resident, evicting
+  /// the least recently used scenes when going over the VRAM budget.
+  /// </summary>
+  void makeResident(int scene_id);
+
+  /// <summary>
+  /// Loads the materials of a scene, on the CPU, if it has none yet. The
+  /// peers share the ones of the primary GPU, and thus their textures.
+  /// </summary>
+  void loadMaterials(int scene_id);
+
+  /// <summary>
+  /// Releases a scene, and the textures no other resident scene uses.
+  /// </summary>
+  void evict(int scene_id);
+
+  /// <summary>
+  /// Loads a scene on the CPU in the background, so that selecting it
+  /// only has to upload it.
+  /// </summary>
+  void prefetch(int scene_id);
+
+  void waitPrefetch();
+
+  /// <summary>
+  /// Uploads the textures of a scene that are not resident yet, and the
+  /// texture table.
+  /// </summary>
+  void uploadSceneTextures(const scene::Scene& scene);
+
+  /// <summary>
+  /// Releases the given textures when no resident scene uses them anymore.
+  /// </summary>
+  void releaseUnusedTextures(const std::vector<int>& ids);
+
+  /// <summary>
+  /// Polls the sources of the current scene, a few times per second, and
+  /// reloads it when some were modified.
+  /// </summary>
+  void pollSources(float delta);
+
+  /// <summary>
+  /// Updates a resident scene, on every GPU, after some of its sources
+  /// were modified, uploading it again when it cannot be updated in place.
+  /// The sources are only read by this GPU, the peers copy its updates.
+  /// </summary>
+  void reloadScene(int scene_id, const std::vector<std::string>& modified);
+
+  /// <summary>
+  /// Updates the copy of a scene on a peer from the reloaded one.
+  /// </summary>
+  /// <param name="source">Scene reloaded by the primary GPU.</param>
+  /// <param name="changes">`SceneChange' flags returned by its reload.
+  /// </param>
+  void copyReload(int scene_id, const scene::Scene& source,
+                  unsigned int changes);
+
+  /// <summary>
+  /// Updates the textures and the acceleration structures of a reloaded
+  /// scene, or uploads it again when it was released.
+  /// </summary>
+  /// <param name="ids">Textures used by the scene before the reload.</param>
+  void applyReload(int scene_id, const std::vector<int>& ids,
+                   unsigned int changes);
+
+  /// <summary>
+  /// Updates the pointer to a scene in the GPU list, null when the scene
+  /// is not resident.
+  /// </summary>
+  void uploadScenePointer(int scene_id);
+
+  inline AccumulationBuffer temporalFramebuffer() const
+  {
+    AccumulationBuffer framebuffer;
+    framebuffer.data = _d_temporal_framebuffer;
+    framebuffer.format = _accumulation_format;
+    return framebuffer;
+  }
+
+  /// <summary>
+  /// Surface of the current framebuffer, along with its format.
+  /// </summary>
+  inline OutputSurface outputSurface()
+  {
+    OutputSurface surface;
+    surface.surface = _interop.getSurface();
+    surface.format = _interop.isHalfFloat() ? OUTPUT_RGBA16F : OUTPUT_RGBA8;
+    return surface;
+  }
+
 public:
   inline void setMoved(bool moved) { _moved = moved; }
 
+  /// <summary>
+  /// Uploads the meshes using the indexed layout, to call before `init'.
+  /// </summary>
+  inline void setIndexed(bool indexed)
+  {
+    for (auto& scene : _raw_scenes)
+      scene.setIndexed(indexed);
+  }
+
+  /// <summary>
+  /// Uploads the material textures as RGBA8 instead of float RGBA,
+  /// to call before `init'. HDR textures are clamped to [0, 1].
+  /// </summary>
+  inline void setRGBA8Textures(bool rgba8) { _rgba8_textures = rgba8; }
+
+  /// <summary>
+  /// Stores the cubemaps as fp16 instead of float RGBA, to call before
+  /// `init'. Radiance over the largest fp16 is clamped.
+  /// </summary>
+  inline void setHalfCubemaps(bool half_float) { _half_cubemaps = half_float; }
+
+  /// <summary>
+  /// Sets the layout of the temporal framebuffers, to call before `init'.
+  /// Packed layouts take less bandwidth, fp16 means losing the updates of
+  /// the long accumulations.
+  /// </summary>
+  void setAccumulationFormat(AccumulationFormat format);
+
+  /// <summary>
+  /// Sets the format of the framebuffers the colors are written to. fp16
+  /// framebuffers keep the colors brighter than white.
+  /// </summary>
+  inline void setOutputFormat(OutputFormat format)
+  {
+    _interop.setHalfFloat(format == OUTPUT_RGBA16F);
+  }
+
+  /// <summary>
+  /// Sets the VRAM, in MB, that resident scenes can use, to call before
+  /// `init'. By default, 90% of the memory free after the initialization.
+  /// </summary>
+  inline void setVRAMBudget(size_t budget) { _vram_budget = budget; }
+
+  /// <summary>
+  /// Sets the VRAM, in MB, the meshes of a scene can take, to call before
+  /// `init'. Larger meshes are streamed from the host memory through a
+  /// cache of this size. By default, half of the VRAM budget.
+  /// </summary>
+  inline void setGeometryCache(size_t size) { _geometry_cache = size; }
+
+  /// <summary>
+  /// Sets the number of GPUs rendering each frame, 0 for all of them, to
+  /// call before `init'. Scenes are uploaded to each GPU, accumulating
+  /// their own samples, which are merged on this processor's GPU.
+  /// </summary>
+  inline void setGPUCount(unsigned int count) { _gpu_count = count; }
+
+  /// <summary>
+  /// Sets the first sample rendered by `renderOffline'. Nodes of a render
+  /// farm rendering the same frame start from distinct samples.
+  /// </summary>
+  inline void setSampleOffset(unsigned int offset) { _sample_offset = offset; }
+
+  /// <summary>
+  /// Presents each frame while the next one renders, at the cost of a
+  /// frame of latency.
+  /// </summary>
+  inline void setPipelined(bool pipelined) { _pipelined = pipelined; }
+
+  /// <summary>
+  /// Sets the sampler drawing the random numbers of the paths, among
+  /// `getSamplerItems()'.
+  /// </summary>
+  inline void setSamplerId(int sampler_id) { _sampler_id = sampler_id; }
+
+  /// <summary>
+  /// Watches the files of the current scene, updating it whenever they are
+  /// saved: lights, materials and meshes keeping their size are copied
+  /// over the resident ones, the others making the scene upload again.
+  /// </summary>
+  inline void setHotReload(bool hot_reload) { _hot_reload = hot_reload; }
+
+  /// <summary>
+  /// Starts encoding every rendered frame with NVENC, at the size of the
+  /// screen, to call after `init'.
+  /// </summary>
+  /// <param name="bitrate">Target bitrate, in bits per second.</param>
+  /// <returns>False if NVENC is not available.</returns>
+  bool startStreaming(driver::VideoCodec codec, unsigned int bitrate);
+
+  /// <summary>
+  /// Makes the next encoded frame a key frame, for a client joining the
+  /// stream.
+  /// </summary>
+  inline void requestKeyframe() { _encoder.requestKeyframe(); }
+
+  /// <summary>
+  /// Encodes the rendered frames only while a client watches them, as
+  /// reading the bitstream back waits for the encoder.
+  /// </summary>
+  inline void setStreaming(bool streaming) { _streaming = streaming; }
+
+  /// <summary>
+  /// Bitstream of the last rendered frame, empty when not streaming or
+  /// when no client is connected.
+  /// </summary>
+  inline const std::vector<unsigned char>& getVideoPacket() const
+  {
+    return _video_packet;
+  }
+
   inline driver::Interop& getInterop() { return _interop; }
 
+  inline driver::GPUInfo& getGPUInfo() { return _gpu_info; }
+
+  inline const LoadTimes& getLoadTimes() const { return _load_times; }
+
+  /// <summary>
+  /// Timings of the stages of the last frames, and the device counters
+  /// when they are compiled in. Only windowed processors are profiled.
+  /// </summary>
+  inline profiling::Profiler& getProfiler() { return _profiler; }
+
   inline scene::Camera& getCamera() { return _camera; }
 
   inline const std::vector<std::string>& getSceneItems() const
@@ -91,12 +438,57 @@ public:
     return _post_names;
   }
 
+  inline const std::vector<std::string>& getKernelItems()
+  {
+    return _kernel_names;
+  }
+
+  inline const std::vector<std::string>& getSamplerItems()
+  {
+    return _sampler_names;
+  }
+
   inline int& getSceneId() { return _scene_id; }
 
   inline int& getCubemapId() { return _cubemap_id; }
 
   inline int& getPostProcessId() { return _post_id; }
 
+  inline int& getKernelId() { return _kernel_id; }
+
+  inline int& getSamplerId() { return _sampler_id; }
+
+  /// <summary>
+  /// Whether the accumulated samples are reprojected when the camera
+  /// moves, instead of being discarded.
+  /// </summary>
+  inline bool& getReprojection() { return _reprojection; }
+
+  /// <summary>
+  /// Whether the displayed frames are denoised.
+  /// </summary>
+  inline bool& getDenoise() { return _denoise; }
+
+  /// <summary>
+  /// Whether pixels trace more paths the noisier they are, and stop
+  /// once they converged.
+  /// </summary>
+  inline bool& getAdaptive() { return _adaptive; }
+
+  /// <summary>
+  /// Whether the wavefront kernel reorders its queues between the stages
+  /// of a bounce, by material and by ray direction and origin.
+  /// </summary>
+  inline bool& getRayReordering() { return _ray_reordering; }
+
+  /// <summary>
+  /// Whether moving frames are rendered at a lower resolution when they
+  /// take longer than the frame time target, in ms, and upscaled.
+  /// </summary>
+  inline bool& getDynamicResolution() { return _dynamic_resolution; }
+
+  inline float& getFrameTarget() { return _frame_target_ms; }
+
 private:
   std::string _asset_folder;
 
@@ -109,6 +501,21 @@ private:
   std::vector<std::string> _post_names = { "None", "Grayscale", "Sepia",
                                            "Inversion" };
 
+  /// <summary>
+  /// Implementations of the path tracer. Depending on the scene, persistent
+  /// threads or the wavefront one can be more efficient on long paths.
+  /// "OptiX" is added when the GPU supports it.
+  /// </summary>
+  std::vector<std::string> _kernel_names = { "Megakernel", "Persistent",
+                                             "Wavefront" };
+
+  /// <summary>
+  /// Samplers of the random numbers of the paths. Low discrepancy ones
+  /// converge faster than independent samples.
+  /// </summary>
+  std::vector<std::string> _sampler_names = { "Sobol", "Rank-1",
+                                              "Random" };
+
   scene::Camera _camera;
   scene::Cubemap _cubemap;
 
@@ -118,16 +525,155 @@ private:
   int _prev_scene_id;
   int _cubemap_id;
   int _post_id;
+  int _kernel_id;
+  int _sampler_id;
 
   driver::Interop _interop;
   driver::GPUInfo _gpu_info;
   cudaStream_t _stream;
 
+  /// <summary>
+  /// Hardware ray tracing, holding the acceleration structures of the
+  /// resident scenes when available.
+  /// </summary>
+  driver::OptixBackend _optix;
+
+  /// <summary>
+  /// Hardware encoding of the rendered frames, open while streaming, and
+  /// the bitstream of the last one.
+  /// </summary>
+  driver::VideoEncoder _encoder;
+  std::vector<unsigned char> _video_packet;
+  bool _streaming;
+
+  profiling::Profiler _profiler;
+
+  LoadTimes _load_times;
+
+  /// <summary>
+  /// GPU this processor renders on.
+  /// </summary>
+  int _device;
+
+  /// <summary>
+  /// Recorded once the last frame of this processor can be overwritten:
+  /// after it is rendered on peers, after it is merged on the others.
+  /// </summary>
+  cudaEvent_t _frame_done;
+
+  /// <summary>
+  /// Number of frames accumulated since the camera last moved.
+  /// </summary>
+  unsigned int _nb_frames;
+
+  /// <summary>
+  /// Processors of the other GPUs, and the copies of their
+  /// accumulation buffers on this GPU. Peers point to the processor that
+  /// created them, null on the primary GPU.
+  /// </summary>
+  unsigned int _gpu_count;
+  std::vector<std::unique_ptr<GPUProcessor>> _peers;
+  std::vector<void*> _peer_framebuffers;
+  GPUProcessor* _primary;
+
+  unsigned int _sample_offset;
+
+  bool _pipelined;
+
+  /// <summary>
+  /// Hot reloading: the sources of the scene watched, and the time since
+  /// they were last polled.
+  /// </summary>
+  bool _hot_reload;
+  utils::FileWatcher _watcher;
+  int _watched_scene;
+  float _watch_elapsed;
+
   /// <summary>
   /// The temporal buffer is used to accumulate several
   /// frame, allowing to converge when there is no move.
   /// </summary>
-  float3* _d_temporal_framebuffer;
+  void* _d_temporal_framebuffer;
+  AccumulationFormat _accumulation_format;
+
+  /// <summary>
+  /// Allocated when the wavefront kernel is first used,
+  /// and released whenever the screen is resized.
+  /// </summary>
+  WavefrontBuffers* _wavefront;
+
+  /// <summary>
+  /// Bins the queues of the wavefront kernel between its stages.
+  /// </summary>
+  bool _ray_reordering;
+
+  /// <summary>
+  /// History of the reprojected accumulation, allocated while it is
+  /// enabled. Frames merged from several GPUs are not reprojected.
+  /// </summary>
+  bool _reprojection;
+  ReprojectionBuffers* _reprojection_buffers;
+
+  /// <summary>
+  /// Feature buffers of the denoiser, allocated while it is enabled.
+  /// Frames merged from several GPUs are not denoised.
+  /// </summary>
+  bool _denoise;
+  DenoiserBuffers* _denoiser;
+
+  /// <summary>
+  /// Moments of the samples of each pixel, allocated while adaptive
+  /// sampling is enabled. It is disabled on several GPUs, whose frames are
+  /// merged assuming every pixel has the same number of samples.
+  /// </summary>
+  bool _adaptive;
+  AdaptiveBuffers* _adaptive_buffers;
+
+  /// <summary>
+  /// Dynamic resolution: the scale of the resolution of moving frames,
+  /// adjusted after each of them from the time of the last frame, and the
+  /// size of the last frame rendered. Static frames always accumulate at
+  /// the size of the screen. Disabled when reprojecting, or when rendering
+  /// on several GPUs.
+  /// </summary>
+  bool _dynamic_resolution;
+  float _frame_target_ms;
+  float _render_scale;
+  float _last_frame_ms;
+  unsigned int _render_width;
+  unsigned int _render_height;
+
+  /// <summary>
+  /// Stores material textures with 8 bits per channel, colors being
+  /// encoded in sRGB. Uses 4 times less VRAM than float textures.
+  /// </summary>
+  bool _rgba8_textures;
+
+  /// <summary>
+  /// Stores the cubemaps with 16 bits floats, halving their VRAM.
+  /// </summary>
+  bool _half_cubemaps;
+
+  /// <summary>
+  /// Residency of the scenes: VRAM used by each resident scene,
+  /// and the last time it was selected, for the LRU eviction.
+  /// </summary>
+  size_t _vram_budget;
+  size_t _geometry_cache;
+  std::vector<size_t> _scene_vram;
+  std::vector<unsigned long long> _scene_last_use;
+  unsigned long long _use_counter;
+
+  /// <summary>
+  /// CPU copy of the texture table, indexed by texture id.
+  /// Textures that are not resident have a null array.
+  /// </summary>
+  std::vector<scene::TextureObject> _textures;
+
+  /// <summary>
+  /// Loading of the next likely scene.
+  /// </summary>
+  std::future<void> _prefetch;
 
   bool _keys[65536];
   bool _moved;
@@ -4,6 +4,12 @@
 #include <GLFW/glfw3.h>
 #include <scene/scene_data.h>
 
+#include <string>
+
+namespace profiling {
+class Profiler;
+}
+
 namespace gui {
 /// <summary>
 /// Singleton of the UI. This can be use everywhere
@@ -39,8 +45,22 @@ public:
 
   void postProcess(int& post_id, const std::vector<std::string>& items);
 
+  void kernel(int& kernel_id, const std::vector<std::string>& items,
+              int& sampler_id, const std::vector<std::string>& samplers,
+              bool& reprojection, bool& denoise, bool& adaptive,
+              bool& ray_reordering, bool& dynamic_resolution,
+              float& frame_target_ms);
+
   void camera(scene::Camera& cam, float h_offset = 0.0f);
 
+  /// <summary>
+  /// Shows the timings of the last frames as rolling histograms, along
+  /// with the device counters, and saves them as JSON to `json_path' on
+  /// demand.
+  /// </summary>
+  void profiler(const profiling::Profiler& profiler,
+                const std::string& json_path);
+
 private:
   static GUIManager* _instance;
 
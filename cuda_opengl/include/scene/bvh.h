@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+
+#include "scene/scene_data.h"
+
+namespace scene {
+/// <summary>
+/// Axis-aligned bounding box, used while building the BVHs.
+/// </summary>
+struct AABB
+{
+  float3 min;
+  float3 max;
+};
+
+namespace bvh {
+/// <summary>
+/// Bounds of the box `box' once moved by the affine transform `m', made of
+/// its eight transformed corners.
+/// </summary>
+__host__ __device__ inline AABB
+transformBox(const AABB& box, const float4 m[3])
+{
+  AABB out;
+  for (int c = 0; c < 8; ++c) {
+    const float3 corner = make_float3(c & 1 ? box.max.x : box.min.x,
+                                      c & 2 ? box.max.y : box.min.y,
+                                      c & 4 ? box.max.z : box.min.z);
+    const float3 p = transformPoint(m, corner);
+    if (c == 0)
+      out = { p, p };
+    out.min = make_float3(fminf(out.min.x, p.x), fminf(out.min.y, p.y),
+                          fminf(out.min.z, p.z));
+    out.max = make_float3(fmaxf(out.max.x, p.x), fmaxf(out.max.y, p.y),
+                          fmaxf(out.max.z, p.z));
+  }
+  return out;
+}
+
+/// <summary>
+/// Creates an empty box, ready to be grown.
+/// </summary>
+AABB emptyBox();
+
+/// <summary>
+/// Grows the box `box' to contains the point `p'.
+/// </summary>
+void grow(AABB& box, const float3& p);
+
+/// <summary>
+/// Grows the box `box' to contains the box `b'.
+/// </summary>
+void grow(AABB& box, const AABB& b);
+
+/// <summary>
+/// Builds a BVH over a list of primitives using the Surface Area Heuristic.
+/// Primitives are binned along the largest axis of their centroids bounds.
+/// </summary>
+/// <param name="boxes">Bounding box of each primitive.</param>
+/// <param name="out_nodes">Contains the nodes, the root being the first
+/// one.</param>
+/// <param name="out_order">Contains, for each leaf slot, the index of the
+/// primitive it references. Primitives should be reordered according to it
+/// before being uploaded.</param>
+void build(const std::vector<AABB>& boxes, std::vector<BVHNode>& out_nodes,
+           std::vector<unsigned int>& out_order);
+} // namespace bvh
+} // namespace scene
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include "scene/scene_data.h"
+
+namespace scene {
+namespace cubemap {
+/// <summary>
+/// Creates, on the GPU, the cubemap of an environment image decoded on the
+/// CPU. The image is either a cube cross, 4 faces wide and 3 faces high, or
+/// an equirectangular panorama, twice as wide as high, whose faces are a
+/// quarter of its width. Every level of the mip chain is prefiltered from
+/// the previous one, blurring the environment over the angle of its texels,
+/// and the distribution importance sampling it is built from the first
+/// level.
+/// </summary>
+/// <param name="pixels">Linear pixels, `nb_chan' floats each, rows starting
+/// from the top of the image.</param>
+/// <param name="half_float">Stores the texels as fp16 instead of floats,
+/// taking half the VRAM. Values are clamped to the largest fp16.</param>
+/// <param name="out">Contains the cubemap.</param>
+/// <returns>False if the image is neither a cube cross nor a
+/// panorama.</returns>
+bool create(const float* pixels, unsigned int width, unsigned int height,
+            unsigned int nb_chan, bool half_float, Cubemap& out,
+            cudaStream_t stream = 0);
+
+/// <summary>
+/// Releases the GPU storage of a cubemap.
+/// </summary>
+void release(Cubemap& cubemap);
+} // namespace cubemap
+} // namespace scene
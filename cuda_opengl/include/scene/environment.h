@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include "scene/scene_data.h"
+
+namespace scene {
+namespace environment {
+/// <summary>
+/// Builds, on the GPU, the distribution used to importance sample a cubemap.
+/// Each texel is weighted by its luminance and by the solid angle it covers,
+/// and the CDFs of the rows and of the texels inside each row are computed
+/// using parallel scans.
+/// </summary>
+/// <param name="texels">GPU texels of the first level of the cubemap, as 4
+/// floats per texel, laid out face after face.</param>
+/// <param name="size">Size of a face of the cubemap.</param>
+/// <param name="stream">Stream on which the build is made.</param>
+/// <returns>The distribution, whose buffers are on the GPU.</returns>
+EnvironmentDistribution build(const float* texels, unsigned int size,
+                              cudaStream_t stream = 0);
+
+/// <summary>
+/// Releases the GPU buffers of a distribution.
+/// </summary>
+void release(EnvironmentDistribution& distribution);
+} // namespace environment
+} // namespace scene
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+#include "scene_data.h"
+
+namespace scene {
+/// <summary>
+/// Out-of-core meshes of a scene too large for the VRAM. Every mesh, along
+/// with its BVH, lives in pinned host memory mapped on the GPU, which the
+/// kernels read over the bus. The meshes their rays reach are requested
+/// through `SceneData::mesh_states', and copied between frames to a cache of
+/// fixed size in VRAM, the least recently used ones being paged out when it
+/// is full. The table of the meshes always points to a valid copy, so frames
+/// never wait for the geometry, they only get faster once it is resident.
+///
+/// Host memory is mapped at the same address on the GPU, which unified
+/// addressing guarantees on every 64 bits platform. As a device arena, the
+/// memory is only freed by `release'.
+/// </summary>
+class GeometryStream
+{
+public:
+  GeometryStream();
+
+  /// <summary>
+  /// Allocates the pinned host copy of meshes of the given sizes, in bytes,
+  /// and a cache of `capacity' bytes in VRAM.
+  /// </summary>
+  void init(const std::vector<size_t>& sizes, size_t capacity);
+
+  /// <summary>
+  /// Range of the host copy of a mesh, where its buffers are to be written.
+  /// </summary>
+  char* hostRange(unsigned int mesh_id) const;
+
+  /// <summary>
+  /// Starts streaming the meshes of an uploaded scene, every one of them
+  /// being paged out.
+  /// </summary>
+  /// <param name="meshes">Meshes, pointing to their host range.</param>
+  /// <param name="d_meshes">Table of the meshes on the GPU.</param>
+  /// <param name="d_states">States of the meshes on the GPU.</param>
+  void bind(const std::vector<Mesh>& meshes, Mesh* d_meshes,
+            unsigned int* d_states);
+
+  /// <summary>
+  /// Alternately reads back the states marked by the frames queued on
+  /// `stream' since the last call, and, once they arrived, pages in the
+  /// meshes they requested and resets them. To call after each frame: it
+  /// never waits for the GPU.
+  /// </summary>
+  void update(cudaStream_t stream);
+
+  /// <summary>
+  /// Pages every mesh out, to call when their host copies are modified.
+  /// Waits for the GPU.
+  /// </summary>
+  void invalidate();
+
+  /// <summary>
+  /// Frees the host copy and the cache, once the frames using them are
+  /// done.
+  /// </summary>
+  void release();
+
+  inline bool enabled() const { return _host != nullptr; }
+
+  /// <summary>
+  /// Size of the cache in VRAM, in bytes.
+  /// </summary>
+  inline size_t capacity() const { return _capacity; }
+
+private:
+  /// <summary>
+  /// Location of a mesh: its range in the host copy, and in the cache when
+  /// it is resident, along with the last frame that used it.
+  /// </summary>
+  struct Page
+  {
+    size_t host_offset;
+    size_t size;
+    size_t cache_offset;
+    bool resident;
+    unsigned long long last_use;
+  };
+
+  /// <summary>
+  /// Handles the states read back: records the meshes used, and pages in
+  /// the requested ones.
+  /// </summary>
+  void process(cudaStream_t stream);
+
+  /// <summary>
+  /// Copies a mesh to the cache, paging out the least recently used ones
+  /// until it fits.
+  /// </summary>
+  /// <returns>False if it does not fit without paging out a mesh used by
+  /// the last frame read back.</returns>
+  bool pageIn(unsigned int mesh_id, cudaStream_t stream);
+
+  void pageOut(unsigned int mesh_id);
+
+  /// <summary>
+  /// First fit allocation of a range of the cache.
+  /// </summary>
+  bool allocate(size_t size, size_t& out_offset);
+
+  void free(size_t offset, size_t size);
+
+  char* _host;
+  std::vector<Page> _pages;
+
+  char* _cache;
+  size_t _capacity;
+
+  /// <summary>
+  /// Free ranges of the cache, by offset.
+  /// </summary>
+  std::map<size_t, size_t> _free;
+
+  /// <summary>
+  /// Meshes pointing to their host copy, and the table uploaded to the GPU,
+  /// pointing to the copy the kernels read.
+  /// </summary>
+  std::vector<Mesh> _host_meshes;
+  std::vector<Mesh> _table;
+  Mesh* _d_meshes;
+
+  /// <summary>
+  /// States of the meshes on the GPU, and their pinned copy, read back
+  /// asynchronously: `_states_read' is recorded once it is written.
+  /// </summary>
+  unsigned int* _d_states;
+  unsigned int* _h_states;
+  cudaEvent_t _states_read;
+  bool _pending;
+
+  unsigned long long _frame;
+};
+} // namespace scene
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include <vector>
+
+#include "scene/scene_data.h"
+
+namespace scene {
+namespace lbvh {
+/// <summary>
+/// GPU scratch of the refits: the parent of each node, and the flags
+/// merging its children. It is kept by the caller, e.g. in the arena of a
+/// scene, so that refitting meshes updated each frame does not allocate.
+/// Refits sharing a scratch must be made on the same stream.
+/// </summary>
+struct RefitScratch
+{
+  int* data = nullptr;
+  unsigned int nb_nodes = 0;
+
+  /// <summary>
+  /// Size of the scratch of BVHs of up to `nb_nodes' nodes, in bytes.
+  /// </summary>
+  static size_t bytes(unsigned int nb_nodes)
+  {
+    return 2 * (size_t)nb_nodes * sizeof(int);
+  }
+};
+
+/// <summary>
+/// Builds the BVH of a mesh whose triangles are already on the GPU,
+/// following the Karras method: triangles are sorted by the Morton code of
+/// their centroid using a radix sort, and the whole hierarchy is then emitted
+/// in parallel.
+///
+/// Triangles and faces, or indices for an indexed mesh, are reordered in
+/// place, and the nodes are written to `mesh.bvh', allocated by the caller.
+/// </summary>
+/// <param name="mesh">Mesh containing GPU triangles and faces, or GPU
+/// indices and vertices, and a GPU BVH of 2 * N - 1 nodes for its N
+/// faces.</param>
+/// <param name="out_order">Contains the source face of each sorted face, so
+/// that new vertices of the faces can later be sorted the same way and
+/// refit.</param>
+/// <param name="stream">Stream on which the build is made.</param>
+void build(Mesh& mesh, std::vector<unsigned int>& out_order,
+           cudaStream_t stream = 0);
+
+/// <summary>
+/// Refits the BVH of a mesh whose triangles have moved, without changing its
+/// topology. This works with any BVH, built on the CPU or on the GPU. The
+/// refit is only enqueued on `stream', and does not allocate.
+/// </summary>
+/// <param name="mesh">Mesh containing GPU triangles and BVH.</param>
+/// <param name="scratch">Scratch of at least as many nodes as the
+/// BVH.</param>
+/// <param name="stream">Stream on which the refit is made.</param>
+void refit(const Mesh& mesh, const RefitScratch& scratch,
+           cudaStream_t stream = 0);
+
+/// <summary>
+/// Refits a top-level BVH, after the BVHs of its meshes have been refitted,
+/// or its instances moved.
+/// </summary>
+/// <param name="instances">GPU instances referenced by the top-level
+/// BVH.</param>
+/// <param name="meshes">GPU meshes referenced by the instances.</param>
+/// <param name="bvh">Top-level BVH to refit.</param>
+/// <param name="scratch">Scratch of at least as many nodes as the
+/// BVH.</param>
+/// <param name="stream">Stream on which the refit is made.</param>
+void refitTopLevel(const Buffer<Instance>& instances,
+                   const Buffer<Mesh>& meshes, const Buffer<BVHNode>& bvh,
+                   const RefitScratch& scratch, cudaStream_t stream = 0);
+} // namespace lbvh
+} // namespace scene
@@ -2,6 +2,7 @@
 
 #include <tiny_obj_loader.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "scene/scene_data.h"
@@ -38,6 +39,18 @@ public:
   MaterialLoader* set(const std::vector<tinyobj::material_t>* tiny_materials,
                       const std::string mtl_folder);
 
+  /// <summary>
+  /// Decodes, in parallel, every texture referenced by the given materials
+  /// that is not loaded yet. The following calls to `load()' then only
+  /// have to pack them.
+  /// </summary>
+  /// <param name="materials">TinyObjLoader materials of each scene.</param>
+  /// <param name="mtl_folders">Folder containing the assets of each
+  /// scene.</param>
+  void prefetch(
+    const std::vector<const std::vector<tinyobj::material_t>*>& materials,
+    const std::vector<std::string>& mtl_folders);
+
   /// <summary>
   /// Loads the data passed to the `set()' method and
   /// returns the associated material.
@@ -51,11 +64,28 @@ public:
   /// </summary>
   void release();
 
+  /// <summary>
+  /// Frees the texture made for a material alone, e.g. the unit texture of
+  /// its colors, once the material is replaced, so that the next materials
+  /// loaded take its id instead of adding textures. Its GPU copy is to be
+  /// released before loading them. Shared textures are kept.
+  /// </summary>
+  void recycle(const Material& mat);
+
   inline const std::vector<scene::Texture>& getTextures() const
   {
     return _textures;
   }
 
+  /// <summary>
+  /// Checks if a texture contains colors, the other ones containing data
+  /// such as normals. Only colors can be stored in sRGB.
+  /// </summary>
+  inline bool isColorTexture(int tex_id) const
+  {
+    return _color_tex.count(tex_id) > 0;
+  }
+
 private:
   int getTextureId(std::string tex_rgb);
 
@@ -66,6 +96,11 @@ private:
 
   int registerOrGet(std::string tex_rgb);
 
+  /// <summary>
+  /// Adds a texture made for a single material, in a recycled slot if any.
+  /// </summary>
+  int addOwned(const Texture& tex);
+
 private:
   static MaterialLoader* inst;
 
@@ -86,6 +121,18 @@ private:
   /// </summary>
   std::unordered_map<std::string, int> _packed_tex;
 
+  /// <summary>
+  /// Contains the ids of the textures used as diffuse maps.
+  /// </summary>
+  std::unordered_set<int> _color_tex;
+
+  /// <summary>
+  /// Contains the ids of the textures made for a single material, and the
+  /// ids of the recycled ones, free to be taken again.
+  /// </summary>
+  std::unordered_set<int> _owned_tex;
+  std::vector<int> _free_ids;
+
   /// <summary>
   /// Contains the materials to send to the GPU.
   /// </summary>
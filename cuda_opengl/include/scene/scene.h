@@ -1,12 +1,34 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
+#include <driver/device_arena.h>
 #include <tiny_obj_loader.h>
 
+#include "geometry_stream.h"
+#include "lbvh.h"
+#include "scene_cache.h"
 #include "scene_data.h"
 
 namespace scene {
+/// <summary>
+/// Parts of an uploaded scene updated by `Scene::reload'.
+/// </summary>
+enum SceneChange
+{
+  SCENE_UNCHANGED = 0,
+  SCENE_LIGHTS = 1 << 0,
+  SCENE_MATERIALS = 1 << 1,
+  SCENE_GEOMETRY = 1 << 2,
+  /// <summary>
+  /// The scene could not be updated in place, and was released to be
+  /// uploaded again.
+  /// </summary>
+  SCENE_RELEASED = 1 << 3
+};
+
 /// <summary>
 /// Loads primitives of a given scene using the
 /// TinyObjLoader library.
@@ -22,29 +44,163 @@ public:
 
 public:
   /// <summary>
-  /// Uploads the CPU scene to the GPU.
+  /// Only parses the scene file, giving the initial camera and the cubemap
+  /// without loading the OBJ.
+  /// </summary>
+  void describe();
+
+  /// <summary>
+  /// Parses the scene file and its OBJ, without touching the GPU.
+  /// Scenes can thus be loaded concurrently, on different threads.
+  /// When the scene has a valid cache, it is read instead.
+  /// </summary>
+  void load();
+
+  /// <summary>
+  /// Uploads the CPU scene to the GPU, loading it first if needed.
+  /// The CPU data are released once uploaded.
   /// </summary>
   /// <param name="camera">Not used anymore.</param>
   void upload(scene::Camera* camera);
 
   /// <summary>
-  /// Releases the scene from the GPU.
+  /// Releases the scene from the GPU. It can be uploaded again later,
+  /// keeping its materials and thus the ids of its textures.
   /// </summary>
   void release();
 
+  /// <summary>
+  /// Loads the materials of the scene, and the textures they use, on the
+  /// CPU, loading the scene first if needed. Uploads then keep them.
+  /// </summary>
+  void loadMaterials();
+
+  /// <summary>
+  /// Makes the next upload use materials already loaded for a copy of the
+  /// scene on another GPU, instead of loading them again.
+  /// </summary>
+  inline void setMaterials(const std::vector<Material>& materials)
+  {
+    _cpu_materials = materials;
+  }
+
+  /// <summary>
+  /// Materials of the scene, with the ids of their textures, empty until
+  /// they are loaded.
+  /// </summary>
+  const inline std::vector<Material>& getCPUMaterials() const
+  {
+    return _cpu_materials;
+  }
+
+  /// <summary>
+  /// Files the scene is made of: the scene file, its OBJ and the MTL files
+  /// of the OBJ.
+  /// </summary>
+  std::vector<std::string> getSources() const;
+
+  /// <summary>
+  /// Updates the uploaded scene after some of its sources were modified,
+  /// reading them again. What keeps the size of its buffers is copied over
+  /// the uploaded one: the lights, the materials modified, whose new
+  /// textures then have to be uploaded, and the meshes modified, whose BVHs
+  /// are rebuilt. Otherwise the scene is released, so that it is uploaded
+  /// again from its sources. Sources failing to parse are ignored, keeping
+  /// the scene as it was.
+  /// </summary>
+  /// <param name="modified">Paths of the modified sources, as given by
+  /// `getSources'.</param>
+  /// <returns>The `SceneChange' flags of what was updated.</returns>
+  unsigned int reload(const std::vector<std::string>& modified);
+
+  /// <summary>
+  /// Copies what the last `reload' of a copy of the scene on another GPU
+  /// updated in place, instead of reading the sources again. Both copies
+  /// were uploaded from the same sources, and so have the same buffers.
+  /// </summary>
+  /// <param name="source">Copy of the scene that was reloaded.</param>
+  /// <param name="changes">`SceneChange' flags returned by its reload. If
+  /// `SCENE_RELEASED', the scene is released as the source was.</param>
+  void copyReload(const Scene& source, unsigned int changes);
+
+  /// <summary>
+  /// Lists the textures used by the materials of an uploaded scene.
+  /// Ids may appear several times.
+  /// </summary>
+  std::vector<int> getTextureIds() const;
+
+  /// <summary>
+  /// Refits every BVH of the scene, to call whenever the faces have
+  /// been modified on the GPU (animation, edition, etc...).
+  /// The topology of the BVHs is kept, which is way faster than a rebuild.
+  /// </summary>
+  void refit();
+
+  /// <summary>
+  /// Selects the layout of the meshes, to call before `upload'.
+  /// The indexed layout shares vertices between faces, and takes several
+  /// times less memory, at the cost of an indirection when intersecting.
+  /// </summary>
+  inline void setIndexed(bool indexed) { _indexed = indexed; }
+
+  inline bool isIndexed() const { return _indexed; }
+
+  /// <summary>
+  /// Sets the VRAM, in bytes, the meshes can take, to call before `upload'.
+  /// Larger meshes are kept in host memory, and streamed through a cache of
+  /// this size. 0 by default, so that every mesh is resident.
+  /// </summary>
+  inline void setGeometryCache(size_t size) { _geometry_cache = size; }
+
+  /// <summary>
+  /// Whether the meshes of the uploaded scene are streamed.
+  /// </summary>
+  inline bool isStreamed() const { return _geometry.enabled(); }
+
+  /// <summary>
+  /// Pages in the streamed meshes the last frames requested, to call after
+  /// each frame queued on `stream'. Does nothing when they are resident.
+  /// </summary>
+  void streamGeometry(cudaStream_t stream);
+
   const inline std::string& getSceneName() { return _filepath; }
 
   const inline std::string& getCubemapPath() const { return _cubemap_path; }
 
   const inline scene::Camera& getInitCamera() const { return _init_camera; }
 
+  /// <summary>
+  /// Materials parsed by `load', until the scene is uploaded.
+  /// </summary>
+  const inline std::vector<tinyobj::material_t>& getMaterials() const
+  {
+    return _materials;
+  }
+
+  const inline std::string& getMaterialFolder() const { return _mtl_dir; }
+
   const inline scene::SceneData* getUploadedScenePointer() const
   {
     return _d_scene_data;
   }
 
+  /// <summary>
+  /// CPU copy of the meshes of an uploaded scene, pointing to the GPU.
+  /// </summary>
+  const inline std::vector<scene::Mesh>& getMeshes() const { return _meshes; }
+
+  /// <summary>
+  /// Instances of an uploaded scene, on the GPU.
+  /// </summary>
+  const inline Buffer<Instance>& getInstances() const
+  {
+    return _scene_data->instances;
+  }
+
   inline bool ready() { return _ready; }
 
+  inline bool uploaded() const { return _uploaded; }
+
   inline std::string& error() { return _load_error; }
 
 private:
@@ -59,8 +215,11 @@ private:
   std::string _filepath;
   std::string _cubemap_path;
 
+  bool _loaded;
+  bool _cached;
   bool _uploaded;
   bool _ready;
+  bool _indexed;
   std::string _load_error;
 
   /// <summary>
@@ -70,6 +229,70 @@ private:
 
   scene::SceneData* _scene_data;
   scene::SceneData* _d_scene_data;
+
+  /// <summary>
+  /// VRAM of every buffer of the scene, `_d_scene_data' included.
+  /// </summary>
+  driver::DeviceArena _arena;
+
+  /// <summary>
+  /// Scratch of the refits, taken from the arena for the largest BVH.
+  /// </summary>
+  lbvh::RefitScratch _refit_scratch;
+
+  /// <summary>
+  /// Streamed meshes, and the VRAM they can take before being streamed.
+  /// </summary>
+  GeometryStream _geometry;
+  size_t _geometry_cache;
+
+  /// <summary>
+  /// CPU copy of the uploaded meshes, containing GPU pointers.
+  /// </summary>
+  std::vector<scene::Mesh> _meshes;
+
+  /// <summary>
+  /// Materials of the first upload, reused by the next ones.
+  /// </summary>
+  std::vector<Material> _cpu_materials;
+
+  /// <summary>
+  /// Sources of the uploaded scene, compared with the reloaded ones: the
+  /// lights, the TinyObjLoader materials, and a hash of each mesh as built
+  /// from the OBJ, empty when the meshes were read from the cache.
+  /// </summary>
+  std::vector<LightProp> _source_lights;
+  std::vector<tinyobj::material_t> _source_materials;
+  std::vector<uint64_t> _mesh_hashes;
+
+  /// <summary>
+  /// Order of the faces of the meshes whose BVH was built on the GPU, as
+  /// sorted by the build, and a hash of what a refit keeps of each mesh.
+  /// Reloads refit the meshes whose faces only moved, instead of
+  /// rebuilding their BVH.
+  /// </summary>
+  std::vector<std::vector<unsigned int>> _face_orders;
+  std::vector<uint64_t> _topology_hashes;
+
+  /// <summary>
+  /// Meshes updated by the last reload, for `copyReload'.
+  /// </summary>
+  std::vector<unsigned int> _reloaded_meshes;
+
+  /// <summary>
+  /// CPU data filled by `load', released after the upload.
+  /// </summary>
+  std::vector<tinyobj::shape_t> _shapes;
+  std::vector<tinyobj::material_t> _materials;
+  tinyobj::attrib_t _attrib;
+  std::vector<LightProp> _lights;
+  std::string _obj_path;
+  std::string _mtl_dir;
+
+  /// <summary>
+  /// Buffers read from the cache, or built from the OBJ, until uploaded.
+  /// </summary>
+  cache::SceneCache _cache;
 };
 
 } // namespace scene
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <tiny_obj_loader.h>
+
+#include "scene/scene_data.h"
+
+namespace scene {
+namespace cache {
+/// <summary>
+/// CPU copy of the buffers of a mesh, as they are uploaded to the GPU:
+/// faces are already sorted to match the leaves of the BVH.
+/// </summary>
+struct MeshData
+{
+  std::vector<Triangle> triangles;
+  std::vector<Face> faces;
+
+  std::vector<uint4> indices;
+  std::vector<float4> positions;
+  std::vector<float3> normals;
+  std::vector<float2> texcoords;
+
+  std::vector<BVHNode> bvh;
+};
+
+/// <summary>
+/// Everything needed to upload a scene without parsing its sources.
+/// Textures are not part of it: they are shared between the scenes, and
+/// are still decoded from their files.
+/// </summary>
+struct SceneCache
+{
+  Camera camera;
+  std::string cubemap_path;
+  std::vector<LightProp> lights;
+
+  std::vector<tinyobj::material_t> materials;
+  std::string mtl_dir;
+
+  /// <summary>
+  /// Unique meshes, and their instances sorted to match the leaves of the
+  /// top-level BVH.
+  /// </summary>
+  std::vector<MeshData> meshes;
+  std::vector<Instance> instances;
+  std::vector<BVHNode> bvh;
+};
+
+/// <summary>
+/// Path of the cache of a scene, stored next to it.
+/// </summary>
+std::string path(const std::string& scene_path);
+
+/// <summary>
+/// Reads the cache of a scene, if it exists and is still valid. A cache is
+/// valid when it has been written by this version, with the same layout,
+/// and when none of its sources changed: the content of the scene file is
+/// hashed, the other sources being checked by size and modification time.
+/// </summary>
+/// <param name="scene_path">Path of the .scene file.</param>
+/// <param name="indexed">Layout of the meshes.</param>
+/// <param name="out">Contains the cached scene.</param>
+/// <returns>False if there is no valid cache.</returns>
+bool read(const std::string& scene_path, bool indexed, SceneCache& out);
+
+/// <summary>
+/// Writes the cache of a scene. Failures are only reported, the scene
+/// being loaded from its sources next time.
+/// </summary>
+/// <param name="scene_path">Path of the .scene file.</param>
+/// <param name="indexed">Layout of the meshes.</param>
+/// <param name="sources">Files the scene has been built from, besides the
+/// .scene file itself (OBJ, MTL).</param>
+/// <param name="scene">Scene to cache.</param>
+void write(const std::string& scene_path, bool indexed,
+           const std::vector<std::string>& sources, const SceneCache& scene);
+} // namespace cache
+} // namespace scene
@@ -10,18 +10,42 @@ namespace scene {
 template <typename T>
 struct __align__(16) Buffer
 {
-  unsigned int size;
+  unsigned int size = 0;
   T* data = nullptr;
 };
 
+/// <summary>
+/// Distribution of the luminance of a cubemap, used to importance sample it.
+/// Texels are seen as a 2D array made of the rows of every face, one face
+/// after the other, the faces being in the CUDA order (+x, -x, +y, ...).
+/// CDFs are not normalized, `total' being the sum of every weight.
+/// </summary>
+struct __align__(16) EnvironmentDistribution
+{
+  unsigned int size;
+  float total;
+  /// <summary>
+  /// CDF of the texels of each row, 6 * `size' * `size' elements.
+  /// </summary>
+  float* conditional = nullptr;
+  /// <summary>
+  /// CDF of the rows, 6 * `size' elements.
+  /// </summary>
+  float* marginal = nullptr;
+};
+
 /// <summary>
 /// GPU-aligned Cubemap containing the pixel data, as well as
 /// the Cubemap format (number of channels, etc...)
+/// * tex: texture object sampling the cubemap, using trilinear filtering
+/// over its prefiltered levels.
 /// </summary>
 struct __align__(8) Cubemap
 {
-  cudaArray* cubemap;
+  cudaMipmappedArray_t cubemap = nullptr;
   cudaChannelFormatDesc cubemap_desc;
+  cudaTextureObject_t tex = 0;
+  EnvironmentDistribution distribution;
 };
 
 /// <summary>
@@ -37,42 +61,197 @@ struct __align__(16) Texture
 };
 
 /// <summary>
-/// GPU-aligned primitive containing
-/// * The three vertices making the face;
+/// GPU texture, sampled through the texture units. It contains the whole
+/// mip chain of a `Texture', always stored as float4.
+/// * tex: texture object, using trilinear filtering and wrapping;
+/// * array: mip chain bound to the texture object;
+/// * w, h: size of the first level.
+/// </summary>
+struct __align__(16) TextureObject
+{
+  cudaTextureObject_t tex = 0;
+  cudaMipmappedArray_t array = nullptr;
+  int w;
+  int h;
+};
+
+/// <summary>
+/// GPU-aligned primitive used by the intersection tests only.
+/// It contains the first vertex and the two edges starting from it,
+/// so that a test only reads three float4.
+/// </summary>
+struct __align__(16) Triangle
+{
+  float4 v0;
+  float4 e1;
+  float4 e2;
+};
+
+/// <summary>
+/// GPU-aligned shading attributes of a primitive, only fetched
+/// for the closest hit:
 /// * One normal per vertex;
+/// * One texture coordinate per vertex;
 /// * One tangent for the whole primitive;
 /// * The id of the material shading this primitive.
 /// </summary>
 struct __align__(16) Face
 {
-  float3 vertices[3];
   float3 normals[3];
   float2 texcoords[3];
   float3 tangent;
   unsigned int material_id;
 };
 
+/// <summary>
+/// Maximum depth of a BVH. The builder stops splitting when
+/// reaching it, which bounds the traversal stack on the GPU.
+/// </summary>
+constexpr int BVH_MAX_DEPTH = 64;
+
+/// <summary>
+/// GPU-aligned BVH node, fitting in two float4.
+/// * min / max: bounds of the node;
+/// * left: index of the left child, or first primitive for a leaf;
+/// * right: index of the right child, or minus the primitive count
+///   for a leaf.
+/// </summary>
+struct __align__(16) BVHNode
+{
+  float3 min;
+  int left;
+  float3 max;
+  int right;
+};
+
+/// <summary>
+/// Computes the tangent of a face from two of its edges,
+/// and the matching UV deltas.
+/// </summary>
+__host__ __device__ inline float3
+faceTangent(const float3& edge1, const float3& edge2, const float2& delta_uv1,
+            const float2& delta_uv2)
+{
+  float f = 1.0f / (delta_uv1.x * delta_uv2.y - delta_uv2.x * delta_uv1.y);
+
+  float3 tangent;
+  tangent.x = f * (delta_uv2.y * edge1.x - delta_uv1.y * edge2.x);
+  tangent.y = f * (delta_uv2.y * edge1.y - delta_uv1.y * edge2.y);
+  tangent.z = f * (delta_uv2.y * edge1.z - delta_uv1.y * edge2.z);
+  return tangent;
+}
+
 /// <summary>
 /// GPU-aligned Mesh.
-/// A mesh is simply described by a list of faces.
+/// A mesh uses one of the two following layouts:
+/// * De-indexed: a list of triangles, and the list of their
+///   shading attributes;
+/// * Indexed: shared positions, normals and UVs, referenced by
+///   one index per face vertex. The last component of an index
+///   contains the material id of the face.
+/// Triangles, faces and indices are sorted to match the leaves
+/// of the BVH. A mesh is indexed when `indices' is not empty.
 /// </summary>
 struct __align__(16) Mesh
 {
+  struct Buffer<Triangle> triangles;
   struct Buffer<Face> faces;
+
+  struct Buffer<uint4> indices;
+  struct Buffer<float4> positions;
+  struct Buffer<float3> normals;
+  struct Buffer<float2> texcoords;
+
+  struct Buffer<BVHNode> bvh;
+};
+
+/// <summary>
+/// GPU-aligned instance, placing a mesh in the scene. Transforms are affine,
+/// stored as the three rows of a 3x4 matrix, the translation being the last
+/// column:
+/// * to_world: from the space of the mesh to the space of the scene;
+/// * to_object: inverse of `to_world', moving the rays to the mesh;
+/// * mesh_id: index of the mesh in `SceneData::meshes'.
+/// </summary>
+struct __align__(16) Instance
+{
+  float4 to_world[3];
+  float4 to_object[3];
+  unsigned int mesh_id;
+};
+
+/// <summary>
+/// Applies the affine transform `m' to the point `p'.
+/// </summary>
+__host__ __device__ inline float3
+transformPoint(const float4 m[3], const float3& p)
+{
+  return make_float3(m[0].x * p.x + m[0].y * p.y + m[0].z * p.z + m[0].w,
+                     m[1].x * p.x + m[1].y * p.y + m[1].z * p.z + m[1].w,
+                     m[2].x * p.x + m[2].y * p.y + m[2].z * p.z + m[2].w);
+}
+
+/// <summary>
+/// Applies the linear part of the affine transform `m' to the vector `v'.
+/// </summary>
+__host__ __device__ inline float3
+transformVector(const float4 m[3], const float3& v)
+{
+  return make_float3(m[0].x * v.x + m[0].y * v.y + m[0].z * v.z,
+                     m[1].x * v.x + m[1].y * v.y + m[1].z * v.z,
+                     m[2].x * v.x + m[2].y * v.y + m[2].z * v.z);
+}
+
+/// <summary>
+/// Moves the normal `n' of a mesh to the space of the scene, using the
+/// transpose of the inverse transform. The result is not normalized.
+/// </summary>
+__host__ __device__ inline float3
+transformNormal(const Instance& instance, const float3& n)
+{
+  const float4* m = instance.to_object;
+  return make_float3(m[0].x * n.x + m[1].x * n.y + m[2].x * n.z,
+                     m[0].y * n.x + m[1].y * n.y + m[2].y * n.z,
+                     m[0].z * n.x + m[1].z * n.y + m[2].z * n.z);
+}
+
+/// <summary>
+/// States of the meshes of a streamed scene, set by the kernels when their
+/// rays reach a mesh, and reset by the host after each frame:
+/// * MESH_PAGED_OUT / MESH_REQUESTED: read from the host, and needed;
+/// * MESH_RESIDENT / MESH_USED: in the VRAM cache, and used by a frame.
+/// </summary>
+enum MeshState
+{
+  MESH_PAGED_OUT = 0,
+  MESH_REQUESTED,
+  MESH_RESIDENT,
+  MESH_USED
 };
 
 /// <summary>
 /// GPU-aligned SceneData.
 /// SceneData contains data relative to only one scene:
-/// * meshes: list of meshes;
+/// * meshes: list of the unique meshes, in the space of their instances;
+/// * instances: list of instances, sorted to match the leaves of `bvh';
+/// * bvh: top-level BVH, whose leaves reference instances;
 /// * materials: list of materials;
-/// * lights: list of lights.
+/// * lights: list of lights, sorted to match the leaves of `light_bvh';
+/// * light_bvh: BVH of the light spheres, used to intersect and sample them;
+/// * light_power: power of the lights under each node of `light_bvh';
+/// * mesh_states: `MeshState' of each mesh when they are streamed, empty
+///   when every mesh is resident.
 /// </summary>
 struct __align__(16) SceneData
 {
   struct Buffer<Mesh> meshes;
+  struct Buffer<Instance> instances;
+  struct Buffer<BVHNode> bvh;
   struct Buffer<struct Material> materials;
   struct Buffer<struct LightProp> lights;
+  struct Buffer<BVHNode> light_bvh;
+  struct Buffer<struct LightPower> light_power;
+  struct Buffer<unsigned int> mesh_states;
 };
 
 /// <summary>
@@ -82,8 +261,8 @@ struct __align__(16) SceneData
 /// </summary>
 struct __align__(16) Scenes
 {
-  struct Buffer<struct Texture> textures;
-  struct SceneData** scenes;
+  struct Buffer<struct TextureObject> textures;
+  struct SceneData** scenes = nullptr;
 };
 
 /// <summary>
@@ -114,6 +293,29 @@ struct __align__(8) LightProp
   float radius;
 };
 
+/// <summary>
+/// GPU-aligned power of the lights under a node of the light BVH.
+/// * power: sum of the powers of the lights;
+/// * count: number of lights, the lights of the left child coming first.
+/// </summary>
+struct __align__(8) LightPower
+{
+  float power;
+  unsigned int count;
+};
+
+/// <summary>
+/// Power of a sphere light, up to a constant factor: its luminance times
+/// the area of the sphere.
+/// </summary>
+__host__ __device__ inline float
+lightPower(const LightProp& light)
+{
+  const float luminance = 0.2126f * light.color.x + 0.7152f * light.color.y +
+                          0.0722f * light.color.z;
+  return luminance * light.emission * light.radius * light.radius;
+}
+
 /// <summary>
 /// GPU-aligned Camera.
 /// Contains the camera data. This struct will be passed
@@ -135,11 +337,15 @@ struct __align__(8) Camera
 /// <summary>
 /// GPU-aligned Ray.
 /// dir: direction of the ray;
-/// origin: origin of the ray.
+/// origin: origin of the ray;
+/// cone_width: width of the ray cone at its origin;
+/// cone_spread: angle of the ray cone, used to select texture mip levels.
 /// </summary>
 struct __align__(16) Ray
 {
   float3 dir;
   float3 origin;
+  float cone_width;
+  float cone_spread;
 };
 }
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include "raytrace.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Device counters
+//
+// Counts the work of the kernels when built with ARTRACER_COUNTERS, and
+// compiles to nothing otherwise. Unit increments are aggregated per warp,
+// so that a single atomic is issued by the threads counting together.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef ARTRACER_COUNTERS
+/// <summary>
+/// Counters of the current GPU, read and cleared by `readCounters'.
+/// </summary>
+__device__ inline RenderCounters* deviceCounters();
+
+#ifndef ARTRACER_OPTIX_PROGRAMS
+/// <summary>
+/// Defined once, along with `readCounters'. The OptiX programs are a module
+/// of their own, which reaches it through its launch parameters instead.
+/// </summary>
+extern __device__ RenderCounters g_counters;
+
+__device__ inline RenderCounters*
+deviceCounters()
+{
+  return &g_counters;
+}
+#endif
+
+/// <summary>
+/// Adds 1 to `counter' for each thread of the warp calling it.
+/// </summary>
+__device__ inline void
+countWarp(unsigned long long* counter)
+{
+  const unsigned int mask = __activemask();
+  const unsigned int thread =
+    threadIdx.x + blockDim.x * (threadIdx.y + blockDim.y * threadIdx.z);
+  if (thread % warpSize == __ffs(mask) - 1)
+    atomicAdd(counter, (unsigned long long)__popc(mask));
+}
+#endif
+
+/// <summary>
+/// Counts a ray traced through the scene, and the triangles it tested.
+/// </summary>
+__device__ inline void
+countRay(unsigned int triangle_tests)
+{
+#ifdef ARTRACER_COUNTERS
+  countWarp(&deviceCounters()->rays);
+  if (triangle_tests)
+    atomicAdd(&deviceCounters()->triangle_tests,
+              (unsigned long long)triangle_tests);
+#else
+  (void)triangle_tests;
+#endif
+}
+
+/// <summary>
+/// Counts a path starting from the camera.
+/// </summary>
+__device__ inline void
+countPath()
+{
+#ifdef ARTRACER_COUNTERS
+  countWarp(&deviceCounters()->paths);
+#endif
+}
+
+/// <summary>
+/// Counts a bounce of a path, i.e. a ray leaving the camera or a surface.
+/// </summary>
+__device__ inline void
+countBounce()
+{
+#ifdef ARTRACER_COUNTERS
+  countWarp(&deviceCounters()->bounces);
+#endif
+}
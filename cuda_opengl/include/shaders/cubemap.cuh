@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include "cutils_math.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Faces of the cubemaps
+////////////////////////////////////////////////////////////////////////////////
+
+/// <summary>
+/// Gives the direction, in the space of cubemap fetches, of the point (s, t)
+/// of a face, s and t being in [-1, 1].
+/// </summary>
+__device__ inline float3
+cubemapDirection(unsigned int face, float s, float t)
+{
+  switch (face) {
+    case 0:
+      return make_float3(1.0f, -t, -s);
+    case 1:
+      return make_float3(-1.0f, -t, s);
+    case 2:
+      return make_float3(s, 1.0f, t);
+    case 3:
+      return make_float3(s, -1.0f, -t);
+    case 4:
+      return make_float3(s, -t, 1.0f);
+    default:
+      return make_float3(-s, -t, -1.0f);
+  }
+}
+
+/// <summary>
+/// Gives the face fetched by a cubemap lookup in the direction `c', and the
+/// coordinates (s, t) in [-1, 1] of the fetch inside this face.
+/// </summary>
+__device__ inline unsigned int
+cubemapFace(const float3& c, float& s, float& t)
+{
+  float ax = fabsf(c.x);
+  float ay = fabsf(c.y);
+  float az = fabsf(c.z);
+
+  if (ax >= ay && ax >= az) {
+    s = (c.x > 0.0f ? -c.z : c.z) / ax;
+    t = -c.y / ax;
+    return c.x > 0.0f ? 0 : 1;
+  }
+  if (ay >= az) {
+    s = c.x / ay;
+    t = (c.y > 0.0f ? c.z : -c.z) / ay;
+    return c.y > 0.0f ? 2 : 3;
+  }
+
+  s = (c.z > 0.0f ? c.x : -c.x) / az;
+  t = -c.y / az;
+  return c.z > 0.0f ? 4 : 5;
+}
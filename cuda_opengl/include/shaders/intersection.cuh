@@ -1,8 +1,8 @@
 #pragma once
 
 #include <cuda_runtime.h>
-#include <curand.h>
-#include <curand_kernel.h>
+
+#include "counters.cuh"
 
 struct __align__(8) IntersectionData
 {
@@ -15,33 +15,28 @@ struct __align__(8) IntersectionData
   float dist;
   float specular_col;
   float ior;
+  unsigned int material_id;
 };
 
-__device__ inline int
-getTextureIdx(const scene::Texture& texture, const float2& uv)
-{
-  int x = uv.x * (texture.w - 1);
-  int y = uv.y * (texture.h - 1);
-  return (y * texture.w + x) * texture.nb_chan;
-}
-
 /// <summary>
-/// Fetch a given texture, using interpolated UVs.
+/// Fetch a given texture, using interpolated UVs. The fetch is filtered by
+/// the texture units, between the two mip levels closest to `lod'.
 /// </summary>
 /// <param name="textures">Textures list.</param>
 /// <param name="tex_id">ID of the texture to fetch.</param>
 /// <param name="uv">Interpolated UVs used for the fetch.</param>
-/// <param name="out">Contains the texture fetch value, as a float3.</param>
+/// <param name="lod">Level of detail of the hit, independent of the size of
+/// the texture.</param>
+/// <param name="out">Contains the texture fetch value, as a float4.</param>
 __device__ inline void
-sampleTexture(const scene::Buffer<scene::Texture>& textures, int tex_id,
-              const float2& uv, float3& out)
+sampleTexture(const scene::Buffer<scene::TextureObject>& textures, int tex_id,
+              const float2& uv, float lod, float4& out)
 {
-  const scene::Texture& tex = textures.data[tex_id];
-  int idx = getTextureIdx(tex, uv);
+  const scene::TextureObject& tex = textures.data[tex_id];
 
-  out.x = tex.data[idx];
-  out.y = tex.data[idx + 1];
-  out.z = tex.data[idx + 2];
+  // A texel covers less of the surface on larger textures.
+  lod += 0.5f * __log2f((float)(tex.w * tex.h));
+  out = tex2DLod<float4>(tex.tex, uv.x, uv.y, lod);
 }
 
 /// <summary>
@@ -50,18 +45,16 @@ sampleTexture(const scene::Buffer<scene::Texture>& textures, int tex_id,
 /// <param name="textures">Textures list.</param>
 /// <param name="tex_id">ID of the texture to fetch.</param>
 /// <param name="uv">Interpolated UVs used for the fetch.</param>
-/// <param name="out">Contains the texture fetch value, as a float4.</param>
+/// <param name="lod">Level of detail of the hit, independent of the size of
+/// the texture.</param>
+/// <param name="out">Contains the texture fetch value, as a float3.</param>
 __device__ inline void
-sampleTexture(const scene::Buffer<scene::Texture>& textures, int tex_id,
-              const float2& uv, float4& out)
+sampleTexture(const scene::Buffer<scene::TextureObject>& textures, int tex_id,
+              const float2& uv, float lod, float3& out)
 {
-  const scene::Texture& tex = textures.data[tex_id];
-  int idx = getTextureIdx(tex, uv);
-
-  out.x = tex.data[idx];
-  out.y = tex.data[idx + 1];
-  out.z = tex.data[idx + 2];
-  out.w = tex.data[idx + 3];
+  float4 fetch;
+  sampleTexture(textures, tex_id, uv, lod, fetch);
+  out = make_float3(fetch);
 }
 
 /// <summary>
@@ -93,45 +86,198 @@ generateRay(const int x, const int y, const int half_w, const int half_h,
   ray.dir = screen_pos - cam.position;
   ray.dir = normalize(ray.dir);
 
+  // The cone starts on the camera, and covers one pixel.
+  ray.cone_width = 0.0f;
+  ray.cone_spread = 1.0f / screen_dist;
+
   return ray;
 }
 
 /// <summary>
-/// Checks a ray-triangle intersection.
+/// Finds the coordinates on the virtual screen of the point `p', seen from
+/// the camera. This is the inverse of `generateRay', depth of field aside.
+/// </summary>
+/// <param name="p">Point to project.</param>
+/// <param name="half_w">Half of the width of the virtual screen.</param>
+/// <param name="half_h">Half of the height of the virtual screen.</param>
+/// <param name="cam">Scene camera.</param>
+/// <param name="out_x">Contains the horizontal coordinate.</param>
+/// <param name="out_y">Contains the vertical coordinate.</param>
+/// <returns>False if `p' is behind the camera.</returns>
+HOST_DEVICE inline bool
+projectPoint(const float3& p, const int half_w, const int half_h,
+             const scene::Camera& cam, float& out_x, float& out_y)
+{
+  float screen_dist = half_w / tanf(cam.fov_x * 0.5f);
+
+  // Same base as the one of `generateRay'.
+  float3 u = normalize(cross(cam.dir, make_float3(0.0, -1.0, 0.0)));
+  float3 v = normalize(cross(u, cam.dir));
+  u *= -1.0;
+
+  float3 op = p - cam.position;
+  float depth = dot(op, cam.dir) / dot(cam.dir, cam.dir);
+  if (depth <= 0.0f)
+    return false;
+
+  float scale = screen_dist / depth;
+  out_x = half_w + dot(op, u) * scale;
+  out_y = half_h + dot(op, v) * scale;
+  return true;
+}
+
+/// <summary>
+/// Checks a ray-triangle intersection, using the Moller-Trumbore algorithm.
 /// </summary>
+/// <param name="v0">First vertex of the triangle.</param>
+/// <param name="v0v1">Edge going from the first to the second vertex.</param>
+/// <param name="v0v2">Edge going from the first to the third vertex.</param>
+/// <param name="ray">Ray to trace.</param>
+/// <param name="t">Contains the distance of the hit.</param>
+/// <param name="u">Contains the first barycentric coordinate.</param>
+/// <param name="v">Contains the second barycentric coordinate.</param>
+/// <param name="two_sided">If false, back faces are culled.</param>
 __device__ inline bool
-intersectTriangle(const scene::Face& face, float3& out_normal, float2& out_uv,
-                  const scene::Ray& ray, float& t)
+intersectTriangle(const float3& v0, const float3& v0v1, const float3& v0v2,
+                  const scene::Ray& ray, float& t, float& u, float& v,
+                  bool two_sided = false)
 {
-  float3 v0v1 = face.vertices[1] - face.vertices[0];
-  float3 v0v2 = face.vertices[2] - face.vertices[0];
   float3 p_vec = cross(ray.dir, v0v2);
   float det = dot(v0v1, p_vec);
-  if (det < 0.0000001)
+  if ((two_sided ? fabsf(det) : det) < 0.0000001)
     return false;
 
   float inv_det = __fdividef(1.f, det);
-  float3 t_vec = ray.origin - face.vertices[0];
-  float u = dot(t_vec, p_vec) * inv_det;
+  float3 t_vec = ray.origin - v0;
+  u = dot(t_vec, p_vec) * inv_det;
   if (u < 0 || u > 1)
     return false;
 
   float3 qvec = cross(t_vec, v0v1);
-  float v = dot(ray.dir, qvec) * inv_det;
+  v = dot(ray.dir, qvec) * inv_det;
   if (v < 0 || u + v > 1)
     return false;
 
+  t = dot(v0v2, qvec) * inv_det;
+  return true;
+}
+
+/// <summary>
+/// Checks a ray-triangle intersection. Only the positions are read,
+/// through the read-only cache.
+/// </summary>
+__device__ inline bool
+intersectTriangle(const scene::Triangle& tri, const scene::Ray& ray, float& t,
+                  float& u, float& v, bool two_sided = false)
+{
+  const float3 v0 = make_float3(__ldg(&tri.v0));
+  const float3 v0v1 = make_float3(__ldg(&tri.e1));
+  const float3 v0v2 = make_float3(__ldg(&tri.e2));
+
+  return intersectTriangle(v0, v0v1, v0v2, ray, t, u, v, two_sided);
+}
+
+/// <summary>
+/// Checks a ray-triangle intersection with the face `i' of an indexed mesh.
+/// The edges are computed on the fly from the shared positions.
+/// </summary>
+__device__ inline bool
+intersectTriangle(const scene::Mesh& mesh, int i, const scene::Ray& ray,
+                  float& t, float& u, float& v, bool two_sided = false)
+{
+  const uint4 idx = __ldg(&mesh.indices.data[i]);
+  const float3 v0 = make_float3(__ldg(&mesh.positions.data[idx.x]));
+  const float3 v1 = make_float3(__ldg(&mesh.positions.data[idx.y]));
+  const float3 v2 = make_float3(__ldg(&mesh.positions.data[idx.z]));
+
+  return intersectTriangle(v0, v1 - v0, v2 - v0, ray, t, u, v, two_sided);
+}
+
+/// <summary>
+/// Interpolates the shading attributes of a face,
+/// using the barycentric coordinates of the hit.
+/// </summary>
+__device__ inline void
+interpolateFace(const scene::Face& face, float u, float v, float3& out_normal,
+                float2& out_uv)
+{
   // Interpolates normals
   out_normal = (1.0f - u - v) * face.normals[0] + u * face.normals[1] +
                v * face.normals[2];
-  // out_normal = face.normals[0];
   // Interpolates uvs
   out_uv = (1.0f - u - v) * face.texcoords[0] + u * face.texcoords[1] +
            v * face.texcoords[2];
   out_uv = mod(out_uv, 1.0);
+}
 
-  t = dot(v0v2, qvec) * inv_det;
-  return true;
+/// <summary>
+/// Interpolates the shading attributes of the face `i' of a mesh, whatever
+/// its layout is. The tangent of indexed faces is computed on the fly.
+/// </summary>
+/// <returns>The material id of the face.</returns>
+__device__ inline unsigned int
+interpolateFace(const scene::Mesh& mesh, int i, float u, float v,
+                float3& out_normal, float2& out_uv, float3& out_tangent)
+{
+  if (mesh.indices.size == 0) {
+    const scene::Face& face = mesh.faces.data[i];
+    interpolateFace(face, u, v, out_normal, out_uv);
+    out_tangent = face.tangent;
+    return face.material_id;
+  }
+
+  const uint4 idx = mesh.indices.data[i];
+  const float3 normals[3] = { mesh.normals.data[idx.x],
+                              mesh.normals.data[idx.y],
+                              mesh.normals.data[idx.z] };
+  const float2 uvs[3] = { mesh.texcoords.data[idx.x],
+                          mesh.texcoords.data[idx.y],
+                          mesh.texcoords.data[idx.z] };
+  const float3 v0 = make_float3(mesh.positions.data[idx.x]);
+  const float3 v1 = make_float3(mesh.positions.data[idx.y]);
+  const float3 v2 = make_float3(mesh.positions.data[idx.z]);
+
+  out_normal = (1.0f - u - v) * normals[0] + u * normals[1] + v * normals[2];
+  out_uv = (1.0f - u - v) * uvs[0] + u * uvs[1] + v * uvs[2];
+  out_uv = mod(out_uv, 1.0);
+  out_tangent =
+    scene::faceTangent(v1 - v0, v2 - v0, uvs[1] - uvs[0], uvs[2] - uvs[0]);
+  return idx.w;
+}
+
+/// <summary>
+/// Computes the ratio between the area of the face `i' of an instanced mesh
+/// in UV space and its area in world space, used to select the mip level of
+/// its textures.
+/// </summary>
+__device__ inline float
+faceTexelDensity(const scene::Mesh& mesh, const scene::Instance& instance,
+                 int i)
+{
+  float3 e1, e2;
+  float2 t1, t2;
+  if (mesh.indices.size == 0) {
+    const scene::Triangle& tri = mesh.triangles.data[i];
+    const scene::Face& face = mesh.faces.data[i];
+    e1 = make_float3(tri.e1);
+    e2 = make_float3(tri.e2);
+    t1 = face.texcoords[1] - face.texcoords[0];
+    t2 = face.texcoords[2] - face.texcoords[0];
+  } else {
+    const uint4 idx = mesh.indices.data[i];
+    const float3 v0 = make_float3(mesh.positions.data[idx.x]);
+    const float2 uv0 = mesh.texcoords.data[idx.x];
+    e1 = make_float3(mesh.positions.data[idx.y]) - v0;
+    e2 = make_float3(mesh.positions.data[idx.z]) - v0;
+    t1 = mesh.texcoords.data[idx.y] - uv0;
+    t2 = mesh.texcoords.data[idx.z] - uv0;
+  }
+  e1 = scene::transformVector(instance.to_world, e1);
+  e2 = scene::transformVector(instance.to_world, e2);
+
+  float world_area = length(cross(e1, e2));
+  float uv_area = fabsf(t1.x * t2.y - t1.y * t2.x);
+  return world_area > 0.0f ? uv_area / world_area : 0.0f;
 }
 
 /// <summary>
@@ -154,6 +300,356 @@ intersectSphere(const scene::Ray& r, const scene::LightProp& light, float& t)
   return t != 0.0;
 }
 
+/// <summary>
+/// Checks a ray-box intersection, using the slab method.
+/// </summary>
+/// <param name="node">Node containing the box to test.</param>
+/// <param name="origin">Origin of the ray.</param>
+/// <param name="inv_dir">Inverse of the ray direction.</param>
+/// <param name="t_max">Distance of the closest hit found so far.</param>
+/// <param name="t_near">Contains the entry distance in the box.</param>
+__device__ inline bool
+intersectBox(const scene::BVHNode& node, const float3& origin,
+             const float3& inv_dir, float t_max, float& t_near)
+{
+  float3 t0 = (node.min - origin) * inv_dir;
+  float3 t1 = (node.max - origin) * inv_dir;
+
+  t_near = fmaxf(fmaxf(fminf(t0.x, t1.x), fminf(t0.y, t1.y)),
+                 fmaxf(fminf(t0.z, t1.z), 0.0f));
+  float t_far = fminf(fminf(fmaxf(t0.x, t1.x), fmaxf(t0.y, t1.y)),
+                      fminf(fmaxf(t0.z, t1.z), t_max));
+
+  return t_near <= t_far;
+}
+
+/// <summary>
+/// Traverses a BVH using a stack, visiting the closest child first.
+/// Each leaf reached is handed to `leaf', which can shrink `t_max'
+/// when it finds a closer hit, or stop the traversal by returning true.
+/// </summary>
+/// <param name="nodes">Nodes of the BVH, the root being the first.</param>
+/// <param name="r">Ray to trace.</param>
+/// <param name="inv_dir">Inverse of the ray direction.</param>
+/// <param name="t_max">Distance of the closest hit found so far.</param>
+/// <param name="leaf">Functor called as `leaf(first, count, t_max)'.</param>
+/// <returns>True if the traversal has been stopped by a leaf.</returns>
+template <typename Leaf>
+__device__ inline bool
+traverseBVH(const scene::BVHNode* nodes, const scene::Ray& r,
+            const float3& inv_dir, float& t_max, Leaf& leaf)
+{
+  int stack[scene::BVH_MAX_DEPTH];
+  float stack_dist[scene::BVH_MAX_DEPTH];
+  int stack_size = 0;
+
+  float t_near;
+  if (!intersectBox(nodes[0], r.origin, inv_dir, t_max, t_near))
+    return false;
+
+  stack[stack_size] = 0;
+  stack_dist[stack_size++] = t_near;
+
+  while (stack_size) {
+    --stack_size;
+    // A closer hit has been found since this node was pushed.
+    if (stack_dist[stack_size] > t_max)
+      continue;
+
+    const scene::BVHNode& node = nodes[stack[stack_size]];
+    if (node.right < 0) {
+      if (leaf(node.left, -node.right, t_max))
+        return true;
+      continue;
+    }
+
+    float t_left, t_right;
+    bool hit_left =
+      intersectBox(nodes[node.left], r.origin, inv_dir, t_max, t_left);
+    bool hit_right =
+      intersectBox(nodes[node.right], r.origin, inv_dir, t_max, t_right);
+
+    // Pushes the farthest child first, so that the closest one
+    // is visited first and prunes as much as possible.
+    if (hit_left && hit_right) {
+      bool left_first = t_left <= t_right;
+      stack[stack_size] = left_first ? node.right : node.left;
+      stack_dist[stack_size++] = left_first ? t_right : t_left;
+      stack[stack_size] = left_first ? node.left : node.right;
+      stack_dist[stack_size++] = left_first ? t_left : t_right;
+    } else if (hit_left) {
+      stack[stack_size] = node.left;
+      stack_dist[stack_size++] = t_left;
+    } else if (hit_right) {
+      stack[stack_size] = node.right;
+      stack_dist[stack_size++] = t_right;
+    }
+  }
+
+  return false;
+}
+
+/// <summary>
+/// Leaf of a mesh BVH: tests the triangles it contains,
+/// and keeps track of the closest one.
+/// </summary>
+struct TriangleLeaf
+{
+  const scene::Mesh& mesh;
+  const scene::Ray& r;
+  int face;
+  float u;
+  float v;
+  unsigned int tests;
+
+  __device__ inline bool operator()(int first, int count, float& t_max)
+  {
+    // The layout is the same for the whole mesh,
+    // so this branch does not diverge.
+    const bool indexed = mesh.indices.size > 0;
+
+    float t, b1, b2;
+    tests += count;
+    for (int i = first; i < first + count; ++i) {
+      bool hit = indexed
+                   ? intersectTriangle(mesh, i, r, t, b1, b2)
+                   : intersectTriangle(mesh.triangles.data[i], r, t, b1, b2);
+      if (hit && t < t_max && t > 0.0) {
+        t_max = t;
+        face = i;
+        u = b1;
+        v = b2;
+      }
+    }
+    return false;
+  }
+};
+
+/// <summary>
+/// Moves a ray to the space of the mesh of an instance. The direction is not
+/// normalized again, so that distances along the ray stay the same in both
+/// spaces.
+/// </summary>
+__device__ inline scene::Ray
+toObject(const scene::Instance& instance, const scene::Ray& r)
+{
+  scene::Ray local = r;
+  local.origin = scene::transformPoint(instance.to_object, r.origin);
+  local.dir = scene::transformVector(instance.to_object, r.dir);
+  return local;
+}
+
+/// <summary>
+/// Marks a mesh of a streamed scene as reached by a ray: paged out meshes
+/// get requested, and resident ones used by the frame, which keeps them in
+/// the cache. Each state is only written once per frame.
+/// </summary>
+__device__ inline void
+requestMesh(const scene::SceneData& scene, unsigned int mesh_id)
+{
+  if (!scene.mesh_states.size)
+    return;
+
+  unsigned int& state = scene.mesh_states.data[mesh_id];
+  if (state == scene::MESH_PAGED_OUT || state == scene::MESH_RESIDENT)
+    state = state + 1;
+}
+
+/// <summary>
+/// Leaf of the top-level BVH: traverses the BVH of the mesh
+/// of each instance it contains, in the space of the mesh.
+/// </summary>
+struct InstanceLeaf
+{
+  const scene::SceneData& scene;
+  const scene::Ray& r;
+  const scene::Instance* instance;
+  int face;
+  float u;
+  float v;
+  unsigned int tests;
+
+  __device__ inline bool operator()(int first, int count, float& t_max)
+  {
+    for (int i = first; i < first + count; ++i) {
+      const scene::Instance& inst = scene.instances.data[i];
+      requestMesh(scene, inst.mesh_id);
+      const scene::Mesh& mesh = scene.meshes.data[inst.mesh_id];
+      const scene::Ray local = toObject(inst, r);
+      const float3 inv_dir = make_float3(
+        1.0f / local.dir.x, 1.0f / local.dir.y, 1.0f / local.dir.z);
+
+      TriangleLeaf leaf{ mesh, local, -1 };
+      traverseBVH(mesh.bvh.data, local, inv_dir, t_max, leaf);
+      tests += leaf.tests;
+      if (leaf.face >= 0) {
+        instance = &inst;
+        face = leaf.face;
+        u = leaf.u;
+        v = leaf.v;
+      }
+    }
+    return false;
+  }
+};
+
+/// <summary>
+/// Leaf of a mesh BVH for occlusion queries: stops
+/// as soon as any triangle is hit.
+/// </summary>
+struct OcclusionLeaf
+{
+  const scene::Mesh& mesh;
+  const scene::Ray& r;
+  unsigned int tests;
+
+  __device__ inline bool operator()(int first, int count, float& t_max)
+  {
+    const bool indexed = mesh.indices.size > 0;
+
+    float t, b1, b2;
+    for (int i = first; i < first + count; ++i) {
+      ++tests;
+      bool hit =
+        indexed ? intersectTriangle(mesh, i, r, t, b1, b2, true)
+                : intersectTriangle(mesh.triangles.data[i], r, t, b1, b2, true);
+      if (hit && t < t_max && t > 0.0)
+        return true;
+    }
+    return false;
+  }
+};
+
+/// <summary>
+/// Leaf of the top-level BVH for occlusion queries.
+/// </summary>
+struct InstanceOcclusionLeaf
+{
+  const scene::SceneData& scene;
+  const scene::Ray& r;
+  unsigned int tests;
+
+  __device__ inline bool operator()(int first, int count, float& t_max)
+  {
+    for (int i = first; i < first + count; ++i) {
+      const scene::Instance& inst = scene.instances.data[i];
+      requestMesh(scene, inst.mesh_id);
+      const scene::Mesh& mesh = scene.meshes.data[inst.mesh_id];
+      const scene::Ray local = toObject(inst, r);
+      const float3 inv_dir = make_float3(
+        1.0f / local.dir.x, 1.0f / local.dir.y, 1.0f / local.dir.z);
+
+      OcclusionLeaf leaf{ mesh, local };
+      const bool hit = traverseBVH(mesh.bvh.data, local, inv_dir, t_max, leaf);
+      tests += leaf.tests;
+      if (hit)
+        return true;
+    }
+    return false;
+  }
+};
+
+/// <summary>
+/// Leaf of the light BVH: tests the spheres it contains, and keeps track of
+/// the closest one.
+/// </summary>
+struct LightLeaf
+{
+  const scene::SceneData& scene;
+  const scene::Ray& r;
+  const scene::LightProp* light;
+
+  __device__ inline bool operator()(int first, int count, float& t_max)
+  {
+    float t;
+    for (int i = first; i < first + count; ++i) {
+      const scene::LightProp& l = scene.lights.data[i];
+      if (intersectSphere(r, l, t) && t < t_max && t >= 0.0f) {
+        t_max = t;
+        light = &l;
+      }
+    }
+    return false;
+  }
+};
+
+/// <summary>
+/// Closest triangle hit by a ray, as found by the traversal backend:
+/// * instance: instance of the mesh, null if nothing was hit;
+/// * face: index of the face in the mesh;
+/// * u / v: barycentric coordinates of the hit.
+/// </summary>
+struct TraceHit
+{
+  const scene::Instance* instance;
+  int face;
+  float u;
+  float v;
+};
+
+// The traversal of the triangles goes through one of two backends, the
+// shading being the same for both: the BVHs above, or OptiX, in the
+// programs compiled for it, whose traversal runs on the RT cores.
+#ifdef ARTRACER_OPTIX_PROGRAMS
+#include "optix_trace.cuh"
+#else
+/// <summary>
+/// Finds the closest triangle hit by `r' before the distance `t_max',
+/// going through the top-level BVH and then through the BVH of the mesh of
+/// each instance. Back faces are culled.
+/// </summary>
+/// <param name="t_max">Contains the distance of the hit, if any.</param>
+__device__ inline bool
+traceClosest(const scene::SceneData& scene, const scene::Ray& r,
+             float& t_max, TraceHit& hit)
+{
+  const float3 inv_dir =
+    make_float3(1.0f / r.dir.x, 1.0f / r.dir.y, 1.0f / r.dir.z);
+  InstanceLeaf leaf{ scene, r, nullptr, -1 };
+  traverseBVH(scene.bvh.data, r, inv_dir, t_max, leaf);
+  countRay(leaf.tests);
+
+  hit.instance = leaf.instance;
+  hit.face = leaf.face;
+  hit.u = leaf.u;
+  hit.v = leaf.v;
+  return leaf.instance != nullptr;
+}
+
+/// <summary>
+/// Checks whether any triangle blocks `r' before the distance `t_max',
+/// from either side. The traversal stops at the first hit found.
+/// </summary>
+__device__ inline bool
+traceOcclusion(const scene::SceneData& scene, const scene::Ray& r,
+               float t_max)
+{
+  const float3 inv_dir =
+    make_float3(1.0f / r.dir.x, 1.0f / r.dir.y, 1.0f / r.dir.z);
+  InstanceOcclusionLeaf leaf{ scene, r };
+  const bool hit = traverseBVH(scene.bvh.data, r, inv_dir, t_max, leaf);
+  countRay(leaf.tests);
+  return hit;
+}
+#endif
+
+/// <summary>
+/// Checks whether anything blocks the ray `r' before the distance `t_max'.
+/// The traversal stops at the first hit found, and neither the shading
+/// attributes nor the lights are looked at, which makes it way cheaper than
+/// `intersect' for shadow rays. Faces block the ray from both sides.
+/// </summary>
+__device__ inline bool
+occluded(const scene::Ray& r, const scene::Scenes& scenes,
+         unsigned int scene_id, float t_max)
+{
+  const scene::SceneData* scene = scenes.scenes[scene_id];
+  if (!scene->bvh.size)
+    return false;
+
+  return traceOcclusion(*scene, r, t_max);
+}
+
 /// <summary>
 /// Checks an intersection between a ray and all the meshes of the
 /// scene pointed by `scene_id'.
@@ -165,42 +661,54 @@ intersect(const scene::Ray& r, const scene::Scenes& scenes,
   static const float MAX_DIST = 100000.0;
 
   const scene::SceneData* scene = scenes.scenes[scene_id];
-  const scene::Buffer<scene::Texture>& textures = scenes.textures;
+  const scene::Buffer<scene::TextureObject>& textures = scenes.textures;
 
   float inter_dist = MAX_DIST;
   intersection.dist = MAX_DIST;
 
-  float3 normal;
-  float2 uv;
-
   const scene::Material* inter_mat = nullptr;
-
-  // Checks meshes intersection
-  for (size_t m = 0; m < scene->meshes.size; ++m) {
-    const auto& mesh = scene->meshes.data[m];
-    for (size_t i = 0; i < mesh.faces.size; ++i) {
-      const auto& face = mesh.faces.data[i];
-      if (intersectTriangle(face, normal, uv, r, inter_dist) &&
-          inter_dist < intersection.dist && inter_dist > 0.0) {
-        inter_mat = &scene->materials.data[face.material_id];
-        intersection.ior = inter_mat->ior;
-        intersection.normal = normal;
-        intersection.surface_normal = normal;
-        intersection.tangent = face.tangent;
-
-        intersection.uv = uv;
-        intersection.dist = inter_dist;
-        intersection.light = NULL;
-      }
-    }
+  float lod = 0.0f;
+
+  // Checks meshes intersection, through the traversal backend. Shading
+  // attributes are only fetched for the closest hit, and moved from the
+  // space of its mesh to the scene.
+  TraceHit hit;
+  if (scene->bvh.size && traceClosest(*scene, r, intersection.dist, hit)) {
+    const scene::Instance& inst = *hit.instance;
+    const scene::Mesh& mesh = scene->meshes.data[inst.mesh_id];
+    unsigned int material_id =
+      interpolateFace(mesh, hit.face, hit.u, hit.v, intersection.normal,
+                      intersection.uv, intersection.tangent);
+    // Scaled instances change the length of the normals.
+    intersection.normal =
+      normalize(scene::transformNormal(inst, intersection.normal));
+    intersection.tangent =
+      normalize(scene::transformVector(inst.to_world, intersection.tangent));
+
+    // Level of detail given by the ray cone: its width at the hit,
+    // projected on the surface, compared to the UV size of the face.
+    float width = r.cone_width + r.cone_spread * intersection.dist;
+    float cos_t = fabsf(dot(r.dir, normalize(intersection.normal)));
+    lod = 0.5f * __log2f(faceTexelDensity(mesh, inst, hit.face)) +
+          __log2f(width / fmaxf(cos_t, 0.0001f));
+
+    inter_mat = &scene->materials.data[material_id];
+    intersection.material_id = material_id;
+    intersection.ior = inter_mat->ior;
+    intersection.surface_normal = intersection.normal;
+    intersection.light = NULL;
   }
 
-  // At least one intersection has been found.
-  for (unsigned l = 0; l < scene->lights.size; ++l) {
-    // Checks lights intersection
-    const scene::LightProp& light = scene->lights.data[l];
-    if (intersectSphere(r, light, inter_dist) &&
-        inter_dist < intersection.dist && inter_dist >= 0.0) {
+  // Checks lights intersection, through their BVH, which only visits the
+  // lights whose bounds are closer than the hit.
+  if (scene->light_bvh.size) {
+    const float3 inv_dir =
+      make_float3(1.0f / r.dir.x, 1.0f / r.dir.y, 1.0f / r.dir.z);
+    LightLeaf leaf{ *scene, r, nullptr };
+    inter_dist = intersection.dist;
+    traverseBVH(scene->light_bvh.data, r, inv_dir, inter_dist, leaf);
+    if (leaf.light) {
+      const scene::LightProp& light = *leaf.light;
       intersection.light = &light;
       intersection.dist = inter_dist;
       intersection.diffuse_col =
@@ -216,7 +724,7 @@ intersect(const scene::Ray& r, const scene::Scenes& scenes,
   if (inter_mat) {
     // Fetches diffuse color from texture
     float4 fetch;
-    sampleTexture(textures, inter_mat->diffuse_spec_map, intersection.uv,
+    sampleTexture(textures, inter_mat->diffuse_spec_map, intersection.uv, lod,
                   fetch);
     intersection.diffuse_col.x = fetch.x;
     intersection.diffuse_col.y = fetch.y;
@@ -227,7 +735,8 @@ intersect(const scene::Ray& r, const scene::Scenes& scenes,
     // Computes normal perturbated by normal map
     if (inter_mat->normal_map >= 0) {
       float3 normal;
-      sampleTexture(textures, inter_mat->normal_map, intersection.uv, normal);
+      sampleTexture(textures, inter_mat->normal_map, intersection.uv, lod,
+                    normal);
       intersection.normal = normalize((normal * 2.0f) - 1.0f);
 
       float3 binormal =
@@ -238,7 +747,7 @@ intersect(const scene::Ray& r, const scene::Scenes& scenes,
       tbn.y = -binormal;
       tbn.z = intersection.surface_normal;
 
-      intersection.normal = tbn * intersection.normal;
+      intersection.normal = normalize(tbn * intersection.normal);
     }
   }
 
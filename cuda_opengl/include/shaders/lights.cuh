@@ -0,0 +1,345 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include "cubemap.cuh"
+#include "cutils_math.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Explicit sampling of the sphere lights
+////////////////////////////////////////////////////////////////////////////////
+
+/// <summary>
+/// Computes the PDF, in solid angle, of sampling a direction towards `light'
+/// from the point `p', when directions are uniformly sampled inside the cone
+/// subtended by the sphere.
+/// </summary>
+/// <returns>The PDF, or 0 when `p' is inside the light.</returns>
+__device__ inline float
+sphereLightPdf(const scene::LightProp& light, const float3& p)
+{
+  float3 op = light.vec - p;
+  float dist2 = dot(op, op);
+  float radius2 = light.radius * light.radius;
+  if (dist2 <= radius2)
+    return 0.0f;
+
+  float cos_max = __fsqrt_rn(1.0f - radius2 / dist2);
+  return 1.0f / (2.0f * M_PI * (1.0f - cos_max));
+}
+
+/// <summary>
+/// Samples a direction towards a sphere light, uniformly inside the cone
+/// it subtends from the point `p'.
+/// </summary>
+/// <param name="light">Light to sample.</param>
+/// <param name="p">Point from which the light is sampled.</param>
+/// <param name="u1">First uniform random number.</param>
+/// <param name="u2">Second uniform random number.</param>
+/// <param name="out_dir">Contains the sampled direction.</param>
+/// <param name="out_dist">Contains the distance to the light surface, along
+/// the sampled direction.</param>
+/// <param name="out_pdf">Contains the PDF of the direction, in solid
+/// angle.</param>
+/// <returns>False if `p' is inside the light.</returns>
+__device__ inline bool
+sampleSphereLight(const scene::LightProp& light, const float3& p, float u1,
+                  float u2, float3& out_dir, float& out_dist, float& out_pdf)
+{
+  float3 op = light.vec - p;
+  float dist2 = dot(op, op);
+  float radius2 = light.radius * light.radius;
+  if (dist2 <= radius2)
+    return false;
+
+  float dist = __fsqrt_rn(dist2);
+  float3 w = op / dist;
+
+  float cos_max = __fsqrt_rn(1.0f - radius2 / dist2);
+  float cos_t = 1.0f - u1 * (1.0f - cos_max);
+  float sin_t = __fsqrt_rn(fmaxf(0.0f, 1.0f - cos_t * cos_t));
+  float phi = 2.0f * M_PI * u2;
+
+  // u, v and w form the base of the cone
+  float3 u = normalize(cross(fabs(w.x) > .1 ? make_float3(0.0f, 1.0f, 0.0f)
+                                            : make_float3(1.0f, 0.0f, 0.0f),
+                             w));
+  float3 v = cross(w, u);
+
+  out_dir =
+    normalize(u * __cosf(phi) * sin_t + v * __sinf(phi) * sin_t + w * cos_t);
+
+  // Distance to the closest intersection with the sphere
+  float b = dot(op, out_dir);
+  float disc = fmaxf(0.0f, b * b - dist2 + radius2);
+  out_dist = b - __fsqrt_rn(disc);
+
+  out_pdf = 1.0f / (2.0f * M_PI * (1.0f - cos_max));
+  return true;
+}
+
+/// <summary>
+/// Weight of a sample drawn with the PDF `pdf_a', when the same direction
+/// can also be drawn with the PDF `pdf_b' (power heuristic, beta = 2).
+/// </summary>
+__device__ inline float
+powerHeuristic(float pdf_a, float pdf_b)
+{
+  float a2 = pdf_a * pdf_a;
+  float b2 = pdf_b * pdf_b;
+  if (a2 + b2 <= 0.0f)
+    return 0.0f;
+
+  return a2 / (a2 + b2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Selection of the lights through their BVH
+////////////////////////////////////////////////////////////////////////////////
+
+/// <summary>
+/// Estimates the contribution, at the point `p', of lights of power `power'
+/// bounded by the sphere of center `center' and squared radius `radius2':
+/// their power over their squared distance, which is clamped to the bounds
+/// so that the lights around `p' do not get an infinite importance.
+/// </summary>
+__device__ inline float
+lightImportance(float power, const float3& center, float radius2,
+                const float3& p)
+{
+  float3 d = center - p;
+  return power / fmaxf(dot(d, d), fmaxf(radius2, 1e-6f));
+}
+
+/// <summary>
+/// Importance of the lights under a node of the light BVH, seen from `p'.
+/// </summary>
+__device__ inline float
+nodeImportance(const scene::SceneData& scene, int node, const float3& p)
+{
+  const scene::BVHNode& n = scene.light_bvh.data[node];
+  float3 half = (n.max - n.min) * 0.5f;
+  return lightImportance(scene.light_power.data[node].power,
+                         (n.min + n.max) * 0.5f, dot(half, half), p);
+}
+
+/// <summary>
+/// Importance of a single light, seen from `p'.
+/// </summary>
+__device__ inline float
+lightImportance(const scene::LightProp& light, const float3& p)
+{
+  return lightImportance(scene::lightPower(light), light.vec,
+                         light.radius * light.radius, p);
+}
+
+/// <summary>
+/// Picks one of the lights of a scene, proportionally to its importance
+/// seen from the point `p'. The light BVH is walked down from its root, each
+/// step choosing a child proportionally to the importance of its bounds, and
+/// a light is then chosen among the few of the leaf reached. The cost stays
+/// logarithmic in the number of lights.
+/// </summary>
+/// <param name="u">Uniform random number, rescaled at each step to be
+/// reused by the next one.</param>
+/// <param name="out_pdf">Contains the probability of picking the
+/// light.</param>
+/// <returns>Index of the light, or -1 if none contributes to `p'.</returns>
+__device__ inline int
+pickLight(const scene::SceneData& scene, const float3& p, float u,
+          float& out_pdf)
+{
+  const scene::BVHNode* nodes = scene.light_bvh.data;
+  float pdf = 1.0f;
+  int node = 0;
+  while (nodes[node].right >= 0) {
+    const int left = nodes[node].left;
+    const int right = nodes[node].right;
+    float w_left = nodeImportance(scene, left, p);
+    float w_right = nodeImportance(scene, right, p);
+    if (w_left + w_right <= 0.0f)
+      return -1;
+
+    float p_left = w_left / (w_left + w_right);
+    if (u < p_left) {
+      u /= p_left;
+      pdf *= p_left;
+      node = left;
+    } else {
+      u = (u - p_left) / (1.0f - p_left);
+      pdf *= 1.0f - p_left;
+      node = right;
+    }
+    u = fminf(u, 0.99999994f);
+  }
+
+  const int first = nodes[node].left;
+  const int count = -nodes[node].right;
+  float total = 0.0f;
+  for (int i = first; i < first + count; ++i)
+    total += lightImportance(scene.lights.data[i], p);
+  if (total <= 0.0f)
+    return -1;
+
+  // The last light with an importance is kept when `u' rounds past the end.
+  float target = u * total;
+  int picked = -1;
+  float w_picked = 0.0f;
+  for (int i = first; i < first + count; ++i) {
+    float w = lightImportance(scene.lights.data[i], p);
+    if (w <= 0.0f)
+      continue;
+    picked = i;
+    w_picked = w;
+    if (target < w)
+      break;
+    target -= w;
+  }
+
+  out_pdf = pdf * w_picked / total;
+  return picked;
+}
+
+/// <summary>
+/// Computes the probability that `pickLight' picks the light `light' from
+/// the point `p', following the path from the root to its leaf. The lights
+/// of a node being contiguous, the left ones first, the counts of the nodes
+/// tell which child contains it.
+/// </summary>
+__device__ inline float
+pickLightPdf(const scene::SceneData& scene, const float3& p,
+             unsigned int light)
+{
+  const scene::BVHNode* nodes = scene.light_bvh.data;
+  float pdf = 1.0f;
+  unsigned int first = 0;
+  int node = 0;
+  while (nodes[node].right >= 0) {
+    const int left = nodes[node].left;
+    const int right = nodes[node].right;
+    float w_left = nodeImportance(scene, left, p);
+    float w_right = nodeImportance(scene, right, p);
+    if (w_left + w_right <= 0.0f)
+      return 0.0f;
+
+    const unsigned int nb_left = scene.light_power.data[left].count;
+    if (light < first + nb_left) {
+      pdf *= w_left / (w_left + w_right);
+      node = left;
+    } else {
+      pdf *= w_right / (w_left + w_right);
+      first += nb_left;
+      node = right;
+    }
+  }
+
+  float total = 0.0f;
+  for (int i = nodes[node].left; i < nodes[node].left - nodes[node].right;
+       ++i)
+    total += lightImportance(scene.lights.data[i], p);
+  if (total <= 0.0f)
+    return 0.0f;
+
+  return pdf * lightImportance(scene.lights.data[light], p) / total;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Importance sampling of the environment
+////////////////////////////////////////////////////////////////////////////////
+
+/// <summary>
+/// Finds the first element of an inclusive CDF greater than `value'.
+/// </summary>
+__device__ inline unsigned int
+upperBound(const float* cdf, unsigned int nb_elt, float value)
+{
+  unsigned int low = 0;
+  unsigned int high = nb_elt;
+  while (low < high) {
+    unsigned int mid = (low + high) / 2;
+    if (cdf[mid] <= value)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return min(low, nb_elt - 1);
+}
+
+/// <summary>
+/// Computes the PDF, in solid angle, of sampling the point (s, t) of a face,
+/// given the weight of the texel containing it.
+/// </summary>
+__device__ inline float
+texelPdf(const scene::EnvironmentDistribution& dist, float weight, float s,
+         float t)
+{
+  // Going from the area of the face to solid angles.
+  float d2 = 1.0f + s * s + t * t;
+  float texel_area = 4.0f / (dist.size * dist.size);
+  return weight / dist.total * d2 * __fsqrt_rn(d2) / texel_area;
+}
+
+/// <summary>
+/// Computes the PDF, in solid angle, of sampling the direction `dir' with
+/// `sampleEnvironment'.
+/// </summary>
+__device__ inline float
+environmentPdf(const scene::EnvironmentDistribution& dist, const float3& dir)
+{
+  if (dist.total <= 0.0f)
+    return 0.0f;
+
+  // Cubemap fetches are made with a flipped z axis.
+  float s, t;
+  unsigned int face = cubemapFace(make_float3(dir.x, dir.y, -dir.z), s, t);
+
+  unsigned int x = min((unsigned int)((s + 1.0f) * 0.5f * dist.size),
+                       dist.size - 1);
+  unsigned int y = min((unsigned int)((t + 1.0f) * 0.5f * dist.size),
+                       dist.size - 1);
+
+  const float* row = dist.conditional + (face * dist.size + y) * dist.size;
+  float weight = row[x] - (x > 0 ? row[x - 1] : 0.0f);
+  return texelPdf(dist, weight, s, t);
+}
+
+/// <summary>
+/// Samples a direction of the environment, proportionally to its luminance.
+/// A row is chosen using the marginal CDF, then a texel inside it using the
+/// conditional CDF, and the direction is uniformly picked inside the texel.
+/// </summary>
+/// <param name="dist">Distribution of the environment.</param>
+/// <param name="u">Four uniform random numbers.</param>
+/// <param name="out_dir">Contains the sampled direction.</param>
+/// <param name="out_pdf">Contains the PDF of the direction, in solid
+/// angle.</param>
+/// <returns>False if no direction could be sampled.</returns>
+__device__ inline bool
+sampleEnvironment(const scene::EnvironmentDistribution& dist, const float4& u,
+                  float3& out_dir, float& out_pdf)
+{
+  if (dist.total <= 0.0f)
+    return false;
+
+  const unsigned int nb_rows = 6 * dist.size;
+  unsigned int r = upperBound(dist.marginal, nb_rows, u.x * dist.total);
+  float row_start = r > 0 ? dist.marginal[r - 1] : 0.0f;
+  float row_total = dist.marginal[r] - row_start;
+
+  const float* row = dist.conditional + r * dist.size;
+  unsigned int x = upperBound(row, dist.size, u.y * row_total);
+  float weight = row[x] - (x > 0 ? row[x - 1] : 0.0f);
+  if (weight <= 0.0f)
+    return false;
+
+  unsigned int face = r / dist.size;
+  unsigned int y = r % dist.size;
+  float s = 2.0f * (x + u.z) / dist.size - 1.0f;
+  float t = 2.0f * (y + u.w) / dist.size - 1.0f;
+
+  // Cubemap fetches are made with a flipped z axis.
+  float3 c = cubemapDirection(face, s, t);
+  out_dir = normalize(make_float3(c.x, c.y, -c.z));
+  out_pdf = texelPdf(dist, weight, s, t);
+  return true;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <optix.h>
+
+// Traversal backend of the programs compiled for OptiX, included by
+// intersection.cuh in place of the BVH traversal. Rays are traced against
+// the instance acceleration structure of the scene, built by
+// `driver::OptixBackend' from the uploaded meshes, and their hits are
+// returned through the payload registers:
+// * 0: index of the instance, ~0 when nothing was hit;
+// * 1: index of the face in its mesh;
+// * 2 / 3: barycentric coordinates of the hit;
+// * 4: distance of the hit.
+// Occlusion rays only use the first one, cleared by their miss program.
+
+/// <summary>
+/// Traversable of the scene being rendered, defined along with the launch
+/// parameters.
+/// </summary>
+__device__ inline OptixTraversableHandle sceneTraversable();
+
+/// <summary>
+/// Miss programs of the rays, matching their index in the shader binding
+/// table. A single hit group shades both kinds of rays.
+/// </summary>
+enum OptixMissProgram
+{
+  OPTIX_MISS_RADIANCE = 0,
+  OPTIX_MISS_OCCLUSION,
+  NB_OPTIX_MISS_PROGRAMS
+};
+
+constexpr unsigned int OPTIX_NO_HIT = ~0u;
+
+__device__ inline bool
+traceClosest(const scene::SceneData& scene, const scene::Ray& r,
+             float& t_max, TraceHit& hit)
+{
+  unsigned int instance = OPTIX_NO_HIT;
+  unsigned int face = 0;
+  unsigned int u = 0;
+  unsigned int v = 0;
+  unsigned int t = __float_as_uint(t_max);
+  // Faces are culled when seen from the back, as the software traversal.
+  optixTrace(sceneTraversable(), r.origin, r.dir, 0.0f, t_max, 0.0f,
+             OptixVisibilityMask(255),
+             OPTIX_RAY_FLAG_DISABLE_ANYHIT |
+               OPTIX_RAY_FLAG_CULL_BACK_FACING_TRIANGLES,
+             0, 1, OPTIX_MISS_RADIANCE, instance, face, u, v, t);
+  // The triangles tested by the RT cores cannot be counted.
+  countRay(0);
+
+  if (instance == OPTIX_NO_HIT) {
+    hit.instance = nullptr;
+    return false;
+  }
+
+  hit.instance = &scene.instances.data[instance];
+  hit.face = face;
+  hit.u = __uint_as_float(u);
+  hit.v = __uint_as_float(v);
+  t_max = __uint_as_float(t);
+  return true;
+}
+
+__device__ inline bool
+traceOcclusion(const scene::SceneData&, const scene::Ray& r, float t_max)
+{
+  unsigned int occluded = 1;
+  optixTrace(sceneTraversable(), r.origin, r.dir, 0.0f, t_max, 0.0f,
+             OptixVisibilityMask(255),
+             OPTIX_RAY_FLAG_DISABLE_ANYHIT |
+               OPTIX_RAY_FLAG_TERMINATE_ON_FIRST_HIT |
+               OPTIX_RAY_FLAG_DISABLE_CLOSESTHIT,
+             0, 1, OPTIX_MISS_OCCLUSION, occluded);
+  countRay(0);
+  return occluded != 0;
+}
+
+extern "C" __global__ void
+__closesthit__radiance()
+{
+  const float2 barycentrics = optixGetTriangleBarycentrics();
+  optixSetPayload_0(optixGetInstanceIndex());
+  optixSetPayload_1(optixGetPrimitiveIndex());
+  optixSetPayload_2(__float_as_uint(barycentrics.x));
+  optixSetPayload_3(__float_as_uint(barycentrics.y));
+  optixSetPayload_4(__float_as_uint(optixGetRayTmax()));
+}
+
+extern "C" __global__ void
+__miss__radiance()
+{
+}
+
+extern "C" __global__ void
+__miss__occlusion()
+{
+  optixSetPayload_0(0);
+}
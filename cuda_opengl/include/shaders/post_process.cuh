@@ -1,11 +1,10 @@
 #pragma once
 
 #include <cuda.h>
-#include <curand.h>
-#include <curand_kernel.h>
 #include <driver_types.h>
 
 #include "../driver/cuda_helper.h"
+#include "sampler.cuh"
 
 /// <summary>
 /// Applies the tone mapping used in the Uncharted game.
@@ -45,17 +44,18 @@ exposure(float3 color)
 /// </summary>
 /// <param name="r">Initial ray (origin and direction).</param>
 /// <param name="cam">Camera used to compute the DOF.</param>
-/// <param name="rand_state">Random state.</param>
+/// <param name="sampler">Sampler of the path, whose two first dimensions
+/// are the position on the lens.</param>
 __device__ inline void
-camera_dof(scene::Ray& r, const scene::Camera& cam, curandState* rand_state)
+camera_dof(scene::Ray& r, const scene::Camera& cam, const Sampler& sampler)
 {
   // Focus distance
   // float3 focal_point = 2.f * r.dir;
   float3 focal_point = cam.focus_dist * r.dir;
-  float random_angle = curand_uniform(rand_state) * 2.0f * M_PI;
+  float random_angle = sample1D(sampler, 0) * 2.0f * M_PI;
 
   // Aperture size
-  float random_radius = curand_uniform(rand_state) * cam.aperture;
+  float random_radius = sample1D(sampler, 1) * cam.aperture;
   float3 random_aperture_pos =
     (cos(random_angle) * cam.u + sin(random_angle) * cam.v) * random_radius;
 
@@ -3,15 +3,299 @@
 #include <cuda.h>
 #include <driver_types.h>
 
+#include "../driver/gpu_info.h"
+#include "../driver/optix_backend.h"
 #include "../scene/scene.h"
 #include "cutils_math.h"
 
-cudaError_t raytrace(cudaArray_const_t array, const scene::Scenes& scenes,
-                     unsigned int scene_id,
+/// <summary>
+/// Maximum number of GPUs rendering the same frames.
+/// </summary>
+constexpr int MAX_RENDER_DEVICES = 16;
+
+/// <summary>
+/// Layouts of the temporal framebuffer, which accumulates the radiance of
+/// each pixel:
+/// * ACCUMULATION_FLOAT3: the sum of the samples, in 12 bytes (default);
+/// * ACCUMULATION_FLOAT4: the same, padded to 16 bytes, so that a pixel is
+///   read and written with a single vectorized access;
+/// * ACCUMULATION_HALF4: the mean of the samples as fp16, in 8 bytes. Sums
+///   would lose their precision in a few samples, while means of clamped
+///   samples stay in [0, 1]. Below 1/2048, the updates of the mean are lost,
+///   so it stops converging after a few thousand samples.
+/// </summary>
+enum AccumulationFormat
+{
+  ACCUMULATION_FLOAT3 = 0,
+  ACCUMULATION_FLOAT4,
+  ACCUMULATION_HALF4,
+  NB_ACCUMULATION_FORMATS
+};
+
+/// <summary>
+/// Size of a pixel of the temporal framebuffer using the layout `format'.
+/// </summary>
+inline size_t
+accumulationPixelSize(AccumulationFormat format)
+{
+  return format == ACCUMULATION_FLOAT4
+           ? sizeof(float4)
+           : format == ACCUMULATION_HALF4 ? sizeof(uint2) : sizeof(float3);
+}
+
+/// <summary>
+/// Temporal framebuffer on the GPU, one pixel per texel of the screen,
+/// starting from the bottom row.
+/// </summary>
+struct AccumulationBuffer
+{
+  void* data = nullptr;
+  AccumulationFormat format = ACCUMULATION_FLOAT3;
+};
+
+/// <summary>
+/// Formats of the surface the colors are written to:
+/// * OUTPUT_RGBA8: 8 bits per channel (default);
+/// * OUTPUT_RGBA16F: fp16 channels, keeping colors brighter than white for
+///   HDR displays, without the 8 bits quantization.
+/// </summary>
+enum OutputFormat
+{
+  OUTPUT_RGBA8 = 0,
+  OUTPUT_RGBA16F,
+  NB_OUTPUT_FORMATS
+};
+
+/// <summary>
+/// Surface object of the framebuffer the colors are written to,
+/// along with its format.
+/// </summary>
+struct OutputSurface
+{
+  cudaSurfaceObject_t surface = 0;
+  OutputFormat format = OUTPUT_RGBA8;
+};
+
+/// <summary>
+/// History of the temporal accumulation reusing samples across camera
+/// moves: the average radiance of each pixel, and the first hit it shows,
+/// for the last two frames.
+/// </summary>
+struct ReprojectionBuffers;
+
+/// <summary>
+/// Allocates the reprojection buffers for a screen of the given size.
+/// </summary>
+ReprojectionBuffers* createReprojection(unsigned int width,
+                                        unsigned int height);
+
+void releaseReprojection(ReprojectionBuffers* buffers);
+
+/// <summary>
+/// Color and first hit features of each pixel, filtered by the denoiser.
+/// </summary>
+struct DenoiserBuffers;
+
+DenoiserBuffers* createDenoiser(unsigned int width, unsigned int height);
+
+void releaseDenoiser(DenoiserBuffers* buffers);
+
+/// <summary>
+/// Number of samples of each pixel, and the second moment of their
+/// luminance, from which adaptive sampling estimates its error.
+/// </summary>
+struct AdaptiveBuffers;
+
+AdaptiveBuffers* createAdaptive(unsigned int width, unsigned int height);
+
+void releaseAdaptive(AdaptiveBuffers* buffers);
+
+/// <summary>
+/// Renders a frame, each thread following the whole path of its pixel.
+/// </summary>
+/// <param name="surface">Surface the colors are written to.</param>
+/// <param name="temporal_framebuffer">Sum, or mean, of the samples of each
+/// pixel since the camera last moved.</param>
+/// <param name="reprojection">If not null, frames are accumulated in these
+/// buffers instead of `temporal_framebuffer': the history of each pixel is
+/// reprojected from the previous frame, so that it survives camera moves,
+/// and moving frames are fully traced instead of previewed.</param>
+/// <param name="denoiser">If not null, the average color of each pixel is
+/// filtered by an edge-avoiding a-trous filter, guided by the normal,
+/// distance and albedo of its first hit, before being written.</param>
+/// <param name="adaptive">If not null, each pixel traces as many paths as
+/// the error of its mean requires, up to a few, and stops once it is under
+/// a threshold. The temporal framebuffer then holds a different number of
+/// samples in each pixel. Ignored when reprojecting.</param>
+cudaError_t raytrace(const OutputSurface& surface,
+                     const scene::Scenes& scenes, unsigned int scene_id,
                      const std::vector<scene::Cubemap>& cubemaps,
                      int cubemap_id, const scene::Camera* const cam,
                      const unsigned int width, const unsigned int height,
-                     cudaStream_t stream, float3* temporal_framebuffer,
-                     bool moved, unsigned int post_id);
+                     cudaStream_t stream,
+                     const AccumulationBuffer& temporal_framebuffer,
+                     bool moved, unsigned int post_id,
+                     ReprojectionBuffers* reprojection = nullptr,
+                     DenoiserBuffers* denoiser = nullptr,
+                     AdaptiveBuffers* adaptive = nullptr);
+
+/// <summary>
+/// Renders a frame like `raytrace', but using persistent threads: only
+/// enough threads to fill the GPU are launched, and each warp pulls tiles
+/// from a global counter until the frame is done.
+/// </summary>
+/// <param name="gpu">GPU on which the kernel runs, used to choose the size
+/// of the launch.</param>
+cudaError_t raytracePersistent(
+  const OutputSurface& surface, const scene::Scenes& scenes,
+  unsigned int scene_id, const std::vector<scene::Cubemap>& cubemaps,
+  int cubemap_id, const scene::Camera* const cam, const unsigned int width,
+  const unsigned int height, cudaStream_t stream,
+  const AccumulationBuffer& temporal_framebuffer, bool moved,
+  unsigned int post_id, const driver::GPUInfo::GPU& gpu,
+  ReprojectionBuffers* reprojection = nullptr,
+  DenoiserBuffers* denoiser = nullptr, AdaptiveBuffers* adaptive = nullptr);
+
+/// <summary>
+/// Renders a frame like `raytrace', its rays being traced by OptiX on the
+/// RT cores, against the acceleration structures `optix' built for the
+/// scene. Falls back on `raytrace' when OptiX is not available.
+/// </summary>
+cudaError_t raytraceOptix(
+  driver::OptixBackend& optix, const OutputSurface& surface,
+  const scene::Scenes& scenes, unsigned int scene_id,
+  const std::vector<scene::Cubemap>& cubemaps, int cubemap_id,
+  const scene::Camera* const cam, const unsigned int width,
+  const unsigned int height, cudaStream_t stream,
+  const AccumulationBuffer& temporal_framebuffer, bool moved,
+  unsigned int post_id, ReprojectionBuffers* reprojection = nullptr,
+  DenoiserBuffers* denoiser = nullptr, AdaptiveBuffers* adaptive = nullptr);
+
+/// <summary>
+/// One of the views rendered by `raytraceViews': its camera, and the
+/// temporal framebuffer accumulating its samples.
+/// </summary>
+struct RenderView
+{
+  scene::Camera camera;
+  AccumulationBuffer framebuffer;
+};
+
+/// <summary>
+/// Renders a sample per pixel of several views of the same scene, all of
+/// them of the same size, with a single dispatch of persistent threads.
+/// Small views fill the GPU together, the launch overhead is paid once, and
+/// the BVHs and textures stay in the caches from a view to the next one.
+/// Views are accumulated as static frames, without being written to any
+/// surface: their sums are read with `readSums'.
+/// </summary>
+/// <param name="frame_nb">Number of frames accumulated in each view with
+/// this one, 1 restarting them. Also the seed of the samples.</param>
+/// <param name="gpu">GPU on which the kernel runs, used to choose the size
+/// of the launch.</param>
+cudaError_t raytraceViews(const std::vector<RenderView>& views,
+                          const scene::Scenes& scenes, unsigned int scene_id,
+                          const std::vector<scene::Cubemap>& cubemaps,
+                          int cubemap_id, const unsigned int width,
+                          const unsigned int height, unsigned int frame_nb,
+                          cudaStream_t stream,
+                          const driver::GPUInfo::GPU& gpu);
+
+/// <summary>
+/// Device buffers of the wavefront path tracer: the state of one path per
+/// pixel, the queues connecting the stages, and the bins reordering them.
+/// </summary>
+struct WavefrontBuffers;
+
+/// <summary>
+/// Allocates the wavefront buffers for a screen of the given size.
+/// </summary>
+WavefrontBuffers* createWavefront(unsigned int width, unsigned int height);
+
+void releaseWavefront(WavefrontBuffers* buffers);
+
+/// <summary>
+/// Renders a frame like `raytrace', but using one kernel per stage of a
+/// bounce (generation, intersection, shading of each kind of material,
+/// and environment), connected by compacted ray queues. There being one
+/// path per pixel, adaptive sampling only leaves converged pixels out.
+/// </summary>
+/// <param name="reorder">Bins the hits by material before they are shaded,
+/// and the bounce rays by direction octant and origin cell before they are
+/// intersected, making neighbouring threads run the same branches and read
+/// the same textures and nodes.</param>
+cudaError_t raytraceWavefront(
+  WavefrontBuffers* buffers, const OutputSurface& surface,
+  const scene::Scenes& scenes, unsigned int scene_id,
+  const std::vector<scene::Cubemap>& cubemaps, int cubemap_id,
+  const scene::Camera* const cam, const unsigned int width,
+  const unsigned int height, cudaStream_t stream,
+  const AccumulationBuffer& temporal_framebuffer, bool moved,
+  unsigned int post_id,
+  ReprojectionBuffers* reprojection = nullptr,
+  DenoiserBuffers* denoiser = nullptr, AdaptiveBuffers* adaptive = nullptr,
+  bool reorder = false);
+
+/// <summary>
+/// Writes to the screen the average of frames accumulated separately, by
+/// several GPUs. Each framebuffer must be accessible from the current GPU.
+/// </summary>
+/// <param name="framebuffers">Temporal framebuffers to merge.</param>
+/// <param name="nb_frames">Number of frames each one contains.</param>
+cudaError_t mergeFrames(const OutputSurface& surface,
+                        const std::vector<AccumulationBuffer>& framebuffers,
+                        const std::vector<unsigned int>& nb_frames,
+                        const unsigned int width, const unsigned int height,
+                        cudaStream_t stream, unsigned int post_id);
+
+/// <summary>
+/// Copies to the CPU the sum of the samples of each pixel of a temporal
+/// framebuffer, whatever its layout. Waits for the copy.
+/// </summary>
+/// <param name="nb_frames">Number of frames the framebuffer contains.</param>
+/// <param name="out_sums">Contains `nb_pixels' sums.</param>
+cudaError_t readSums(const AccumulationBuffer& framebuffer,
+                     unsigned int nb_frames, size_t nb_pixels,
+                     float3* out_sums, cudaStream_t stream);
+
+/// <summary>
+/// Offsets the seeds of the frames rendered on the current GPU, and restarts
+/// them from the first frame. Nodes of a render farm rendering the same
+/// frame use offsets at least as far apart as the number of samples each
+/// one renders, to draw other samples.
+/// </summary>
+void setSeedOffset(unsigned int offset);
+
+/// <summary>
+/// Chooses the sampler drawing the random numbers of the paths on the
+/// current GPU: 0 for an Owen scrambled Sobol sequence (the default), 1 for
+/// a rank-1 sequence with a blue noise dither, 2 for independent samples.
+/// </summary>
+void setSampler(unsigned int sampler_id);
+
+/// <summary>
+/// Work done by the kernels on a GPU since the counters were last read.
+/// Counting is compiled in with ARTRACER_COUNTERS only, as its atomics slow
+/// the render down.
+/// </summary>
+struct RenderCounters
+{
+  /// <summary>
+  /// Rays traced, shadow rays included, and the triangles they tested.
+  /// </summary>
+  unsigned long long rays;
+  unsigned long long triangle_tests;
+
+  /// <summary>
+  /// Paths started, and the number of bounces they took.
+  /// </summary>
+  unsigned long long paths;
+  unsigned long long bounces;
+};
 
-void setupFunctionTables();
+/// <summary>
+/// Reads the counters of the current GPU once the work queued on `stream'
+/// is done, and clears them. Waits for the stream.
+/// </summary>
+/// <returns>False if the counters are not compiled in.</returns>
+bool readCounters(RenderCounters& out, cudaStream_t stream);
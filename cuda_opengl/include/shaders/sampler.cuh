@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include "cutils_math.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Samplers
+//
+// Every random number of a path is a sample of a sequence, indexed by the
+// pixel, the number of the sample in this pixel, and its dimension, i.e.
+// the rank of the number along the path. Samplers are stateless: a sample
+// is computed from these indices only, so paths keep a few integers instead
+// of the state of a random generator, and nothing has to be initialized.
+////////////////////////////////////////////////////////////////////////////////
+
+enum SamplerType
+{
+  /// <summary>
+  /// Sobol sequence, Owen scrambled per pixel (Burley 2020): the samples of
+  /// a pixel stay stratified whatever their number.
+  /// </summary>
+  SAMPLER_SOBOL = 0,
+
+  /// <summary>
+  /// R2 sequence (a rank-1 lattice with no fixed size), shifted per pixel by
+  /// a dither mask, so that the error is distributed as blue noise.
+  /// </summary>
+  SAMPLER_RANK1,
+
+  /// <summary>
+  /// Independent samples, hashed from the indices.
+  /// </summary>
+  SAMPLER_RANDOM,
+
+  NB_SAMPLERS
+};
+
+/// <summary>
+/// Samples drawn for a frame: the sampler, and the index of the first sample
+/// of the frame in each pixel. `offset' separates the samples of several
+/// GPUs, or nodes of a render farm, rendering the same frames.
+/// </summary>
+struct SamplerFrame
+{
+  SamplerType type;
+  unsigned int offset;
+  unsigned int frame;
+};
+
+/// <summary>
+/// Sample of a pixel being traced. `dimension' is the first dimension of the
+/// current bounce, the dimensions of a bounce being given relative to it.
+/// </summary>
+struct Sampler
+{
+  SamplerType type;
+  unsigned short x;
+  unsigned short y;
+  unsigned int index;
+  unsigned int dimension;
+};
+
+/// <summary>
+/// Mixes the bits of an integer (lowbias32, by Chris Wellons).
+/// </summary>
+__device__ inline unsigned int
+hashInt(unsigned int x)
+{
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+/// <summary>
+/// Random permutation of the integers preserving their base 2 structure,
+/// i.e. an Owen scrambling of their bits, from Burley's hash.
+/// </summary>
+__device__ inline unsigned int
+nestedUniformScramble(unsigned int x, unsigned int seed)
+{
+  x = __brev(x);
+  x ^= x * 0x3d20adeau;
+  x += seed;
+  x *= (seed >> 16) | 1u;
+  x ^= x * 0x05526c56u;
+  x ^= x * 0x53a22864u;
+  return __brev(x);
+}
+
+/// <summary>
+/// Gives one of the first two dimensions of the Sobol sequence, as a
+/// 0.32 fixed point number: a van der Corput sequence for the first one.
+/// </summary>
+__device__ inline unsigned int
+sobol(unsigned int index, unsigned int dimension)
+{
+  if (dimension == 0)
+    return __brev(index);
+
+  unsigned int result = 0;
+  for (unsigned int v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+    if (index & 1)
+      result ^= v;
+  return result;
+}
+
+/// <summary>
+/// Sobol sample of a pixel. Dimensions are drawn in pairs from the first
+/// two dimensions of the sequence, each pair shuffling the indices with its
+/// own scrambling, so that the pairs are independent.
+/// </summary>
+__device__ inline unsigned int
+sobolSample(unsigned int pixel, unsigned int index, unsigned int dimension)
+{
+  const unsigned int seed = hashInt(pixel ^ hashInt(dimension >> 1));
+  const unsigned int shuffled = nestedUniformScramble(index, seed);
+  return nestedUniformScramble(sobol(shuffled, dimension & 1),
+                               hashInt(seed + 1 + (dimension & 1)));
+}
+
+/// <summary>
+/// Generators of the R2 sequence, powers of the inverse of the plastic
+/// number, as 0.32 fixed point numbers.
+/// </summary>
+constexpr unsigned int RANK1_GENERATORS[2] = { 3242174889u, 2447445414u };
+
+/// <summary>
+/// R2 sample of a pixel. Each pair of dimensions multiplies the index by
+/// another odd number, so that the pairs draw other points of the sequence,
+/// and is shifted by the R2 dither mask of the pixel, which is close to
+/// blue noise: neighbor pixels get samples far apart.
+/// </summary>
+__device__ inline unsigned int
+rank1Sample(unsigned int x, unsigned int y, unsigned int index,
+            unsigned int dimension)
+{
+  const unsigned int pair = dimension >> 1;
+  const unsigned int axis = dimension & 1;
+  const unsigned int mask = x * RANK1_GENERATORS[axis] +
+                            y * RANK1_GENERATORS[1 - axis] +
+                            hashInt(dimension);
+  return mask + index * (2 * pair + 1) * RANK1_GENERATORS[axis];
+}
+
+/// <summary>
+/// Creates the sampler of the sample `index' of the pixel (x, y), starting
+/// at its first dimension.
+/// </summary>
+__device__ inline Sampler
+makeSampler(SamplerType type, unsigned int x, unsigned int y,
+            unsigned int index)
+{
+  Sampler sampler;
+  sampler.type = type;
+  sampler.x = x;
+  sampler.y = y;
+  sampler.index = index;
+  sampler.dimension = 0;
+  return sampler;
+}
+
+/// <summary>
+/// Gives the dimension `offset' of the current bounce of a sampler.
+/// </summary>
+/// <returns>A number in [0, 1).</returns>
+__device__ inline float
+sample1D(const Sampler& sampler, unsigned int offset)
+{
+  const unsigned int dimension = sampler.dimension + offset;
+  const unsigned int pixel = ((unsigned int)sampler.y << 16) | sampler.x;
+
+  unsigned int bits;
+  if (sampler.type == SAMPLER_SOBOL)
+    bits = sobolSample(pixel, sampler.index, dimension);
+  else if (sampler.type == SAMPLER_RANK1)
+    bits = rank1Sample(sampler.x, sampler.y, sampler.index, dimension);
+  else
+    bits = hashInt(pixel ^ hashInt(sampler.index ^ hashInt(dimension)));
+
+  // Keeps the 24 bits a float can hold, so that 1 is never reached.
+  return (bits >> 8) * (1.0f / 16777216.0f);
+}
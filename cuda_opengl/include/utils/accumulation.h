@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace image {
+/// <summary>
+/// Sum of the samples of a frame, as rendered by a node of a render farm.
+/// Partial accumulations of the same frame are merged by adding them.
+/// </summary>
+struct Accumulation
+{
+  unsigned int width = 0;
+  unsigned int height = 0;
+  uint64_t nb_samples = 0;
+
+  /// <summary>
+  /// Sum of the linear RGB radiance of each pixel, rows starting from
+  /// the top of the image.
+  /// </summary>
+  std::vector<float> rgb;
+};
+
+/// <summary>
+/// Writes a partial accumulation, to be merged with `addAccumulation()'.
+/// </summary>
+/// <returns>False if the file could not be written.</returns>
+bool writeAccumulation(const std::string& path, const Accumulation& acc);
+
+/// <summary>
+/// Adds the content of an accumulation file to `out'. The file is read by
+/// blocks of rows, so that merging any number of files only keeps a single
+/// frame in memory. An empty `out' takes the size of the file.
+/// </summary>
+/// <param name="path">Path of the file to add.</param>
+/// <param name="out">Accumulation the file is added to.</param>
+/// <returns>False if the file could not be read, or has another size.</returns>
+bool addAccumulation(const std::string& path, Accumulation& out);
+}
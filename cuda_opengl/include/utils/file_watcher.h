@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace utils {
+/// <summary>
+/// Watches files for modifications by polling their size and modification
+/// time, which editors update when saving. Files missing when polled, e.g.
+/// while an editor replaces them, are reported once they are back.
+/// </summary>
+class FileWatcher
+{
+public:
+  /// <summary>
+  /// Replaces the watched files, taking their current state as the
+  /// reference.
+  /// </summary>
+  void watch(const std::vector<std::string>& paths);
+
+  /// <summary>
+  /// Lists the files modified since the last call, or since `watch'.
+  /// </summary>
+  std::vector<std::string> poll();
+
+  inline bool empty() const { return _files.empty(); }
+
+private:
+  struct File
+  {
+    std::string path;
+    int64_t size;
+    int64_t mtime;
+  };
+
+  std::vector<File> _files;
+};
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace image {
+/// <summary>
+/// Reads an HDR image from an uncompressed, single part scanline OpenEXR
+/// file, whose R, G and B (or Y) channels are 16 or 32 bits floats.
+/// </summary>
+/// <param name="path">Path of the file to read.</param>
+/// <param name="out_width">Contains the width of the image.</param>
+/// <param name="out_height">Contains the height of the image.</param>
+/// <param name="out_rgb">Contains the linear RGB pixels, rows starting from
+/// the top of the image.</param>
+/// <returns>False if the file could not be read, or uses a compression or
+/// a layout this reader does not support.</returns>
+bool readEXR(const std::string& path, unsigned int& out_width,
+             unsigned int& out_height, std::vector<float>& out_rgb);
+}
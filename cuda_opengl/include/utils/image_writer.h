@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+
+namespace image {
+/// <summary>
+/// Writes an HDR image as an uncompressed OpenEXR file, with 32 bits float
+/// R, G and B channels.
+/// </summary>
+/// <param name="path">Path of the file to write.</param>
+/// <param name="width">Width of the image.</param>
+/// <param name="height">Height of the image.</param>
+/// <param name="rgb">Linear RGB pixels, rows starting from the top of the
+/// image.</param>
+/// <returns>False if the file could not be written.</returns>
+bool writeEXR(const std::string& path, unsigned int width, unsigned int height,
+              const float* rgb);
+
+/// <summary>
+/// Writes an 8 bits RGB image as a PNG file. Its data is stored without
+/// compression, which keeps the writer free of dependencies.
+/// </summary>
+/// <param name="path">Path of the file to write.</param>
+/// <param name="width">Width of the image.</param>
+/// <param name="height">Height of the image.</param>
+/// <param name="rgba">RGBA8 pixels, rows starting from the top of the image.
+/// Alpha is dropped.</param>
+/// <returns>False if the file could not be written.</returns>
+bool writePNG(const std::string& path, unsigned int width, unsigned int height,
+              const unsigned char* rgba);
+}
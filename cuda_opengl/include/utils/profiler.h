@@ -0,0 +1,170 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <cuda_runtime.h>
+
+#include <chrono>
+#include <deque>
+#include <string>
+
+#include <shaders/raytrace.h>
+
+namespace profiling {
+/// <summary>
+/// Stages of a frame timed by the profiler, in the order they run.
+/// </summary>
+enum Stage
+{
+  /// <summary>
+  /// Mapping the framebuffer from OpenGL to CUDA.
+  /// </summary>
+  STAGE_MAP = 0,
+
+  /// <summary>
+  /// Kernels of the selected implementation, denoising included.
+  /// </summary>
+  STAGE_TRACE,
+
+  /// <summary>
+  /// Copies of the frames of the other GPUs, and their merge.
+  /// </summary>
+  STAGE_MERGE,
+
+  /// <summary>
+  /// Conversion and encoding of the frame sent to the stream client.
+  /// </summary>
+  STAGE_ENCODE,
+
+  STAGE_UNMAP,
+
+  /// <summary>
+  /// Copy of the framebuffer to the screen, timed on the OpenGL side.
+  /// </summary>
+  STAGE_BLIT,
+
+  NB_STAGES
+};
+
+/// <summary>
+/// Name of a stage, as shown by the GUI and written in the reports.
+/// </summary>
+const char* stageName(Stage stage);
+
+/// <summary>
+/// Timings and counters of a profiled frame. Stages that did not run in
+/// this frame take 0 ms.
+/// </summary>
+struct FrameStats
+{
+  float stage_ms[NB_STAGES];
+
+  /// <summary>
+  /// Time from the start of this frame to the start of the next one,
+  /// measured on the CPU.
+  /// </summary>
+  float frame_ms;
+
+  bool has_counters;
+  RenderCounters counters;
+};
+
+/// <summary>
+/// Times the stages of the frames of a GPU, using CUDA events on its stream
+/// and OpenGL timer queries for the blit. Their results are read a few
+/// frames later, once available, so that profiling never waits for the
+/// GPU. Built with ARTRACER_NVTX, stages are also NVTX ranges, shown by
+/// Nsight Systems.
+/// </summary>
+class Profiler
+{
+public:
+  /// <summary>
+  /// Number of frames kept for the histograms and the reports.
+  /// </summary>
+  static constexpr unsigned int HISTORY_SIZE = 240;
+
+  Profiler();
+  ~Profiler();
+
+  /// <summary>
+  /// Creates the events on the current GPU, and the timer queries if the
+  /// frames are blitted with OpenGL.
+  /// </summary>
+  void init(bool gl);
+
+  void release();
+
+  /// <summary>
+  /// Starts the next frame, collecting the oldest frame still in flight.
+  /// </summary>
+  void beginFrame();
+
+  /// <summary>
+  /// Marks the start of a stage in the work queued on `stream'. The blit
+  /// is timed in the OpenGL command stream instead.
+  /// </summary>
+  void begin(Stage stage, cudaStream_t stream);
+
+  void end(Stage stage, cudaStream_t stream);
+
+  /// <summary>
+  /// Attaches the device counters of the current frame.
+  /// </summary>
+  void setCounters(const RenderCounters& counters);
+
+  void endFrame();
+
+  /// <summary>
+  /// Last frames collected, oldest first.
+  /// </summary>
+  inline const std::deque<FrameStats>& history() const { return _history; }
+
+  /// <summary>
+  /// Writes the statistics of the frames kept in the history as JSON: the
+  /// mean, min and max of each stage and of the frame time, the timings
+  /// of each frame, and the average counters if any.
+  /// </summary>
+  /// <returns>False if the file could not be written.</returns>
+  bool writeJSON(const std::string& path) const;
+
+private:
+  /// <summary>
+  /// Number of frames recorded before their results are read.
+  /// </summary>
+  static constexpr unsigned int FRAMES_IN_FLIGHT = 4;
+
+  /// <summary>
+  /// Events and query of a frame in flight, and what was recorded.
+  /// </summary>
+  struct Slot
+  {
+    cudaEvent_t begin[NB_STAGES];
+    cudaEvent_t end[NB_STAGES];
+    GLuint query;
+    bool recorded[NB_STAGES];
+    bool pending;
+    FrameStats stats;
+  };
+
+  /// <summary>
+  /// Reads the results of a frame, and adds it to the history.
+  /// </summary>
+  void collect(Slot& slot);
+
+private:
+  bool _initialized;
+  bool _gl;
+
+  Slot _slots[FRAMES_IN_FLIGHT];
+  unsigned int _current;
+
+  /// <summary>
+  /// Start of the current frame on the CPU.
+  /// </summary>
+  std::chrono::steady_clock::time_point _frame_start;
+  bool _started;
+
+  std::deque<FrameStats> _history;
+};
+} // namespace profiling
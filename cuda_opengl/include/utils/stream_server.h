@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace remote {
+/// <summary>
+/// Input of the remote client: a key pressed or released, given by its
+/// GLFW code, a move of the mouse, in pixels, or the end of the session.
+/// </summary>
+struct InputEvent
+{
+  enum Type
+  {
+    KEY = 0,
+    MOUSE,
+    QUIT
+  };
+
+  Type type;
+  int key;
+  bool pressed;
+  float dx;
+  float dy;
+};
+
+/// <summary>
+/// Streams the encoded frames to a single client over TCP, and reads back
+/// its input. The frames are sent as a raw Annex B bitstream, which players
+/// read directly, e.g. `ffplay -fflags nobuffer tcp://HOST:PORT'. The
+/// client sends its input on the same connection, one event per line:
+/// * `k KEY 1' or `k KEY 0' when a key is pressed or released;
+/// * `m DX DY' when the mouse moves;
+/// * `q' to end the session.
+/// Nothing blocks but sending a frame: a new client replaces the previous
+/// one, and a client too slow to read the frames is disconnected.
+/// </summary>
+class StreamServer
+{
+public:
+  StreamServer();
+  ~StreamServer();
+
+  StreamServer(const StreamServer&) = delete;
+  StreamServer& operator=(const StreamServer&) = delete;
+
+  /// <summary>
+  /// Listens on `port', on every interface.
+  /// </summary>
+  /// <returns>False if the port cannot be bound, the reason being
+  /// printed.</returns>
+  bool listen(unsigned short port);
+
+  /// <summary>
+  /// Accepts a waiting client, if any.
+  /// </summary>
+  /// <returns>True when a client connected: the stream has to restart from
+  /// a key frame.</returns>
+  bool accept();
+
+  inline bool connected() const { return _client >= 0; }
+
+  /// <summary>
+  /// Reads the events the client sent since the last call.
+  /// </summary>
+  void poll(std::vector<InputEvent>& out_events);
+
+  /// <summary>
+  /// Sends an encoded frame to the client, disconnecting it on failure.
+  /// </summary>
+  void send(const std::vector<unsigned char>& packet);
+
+  void close();
+
+private:
+  void disconnect();
+
+  /// <summary>
+  /// Sockets, -1 when closed.
+  /// </summary>
+  long long _listener;
+  long long _client;
+
+  /// <summary>
+  /// Last line received, not terminated yet.
+  /// </summary>
+  std::string _line;
+};
+} // namespace remote
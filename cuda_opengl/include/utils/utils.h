@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <string>
 
 namespace utils {
@@ -14,4 +15,21 @@ unsigned int nextPow2(unsigned int v);
 ///   <c>false</c>.
 /// </returns>
 bool isHexa(const std::string& s);
+
+/// <summary>
+/// Checks whether a path ends with the given extension, ignoring case.
+/// </summary>
+/// <param name="path">Path to check.</param>
+/// <param name="ext">Lower case extension, dot included.</param>
+bool hasExtension(const std::string& path, const char* ext);
+
+/// <summary>
+/// Runs `task' for every index in [0, count[, on as many threads as the
+/// CPU has cores. The calling thread takes part in the work, and returns
+/// when every task is done. The first exception thrown by a task is
+/// rethrown once all threads are joined.
+/// </summary>
+/// <param name="count">Number of tasks.</param>
+/// <param name="task">Function called with the index of each task.</param>
+void parallelFor(size_t count, const std::function<void(size_t)>& task);
 }
@@ -0,0 +1,279 @@
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <utility>
+
+#include <benchmark.h>
+#include <gpu_processor.h>
+#include <utils/accumulation.h>
+
+namespace benchmark {
+const std::vector<std::string> BUNDLED_SCENES = {
+  "cornell.scene",    "indoor.scene",    "island.scene",
+  "crate_land.scene", "sss_crate.scene", "color_sample.scene"
+};
+
+namespace {
+/// <summary>
+/// Samples per pixel rendered before each measure, so that buffers and
+/// captured frames are created before the timer starts.
+/// </summary>
+constexpr unsigned int WARMUP_SPP = 4;
+
+/// <summary>
+/// Measures of a scene rendered with a kernel at a resolution.
+/// </summary>
+struct Result
+{
+  std::string scene;
+  std::string kernel;
+  Resolution resolution;
+  processor::OfflineStats stats;
+  processor::LoadTimes load;
+  size_t peak_vram;
+  bool has_rmse;
+  double rmse;
+};
+
+void
+makeDirectory(const std::string& path)
+{
+#ifdef _WIN32
+  _mkdir(path.c_str());
+#else
+  mkdir(path.c_str(), 0755);
+#endif
+}
+
+/// <summary>
+/// Path of the reference of a scene at a resolution.
+/// </summary>
+std::string
+referencePath(const std::string& folder, const std::string& scene,
+              const Resolution& resolution)
+{
+  const std::string name = scene.substr(0, scene.rfind(".scene"));
+  return folder + "/" + name + "_" + std::to_string(resolution.width) + "x" +
+         std::to_string(resolution.height) + ".acc";
+}
+
+/// <summary>
+/// Root mean square error between the average radiance of two
+/// accumulations of the same size.
+/// </summary>
+/// <returns>False if they do not have the same size.</returns>
+bool
+rmse(const image::Accumulation& image, const image::Accumulation& reference,
+     double& out)
+{
+  if (image.rgb.size() != reference.rgb.size() || image.rgb.empty())
+    return false;
+
+  const double scale = 1.0 / std::max<uint64_t>(image.nb_samples, 1);
+  const double ref_scale = 1.0 / std::max<uint64_t>(reference.nb_samples, 1);
+  double sum = 0.0;
+  for (size_t i = 0; i < image.rgb.size(); ++i) {
+    const double diff = image.rgb[i] * scale - reference.rgb[i] * ref_scale;
+    sum += diff * diff;
+  }
+  out = std::sqrt(sum / image.rgb.size());
+  return true;
+}
+
+/// <summary>
+/// Rays traced per second by the kernels, in millions, or paths when the
+/// rays are not counted.
+/// </summary>
+double
+megaRaysPerSecond(const Result& result, bool paths)
+{
+  const auto& stats = result.stats;
+  const double count =
+    paths ? (double)result.resolution.width * result.resolution.height *
+              stats.nb_samples
+          : (double)stats.counters.rays;
+  return count / std::max(stats.seconds, 1e-9) * 1e-6;
+}
+
+double
+msPerFrame(const Result& result)
+{
+  return result.stats.seconds * 1e3 /
+         std::max(result.stats.nb_samples, 1u);
+}
+
+void
+printResult(const Result& result)
+{
+  std::cout << std::left << std::setw(20) << result.scene << std::setw(22)
+            << result.kernel << std::right << std::setw(5)
+            << result.resolution.width << "x" << std::left << std::setw(6)
+            << result.resolution.height << std::right << std::fixed
+            << std::setprecision(2) << std::setw(9) << msPerFrame(result)
+            << " ms/frame";
+  if (result.stats.has_counters)
+    std::cout << std::setw(9) << megaRaysPerSecond(result, false)
+              << " Mrays/s";
+  else
+    std::cout << std::setw(9) << megaRaysPerSecond(result, true)
+              << " Mpaths/s";
+  std::cout << std::setw(7) << result.peak_vram << " MB";
+  if (result.has_rmse)
+    std::cout << "  RMSE " << std::setprecision(5) << result.rmse;
+  std::cout << std::defaultfloat << std::endl;
+}
+
+void
+writeResult(std::ofstream& out, const Result& result)
+{
+  const auto& stats = result.stats;
+  const auto& load = result.load;
+  out << "    { \"scene\": \"" << result.scene << "\", \"kernel\": \""
+      << result.kernel << "\", \"width\": " << result.resolution.width
+      << ", \"height\": " << result.resolution.height
+      << ", \"spp\": " << stats.nb_samples
+      << ",\n      \"seconds\": " << stats.seconds
+      << ", \"ms_per_frame\": " << msPerFrame(result)
+      << ", \"mpaths_per_s\": " << megaRaysPerSecond(result, true)
+      << ", \"mrays_per_s\": ";
+  if (stats.has_counters)
+    out << megaRaysPerSecond(result, false) << ", \"triangle_tests_per_ray\": "
+        << (double)stats.counters.triangle_tests /
+             std::max(stats.counters.rays, 1ull)
+        << ", \"bounces_per_path\": "
+        << (double)stats.counters.bounces /
+             std::max(stats.counters.paths, 1ull);
+  else
+    out << "null";
+  out << ",\n      \"peak_vram_mb\": " << result.peak_vram
+      << ", \"rmse\": ";
+  if (result.has_rmse)
+    out << result.rmse;
+  else
+    out << "null";
+  out << ",\n      \"load_s\": { \"scene_files\": " << load.scene_files
+      << ", \"cubemaps\": " << load.cubemaps << ", \"peers\": " << load.peers
+      << ", \"meshes\": " << load.meshes << ", \"upload\": " << load.upload
+      << ", \"textures\": " << load.textures << " } }";
+}
+
+bool
+writeReport(const std::string& path, const std::string& gpu,
+            const Settings& settings, const std::vector<Result>& results)
+{
+  std::ofstream out(path, std::ios::trunc);
+  if (!out.is_open())
+    return false;
+
+  out << "{\n  \"gpu\": \"" << gpu << "\",\n  \"spp\": " << settings.spp
+      << ",\n  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    writeResult(out, results[i]);
+    out << (i + 1 < results.size() ? ",\n" : "\n");
+  }
+  out << "  ]\n}\n";
+  return out.good();
+}
+}
+
+int
+run(const Settings& settings)
+{
+  const std::string references = settings.references.empty()
+                                   ? settings.asset_folder + "/references"
+                                   : settings.references;
+  if (settings.update_references)
+    makeDirectory(references);
+
+  int device = 0;
+  cudaGetDevice(&device);
+  cudaDeviceProp prop;
+  cudaGetDeviceProperties(&prop, device);
+
+  std::vector<Result> results;
+  bool failed = false;
+  for (const auto& scene : settings.scenes) {
+    const Resolution first = settings.resolutions[0];
+    processor::GPUProcessor processor(settings.asset_folder, { scene },
+                                      first.width, first.height, true);
+    // A single GPU, so that runs on other machines stay comparable.
+    processor.setGPUCount(1);
+    processor.init();
+    size_t peak_vram = processor.getGPUInfo().getUsedMo();
+
+    for (const auto& resolution : settings.resolutions) {
+      if (resolution.width != processor.getInterop().width() ||
+          resolution.height != processor.getInterop().height())
+        processor.resize(resolution.width, resolution.height);
+
+      const std::string reference_path =
+        referencePath(references, scene, resolution);
+      image::Accumulation reference;
+      bool has_reference = false;
+      if (settings.update_references) {
+        processor.getKernelId() = 0;
+        processor.accumulate(settings.reference_spp, 0.0);
+        reference = processor.readAccumulation();
+        has_reference = image::writeAccumulation(reference_path, reference);
+        if (!has_reference)
+          std::cerr << "artracer: failed to write `" << reference_path
+                    << "'." << std::endl;
+      } else if (std::ifstream(reference_path).good())
+        has_reference = image::addAccumulation(reference_path, reference);
+
+      // The wavefront kernel is also measured with its queues reordered.
+      std::vector<std::pair<int, bool>> runs;
+      const auto& kernels = processor.getKernelItems();
+      for (size_t k = 0; k < kernels.size(); ++k) {
+        runs.emplace_back(k, false);
+        if (kernels[k] == "Wavefront")
+          runs.emplace_back(k, true);
+      }
+
+      for (const auto& run : runs) {
+        processor.getKernelId() = run.first;
+        processor.getRayReordering() = run.second;
+        processor.accumulate(WARMUP_SPP, 0.0);
+
+        Result result;
+        result.scene = scene;
+        result.kernel = kernels[run.first] + (run.second ? " (reordered)" : "");
+        result.resolution = resolution;
+        result.stats = processor.accumulate(settings.spp, 0.0);
+        result.load = processor.getLoadTimes();
+        peak_vram = std::max(peak_vram, processor.getGPUInfo().getUsedMo());
+        result.peak_vram = peak_vram;
+        result.has_rmse =
+          has_reference &&
+          rmse(processor.readAccumulation(), reference, result.rmse);
+
+        if (result.stats.nb_samples == 0) {
+          std::cerr << "artracer: failed to render `" << scene << "'."
+                    << std::endl;
+          failed = true;
+          continue;
+        }
+        printResult(result);
+        results.push_back(result);
+      }
+    }
+  }
+
+  if (!writeReport(settings.report, prop.name, settings, results)) {
+    std::cerr << "artracer: failed to write `" << settings.report << "'."
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << "Report written to " << settings.report << "." << std::endl;
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+}
@@ -0,0 +1,83 @@
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <driver/cuda_helper.h>
+#include <driver/device_arena.h>
+
+namespace driver {
+void
+DeviceArena::reserve(size_t size)
+{
+  if (size == 0)
+    return;
+
+  Block block;
+  block.data = nullptr;
+  block.size = alignedSize(size);
+  block.offset = 0;
+  cudaMalloc(&block.data, block.size);
+  cudaThrowError();
+
+  _blocks.push_back(block);
+}
+
+void*
+DeviceArena::allocate(size_t size)
+{
+  if (size == 0)
+    return nullptr;
+
+  size = alignedSize(size);
+  if (_blocks.empty() || _blocks.back().offset + size > _blocks.back().size)
+    reserve(size);
+
+  Block& block = _blocks.back();
+  void* range = block.data + block.offset;
+  block.offset += size;
+  return range;
+}
+
+void*
+DeviceArena::stage(const void* data, size_t size)
+{
+  void* range = allocate(size);
+  if (!range)
+    return nullptr;
+
+  Block& block = _blocks.back();
+  const size_t offset = static_cast<char*>(range) - block.data;
+  block.staged.resize(offset + size);
+  std::memcpy(&block.staged[offset], data, size);
+  return range;
+}
+
+void
+DeviceArena::upload()
+{
+  for (auto& block : _blocks) {
+    if (block.staged.empty())
+      continue;
+
+    cudaMemcpy(block.data, &block.staged[0], block.staged.size(),
+               cudaMemcpyHostToDevice);
+    cudaThrowError();
+    std::vector<char>().swap(block.staged);
+  }
+}
+
+void
+DeviceArena::release()
+{
+  for (const auto& block : _blocks) cudaFree(block.data);
+  _blocks.clear();
+}
+
+size_t
+DeviceArena::capacity() const
+{
+  size_t size = 0;
+  for (const auto& block : _blocks) size += block.size;
+  return size;
+}
+} // namespace driver
@@ -20,12 +20,15 @@ GPUInfo::GPUInfo()
     throw std::runtime_error(error);
   }
 
-  // Gets back the GPU properties.
+  // Gets back the properties of the current GPU.
+  int device = 0;
+  cudaGetDevice(&device);
+
   struct GPU* gpu = new GPU;
   struct cudaDeviceProp deviceProp;
-  cudaGetDeviceProperties(&deviceProp, 0);
+  cudaGetDeviceProperties(&deviceProp, device);
 
-  gpu->device_id = 0;
+  gpu->device_id = device;
   gpu->clock_rate = deviceProp.clockRate;
   gpu->warp_size = deviceProp.warpSize;
   gpu->regs_per_block = deviceProp.regsPerBlock;
@@ -35,9 +38,8 @@ GPUInfo::GPUInfo()
   std::memcpy(&gpu->max_threads_dim, &deviceProp.maxThreadsDim,
               3 * sizeof(int));
 
-  // For now, we only handle one GPU It would be nice to handle two or more
-  // GPUs, and to choose them according to some heuristics.
-  // For instance, it would be nice to render the quad on the slow GPU,
+  // Each processor describes its own GPU, the GL one being the same.
+  // It would be nice to render the quad on the slow GPU,
   // and to pathtrace with CUDA on the fast GPU.
   _gpus[0] = gpu;
   _gpus[1] = gpu;
@@ -1,28 +1,61 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <vector>
 
 #include <driver/interop.h>
 
 namespace driver {
-Interop::Interop(unsigned int w, unsigned int h)
+namespace {
+/// <summary>
+/// Converts a fp16 channel, denormals included, to a float.
+/// </summary>
+float
+halfToFloat(unsigned short h)
+{
+  const float sign = (h & 0x8000) ? -1.0f : 1.0f;
+  const int exponent = (h >> 10) & 0x1F;
+  const int mantissa = h & 0x3FF;
+  if (exponent == 0)
+    return sign * std::ldexp((float)mantissa, -24);
+  if (exponent == 31)
+    return mantissa ? 0.0f : sign * 65504.0f;
+  return sign * std::ldexp((float)(mantissa | 0x400), exponent - 25);
+}
+}
+
+Interop::Interop(unsigned int w, unsigned int h, bool offscreen)
   : _width(w)
   , _half_width(w * 0.5)
   , _height(h)
   , _half_height(h * 0.5)
   , _allocated(false)
+  , _offscreen(offscreen)
+  , _half_float(false)
   , _index(0)
 {
-  glCreateRenderbuffers(2, &_rb[0]);
-  glCreateFramebuffers(2, &_fb[0]);
+  if (!_offscreen) {
+    glCreateRenderbuffers(2, &_rb[0]);
+    glCreateFramebuffers(2, &_fb[0]);
 
-  glNamedFramebufferRenderbuffer(_fb[0], GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER,
-                                 _rb[0]);
-  glNamedFramebufferRenderbuffer(_fb[1], GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER,
-                                 _rb[1]);
+    glNamedFramebufferRenderbuffer(_fb[0], GL_COLOR_ATTACHMENT0,
+                                   GL_RENDERBUFFER, _rb[0]);
+    glNamedFramebufferRenderbuffer(_fb[1], GL_COLOR_ATTACHMENT0,
+                                   GL_RENDERBUFFER, _rb[1]);
 
-  _d_cgr[0] = nullptr;
-  _d_cgr[1] = nullptr;
-  _d_ca[0] = nullptr;
-  _d_ca[1] = nullptr;
+    cudaStreamCreateWithFlags(&_present_stream, cudaStreamNonBlocking);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    _d_cgr[i] = nullptr;
+    _d_ca[i] = nullptr;
+    _surfaces[i] = 0;
+    _mapped[i] = false;
+    _presented[i] = nullptr;
+    if (!_offscreen)
+      cudaEventCreateWithFlags(&_rendered[i], cudaEventDisableTiming);
+  }
 
   this->setSize(w, h);
 
@@ -42,12 +75,16 @@ Interop::~Interop()
 cudaError_t
 Interop::map(cudaStream_t stream)
 {
+  if (_offscreen)
+    return cudaSuccess;
   return cudaGraphicsMapResources(1, &_d_cgr[_index], stream);
 }
 
 cudaError_t
 Interop::unmap(cudaStream_t stream)
 {
+  if (_offscreen)
+    return cudaSuccess;
   return cudaGraphicsUnmapResources(1, &_d_cgr[_index], stream);
 }
 
@@ -57,9 +94,73 @@ Interop::swap()
   _index = (_index + 1) % 2;
 }
 
+cudaError_t
+Interop::mapNext(cudaStream_t stream)
+{
+  swap();
+  if (_offscreen)
+    return cudaSuccess;
+
+  // The blit of this framebuffer, two frames ago, must be done.
+  if (_presented[_index]) {
+    glClientWaitSync(_presented[_index], GL_SYNC_FLUSH_COMMANDS_BIT,
+                     GL_TIMEOUT_IGNORED);
+    glDeleteSync(_presented[_index]);
+    _presented[_index] = nullptr;
+  }
+
+  cudaError_t cuda_err = cudaGraphicsMapResources(1, &_d_cgr[_index], stream);
+  _mapped[_index] = cuda_err == cudaSuccess;
+  return cuda_err;
+}
+
+cudaError_t
+Interop::presentPrevious(cudaStream_t stream)
+{
+  if (_offscreen)
+    return cudaSuccess;
+
+  cudaEventRecord(_rendered[_index], stream);
+
+  const int prev = (_index + 1) % 2;
+  if (!_mapped[prev])
+    return cudaSuccess;
+
+  cudaStreamWaitEvent(_present_stream, _rendered[prev], 0);
+  cudaError_t cuda_err =
+    cudaGraphicsUnmapResources(1, &_d_cgr[prev], _present_stream);
+  _mapped[prev] = false;
+  if (cuda_err != cudaSuccess)
+    return cuda_err;
+
+  blitBuffer(prev);
+  _presented[prev] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  return cuda_err;
+}
+
+void
+Interop::flush()
+{
+  if (_offscreen)
+    return;
+
+  for (int i = 0; i < 2; i++) {
+    if (_mapped[i])
+      cudaGraphicsUnmapResources(1, &_d_cgr[i], 0);
+    _mapped[i] = false;
+
+    if (_presented[i])
+      glDeleteSync(_presented[i]);
+    _presented[i] = nullptr;
+  }
+}
+
 void
 Interop::clear()
 {
+  if (_offscreen)
+    return;
+
   const GLfloat clear_color[] = { 1.0f, 1.0f, 1.0f, 1.0f };
   glClearNamedFramebufferfv(_fb[_index], GL_COLOR, 0, clear_color);
 }
@@ -67,8 +168,53 @@ Interop::clear()
 void
 Interop::blit()
 {
-  glBlitNamedFramebuffer(_fb[_index], 0, 0, 0, _width, _height, 0, _height,
-                         _width, 0, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  if (_offscreen)
+    return;
+
+  blitBuffer(_index);
+}
+
+void
+Interop::blitBuffer(int index)
+{
+  const unsigned int w = _render_width[index];
+  const unsigned int h = _render_height[index];
+  const bool scaled = w != _width || h != _height;
+  glBlitNamedFramebuffer(_fb[index], 0, 0, 0, w, h, 0, _height, _width, 0,
+                         GL_COLOR_BUFFER_BIT, scaled ? GL_LINEAR : GL_NEAREST);
+}
+
+void
+Interop::setRenderSize(unsigned int w, unsigned int h)
+{
+  _render_width[_index] = std::min(w, _width);
+  _render_height[_index] = std::min(h, _height);
+}
+
+cudaError_t
+Interop::createSurfaces()
+{
+  for (int i = 0; i < 2; i++) {
+    cudaResourceDesc res_desc;
+    std::memset(&res_desc, 0, sizeof(cudaResourceDesc));
+    res_desc.resType = cudaResourceTypeArray;
+    res_desc.res.array.array = _d_ca[i];
+
+    cudaError_t cuda_err = cudaCreateSurfaceObject(&_surfaces[i], &res_desc);
+    if (cuda_err != cudaSuccess)
+      return cuda_err;
+  }
+  return cudaSuccess;
+}
+
+void
+Interop::releaseSurfaces()
+{
+  for (int i = 0; i < 2; i++) {
+    if (_surfaces[i])
+      cudaDestroySurfaceObject(_surfaces[i]);
+    _surfaces[i] = 0;
+  }
 }
 
 cudaError_t
@@ -79,10 +225,23 @@ Interop::clean()
   if (!_allocated)
     return cuda_err;
 
+  releaseSurfaces();
+  if (_offscreen) {
+    for (int i = 0; i < 2; i++) {
+      if (_d_ca[i] != NULL)
+        cuda_err = cudaFreeArray(_d_ca[i]);
+      _d_ca[i] = nullptr;
+    }
+    return cuda_err;
+  }
+
+  flush();
   for (int i = 0; i < 2; i++) {
     if (_d_cgr[i] != NULL)
       cuda_err = cudaGraphicsUnregisterResource(_d_cgr[i]);
+    cudaEventDestroy(_rendered[i]);
   }
+  cudaStreamDestroy(_present_stream);
 
   glDeleteRenderbuffers(2, _rb);
   glDeleteFramebuffers(2, _fb);
@@ -99,12 +258,42 @@ Interop::setSize(const unsigned int w, const unsigned int h)
   _half_width = w * 0.5;
   _height = h;
   _half_height = h * 0.5;
+  for (int i = 0; i < 2; i++) {
+    _render_width[i] = w;
+    _render_height[i] = h;
+  }
+
+  // Frames still being rendered may be writing to the surfaces.
+  cudaDeviceSynchronize();
+  releaseSurfaces();
+
+  // Offscreen framebuffers are directly written by the kernels.
+  if (_offscreen) {
+    cudaChannelFormatDesc desc =
+      _half_float
+        ? cudaCreateChannelDesc(16, 16, 16, 16, cudaChannelFormatKindFloat)
+        : cudaCreateChannelDesc<uchar4>();
+    for (int i = 0; i < 2; i++) {
+      if (_d_ca[i] != NULL)
+        cudaFreeArray(_d_ca[i]);
+
+      cuda_err = cudaMallocArray(&_d_ca[i], &desc, std::max(_width, 1u),
+                                 std::max(_height, 1u),
+                                 cudaArraySurfaceLoadStore);
+      if (cuda_err != cudaSuccess)
+        return cuda_err;
+    }
+    return createSurfaces();
+  }
 
+  // Resources can not be unregistered while mapped.
+  flush();
   for (int i = 0; i < 2; i++) {
     if (_d_cgr[i] != NULL)
       cudaGraphicsUnregisterResource(_d_cgr[i]);
 
-    glNamedRenderbufferStorage(_rb[i], GL_RGBA8, _width, _height);
+    glNamedRenderbufferStorage(_rb[i], _half_float ? GL_RGBA16F : GL_RGBA8,
+                               _width, _height);
 
     cudaGraphicsGLRegisterImage(&_d_cgr[i], _rb[i], GL_RENDERBUFFER,
                                 cudaGraphicsRegisterFlagsSurfaceLoadStore |
@@ -116,7 +305,43 @@ Interop::setSize(const unsigned int w, const unsigned int h)
     cudaGraphicsSubResourceGetMappedArray(&_d_ca[index], _d_cgr[index], 0, 0);
   cudaGraphicsUnmapResources(2, &_d_cgr[0], 0);
 
-  return cuda_err;
+  // The arrays stay the same as long as the renderbuffers do.
+  return createSurfaces();
+}
+
+cudaError_t
+Interop::setHalfFloat(bool half_float)
+{
+  if (half_float == _half_float)
+    return cudaSuccess;
+
+  _half_float = half_float;
+  return setSize(_width, _height);
+}
+
+cudaError_t
+Interop::read(unsigned char* out_rgba)
+{
+  if (!_half_float) {
+    const size_t pitch = _width * sizeof(uchar4);
+    return cudaMemcpy2DFromArray(out_rgba, pitch, _d_ca[_index], 0, 0, pitch,
+                                 _height, cudaMemcpyDeviceToHost);
+  }
+
+  const size_t nb_channels = (size_t)_width * _height * 4;
+  std::vector<unsigned short> texels(nb_channels);
+  const size_t pitch = _width * 4 * sizeof(unsigned short);
+  cudaError_t cuda_err =
+    cudaMemcpy2DFromArray(texels.data(), pitch, _d_ca[_index], 0, 0, pitch,
+                          _height, cudaMemcpyDeviceToHost);
+  if (cuda_err != cudaSuccess)
+    return cuda_err;
+
+  for (size_t i = 0; i < nb_channels; ++i) {
+    const float value = std::min(std::max(halfToFloat(texels[i]), 0.0f), 1.0f);
+    out_rgba[i] = (unsigned char)(value * 255.0f);
+  }
+  return cudaSuccess;
 }
 
 void
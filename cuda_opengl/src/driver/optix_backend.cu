@@ -0,0 +1,496 @@
+#include <cuda_runtime.h>
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef ARTRACER_OPTIX
+#include <optix.h>
+#include <optix_function_table_definition.h>
+#include <optix_stubs.h>
+#endif
+
+#include <driver/cuda_helper.h>
+#include <driver/optix_backend.h>
+#include <scene/scene.h>
+#include <shaders/cutils_math.h>
+
+namespace driver {
+#ifdef ARTRACER_OPTIX
+#define optixThrowError(call)                                                  \
+  {                                                                            \
+    OptixResult r = call;                                                      \
+    if (r != OPTIX_SUCCESS) {                                                  \
+      std::stringstream ss;                                                    \
+      ss << "OptiX failure " << __FILE__ << ":" << __LINE__;                   \
+      ss << " : " << optixGetErrorString(r) << std::endl;                      \
+      throw std::runtime_error(ss.str());                                      \
+    }                                                                          \
+  }
+
+namespace {
+constexpr unsigned int NB_THREADS = 256;
+
+/// <summary>
+/// Programs of the pipeline, defined in raytrace.cu and optix_trace.cuh, in
+/// the order of their records in the shader binding table. The miss
+/// programs follow the order of `OptixMissProgram'.
+/// </summary>
+enum ProgramGroup
+{
+  GROUP_RAYGEN = 0,
+  GROUP_MISS_RADIANCE,
+  GROUP_MISS_OCCLUSION,
+  GROUP_HIT,
+  NB_GROUPS
+};
+
+constexpr unsigned int NB_MISS_PROGRAMS = 2;
+
+/// <summary>
+/// Payload registers of the rays, and attributes of the triangle hits
+/// (their barycentric coordinates).
+/// </summary>
+constexpr unsigned int NB_PAYLOAD_VALUES = 5;
+constexpr unsigned int NB_ATTRIBUTE_VALUES = 2;
+
+/// <summary>
+/// Records of the shader binding table, none of which carries data: the
+/// programs read everything from the launch parameters.
+/// </summary>
+struct __align__(OPTIX_SBT_RECORD_ALIGNMENT) SBTRecord
+{
+  char header[OPTIX_SBT_RECORD_HEADER_SIZE];
+};
+
+/// <summary>
+/// Writes the vertices of de-indexed triangles, which only store their
+/// first vertex and two edges.
+/// </summary>
+__global__ void
+verticesKernel(const scene::Triangle* triangles, unsigned int nb_triangles,
+               float3* out)
+{
+  unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= nb_triangles)
+    return;
+
+  const scene::Triangle tri = triangles[i];
+  const float3 v0 = make_float3(tri.v0);
+  out[3 * i] = v0;
+  out[3 * i + 1] = v0 + make_float3(tri.e1);
+  out[3 * i + 2] = v0 + make_float3(tri.e2);
+}
+
+std::string
+readFile(const std::string& path)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+    throw std::runtime_error("cannot read `" + path + "'");
+
+  std::stringstream content;
+  content << file.rdbuf();
+  return content.str();
+}
+
+/// <summary>
+/// Builds an acceleration structure, whose buffer is added to `buffers'.
+/// The structure is never updated, so it is built for the fastest traversal.
+/// </summary>
+OptixTraversableHandle
+buildAccel(OptixDeviceContext context, const OptixBuildInput& input,
+           std::vector<void*>& buffers)
+{
+  OptixAccelBuildOptions options = {};
+  options.buildFlags = OPTIX_BUILD_FLAG_PREFER_FAST_TRACE;
+  options.operation = OPTIX_BUILD_OPERATION_BUILD;
+
+  OptixAccelBufferSizes sizes;
+  optixThrowError(
+    optixAccelComputeMemoryUsage(context, &options, &input, 1, &sizes));
+
+  void* output = nullptr;
+  cudaMalloc(&output, sizes.outputSizeInBytes);
+  cudaThrowError();
+  buffers.push_back(output);
+
+  void* temp = nullptr;
+  cudaMalloc(&temp, sizes.tempSizeInBytes);
+  cudaThrowError();
+
+  OptixTraversableHandle handle = 0;
+  OptixResult result = optixAccelBuild(
+    context, 0, &options, &input, 1, (CUdeviceptr)temp,
+    sizes.tempSizeInBytes, (CUdeviceptr)output, sizes.outputSizeInBytes,
+    &handle, nullptr, 0);
+  // Waits for the build before releasing its scratch memory.
+  cudaFree(temp);
+  optixThrowError(result);
+  cudaThrowError();
+  return handle;
+}
+
+/// <summary>
+/// Builds the GAS of a mesh. Indexed meshes are read in place, de-indexed
+/// ones get their vertices written to a temporary buffer. In both cases,
+/// primitives keep the order of the faces, which the shading relies on.
+/// </summary>
+OptixTraversableHandle
+buildMesh(OptixDeviceContext context, const scene::Mesh& mesh,
+          std::vector<void*>& buffers)
+{
+  const unsigned int flags = OPTIX_GEOMETRY_FLAG_DISABLE_ANYHIT;
+
+  OptixBuildInput input = {};
+  input.type = OPTIX_BUILD_INPUT_TYPE_TRIANGLES;
+  OptixBuildInputTriangleArray& triangles = input.triangleArray;
+  triangles.vertexFormat = OPTIX_VERTEX_FORMAT_FLOAT3;
+  triangles.flags = &flags;
+  triangles.numSbtRecords = 1;
+
+  CUdeviceptr vertices = 0;
+  float3* de_indexed = nullptr;
+  if (mesh.indices.size) {
+    vertices = (CUdeviceptr)mesh.positions.data;
+    triangles.vertexStrideInBytes = sizeof(float4);
+    triangles.numVertices = mesh.positions.size;
+    triangles.indexFormat = OPTIX_INDICES_FORMAT_UNSIGNED_INT3;
+    triangles.indexStrideInBytes = sizeof(uint4);
+    triangles.numIndexTriplets = mesh.indices.size;
+    triangles.indexBuffer = (CUdeviceptr)mesh.indices.data;
+  } else {
+    const unsigned int nb_triangles = mesh.triangles.size;
+    cudaMalloc(&de_indexed, 3 * nb_triangles * sizeof(float3));
+    cudaThrowError();
+    verticesKernel<<<(nb_triangles + NB_THREADS - 1) / NB_THREADS,
+                     NB_THREADS>>>(mesh.triangles.data, nb_triangles,
+                                   de_indexed);
+    vertices = (CUdeviceptr)de_indexed;
+    triangles.vertexStrideInBytes = sizeof(float3);
+    triangles.numVertices = 3 * nb_triangles;
+  }
+  triangles.vertexBuffers = &vertices;
+
+  OptixTraversableHandle handle = 0;
+  try {
+    handle = buildAccel(context, input, buffers);
+  } catch (...) {
+    cudaFree(de_indexed);
+    throw;
+  }
+  cudaFree(de_indexed);
+  return handle;
+}
+
+/// <summary>
+/// Acceleration structures of a scene: the handle of its IAS, and the
+/// buffers of the IAS and of the GAS of each mesh.
+/// </summary>
+struct SceneAccel
+{
+  OptixTraversableHandle handle = 0;
+  std::vector<void*> buffers;
+};
+} // namespace
+
+struct OptixBackend::State
+{
+  OptixDeviceContext context = nullptr;
+  OptixModule module = nullptr;
+  OptixProgramGroup groups[NB_GROUPS] = {};
+  OptixPipeline pipeline = nullptr;
+
+  SBTRecord* records = nullptr;
+  OptixShaderBindingTable sbt = {};
+
+  void* params = nullptr;
+  size_t params_size = 0;
+
+  std::vector<SceneAccel> scenes;
+};
+
+OptixBackend::OptixBackend()
+  : _state(nullptr)
+{
+}
+
+OptixBackend::~OptixBackend()
+{
+  release();
+}
+
+bool
+OptixBackend::init(const std::string& ptx_path)
+{
+  release();
+  _state = new State;
+  State& s = *_state;
+
+  try {
+    const std::string ptx = readFile(ptx_path);
+
+    optixThrowError(optixInit());
+    OptixDeviceContextOptions context_options = {};
+    // Null for the context of the current GPU.
+    optixThrowError(optixDeviceContextCreate(0, &context_options, &s.context));
+
+    OptixModuleCompileOptions module_options = {};
+    module_options.maxRegisterCount = OPTIX_COMPILE_DEFAULT_MAX_REGISTER_COUNT;
+    module_options.optLevel = OPTIX_COMPILE_OPTIMIZATION_DEFAULT;
+    module_options.debugLevel = OPTIX_COMPILE_DEBUG_LEVEL_NONE;
+
+    OptixPipelineCompileOptions pipeline_options = {};
+    pipeline_options.usesMotionBlur = 0;
+    // Rays only go through the IAS of the scene and the GAS of a mesh.
+    pipeline_options.traversableGraphFlags =
+      OPTIX_TRAVERSABLE_GRAPH_FLAG_ALLOW_SINGLE_LEVEL_INSTANCING;
+    pipeline_options.numPayloadValues = NB_PAYLOAD_VALUES;
+    pipeline_options.numAttributeValues = NB_ATTRIBUTE_VALUES;
+    pipeline_options.exceptionFlags = OPTIX_EXCEPTION_FLAG_NONE;
+    pipeline_options.pipelineLaunchParamsVariableName = "optix_frame";
+
+    char log[2048];
+    size_t log_size = sizeof(log);
+#if OPTIX_VERSION >= 70700
+    optixThrowError(optixModuleCreate(s.context, &module_options,
+                                      &pipeline_options, ptx.c_str(),
+                                      ptx.size(), log, &log_size, &s.module));
+#else
+    optixThrowError(optixModuleCreateFromPTX(
+      s.context, &module_options, &pipeline_options, ptx.c_str(), ptx.size(),
+      log, &log_size, &s.module));
+#endif
+
+    OptixProgramGroupDesc descs[NB_GROUPS] = {};
+    descs[GROUP_RAYGEN].kind = OPTIX_PROGRAM_GROUP_KIND_RAYGEN;
+    descs[GROUP_RAYGEN].raygen.module = s.module;
+    descs[GROUP_RAYGEN].raygen.entryFunctionName = "__raygen__render";
+    descs[GROUP_MISS_RADIANCE].kind = OPTIX_PROGRAM_GROUP_KIND_MISS;
+    descs[GROUP_MISS_RADIANCE].miss.module = s.module;
+    descs[GROUP_MISS_RADIANCE].miss.entryFunctionName = "__miss__radiance";
+    descs[GROUP_MISS_OCCLUSION].kind = OPTIX_PROGRAM_GROUP_KIND_MISS;
+    descs[GROUP_MISS_OCCLUSION].miss.module = s.module;
+    descs[GROUP_MISS_OCCLUSION].miss.entryFunctionName = "__miss__occlusion";
+    descs[GROUP_HIT].kind = OPTIX_PROGRAM_GROUP_KIND_HITGROUP;
+    descs[GROUP_HIT].hitgroup.moduleCH = s.module;
+    descs[GROUP_HIT].hitgroup.entryFunctionNameCH = "__closesthit__radiance";
+
+    OptixProgramGroupOptions group_options = {};
+    log_size = sizeof(log);
+    optixThrowError(optixProgramGroupCreate(s.context, descs, NB_GROUPS,
+                                            &group_options, log, &log_size,
+                                            s.groups));
+
+    // Only the ray generation program traces rays. The stack size is left
+    // to OptiX, which computes it from the programs.
+    OptixPipelineLinkOptions link_options = {};
+    link_options.maxTraceDepth = 1;
+    log_size = sizeof(log);
+    optixThrowError(optixPipelineCreate(s.context, &pipeline_options,
+                                        &link_options, s.groups, NB_GROUPS,
+                                        log, &log_size, &s.pipeline));
+
+    SBTRecord records[NB_GROUPS];
+    for (unsigned int i = 0; i < NB_GROUPS; ++i)
+      optixThrowError(optixSbtRecordPackHeader(s.groups[i], &records[i]));
+    cudaMalloc(&s.records, sizeof(records));
+    cudaThrowError();
+    cudaMemcpy(s.records, records, sizeof(records), cudaMemcpyHostToDevice);
+    cudaThrowError();
+
+    s.sbt.raygenRecord = (CUdeviceptr)(s.records + GROUP_RAYGEN);
+    s.sbt.missRecordBase = (CUdeviceptr)(s.records + GROUP_MISS_RADIANCE);
+    s.sbt.missRecordStrideInBytes = sizeof(SBTRecord);
+    s.sbt.missRecordCount = NB_MISS_PROGRAMS;
+    s.sbt.hitgroupRecordBase = (CUdeviceptr)(s.records + GROUP_HIT);
+    s.sbt.hitgroupRecordStrideInBytes = sizeof(SBTRecord);
+    s.sbt.hitgroupRecordCount = 1;
+  } catch (const std::exception& e) {
+    std::cerr << "artracer: OptiX is not available, " << e.what()
+              << std::endl;
+    release();
+    return false;
+  }
+
+  return true;
+}
+
+void
+OptixBackend::build(unsigned int scene_id, const scene::Scene& scene)
+{
+  if (!_state)
+    return;
+
+  release(scene_id);
+  if (_state->scenes.size() <= scene_id)
+    _state->scenes.resize(scene_id + 1);
+  SceneAccel& accel = _state->scenes[scene_id];
+
+  const std::vector<scene::Mesh>& meshes = scene.getMeshes();
+  const scene::Buffer<scene::Instance>& d_instances = scene.getInstances();
+  if (d_instances.size == 0)
+    return;
+
+  std::vector<OptixTraversableHandle> gas(meshes.size());
+  for (size_t i = 0; i < meshes.size(); ++i)
+    gas[i] = buildMesh(_state->context, meshes[i], accel.buffers);
+
+  // Instances keep the order of the top-level BVH, so that the index of an
+  // instance hit is its index in the scene.
+  std::vector<scene::Instance> instances(d_instances.size);
+  cudaMemcpy(&instances[0], d_instances.data,
+             instances.size() * sizeof(scene::Instance),
+             cudaMemcpyDeviceToHost);
+  cudaThrowError();
+
+  std::vector<OptixInstance> optix_instances(instances.size());
+  for (size_t i = 0; i < instances.size(); ++i) {
+    OptixInstance& instance = optix_instances[i];
+    std::memset(&instance, 0, sizeof(OptixInstance));
+    // Both are the three rows of a 3x4 matrix.
+    std::memcpy(instance.transform, instances[i].to_world,
+                sizeof(instance.transform));
+    instance.instanceId = i;
+    instance.sbtOffset = 0;
+    instance.visibilityMask = 255;
+    instance.flags = OPTIX_INSTANCE_FLAG_DISABLE_ANYHIT;
+    instance.traversableHandle = gas[instances[i].mesh_id];
+  }
+
+  OptixInstance* d_optix_instances = nullptr;
+  const size_t instances_size = optix_instances.size() * sizeof(OptixInstance);
+  cudaMalloc(&d_optix_instances, instances_size);
+  cudaThrowError();
+  cudaMemcpy(d_optix_instances, &optix_instances[0], instances_size,
+             cudaMemcpyHostToDevice);
+  cudaThrowError();
+
+  OptixBuildInput input = {};
+  input.type = OPTIX_BUILD_INPUT_TYPE_INSTANCES;
+  input.instanceArray.instances = (CUdeviceptr)d_optix_instances;
+  input.instanceArray.numInstances = optix_instances.size();
+
+  try {
+    accel.handle = buildAccel(_state->context, input, accel.buffers);
+  } catch (...) {
+    cudaFree(d_optix_instances);
+    throw;
+  }
+  cudaFree(d_optix_instances);
+}
+
+void
+OptixBackend::release(unsigned int scene_id)
+{
+  if (!_state || scene_id >= _state->scenes.size())
+    return;
+
+  SceneAccel& accel = _state->scenes[scene_id];
+  for (void* buffer : accel.buffers) cudaFree(buffer);
+  accel = SceneAccel();
+}
+
+unsigned long long
+OptixBackend::traversable(unsigned int scene_id) const
+{
+  if (!_state || scene_id >= _state->scenes.size())
+    return 0;
+  return _state->scenes[scene_id].handle;
+}
+
+void
+OptixBackend::launch(const void* params, size_t size, unsigned int width,
+                     unsigned int height, cudaStream_t stream)
+{
+  if (!_state)
+    return;
+
+  State& s = *_state;
+  if (size > s.params_size) {
+    cudaFree(s.params);
+    cudaMalloc(&s.params, size);
+    cudaThrowError();
+    s.params_size = size;
+  }
+
+  // Ordered on the stream, so the previous frame is done reading them.
+  cudaMemcpyAsync(s.params, params, size, cudaMemcpyHostToDevice, stream);
+  optixThrowError(optixLaunch(s.pipeline, stream, (CUdeviceptr)s.params, size,
+                              &s.sbt, width, height, 1));
+}
+
+void
+OptixBackend::release()
+{
+  if (!_state)
+    return;
+
+  State& s = *_state;
+  for (size_t i = 0; i < s.scenes.size(); ++i) release(i);
+
+  cudaFree(s.params);
+  cudaFree(s.records);
+  if (s.pipeline)
+    optixPipelineDestroy(s.pipeline);
+  for (auto group : s.groups) {
+    if (group)
+      optixProgramGroupDestroy(group);
+  }
+  if (s.module)
+    optixModuleDestroy(s.module);
+  if (s.context)
+    optixDeviceContextDestroy(s.context);
+
+  delete _state;
+  _state = nullptr;
+}
+#else
+// OptiX is not compiled in: the backend is never available.
+struct OptixBackend::State
+{
+};
+
+OptixBackend::OptixBackend()
+  : _state(nullptr)
+{
+}
+
+OptixBackend::~OptixBackend() {}
+
+bool
+OptixBackend::init(const std::string&)
+{
+  return false;
+}
+
+void
+OptixBackend::build(unsigned int, const scene::Scene&)
+{
+}
+
+void
+OptixBackend::release(unsigned int)
+{
+}
+
+unsigned long long
+OptixBackend::traversable(unsigned int) const
+{
+  return 0;
+}
+
+void
+OptixBackend::launch(const void*, size_t, unsigned int, unsigned int,
+                     cudaStream_t)
+{
+}
+
+void
+OptixBackend::release()
+{
+}
+#endif
+} // namespace driver
@@ -0,0 +1,395 @@
+#include <cuda_runtime.h>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef ARTRACER_NVENC
+#include <cuda.h>
+#include <cuda_fp16.h>
+#include <nvEncodeAPI.h>
+#endif
+
+#include <driver/cuda_helper.h>
+#include <driver/video_encoder.h>
+
+namespace driver {
+#ifdef ARTRACER_NVENC
+#define nvencThrowError(call)                                                  \
+  {                                                                            \
+    NVENCSTATUS r = call;                                                      \
+    if (r != NV_ENC_SUCCESS) {                                                 \
+      std::stringstream ss;                                                    \
+      ss << "NVENC failure " << __FILE__ << ":" << __LINE__;                   \
+      ss << " : status " << r << std::endl;                                    \
+      throw std::runtime_error(ss.str());                                      \
+    }                                                                          \
+  }
+
+namespace {
+constexpr unsigned int BLOCK_W = 16;
+constexpr unsigned int BLOCK_H = 16;
+
+__device__ inline unsigned char
+toByte(float v)
+{
+  return (unsigned char)(fminf(fmaxf(v, 0.0f), 1.0f) * 255.0f);
+}
+
+/// <summary>
+/// Scales the frame in the top left corner of the surface to the size of
+/// the stream, with the nearest texel, as RGBA8 texels in the order NVENC
+/// calls ABGR.
+/// </summary>
+template <bool HalfFloat>
+__global__ void
+convertKernel(cudaSurfaceObject_t surface, unsigned int render_width,
+              unsigned int render_height, uchar4* out, size_t pitch,
+              unsigned int width, unsigned int height)
+{
+  const unsigned int x = blockIdx.x * blockDim.x + threadIdx.x;
+  const unsigned int y = blockIdx.y * blockDim.y + threadIdx.y;
+  if (x >= width || y >= height)
+    return;
+
+  const unsigned int src_x = x * render_width / width;
+  const unsigned int src_y = y * render_height / height;
+  uchar4 texel;
+  if (HalfFloat) {
+    const ushort4 v = surf2Dread<ushort4>(surface, src_x * sizeof(ushort4),
+                                          src_y);
+    texel = make_uchar4(toByte(__half2float(__ushort_as_half(v.x))),
+                        toByte(__half2float(__ushort_as_half(v.y))),
+                        toByte(__half2float(__ushort_as_half(v.z))), 255);
+  } else
+    texel = surf2Dread<uchar4>(surface, src_x * sizeof(uchar4), src_y);
+
+  reinterpret_cast<uchar4*>((char*)out + y * pitch)[x] = texel;
+}
+}
+
+struct VideoEncoder::State
+{
+  NV_ENCODE_API_FUNCTION_LIST api = {};
+  void* encoder = nullptr;
+
+  unsigned int width = 0;
+  unsigned int height = 0;
+
+  /// <summary>
+  /// Input frame, registered to NVENC, and the buffer of the bitstream.
+  /// </summary>
+  uchar4* input = nullptr;
+  size_t pitch = 0;
+  NV_ENC_REGISTERED_PTR registered = nullptr;
+  NV_ENC_OUTPUT_PTR bitstream = nullptr;
+
+  /// <summary>
+  /// Stream NVENC waits for before reading the input, set on first use.
+  /// </summary>
+  cudaStream_t stream = nullptr;
+  bool stream_set = false;
+
+  bool keyframe = true;
+  unsigned long long frame = 0;
+};
+
+VideoEncoder::VideoEncoder()
+  : _state(nullptr)
+  , _codec(VIDEO_H264)
+  , _bitrate(0)
+  , _fps(0)
+{
+}
+
+VideoEncoder::~VideoEncoder()
+{
+  release();
+}
+
+bool
+VideoEncoder::init(unsigned int width, unsigned int height, VideoCodec codec,
+                   unsigned int bitrate, unsigned int fps)
+{
+  release();
+  _codec = codec;
+  _bitrate = bitrate;
+  _fps = fps;
+
+  _state = new State;
+  State& s = *_state;
+  // 4:2:0 chroma needs even sizes.
+  s.width = width & ~1u;
+  s.height = height & ~1u;
+
+  try {
+    if (s.width == 0 || s.height == 0)
+      throw std::runtime_error("empty frames");
+
+    s.api.version = NV_ENCODE_API_FUNCTION_LIST_VER;
+    nvencThrowError(NvEncodeAPICreateInstance(&s.api));
+
+    // The session shares the context of the runtime on the current GPU.
+    cudaFree(nullptr);
+    cudaThrowError();
+    CUcontext context = nullptr;
+    if (cuCtxGetCurrent(&context) != CUDA_SUCCESS || !context)
+      throw std::runtime_error("no CUDA context");
+
+    NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS session = {};
+    session.version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER;
+    session.device = context;
+    session.deviceType = NV_ENC_DEVICE_TYPE_CUDA;
+    session.apiVersion = NVENCAPI_VERSION;
+    nvencThrowError(s.api.nvEncOpenEncodeSessionEx(&session, &s.encoder));
+
+    const GUID codec_guid =
+      codec == VIDEO_HEVC ? NV_ENC_CODEC_HEVC_GUID : NV_ENC_CODEC_H264_GUID;
+    const GUID preset = NV_ENC_PRESET_P1_GUID;
+    const NV_ENC_TUNING_INFO tuning = NV_ENC_TUNING_INFO_ULTRA_LOW_LATENCY;
+
+    NV_ENC_PRESET_CONFIG preset_config = {};
+    preset_config.version = NV_ENC_PRESET_CONFIG_VER;
+    preset_config.presetCfg.version = NV_ENC_CONFIG_VER;
+    nvencThrowError(s.api.nvEncGetEncodePresetConfigEx(
+      s.encoder, codec_guid, preset, tuning, &preset_config));
+
+    // Constant bitrate, each frame fitting in the bandwidth of a frame
+    // interval so that none waits behind the previous ones.
+    NV_ENC_CONFIG config = preset_config.presetCfg;
+    config.gopLength = NVENC_INFINITE_GOPLENGTH;
+    config.frameIntervalP = 1;
+    config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR;
+    config.rcParams.averageBitRate = bitrate;
+    config.rcParams.maxBitRate = bitrate;
+    config.rcParams.vbvBufferSize = bitrate / std::max(fps, 1u);
+    config.rcParams.vbvInitialDelay = config.rcParams.vbvBufferSize;
+    if (codec == VIDEO_HEVC) {
+      config.encodeCodecConfig.hevcConfig.idrPeriod = config.gopLength;
+      config.encodeCodecConfig.hevcConfig.repeatSPSPPS = 1;
+    } else {
+      config.encodeCodecConfig.h264Config.idrPeriod = config.gopLength;
+      config.encodeCodecConfig.h264Config.repeatSPSPPS = 1;
+    }
+
+    NV_ENC_INITIALIZE_PARAMS params = {};
+    params.version = NV_ENC_INITIALIZE_PARAMS_VER;
+    params.encodeGUID = codec_guid;
+    params.presetGUID = preset;
+    params.tuningInfo = tuning;
+    params.encodeWidth = s.width;
+    params.encodeHeight = s.height;
+    params.darWidth = s.width;
+    params.darHeight = s.height;
+    params.maxEncodeWidth = s.width;
+    params.maxEncodeHeight = s.height;
+    params.frameRateNum = std::max(fps, 1u);
+    params.frameRateDen = 1;
+    params.enablePTD = 1;
+    params.encodeConfig = &config;
+    nvencThrowError(s.api.nvEncInitializeEncoder(s.encoder, &params));
+
+    cudaMallocPitch(&s.input, &s.pitch, s.width * sizeof(uchar4), s.height);
+    cudaThrowError();
+
+    NV_ENC_REGISTER_RESOURCE resource = {};
+    resource.version = NV_ENC_REGISTER_RESOURCE_VER;
+    resource.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR;
+    resource.resourceToRegister = s.input;
+    resource.width = s.width;
+    resource.height = s.height;
+    resource.pitch = s.pitch;
+    resource.bufferFormat = NV_ENC_BUFFER_FORMAT_ABGR;
+    resource.bufferUsage = NV_ENC_INPUT_IMAGE;
+    nvencThrowError(s.api.nvEncRegisterResource(s.encoder, &resource));
+    s.registered = resource.registeredResource;
+
+    NV_ENC_CREATE_BITSTREAM_BUFFER bitstream = {};
+    bitstream.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
+    nvencThrowError(s.api.nvEncCreateBitstreamBuffer(s.encoder, &bitstream));
+    s.bitstream = bitstream.bitstreamBuffer;
+  } catch (const std::exception& e) {
+    std::cerr << "artracer: NVENC is not available, " << e.what()
+              << std::endl;
+    release();
+    return false;
+  }
+
+  return true;
+}
+
+bool
+VideoEncoder::resize(unsigned int width, unsigned int height)
+{
+  if (!_state)
+    return false;
+  if ((width & ~1u) == _state->width && (height & ~1u) == _state->height)
+    return true;
+  return init(width, height, _codec, _bitrate, _fps);
+}
+
+void
+VideoEncoder::requestKeyframe()
+{
+  if (_state)
+    _state->keyframe = true;
+}
+
+bool
+VideoEncoder::encode(cudaSurfaceObject_t surface, bool half_float,
+                     unsigned int render_width, unsigned int render_height,
+                     cudaStream_t stream,
+                     std::vector<unsigned char>& out_packet)
+{
+  out_packet.clear();
+  if (!_state || render_width == 0 || render_height == 0)
+    return false;
+  State& s = *_state;
+
+  const dim3 threads(BLOCK_W, BLOCK_H);
+  const dim3 blocks((s.width + BLOCK_W - 1) / BLOCK_W,
+                    (s.height + BLOCK_H - 1) / BLOCK_H);
+  if (half_float)
+    convertKernel<true><<<blocks, threads, 0, stream>>>(
+      surface, render_width, render_height, s.input, s.pitch, s.width,
+      s.height);
+  else
+    convertKernel<false><<<blocks, threads, 0, stream>>>(
+      surface, render_width, render_height, s.input, s.pitch, s.width,
+      s.height);
+  if (cudaGetLastError() != cudaSuccess)
+    return false;
+
+  try {
+    // NVENC reads the input once the conversion is done, and writes the
+    // bitstream in the order of the frames of the stream.
+    if (!s.stream_set || s.stream != stream) {
+      s.stream = stream;
+      nvencThrowError(s.api.nvEncSetIOCudaStreams(
+        s.encoder, (NV_ENC_CUSTREAM_PTR)&s.stream,
+        (NV_ENC_CUSTREAM_PTR)&s.stream));
+      s.stream_set = true;
+    }
+
+    NV_ENC_MAP_INPUT_RESOURCE map = {};
+    map.version = NV_ENC_MAP_INPUT_RESOURCE_VER;
+    map.registeredResource = s.registered;
+    nvencThrowError(s.api.nvEncMapInputResource(s.encoder, &map));
+
+    NV_ENC_PIC_PARAMS picture = {};
+    picture.version = NV_ENC_PIC_PARAMS_VER;
+    picture.inputBuffer = map.mappedResource;
+    picture.bufferFmt = map.mappedBufferFmt;
+    picture.inputWidth = s.width;
+    picture.inputHeight = s.height;
+    picture.inputPitch = s.pitch;
+    picture.outputBitstream = s.bitstream;
+    picture.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+    picture.inputTimeStamp = s.frame++;
+    if (s.keyframe)
+      picture.encodePicFlags =
+        NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+    const NVENCSTATUS status =
+      s.api.nvEncEncodePicture(s.encoder, &picture);
+    if (status != NV_ENC_SUCCESS) {
+      s.api.nvEncUnmapInputResource(s.encoder, map.mappedResource);
+      nvencThrowError(status);
+    }
+    s.keyframe = false;
+
+    // Locking waits for the frame to be encoded.
+    NV_ENC_LOCK_BITSTREAM lock = {};
+    lock.version = NV_ENC_LOCK_BITSTREAM_VER;
+    lock.outputBitstream = s.bitstream;
+    nvencThrowError(s.api.nvEncLockBitstream(s.encoder, &lock));
+    const unsigned char* data = (const unsigned char*)lock.bitstreamBufferPtr;
+    out_packet.assign(data, data + lock.bitstreamSizeInBytes);
+    nvencThrowError(s.api.nvEncUnlockBitstream(s.encoder, s.bitstream));
+    nvencThrowError(
+      s.api.nvEncUnmapInputResource(s.encoder, map.mappedResource));
+  } catch (const std::exception& e) {
+    std::cerr << "artracer: failed to encode a frame, " << e.what()
+              << std::endl;
+    out_packet.clear();
+    return false;
+  }
+
+  return true;
+}
+
+void
+VideoEncoder::release()
+{
+  if (!_state)
+    return;
+
+  State& s = *_state;
+  if (s.encoder) {
+    // Flushes the encoder before destroying it.
+    NV_ENC_PIC_PARAMS eos = {};
+    eos.version = NV_ENC_PIC_PARAMS_VER;
+    eos.encodePicFlags = NV_ENC_PIC_FLAG_EOS;
+    s.api.nvEncEncodePicture(s.encoder, &eos);
+
+    if (s.bitstream)
+      s.api.nvEncDestroyBitstreamBuffer(s.encoder, s.bitstream);
+    if (s.registered)
+      s.api.nvEncUnregisterResource(s.encoder, s.registered);
+    s.api.nvEncDestroyEncoder(s.encoder);
+  }
+  cudaFree(s.input);
+
+  delete _state;
+  _state = nullptr;
+}
+#else
+// NVENC is not compiled in: the encoder is never available.
+struct VideoEncoder::State
+{
+};
+
+VideoEncoder::VideoEncoder()
+  : _state(nullptr)
+  , _codec(VIDEO_H264)
+  , _bitrate(0)
+  , _fps(0)
+{
+}
+
+VideoEncoder::~VideoEncoder() {}
+
+bool
+VideoEncoder::init(unsigned int, unsigned int, VideoCodec, unsigned int,
+                   unsigned int)
+{
+  std::cerr << "artracer: NVENC is not available, it was not compiled in."
+            << std::endl;
+  return false;
+}
+
+bool
+VideoEncoder::resize(unsigned int, unsigned int)
+{
+  return false;
+}
+
+void
+VideoEncoder::requestKeyframe()
+{
+}
+
+bool
+VideoEncoder::encode(cudaSurfaceObject_t, bool, unsigned int, unsigned int,
+                     cudaStream_t, std::vector<unsigned char>& out_packet)
+{
+  out_packet.clear();
+  return false;
+}
+
+void
+VideoEncoder::release()
+{
+}
+#endif
+} // namespace driver
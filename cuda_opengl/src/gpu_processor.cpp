@@ -2,166 +2,161 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <exception>
+#include <future>
 #include <iostream>
+#include <mutex>
+#include <thread>
 #include <unordered_set>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
+#include <stb/stb_image_resize.h>
 
 #include <driver/cuda_helper.h>
 
 #include <gpu_processor.h>
+#include <scene/cubemap.h>
 #include <scene/material_loader.h>
 #include <shaders/raytrace.h>
-#include <utils/texture_utils.h>
+#include <utils/accumulation.h>
+#include <utils/image_reader.h>
+#include <utils/image_writer.h>
 #include <utils/utils.h>
 
+// PTX of the OptiX programs, given by the build when OptiX is compiled in.
+#ifndef ARTRACER_OPTIX_PTX
+#define ARTRACER_OPTIX_PTX "raytrace.ptx"
+#endif
+
 namespace processor {
 namespace {
 static const float3 WORLD_DOWN_VEC = make_float3(0.0f, -1.0f, 0.0f);
 
 /// <summary>
-/// Creates a texture of size 1x1, useful when no cubemap is speicified.
-/// THis allows us to use the same code path and without additional performance
-/// downgrade.
+/// Bounds of the scale of the resolution of moving frames, and the step it
+/// changes by. Each scale is captured in a graph of its own, so there are
+/// only a few of them.
 /// </summary>
-/// <param name="nb_chan">The number of channels of the created texture.</param>
-/// <param name="color">The color of the only pixel in the texture, in
-/// hexadecimal.</param>
-/// <param name="nb_faces">The number of faces (6 for a cubemap).</param>
-/// <returns>
-///   A point to the texture if the allocation succeeded, <c>nullptr</c>
-///   otherwise.
-/// </returns>
-float*
-createUnitTexture(unsigned int nb_chan, unsigned int color,
-                  unsigned int nb_faces)
-{
-  static const unsigned int DEFAULT_SIZE = 1;
-
-  float r = ((color >> 16) & 0xFF) / 255.0f;
-  float g = ((color >> 8) & 0xFF) / 255.0f;
-  float b = (color & 0xFF) / 255.0f;
-
-  unsigned int nb_elt = DEFAULT_SIZE * DEFAULT_SIZE * nb_chan;
-  float* img = new float[nb_elt * nb_faces];
-  for (unsigned int n = 0; n < nb_faces; ++n) {
-    for (unsigned int i = 0; i < nb_elt; i += nb_chan) {
-      img[n * nb_elt + i] = r;
-      img[n * nb_elt + i + 1] = g;
-      img[n * nb_elt + i + 2] = b;
-      img[n * nb_elt + i + 3] = 0.0;
-    }
-  }
-  return img;
+constexpr float MIN_RENDER_SCALE = 0.25f;
+constexpr float RENDER_SCALE_STEP = 0.125f;
+
+/// <summary>
+/// Seconds between two polls of the sources of the scene when hot
+/// reloading, each source costing a system call.
+/// </summary>
+constexpr float WATCH_PERIOD = 0.25f;
+
+/// <summary>
+/// Gives the scale of the next moving frame. The time of a frame is
+/// assumed to grow with its number of pixels: the scale only goes up if
+/// the frame would still be under the target, and goes down once it is
+/// clearly above, so that it does not switch back and forth.
+/// </summary>
+float
+nextRenderScale(float scale, float frame_ms, float target_ms)
+{
+  if (frame_ms > target_ms * 1.1f)
+    return std::max(scale - RENDER_SCALE_STEP, MIN_RENDER_SCALE);
+
+  const float next = std::min(scale + RENDER_SCALE_STEP, 1.0f);
+  const float growth = (next * next) / (scale * scale);
+  if (frame_ms * growth < target_ms * 0.9f)
+    return next;
+  return scale;
+}
+
+/// <summary>
+/// Fills a panorama of 2x1 pixels with a single color, when no cubemap is
+/// specified. This allows us to use the same code path and without
+/// additional performance downgrade.
+/// </summary>
+/// <param name="color">The color of the panorama, in hexadecimal.</param>
+std::vector<float>
+createUnitPanorama(unsigned int color)
+{
+  const float r = ((color >> 16) & 0xFF) / 255.0f;
+  const float g = ((color >> 8) & 0xFF) / 255.0f;
+  const float b = (color & 0xFF) / 255.0f;
+  return { r, g, b, r, g, b };
 }
 
 /// <summary>
-/// Creates a cubemap and allocates it on the GPU.
+/// Creates a cubemap and allocates it on the GPU. Only the image is
+/// decoded on the CPU, OpenEXR files by our own reader and the other
+/// formats, Radiance HDR included, by stb. Its faces and mip levels are
+/// made by CUDA kernels.
 /// </summary>
-/// <param name="path">The path of the cubemap to load.</param>
+/// <param name="path">The path of the cubemap to load, either a cube cross
+/// or an equirectangular panorama.</param>
+/// <param name="half_float">Stores the cubemap as fp16.</param>
 /// <returns>
 ///   Cubemap structure containing the cuda array as well as,
 ///   the cubemap params.
 /// </returns>
 scene::Cubemap
-uploadCubemap(const std::string& path)
+uploadCubemap(const std::string& path, bool half_float)
 {
-  scene::Cubemap cubemap;
-
-  static const unsigned int NB_COMP = 4;
-  static const unsigned int NB_FACES = 6;
   static const unsigned int DEFAULT_COLOR = 0x131b23;
 
-  // This pointer will contain the image data, either loaded
-  // on the disk, or created by using a constant color.
-  float* img = nullptr;
-  unsigned int size = 1;
+  scene::Cubemap cubemap;
+  std::vector<float> pixels;
+  unsigned int width = 2;
+  unsigned int height = 1;
+  unsigned int nb_chan = 3;
 
-  // This is used to free the pointer correctly,
-  // using either the delete operator, or the
-  // stbi_image_free call.
+  // Images decoded by stb are used in place, and freed by it.
   float* loaded = nullptr;
 
+  std::string ext = path.substr(path.find_last_of('.') + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
   // No cubemap was provided with the scene, we will
   // either use a given hexadecimal color, or use the default color.
+  std::string error;
   if (path.empty() || utils::isHexa(path)) {
-    img = createUnitTexture(
-      NB_COMP, path.empty() ? DEFAULT_COLOR : strtol(path.c_str(), NULL, 16),
-      NB_FACES);
-  }
-  // A path to a cubemap has been provided, we load it and extract
-  // each face from the cubecross.
-  else {
-    std::string error;
-    int w, h, nb_chan;
-    loaded = stbi_loadf(path.c_str(), &w, &h, &nb_chan, STBI_default);
-
-    size = w / 4;
-
-    // An internal error occured in stbi_loadf.
+    pixels = createUnitPanorama(
+      path.empty() ? DEFAULT_COLOR : strtol(path.c_str(), NULL, 16));
+  } else if (ext == "exr") {
+    if (!image::readEXR(path, width, height, pixels))
+      error = "unsupported or compressed OpenEXR file " + path;
+  } else {
+    int w, h, c;
+    loaded = stbi_loadf(path.c_str(), &w, &h, &c, STBI_default);
     if (!loaded)
       error = "unknown error " + path;
-    // Width and height are not the same, the cubecross can not be valid.
-    else if (size != (unsigned)(h) / 3)
-      error = "width and height are not the same";
-    // NPOT.
-    else if (size & (size - 1))
-      error = "size should be a power of 2";
-
-    // No error has occured when loading the cubemap, we
-    // can upload it safely.
-    if (error.empty()) {
-      // CUDA cubemap textures expect the data to lay out as follows:
-      // +x / -x / +y / -y / +z / -z
-      img = new float[size * size * NB_COMP * NB_FACES];
-      // Sends +/- X faces
-      float* tmp = texture::append_cube_faces(img, loaded, w, 0, nb_chan,
-                                              NB_COMP, true, true);
-      // Sends +/- Y faces
-      tmp = texture::append_cube_faces(tmp, loaded, w, 1, nb_chan, NB_COMP,
-                                       false, false);
-      // Sends +/- Z faces
-      texture::append_cube_faces(tmp, loaded, w, 1, nb_chan, NB_COMP, true,
-                                 false);
-    } else {
-      std::cerr << "arttracer: cubemap loading fail: " << error << std::endl;
-      img = createUnitTexture(NB_COMP, DEFAULT_COLOR, NB_FACES);
-      size = 1;
-    }
+    width = w;
+    height = h;
+    nb_chan = c;
   }
 
-  cubemap.cubemap_desc =
-    cudaCreateChannelDesc(32, 32, 32, 32, cudaChannelFormatKindFloat);
-  cudaThrowError();
-
-  cudaMalloc3DArray(&cubemap.cubemap, &cubemap.cubemap_desc,
-                    make_cudaExtent(size, size, NB_FACES), cudaArrayCubemap);
-  cudaThrowError();
-
-  cudaMemcpy3DParms myparms;
-  std::memset(&myparms, 0, sizeof(cudaMemcpy3DParms));
-  myparms.srcPos = make_cudaPos(0, 0, 0);
-  myparms.dstPos = make_cudaPos(0, 0, 0);
-  myparms.srcPtr =
-    make_cudaPitchedPtr(img, size * sizeof(float) * NB_COMP, size, size);
-  myparms.dstArray = cubemap.cubemap;
-  myparms.extent = make_cudaExtent(size, size, NB_FACES);
-  myparms.kind = cudaMemcpyHostToDevice;
-  cudaMemcpy3D(&myparms);
-  cudaThrowError();
-
-  delete[] img;
-
+  const float* data = loaded ? loaded : pixels.data();
+  const bool created =
+    error.empty() && scene::cubemap::create(data, width, height, nb_chan,
+                                            half_float, cubemap);
   if (loaded)
     stbi_image_free(loaded);
-
+  if (created)
+    return cubemap;
+
+  if (error.empty())
+    error = "expected a 4:3 cube cross or a 2:1 equirectangular image";
+  std::cerr << "artracer: cubemap loading fail: " << error << std::endl;
+  pixels = createUnitPanorama(DEFAULT_COLOR);
+  scene::cubemap::create(pixels.data(), 2, 1, 3, half_float, cubemap);
   return cubemap;
 }
 
 void
-uploadCubemaps(const std::string& folder,
+uploadCubemaps(const std::string& folder, bool half_float,
                const std::vector<scene::Scene>& raw_scenes,
                std::vector<std::string>& out_names,
                std::vector<scene::Cubemap>& out)
@@ -177,7 +172,7 @@ uploadCubemaps(const std::string& folder,
 
   for (const auto& map : set) {
     out_names.push_back(map);
-    out.push_back(uploadCubemap(folder + "/" + map));
+    out.push_back(uploadCubemap(folder + "/" + map, half_float));
   }
 }
 
@@ -202,57 +197,431 @@ uploadScenes(const std::vector<scene::Scene>& raw_scenes, scene::Scenes& out)
   cudaThrowError();
 }
 
+/// <summary>
+/// Converts a texture to float4 texels, the texture units not supporting
+/// three-channel formats. Missing channels are set to 1.
+/// </summary>
+std::vector<float4>
+toRGBA(const scene::Texture& tex)
+{
+  std::vector<float4> texels(tex.w * tex.h, make_float4(1.0f));
+  for (size_t i = 0; i < texels.size(); ++i) {
+    float* dst = &texels[i].x;
+    for (int c = 0; c < std::min(tex.nb_chan, 4); ++c)
+      dst[c] = tex.data[i * tex.nb_chan + c];
+  }
+  return texels;
+}
+
+/// <summary>
+/// Encodes a linear value with the sRGB transfer function.
+/// </summary>
+inline float
+linearToSRGB(float v)
+{
+  v = std::min(std::max(v, 0.0f), 1.0f);
+  if (v <= 0.0031308f)
+    return v * 12.92f;
+  return 1.055f * std::pow(v, 1.0f / 2.4f) - 0.055f;
+}
+
+inline unsigned char
+quantize(float v)
+{
+  return (unsigned char)(std::min(std::max(v, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+/// <summary>
+/// Quantizes float4 texels to 8 bits per channel. The colors of sRGB
+/// textures are encoded, and decoded back to linear by the texture units,
+/// which keeps the precision in dark tones. Alpha always stays linear.
+/// </summary>
+std::vector<uchar4>
+toRGBA8(const std::vector<float4>& texels, bool srgb)
+{
+  std::vector<uchar4> result(texels.size());
+  for (size_t i = 0; i < texels.size(); ++i) {
+    float4 t = texels[i];
+    if (srgb)
+      t = make_float4(linearToSRGB(t.x), linearToSRGB(t.y), linearToSRGB(t.z),
+                      t.w);
+
+    result[i] = make_uchar4(quantize(t.x), quantize(t.y), quantize(t.z),
+                            quantize(t.w));
+  }
+  return result;
+}
+
+/// <summary>
+/// Maximum number of mip chains waiting to be copied to the GPU.
+/// Worker threads wait when it is reached, which bounds the memory used.
+/// </summary>
+constexpr size_t MAX_STAGED_TEXTURES = 8;
+
+/// <summary>
+/// Mip chain of a texture, built by a worker thread and waiting to be
+/// copied to the GPU.
+/// </summary>
+struct StagedTexture
+{
+  size_t id;
+  bool rgba8;
+  bool srgb;
+  size_t texel_size;
+  std::vector<int2> sizes;
+  std::vector<std::vector<unsigned char>> levels;
+};
+
+/// <summary>
+/// Pinned buffer from which the copies are made. It is only refilled
+/// once its previous copies are done.
+/// </summary>
+struct StagingBuffer
+{
+  unsigned char* data = nullptr;
+  size_t size = 0;
+  cudaEvent_t done;
+};
+
+template <typename T>
+std::vector<unsigned char>
+toBytes(const std::vector<T>& texels)
+{
+  std::vector<unsigned char> bytes(texels.size() * sizeof(T));
+  std::memcpy(&bytes[0], &texels[0], bytes.size());
+  return bytes;
+}
+
+/// <summary>
+/// Builds the whole mip chain of a texture on the CPU, each level being
+/// downsampled from the previous one. Levels are always filtered in linear
+/// space, before being quantized.
+/// </summary>
+/// <param name="cpu_tex">Texture to stage.</param>
+/// <param name="rgba8">Stores 8 bits per channel instead of floats.</param>
+/// <param name="srgb">Stores the colors in sRGB, only used with 8 bits
+/// channels.</param>
+/// <param name="out">Contains the staged mip chain.</param>
+void
+stageTexture(const scene::Texture& cpu_tex, bool rgba8, bool srgb,
+             StagedTexture& out)
+{
+  out.rgba8 = rgba8;
+  out.srgb = srgb;
+  out.texel_size = rgba8 ? sizeof(uchar4) : sizeof(float4);
+
+  unsigned int nb_levels = 1;
+  while ((std::max(cpu_tex.w, cpu_tex.h) >> nb_levels) > 0) ++nb_levels;
+
+  std::vector<float4> level = toRGBA(cpu_tex);
+  int w = cpu_tex.w;
+  int h = cpu_tex.h;
+  for (unsigned int l = 0; l < nb_levels; ++l) {
+    if (l > 0) {
+      int prev_w = w;
+      int prev_h = h;
+      w = std::max(1, w / 2);
+      h = std::max(1, h / 2);
+
+      std::vector<float4> next(w * h);
+      stbir_resize_float(&level[0].x, prev_w, prev_h, 0, &next[0].x, w, h, 0,
+                         4);
+      level.swap(next);
+    }
+
+    out.sizes.push_back(make_int2(w, h));
+    out.levels.push_back(rgba8 ? toBytes(toRGBA8(level, srgb))
+                               : toBytes(level));
+  }
+}
+
+/// <summary>
+/// Copies a staged mip chain to the GPU, asynchronously on `stream', and
+/// creates its texture object.
+/// </summary>
+/// <param name="staged">Mip chain to copy.</param>
+/// <param name="staging">Pinned buffer used for the copies.</param>
+/// <param name="stream">Stream on which the copies are made.</param>
+/// <param name="out">Contains the GPU texture.</param>
+void
+uploadTexture(const StagedTexture& staged, StagingBuffer& staging,
+              cudaStream_t stream, scene::TextureObject& out)
+{
+  const unsigned int nb_levels = staged.levels.size();
+  out.w = staged.sizes[0].x;
+  out.h = staged.sizes[0].y;
+
+  cudaChannelFormatDesc desc = staged.rgba8 ? cudaCreateChannelDesc<uchar4>()
+                                            : cudaCreateChannelDesc<float4>();
+  cudaExtent extent = make_cudaExtent(out.w, out.h, 0);
+  cudaMallocMipmappedArray(&out.array, &desc, extent, nb_levels);
+  cudaThrowError();
+
+  size_t nb_bytes = 0;
+  for (const auto& level : staged.levels) nb_bytes += level.size();
+
+  // The previous copies made from this buffer must be done.
+  cudaEventSynchronize(staging.done);
+  if (nb_bytes > staging.size) {
+    cudaFreeHost(staging.data);
+    cudaMallocHost(&staging.data, nb_bytes);
+    cudaThrowError();
+    staging.size = nb_bytes;
+  }
+
+  size_t offset = 0;
+  for (unsigned int l = 0; l < nb_levels; ++l) {
+    const auto& level = staged.levels[l];
+    std::memcpy(staging.data + offset, &level[0], level.size());
+
+    const size_t pitch = staged.sizes[l].x * staged.texel_size;
+    cudaArray_t array;
+    cudaGetMipmappedArrayLevel(&array, out.array, l);
+    cudaThrowError();
+    cudaMemcpy2DToArrayAsync(array, 0, 0, staging.data + offset, pitch, pitch,
+                             staged.sizes[l].y, cudaMemcpyHostToDevice, stream);
+    cudaThrowError();
+
+    offset += level.size();
+  }
+  cudaEventRecord(staging.done, stream);
+
+  cudaResourceDesc res_desc;
+  std::memset(&res_desc, 0, sizeof(res_desc));
+  res_desc.resType = cudaResourceTypeMipmappedArray;
+  res_desc.res.mipmap.mipmap = out.array;
+
+  // 8 bits texels are read as floats in [0, 1], in linear space.
+  cudaTextureDesc tex_desc;
+  std::memset(&tex_desc, 0, sizeof(tex_desc));
+  tex_desc.addressMode[0] = cudaAddressModeWrap;
+  tex_desc.addressMode[1] = cudaAddressModeWrap;
+  tex_desc.filterMode = cudaFilterModeLinear;
+  tex_desc.mipmapFilterMode = cudaFilterModeLinear;
+  tex_desc.readMode =
+    staged.rgba8 ? cudaReadModeNormalizedFloat : cudaReadModeElementType;
+  tex_desc.sRGB = staged.rgba8 && staged.srgb;
+  tex_desc.normalizedCoords = 1;
+  tex_desc.maxMipmapLevelClamp = (float)(nb_levels - 1);
+
+  cudaCreateTextureObject(&out.tex, &res_desc, &tex_desc, nullptr);
+  cudaThrowError();
+}
+
+/// <summary>
+/// Uploads the material textures `ids'. Mip chains are built by worker
+/// threads, while the main thread copies the finished ones from two pinned
+/// buffers, so that the copies overlap with the CPU work.
+/// </summary>
+/// <param name="rgba8">Stores 8 bits per channel instead of floats.</param>
+/// <param name="ids">Ids of the textures to upload.</param>
+/// <param name="out">GPU textures, indexed by id, containing the uploaded
+/// ones.</param>
 void
-uploadTextures(scene::Scenes& out)
+uploadTextures(bool rgba8, const std::vector<int>& ids,
+               std::vector<scene::TextureObject>& out)
 {
   auto* mat_loader = scene::MaterialLoader::instance();
   const auto& textures = mat_loader->getTextures();
 
-  if (textures.size() == 0)
+  const size_t nb_tex = ids.size();
+  if (nb_tex == 0)
     return;
 
-  std::vector<scene::Texture> gpu_textures(textures.size());
+  std::mutex mutex;
+  std::condition_variable staged_cond;
+  std::condition_variable space_cond;
+  std::deque<StagedTexture> staged;
+  std::exception_ptr error;
+  bool stop = false;
+
+  std::thread producer([&]() {
+    try {
+      utils::parallelFor(nb_tex, [&](size_t i) {
+        StagedTexture tex;
+        tex.id = ids[i];
+        stageTexture(textures[tex.id], rgba8,
+                     mat_loader->isColorTexture(tex.id), tex);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        space_cond.wait(
+          lock, [&]() { return stop || staged.size() < MAX_STAGED_TEXTURES; });
+        staged.push_back(std::move(tex));
+        staged_cond.notify_one();
+      });
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      error = std::current_exception();
+      staged_cond.notify_one();
+    }
+  });
+
+  cudaStream_t stream;
+  cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking);
+  StagingBuffer buffers[2];
+  for (auto& buffer : buffers) cudaEventCreate(&buffer.done);
+
+  try {
+    for (size_t n = 0; n < nb_tex; ++n) {
+      StagedTexture tex;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        staged_cond.wait(lock, [&]() { return !staged.empty() || error; });
+        if (staged.empty())
+          break;
+
+        tex = std::move(staged.front());
+        staged.pop_front();
+      }
+      space_cond.notify_one();
+
+      uploadTexture(tex, buffers[n % 2], stream, out[tex.id]);
+    }
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error)
+      error = std::current_exception();
+    stop = true;
+    space_cond.notify_all();
+  }
+  producer.join();
+
+  cudaStreamSynchronize(stream);
+  for (auto& buffer : buffers) {
+    cudaFreeHost(buffer.data);
+    cudaEventDestroy(buffer.done);
+  }
+  cudaStreamDestroy(stream);
 
-  out.textures.size = textures.size();
-  for (size_t i = 0; i < out.textures.size; ++i) {
-    const scene::Texture& cpu_tex = textures[i];
-    scene::Texture& gpu_tex = gpu_textures[i];
+  if (error)
+    std::rethrow_exception(error);
+}
 
-    gpu_tex.w = cpu_tex.w;
-    gpu_tex.h = cpu_tex.h;
-    gpu_tex.nb_chan = cpu_tex.nb_chan;
+void
+releaseTexture(scene::TextureObject& texture)
+{
+  if (texture.array == nullptr)
+    return;
 
-    size_t nb_bytes = cpu_tex.w * cpu_tex.h * cpu_tex.nb_chan * sizeof(float);
-    cudaMalloc(&gpu_tex.data, nb_bytes);
-    cudaThrowError();
-    cudaMemcpy(gpu_tex.data, cpu_tex.data, nb_bytes, cudaMemcpyHostToDevice);
+  cudaDestroyTextureObject(texture.tex);
+  cudaFreeMipmappedArray(texture.array);
+  texture = scene::TextureObject();
+}
+
+/// <summary>
+/// Sends the table of the textures to the GPU, the textures that are not
+/// resident having a null texture object. The table only grows.
+/// </summary>
+void
+uploadTextureTable(const std::vector<scene::TextureObject>& textures,
+                   scene::Scenes& out)
+{
+  if (textures.size() == 0)
+    return;
+
+  size_t nb_bytes = textures.size() * sizeof(scene::TextureObject);
+  if (textures.size() > out.textures.size) {
+    cudaFree(out.textures.data);
+    cudaMalloc(&out.textures.data, nb_bytes);
     cudaThrowError();
+    out.textures.size = textures.size();
   }
 
-  size_t nb_bytes = out.textures.size * sizeof(scene::Texture);
-  cudaMalloc(&out.textures.data, nb_bytes);
-  cudaThrowError();
-  cudaMemcpy(out.textures.data, &gpu_textures[0], nb_bytes,
+  cudaMemcpy(out.textures.data, &textures[0], nb_bytes,
              cudaMemcpyHostToDevice);
   cudaThrowError();
 }
+
+using Clock = std::chrono::steady_clock;
+
+/// <summary>
+/// Gives the seconds elapsed since `start', and restarts it.
+/// </summary>
+double
+lap(Clock::time_point& start)
+{
+  const Clock::time_point now = Clock::now();
+  const double seconds = std::chrono::duration<double>(now - start).count();
+  start = now;
+  return seconds;
+}
+
+/// <summary>
+/// Flips summed samples, the accumulation buffers starting from the bottom
+/// of the image.
+/// </summary>
+image::Accumulation
+toAccumulation(const std::vector<float3>& sums, unsigned int width,
+               unsigned int height, uint64_t nb_samples)
+{
+  image::Accumulation acc;
+  acc.width = width;
+  acc.height = height;
+  acc.nb_samples = nb_samples;
+  acc.rgb.resize((size_t)width * height * 3);
+  for (unsigned int y = 0; y < height; ++y) {
+    const float3* row = &sums[(size_t)(height - y - 1) * width];
+    for (unsigned int x = 0; x < width; ++x) {
+      float* dst = &acc.rgb[((size_t)y * width + x) * 3];
+      dst[0] = row[x].x;
+      dst[1] = row[x].y;
+      dst[2] = row[x].z;
+    }
+  }
+  return acc;
+}
 }
 
 GPUProcessor::GPUProcessor(const std::string& asset,
                            std::vector<std::string> scene_names, int width,
-                           int height)
+                           int height, bool headless)
   : _asset_folder(asset)
   , _scene_names(scene_names)
   , _scene_id(0)
   , _prev_scene_id(0)
   , _cubemap_id(0)
   , _post_id(0)
-  , _interop(width, height)
+  , _kernel_id(0)
+  , _sampler_id(0)
+  , _interop(width, height, headless)
   , _d_temporal_framebuffer(nullptr)
+  , _accumulation_format(ACCUMULATION_FLOAT3)
+  , _wavefront(nullptr)
+  , _ray_reordering(false)
+  , _reprojection(false)
+  , _reprojection_buffers(nullptr)
+  , _denoise(false)
+  , _denoiser(nullptr)
+  , _adaptive(false)
+  , _adaptive_buffers(nullptr)
+  , _dynamic_resolution(false)
+  , _frame_target_ms(1000.0f / 30.0f)
+  , _render_scale(1.0f)
+  , _last_frame_ms(0.0f)
+  , _render_width(width)
+  , _render_height(height)
+  , _rgba8_textures(false)
+  , _half_cubemaps(false)
+  , _vram_budget(0)
+  , _geometry_cache(0)
+  , _use_counter(0)
+  , _nb_frames(0)
+  , _gpu_count(1)
+  , _primary(nullptr)
+  , _sample_offset(0)
+  , _pipelined(false)
+  , _hot_reload(false)
+  , _streaming(false)
+  , _watched_scene(-1)
+  , _watch_elapsed(0.0f)
   , _moved(false)
 {
+  cudaGetDevice(&_device);
   cudaStreamCreateWithFlags(&_stream, cudaStreamDefault);
+  cudaEventCreateWithFlags(&_frame_done, cudaEventDisableTiming);
   cudaCalloc(&_d_temporal_framebuffer, width * height, sizeof(float3));
+  if (!headless)
+    _profiler.init(true);
 
   // Initializes all keys to released
   for (size_t i = 0; i < 65536; ++i)
@@ -266,6 +635,20 @@ GPUProcessor::GPUProcessor(const std::string& asset,
 GPUProcessor::~GPUProcessor()
 {
   this->release();
+  cudaEventDestroy(_frame_done);
+}
+
+void
+GPUProcessor::setAccumulationFormat(AccumulationFormat format)
+{
+  if (format == _accumulation_format)
+    return;
+
+  _accumulation_format = format;
+  cudaFree(_d_temporal_framebuffer);
+  cudaCalloc(&_d_temporal_framebuffer, _interop.width() * _interop.height(),
+             accumulationPixelSize(format));
+  cudaThrowError();
 }
 
 void
@@ -276,72 +659,440 @@ GPUProcessor::init()
 
   std::cout << _gpu_info.getProfile() << "\n" << std::endl;
 
-  size_t free_space = 0;
-  size_t consumed = 0;
-  size_t total_consumed = 0;
+  // Rays are traced on the RT cores when OptiX is available.
+  if (_optix.init(ARTRACER_OPTIX_PTX))
+    _kernel_names.push_back("OptiX");
+
+  // Only the scene files are parsed here: scenes are
+  // uploaded the first time they are selected.
+  Clock::time_point start = Clock::now();
+  for (auto& scene : _raw_scenes) scene.describe();
+  uploadScenes(_raw_scenes, _scenes);
+  _load_times.scene_files += lap(start);
+
+  _scene_vram.assign(_raw_scenes.size(), 0);
+  _scene_last_use.assign(_raw_scenes.size(), 0);
 
-  // Uploads scene for GPU usage
-  for (auto& scene : _raw_scenes) {
-    std::cout << "Uploading scene `" << scene.getSceneName()
-              << "' primitives..." << std::endl;
+  // Cubemaps upload.
+  std::cout << "Uploading Cubemaps ..." << std::endl;
+  size_t free_space = _gpu_info.getFreeMo();
+
+  uploadCubemaps(_asset_folder, _half_cubemaps, _raw_scenes, _cubemap_names,
+                 _cubemaps);
+  _load_times.cubemaps += lap(start);
+
+  size_t consumed = free_space - _gpu_info.getFreeMo();
+  std::cout << consumed << " (MB) uploaded!\n" << std::endl;
+
+  // Peers compute their own budget.
+  createPeers();
+  _load_times.peers += lap(start);
 
-    free_space = _gpu_info.getFreeMo();
-    scene.upload(nullptr);
-    consumed = free_space - _gpu_info.getFreeMo();
-    total_consumed += consumed;
+  // Scenes can use most of what remains.
+  if (_vram_budget == 0)
+    _vram_budget = _gpu_info.getFreeMo() * 9 / 10;
+  std::cout << "Scenes VRAM budget: " << _vram_budget << " (MB)" << std::endl;
+  if (_geometry_cache == 0)
+    _geometry_cache = _vram_budget / 2;
 
-    std::cout << consumed << " (MB) uploaded!\n" << std::endl;
+  // Sets the camera to the data
+  // extracted from the first scene.
+  if (this->_raw_scenes.size()) {
+    makeResident(0);
+    prefetch(1 % _raw_scenes.size());
+    _camera = _raw_scenes[0].getInitCamera();
   }
+}
 
-  uploadScenes(_raw_scenes, _scenes);
+void
+GPUProcessor::createPeers()
+{
+  int nb_devices = 0;
+  cudaGetDeviceCount(&nb_devices);
+  unsigned int nb_gpus =
+    _gpu_count == 0 ? nb_devices : std::min<int>(_gpu_count, nb_devices);
+  nb_gpus = std::min<unsigned int>(nb_gpus, MAX_RENDER_DEVICES);
+
+  for (int d = 0; d < nb_devices && _peers.size() + 1 < nb_gpus; ++d) {
+    if (d == _device)
+      continue;
+
+    // Copies between GPUs go through the host without peer access.
+    int can_access = 0;
+    cudaDeviceCanAccessPeer(&can_access, _device, d);
+    if (can_access)
+      cudaDeviceEnablePeerAccess(d, 0);
+    cudaGetLastError();
+
+    std::cout << "Uploading scenes to GPU " << d << "..." << std::endl;
+    cudaSetDevice(d);
+    std::unique_ptr<GPUProcessor> peer(new GPUProcessor(
+      _asset_folder, _scene_names, _interop.width(), _interop.height(), true));
+    peer->_primary = this;
+    for (size_t i = 0; i < _raw_scenes.size(); ++i)
+      peer->_raw_scenes[i].setIndexed(_raw_scenes[i].isIndexed());
+    peer->setRGBA8Textures(_rgba8_textures);
+    peer->setHalfCubemaps(_half_cubemaps);
+    peer->setAccumulationFormat(_accumulation_format);
+    peer->setVRAMBudget(_vram_budget);
+    peer->setGeometryCache(_geometry_cache);
+    peer->init();
+    _peers.push_back(std::move(peer));
+    cudaSetDevice(_device);
+
+    void* copy = nullptr;
+    cudaMalloc(&copy, _interop.width() * _interop.height() *
+                        accumulationPixelSize(_accumulation_format));
+    cudaThrowError();
+    _peer_framebuffers.push_back(copy);
+  }
 
-  // Textures upload.
-  // This allows to avoid duplicating data.
-  std::cout << "Uploading Scenes textures..." << std::endl;
-  free_space = _gpu_info.getFreeMo();
+  if (_peers.size())
+    std::cout << "Rendering with " << _peers.size() + 1 << " GPUs.\n"
+              << std::endl;
+}
 
-  uploadTextures(_scenes);
+void
+GPUProcessor::tracePeers()
+{
+  for (auto& peer : _peers) {
+    cudaSetDevice(peer->_device);
+
+    peer->_camera = _camera;
+    peer->_moved = _moved;
+    peer->_cubemap_id = _cubemap_id;
+    peer->_post_id = _post_id;
+    peer->_kernel_id = _kernel_id;
+    peer->_ray_reordering = _ray_reordering;
+    peer->_sampler_id = _sampler_id;
+    if (peer->_scene_id != _scene_id) {
+      peer->_scene_id = _scene_id;
+      peer->_prev_scene_id = _scene_id;
+      peer->makeResident(_scene_id);
+    }
 
-  consumed = free_space - _gpu_info.getFreeMo();
-  total_consumed += consumed;
+    // The previous frame of the peer must have been copied.
+    cudaStreamWaitEvent(peer->_stream, _frame_done, 0);
+    if (peer->_raw_scenes[_scene_id].uploaded())
+      peer->trace();
+    cudaEventRecord(peer->_frame_done, peer->_stream);
+  }
+  cudaSetDevice(_device);
+}
 
-  std::cout << consumed << " (MB) uploaded!\n" << std::endl;
+void
+GPUProcessor::mergePeers()
+{
+  const unsigned int width = _interop.width();
+  const unsigned int height = _interop.height();
+
+  std::vector<AccumulationBuffer> framebuffers = { temporalFramebuffer() };
+  std::vector<unsigned int> nb_frames = { _nb_frames };
+  for (size_t k = 0; k < _peers.size(); ++k) {
+    const auto& peer = _peers[k];
+    if (!peer->_raw_scenes[_scene_id].uploaded())
+      continue;
+
+    cudaStreamWaitEvent(_stream, peer->_frame_done, 0);
+    cudaMemcpyPeerAsync(_peer_framebuffers[k], _device,
+                        peer->_d_temporal_framebuffer, peer->_device,
+                        width * height *
+                          accumulationPixelSize(_accumulation_format),
+                        _stream);
+    AccumulationBuffer copy = temporalFramebuffer();
+    copy.data = _peer_framebuffers[k];
+    framebuffers.push_back(copy);
+    nb_frames.push_back(peer->_nb_frames);
+  }
+  cudaEventRecord(_frame_done, _stream);
 
-  // Cubemaps upload.
-  std::cout << "Uploading Cubemaps ..." << std::endl;
-  free_space = _gpu_info.getFreeMo();
+  mergeFrames(outputSurface(), framebuffers, nb_frames, width, height,
+              _stream, _post_id);
+}
 
-  uploadCubemaps(_asset_folder, _raw_scenes, _cubemap_names, _cubemaps);
+void
+GPUProcessor::waitPrefetch()
+{
+  if (_prefetch.valid())
+    _prefetch.get();
+}
 
-  consumed = free_space - _gpu_info.getFreeMo();
-  total_consumed += consumed;
+void
+GPUProcessor::prefetch(int scene_id)
+{
+  waitPrefetch();
 
-  std::cout << consumed << " (MB) uploaded!\n" << std::endl;
+  scene::Scene* scene = &_raw_scenes[scene_id];
+  if (scene->uploaded())
+    return;
 
-  // Recaps the overall VRAM consummed. This gives a good idea
-  // how streaming is important, especially with textures!
-  std::cout << "Uploading completed!\n"
-            << "* " << _raw_scenes.size() << " scenes uploaded.\n"
-            << "* " << total_consumed << " (MB) VRAM consumed." << std::endl;
+  _prefetch = std::async(std::launch::async, [scene]() { scene->load(); });
+}
 
-  // Sets the camera to the data
-  // extracted from the first scene.
-  if (this->_raw_scenes.size())
-    _camera = _raw_scenes[0].getInitCamera();
+void
+GPUProcessor::makeResident(int scene_id)
+{
+  _scene_last_use[scene_id] = ++_use_counter;
+
+  scene::Scene& scene = _raw_scenes[scene_id];
+  if (scene.uploaded())
+    return;
+
+  // The scene may still be loading in the background.
+  waitPrefetch();
+
+  std::cout << "Uploading scene `" << scene.getSceneName() << "'..."
+            << std::endl;
+  size_t free_space = _gpu_info.getFreeMo();
+
+  // Textures are decoded in parallel before the materials pack them.
+  // Peers take the materials of the primary GPU instead, with the ids of
+  // their textures, and only upload their own GPU copies.
+  Clock::time_point start = Clock::now();
+  scene.load();
+  _load_times.meshes += lap(start);
+  if (_primary) {
+    _primary->loadMaterials(scene_id);
+    scene.setMaterials(_primary->_raw_scenes[scene_id].getCPUMaterials());
+  } else
+    scene::MaterialLoader::instance()->prefetch(
+      { &scene.getMaterials() }, { scene.getMaterialFolder() });
+  scene.setGeometryCache(_geometry_cache << 20);
+  scene.upload(nullptr);
+  _load_times.upload += lap(start);
+
+  uploadScenePointer(scene_id);
+  if (!scene.uploaded())
+    return;
+  // The acceleration structures of streamed meshes would not fit either,
+  // they are traced by the software traversal.
+  if (scene.isStreamed())
+    std::cout << "Streaming the meshes through a " << _geometry_cache
+              << " (MB) cache." << std::endl;
+  else
+    _optix.build(scene_id, scene);
+  _load_times.upload += lap(start);
+
+  uploadSceneTextures(scene);
+  _load_times.textures += lap(start);
+
+  size_t free_after = _gpu_info.getFreeMo();
+  _scene_vram[scene_id] = free_space > free_after ? free_space - free_after : 0;
+  std::cout << _scene_vram[scene_id] << " (MB) uploaded!\n" << std::endl;
+
+  // Evicts the least recently used scenes until the budget is met.
+  for (;;) {
+    size_t resident = 0;
+    int lru = -1;
+    for (size_t i = 0; i < _raw_scenes.size(); ++i) {
+      if (!_raw_scenes[i].uploaded())
+        continue;
+
+      resident += _scene_vram[i];
+      if ((int)i != scene_id &&
+          (lru < 0 || _scene_last_use[i] < _scene_last_use[lru]))
+        lru = i;
+    }
+
+    if (resident <= _vram_budget || lru < 0)
+      break;
+    evict(lru);
+  }
+}
+
+void
+GPUProcessor::loadMaterials(int scene_id)
+{
+  scene::Scene& scene = _raw_scenes[scene_id];
+  if (!scene.getCPUMaterials().empty())
+    return;
+
+  // The scene may still be loading in the background.
+  waitPrefetch();
+  scene.load();
+  scene::MaterialLoader::instance()->prefetch({ &scene.getMaterials() },
+                                              { scene.getMaterialFolder() });
+  scene.loadMaterials();
+}
+
+void
+GPUProcessor::evict(int scene_id)
+{
+  scene::Scene& scene = _raw_scenes[scene_id];
+  std::cout << "Evicting scene `" << scene.getSceneName() << "'."
+            << std::endl;
+
+  // The last frames may still be using it.
+  cudaStreamSynchronize(_stream);
+
+  std::vector<int> ids = scene.getTextureIds();
+  _optix.release(scene_id);
+  scene.release();
+  uploadScenePointer(scene_id);
+  _scene_vram[scene_id] = 0;
+  releaseUnusedTextures(ids);
+}
+
+void
+GPUProcessor::uploadSceneTextures(const scene::Scene& scene)
+{
+  // Only the textures that are not resident yet are uploaded.
+  _textures.resize(scene::MaterialLoader::instance()->getTextures().size());
+  std::vector<int> missing;
+  std::unordered_set<int> listed;
+  for (int id : scene.getTextureIds()) {
+    if (_textures[id].array == nullptr && listed.insert(id).second)
+      missing.push_back(id);
+  }
+  uploadTextures(_rgba8_textures, missing, _textures);
+  uploadTextureTable(_textures, _scenes);
+}
+
+void
+GPUProcessor::releaseUnusedTextures(const std::vector<int>& ids)
+{
+  // Textures are shared between scenes, they are only released
+  // when no other resident scene uses them.
+  std::unordered_set<int> used;
+  for (const auto& other : _raw_scenes) {
+    if (!other.uploaded())
+      continue;
+    for (int id : other.getTextureIds()) used.insert(id);
+  }
+
+  for (int id : ids) {
+    if (!used.count(id))
+      releaseTexture(_textures[id]);
+  }
+  uploadTextureTable(_textures, _scenes);
+}
+
+void
+GPUProcessor::pollSources(float delta)
+{
+  _watch_elapsed += delta;
+  if (_watch_elapsed < WATCH_PERIOD)
+    return;
+  _watch_elapsed = 0.0f;
+
+  if (_watched_scene != _scene_id) {
+    _watched_scene = _scene_id;
+    _watcher.watch(_raw_scenes[_scene_id].getSources());
+    return;
+  }
+
+  const std::vector<std::string> modified = _watcher.poll();
+  if (modified.empty())
+    return;
+
+  // The scene may reference other sources once reloaded.
+  reloadScene(_scene_id, modified);
+  _watcher.watch(_raw_scenes[_scene_id].getSources());
+}
+
+void
+GPUProcessor::reloadScene(int scene_id,
+                          const std::vector<std::string>& modified)
+{
+  scene::Scene& scene = _raw_scenes[scene_id];
+  if (!scene.uploaded())
+    return;
+
+  // The last frames may still be using the buffers updated.
+  cudaStreamSynchronize(_stream);
+  Clock::time_point start = Clock::now();
+
+  const std::vector<int> ids = scene.getTextureIds();
+  const unsigned int changes = scene.reload(modified);
+  if (changes == scene::SCENE_UNCHANGED)
+    return;
+
+  // The peers copy the updates, or take the new materials of this GPU
+  // when uploading their released copy again.
+  for (auto& peer : _peers) {
+    cudaSetDevice(peer->_device);
+    peer->copyReload(scene_id, scene, changes);
+  }
+  cudaSetDevice(_device);
+
+  applyReload(scene_id, ids, changes);
+  _moved = true;
+  std::cout << "Reloaded scene `" << scene.getSceneName() << "' in "
+            << lap(start) * 1e3 << " ms." << std::endl;
+}
+
+void
+GPUProcessor::copyReload(int scene_id, const scene::Scene& source,
+                         unsigned int changes)
+{
+  scene::Scene& scene = _raw_scenes[scene_id];
+  if (!scene.uploaded())
+    return;
+
+  cudaStreamSynchronize(_stream);
+  const std::vector<int> ids = scene.getTextureIds();
+  scene.copyReload(source, changes);
+  applyReload(scene_id, ids, changes);
+  _moved = true;
+}
+
+void
+GPUProcessor::applyReload(int scene_id, const std::vector<int>& ids,
+                          unsigned int changes)
+{
+  scene::Scene& scene = _raw_scenes[scene_id];
+  if (changes & scene::SCENE_RELEASED) {
+    // The textures recycled by the scene are released before uploading it
+    // again, its new materials being able to take their ids.
+    _optix.release(scene_id);
+    uploadScenePointer(scene_id);
+    _scene_vram[scene_id] = 0;
+    releaseUnusedTextures(ids);
+    makeResident(scene_id);
+  } else {
+    // Modified materials may use textures not resident yet, and no longer
+    // use others.
+    if (changes & scene::SCENE_MATERIALS) {
+      uploadSceneTextures(scene);
+      releaseUnusedTextures(ids);
+    }
+    if ((changes & scene::SCENE_GEOMETRY) && !scene.isStreamed())
+      _optix.build(scene_id, scene);
+  }
+}
+
+void
+GPUProcessor::uploadScenePointer(int scene_id)
+{
+  const scene::Scene& scene = _raw_scenes[scene_id];
+  const scene::SceneData* ptr =
+    scene.uploaded() ? scene.getUploadedScenePointer() : nullptr;
+
+  cudaMemcpy(_scenes.scenes + scene_id, &ptr, sizeof(scene::SceneData*),
+             cudaMemcpyHostToDevice);
+  cudaThrowError();
 }
 
 void
 GPUProcessor::update(float delta)
 {
+  _last_frame_ms = delta * 1e3f;
+
   // Changes the scene if an change happened in the UI.
   if (_prev_scene_id != _scene_id) {
     _prev_scene_id = _scene_id;
+    makeResident(_scene_id);
+    prefetch((_scene_id + 1) % _raw_scenes.size());
+
     // Resets the camera to the scene data
     const auto& scene_cam = this->_raw_scenes[_scene_id].getInitCamera();
     _camera = scene_cam;
     return;
   }
 
+  if (_hot_reload)
+    pollSources(delta);
+
   // Updates cam rotation
   _camera.u = cross(WORLD_DOWN_VEC, _camera.dir);
   _camera.v = cross(_camera.dir, _camera.u);
@@ -365,35 +1116,445 @@ GPUProcessor::update(float delta)
 void
 GPUProcessor::render()
 {
+  if (_pipelined) {
+    renderPipelined();
+    return;
+  }
+
   _interop.clear();
-  if (_raw_scenes.size() == 0)
+  if (_raw_scenes.size() == 0 || !_raw_scenes[_scene_id].uploaded())
     return;
 
+  _profiler.beginFrame();
+  _profiler.begin(profiling::STAGE_MAP, _stream);
   const auto error = _interop.map(_stream);
-  if (error != cudaSuccess) return;
+  _profiler.end(profiling::STAGE_MAP, _stream);
+  if (error != cudaSuccess) {
+    _profiler.endFrame();
+    return;
+  }
 
-  raytrace(_interop.getArray(), _scenes, _scene_id, _cubemaps, _cubemap_id,
-           &_camera, _interop.width(), _interop.height(), _stream,
-           _d_temporal_framebuffer, _moved, _post_id);
+  tracePeers();
+  _profiler.begin(profiling::STAGE_TRACE, _stream);
+  trace();
+  _profiler.end(profiling::STAGE_TRACE, _stream);
+  if (_peers.size()) {
+    _profiler.begin(profiling::STAGE_MERGE, _stream);
+    mergePeers();
+    _profiler.end(profiling::STAGE_MERGE, _stream);
+  }
+  encodeFrame();
 
+  _profiler.begin(profiling::STAGE_UNMAP, _stream);
   _interop.unmap(_stream);
+  _profiler.end(profiling::STAGE_UNMAP, _stream);
   cudaCheckError();
+  readFrameCounters();
 
   this->setMoved(false);
 
+  _profiler.begin(profiling::STAGE_BLIT, _stream);
   _interop.blit();
+  _profiler.end(profiling::STAGE_BLIT, _stream);
   _interop.swap();
+  _profiler.endFrame();
+}
+
+void
+GPUProcessor::readFrameCounters()
+{
+  RenderCounters counters;
+  if (readCounters(counters, _stream))
+    _profiler.setCounters(counters);
+}
+
+void
+GPUProcessor::renderPipelined()
+{
+  if (_raw_scenes.size() == 0 || !_raw_scenes[_scene_id].uploaded())
+    return;
+
+  _profiler.beginFrame();
+  _profiler.begin(profiling::STAGE_MAP, _stream);
+  const auto error = _interop.mapNext(_stream);
+  _profiler.end(profiling::STAGE_MAP, _stream);
+  if (error != cudaSuccess) {
+    _profiler.endFrame();
+    return;
+  }
+
+  tracePeers();
+  _profiler.begin(profiling::STAGE_TRACE, _stream);
+  trace();
+  _profiler.end(profiling::STAGE_TRACE, _stream);
+  if (_peers.size()) {
+    _profiler.begin(profiling::STAGE_MERGE, _stream);
+    mergePeers();
+    _profiler.end(profiling::STAGE_MERGE, _stream);
+  }
+  encodeFrame();
+
+  // Presents the previous frame while this one renders.
+  _profiler.begin(profiling::STAGE_BLIT, _stream);
+  _interop.presentPrevious(_stream);
+  _profiler.end(profiling::STAGE_BLIT, _stream);
+  cudaCheckError();
+  readFrameCounters();
+
+  this->setMoved(false);
+  _profiler.endFrame();
+}
+
+void
+GPUProcessor::trace()
+{
+  const bool reproject = _reprojection && _peers.empty();
+  if (reproject && !_reprojection_buffers)
+    _reprojection_buffers =
+      createReprojection(_interop.width(), _interop.height());
+  else if (!reproject && _reprojection_buffers) {
+    releaseReprojection(_reprojection_buffers);
+    _reprojection_buffers = nullptr;
+  }
+
+  const bool denoise = _denoise && _peers.empty();
+  if (denoise && !_denoiser)
+    _denoiser = createDenoiser(_interop.width(), _interop.height());
+  else if (!denoise && _denoiser) {
+    releaseDenoiser(_denoiser);
+    _denoiser = nullptr;
+  }
+
+  // Pixels do not hold the same number of samples with adaptive sampling,
+  // so the accumulation restarts whenever it is toggled.
+  const bool adaptive = _adaptive && !reproject && _peers.empty();
+  if (adaptive && !_adaptive_buffers) {
+    _adaptive_buffers = createAdaptive(_interop.width(), _interop.height());
+    _moved = true;
+  } else if (!adaptive && _adaptive_buffers) {
+    releaseAdaptive(_adaptive_buffers);
+    _adaptive_buffers = nullptr;
+    _moved = true;
+  }
+
+  // Moving frames are previews, which can be rendered at a lower
+  // resolution and upscaled by the blit.
+  unsigned int width = _interop.width();
+  unsigned int height = _interop.height();
+  if (_dynamic_resolution && _moved && !reproject && _peers.empty()) {
+    _render_scale =
+      nextRenderScale(_render_scale, _last_frame_ms, _frame_target_ms);
+    width = std::max(1u, (unsigned int)(width * _render_scale));
+    height = std::max(1u, (unsigned int)(height * _render_scale));
+  }
+
+  // The accumulation restarts at the size of the screen.
+  if (width != _render_width || height != _render_height)
+    _moved = true;
+  _render_width = width;
+  _render_height = height;
+  _interop.setRenderSize(width, height);
+
+  _nb_frames = _moved ? 1 : _nb_frames + 1;
+
+  setSampler(_sampler_id);
+  if (_kernel_id == 1)
+    raytracePersistent(outputSurface(), _scenes, _scene_id, _cubemaps,
+                       _cubemap_id, &_camera, width, height, _stream,
+                       temporalFramebuffer(),
+                       _moved, _post_id, _gpu_info.getCUDAGPU(),
+                       _reprojection_buffers, _denoiser, _adaptive_buffers);
+  else if (_kernel_id == 2) {
+    if (!_wavefront)
+      _wavefront = createWavefront(_interop.width(), _interop.height());
+
+    raytraceWavefront(_wavefront, outputSurface(), _scenes, _scene_id,
+                      _cubemaps, _cubemap_id, &_camera, width, height,
+                      _stream, temporalFramebuffer(),
+                      _moved, _post_id, _reprojection_buffers, _denoiser,
+                      _adaptive_buffers, _ray_reordering);
+  } else if (_kernel_id == 3)
+    raytraceOptix(_optix, outputSurface(), _scenes, _scene_id, _cubemaps,
+                  _cubemap_id, &_camera, width, height, _stream,
+                  temporalFramebuffer(), _moved, _post_id,
+                  _reprojection_buffers, _denoiser, _adaptive_buffers);
+  else
+    raytrace(outputSurface(), _scenes, _scene_id, _cubemaps, _cubemap_id,
+             &_camera, width, height, _stream, temporalFramebuffer(),
+             _moved, _post_id,
+             _reprojection_buffers, _denoiser, _adaptive_buffers);
+
+  // Streamed meshes reached by the frame are paged in for the next ones.
+  _raw_scenes[_scene_id].streamGeometry(_stream);
+}
+
+bool
+GPUProcessor::startStreaming(driver::VideoCodec codec, unsigned int bitrate)
+{
+  // Remote clients are expected to refresh at 60 Hz.
+  constexpr unsigned int STREAM_FPS = 60;
+  return _encoder.init(_interop.width(), _interop.height(), codec, bitrate,
+                       STREAM_FPS);
+}
+
+void
+GPUProcessor::encodeFrame()
+{
+  _video_packet.clear();
+  if (!_encoder.available() || !_streaming)
+    return;
+
+  // The framebuffer is still mapped: the encoder reads it on the GPU, and
+  // only the bitstream comes back.
+  _profiler.begin(profiling::STAGE_ENCODE, _stream);
+  _encoder.encode(_interop.getSurface(), _interop.isHalfFloat(),
+                  _render_width, _render_height, _stream, _video_packet);
+  _profiler.end(profiling::STAGE_ENCODE, _stream);
+}
+
+OfflineStats
+GPUProcessor::accumulate(unsigned int spp, double time_budget)
+{
+  OfflineStats stats;
+  if (_raw_scenes.size() == 0 || !_raw_scenes[_scene_id].uploaded())
+    return stats;
+
+  // Computes the camera base, without any input.
+  update(0.0f);
+
+  const size_t nb_pixels = (size_t)_interop.width() * _interop.height();
+
+  // Every frame is accumulated, including the first one: resetting the
+  // accumulation by moving would make it a single bounce preview.
+  std::vector<GPUProcessor*> processors = { this };
+  for (auto& peer : _peers) processors.push_back(peer.get());
+  for (auto* p : processors) {
+    cudaSetDevice(p->_device);
+    p->_camera = _camera;
+    p->_cubemap_id = _cubemap_id;
+    p->_post_id = _post_id;
+    p->_kernel_id = _kernel_id;
+    p->_ray_reordering = _ray_reordering;
+    p->_sampler_id = _sampler_id;
+    p->_nb_frames = 0;
+    p->setMoved(false);
+    setSeedOffset(_sample_offset);
+    cudaMemset(p->_d_temporal_framebuffer, 0,
+               nb_pixels * accumulationPixelSize(p->_accumulation_format));
+    cudaThrowError();
+  }
+  cudaSetDevice(_device);
+
+  using clock = std::chrono::steady_clock;
+  const auto start = clock::now();
+  auto elapsed = [&]() {
+    return std::chrono::duration<double>(clock::now() - start).count();
+  };
+
+  // Each GPU renders frames as long as some are left, so that
+  // faster GPUs render more of them.
+  std::atomic<unsigned int> nb_claimed(0);
+  std::vector<RenderCounters> counters(processors.size(), RenderCounters());
+  std::vector<char> counted(processors.size(), false);
+  auto renderFrames = [&](size_t k) {
+    GPUProcessor* p = processors[k];
+    cudaSetDevice(p->_device);
+    if (!p->_raw_scenes[_scene_id].uploaded())
+      return;
+
+    while ((spp == 0 || nb_claimed++ < spp) &&
+           (time_budget <= 0.0 || elapsed() < time_budget)) {
+      p->trace();
+      // Waits for each frame, so that the budget is not overshot
+      // by frames still queued.
+      cudaStreamSynchronize(p->_stream);
+      cudaThrowError();
+
+      RenderCounters frame;
+      if (readCounters(frame, p->_stream)) {
+        counted[k] = true;
+        counters[k].rays += frame.rays;
+        counters[k].triangle_tests += frame.triangle_tests;
+        counters[k].paths += frame.paths;
+        counters[k].bounces += frame.bounces;
+      }
+    }
+  };
+
+  std::vector<std::future<void>> workers;
+  for (size_t k = 1; k < processors.size(); ++k)
+    workers.push_back(std::async(std::launch::async, renderFrames, k));
+  renderFrames(0);
+  for (auto& worker : workers) worker.get();
+  cudaSetDevice(_device);
+
+  stats.seconds = elapsed();
+  for (size_t k = 0; k < processors.size(); ++k) {
+    stats.nb_samples += processors[k]->_nb_frames;
+    stats.has_counters = stats.has_counters || counted[k];
+    stats.counters.rays += counters[k].rays;
+    stats.counters.triangle_tests += counters[k].triangle_tests;
+    stats.counters.paths += counters[k].paths;
+    stats.counters.bounces += counters[k].bounces;
+  }
+  return stats;
+}
+
+image::Accumulation
+GPUProcessor::readAccumulation()
+{
+  const unsigned int width = _interop.width();
+  const unsigned int height = _interop.height();
+  const size_t nb_pixels = (size_t)width * height;
+
+  // Sums the frames of every GPU.
+  std::vector<GPUProcessor*> processors = { this };
+  for (auto& peer : _peers) processors.push_back(peer.get());
+
+  std::vector<float3> accumulated(nb_pixels, make_float3(0.0f));
+  std::vector<float3> frames(nb_pixels);
+  uint64_t nb_samples = 0;
+  for (auto* p : processors) {
+    cudaSetDevice(p->_device);
+    readSums(p->temporalFramebuffer(), p->_nb_frames, nb_pixels, &frames[0],
+             p->_stream);
+    cudaThrowError();
+    for (size_t i = 0; i < nb_pixels; ++i) accumulated[i] += frames[i];
+    nb_samples += p->_nb_frames;
+  }
+  cudaSetDevice(_device);
+
+  return toAccumulation(accumulated, width, height, nb_samples);
+}
+
+std::vector<image::Accumulation>
+GPUProcessor::accumulateViews(const std::vector<scene::Camera>& cameras,
+                              unsigned int spp)
+{
+  std::vector<image::Accumulation> accumulations;
+  if (_raw_scenes.size() == 0 || !_raw_scenes[_scene_id].uploaded() ||
+      cameras.empty() || spp == 0)
+    return accumulations;
+
+  const unsigned int width = _interop.width();
+  const unsigned int height = _interop.height();
+  const size_t nb_pixels = (size_t)width * height;
+
+  // Views accumulate exact sums, whatever the layout of the screen.
+  std::vector<RenderView> views(cameras.size());
+  for (size_t i = 0; i < views.size(); ++i) {
+    scene::Camera& cam = views[i].camera;
+    cam = cameras[i];
+    cam.u = cross(WORLD_DOWN_VEC, cam.dir);
+    cam.v = cross(cam.dir, cam.u);
+    views[i].framebuffer.format = ACCUMULATION_FLOAT3;
+    cudaMalloc(&views[i].framebuffer.data, nb_pixels * sizeof(float3));
+    cudaThrowError();
+  }
+
+  Clock::time_point start = Clock::now();
+  setSampler(_sampler_id);
+  for (unsigned int frame = 1; frame <= spp; ++frame) {
+    raytraceViews(views, _scenes, _scene_id, _cubemaps, _cubemap_id, width,
+                  height, frame, _stream, _gpu_info.getCUDAGPU());
+    cudaThrowError();
+    _raw_scenes[_scene_id].streamGeometry(_stream);
+  }
+
+  std::vector<float3> sums(nb_pixels);
+  for (auto& view : views) {
+    readSums(view.framebuffer, spp, nb_pixels, &sums[0], _stream);
+    cudaThrowError();
+    accumulations.push_back(toAccumulation(sums, width, height, spp));
+    cudaFree(view.framebuffer.data);
+  }
+
+  const double seconds = lap(start);
+  std::cout << "Rendered " << views.size() << " views of " << spp
+            << " spp in " << seconds << " s ("
+            << views.size() * spp / std::max(seconds, 1e-6)
+            << " spp/s)." << std::endl;
+  return accumulations;
+}
+
+bool
+GPUProcessor::renderOffline(unsigned int spp, double time_budget,
+                            const std::string& path)
+{
+  if (_raw_scenes.size() == 0 || !_raw_scenes[_scene_id].uploaded())
+    return false;
+
+  const OfflineStats stats = accumulate(spp, time_budget);
+  const unsigned int nb_samples = stats.nb_samples;
+  const double seconds = stats.seconds;
+  std::cout << "Rendered " << nb_samples << " spp in " << seconds << " s ("
+            << nb_samples / std::max(seconds, 1e-6) << " spp/s)." << std::endl;
+
+  const unsigned int width = _interop.width();
+  const unsigned int height = _interop.height();
+
+  bool written;
+  const bool exr = utils::hasExtension(path, ".exr");
+  if (exr || utils::hasExtension(path, ".acc")) {
+    // Partial accumulations keep the sum, to be merged with others.
+    image::Accumulation acc = readAccumulation();
+    if (exr) {
+      const float scale = 1.0f / std::max(nb_samples, 1u);
+      for (auto& v : acc.rgb) v *= scale;
+    }
+    written = exr ? image::writeEXR(path, width, height, &acc.rgb[0])
+                  : image::writeAccumulation(path, acc);
+  } else {
+    if (_peers.size())
+      mergePeers();
+
+    std::vector<unsigned char> pixels((size_t)width * height * 4);
+    cudaStreamSynchronize(_stream);
+    _interop.read(&pixels[0]);
+    cudaThrowError();
+    written = image::writePNG(path, width, height, &pixels[0]);
+  }
+
+  if (!written)
+    std::cerr << "artracer: failed to write `" << path << "'." << std::endl;
+  return written;
 }
 
 void
 GPUProcessor::resize(unsigned int w, unsigned int h)
 {
+  for (size_t k = 0; k < _peers.size(); ++k) {
+    cudaSetDevice(_peers[k]->_device);
+    _peers[k]->resize(w, h);
+    cudaSetDevice(_device);
+
+    cudaFree(_peer_framebuffers[k]);
+    cudaMalloc(&_peer_framebuffers[k],
+               h * w * accumulationPixelSize(_accumulation_format));
+  }
+
   _interop.setSize(w, h);
+  _render_width = w;
+  _render_height = h;
 
   if (_d_temporal_framebuffer != nullptr)
     cudaFree(_d_temporal_framebuffer);
 
-  cudaMalloc(&_d_temporal_framebuffer, h * w * sizeof(float3));
+  cudaMalloc(&_d_temporal_framebuffer,
+             h * w * accumulationPixelSize(_accumulation_format));
+
+  releaseWavefront(_wavefront);
+  _wavefront = nullptr;
+  releaseReprojection(_reprojection_buffers);
+  _reprojection_buffers = nullptr;
+  releaseDenoiser(_denoiser);
+  _denoiser = nullptr;
+  releaseAdaptive(_adaptive_buffers);
+  _adaptive_buffers = nullptr;
+
+  // The stream restarts at the new size, from a key frame.
+  if (_encoder.available())
+    _encoder.resize(w, h);
 }
 
 void
@@ -414,28 +1575,48 @@ GPUProcessor::isKeyPressed(const unsigned int key)
 void
 GPUProcessor::release()
 {
+  waitPrefetch();
+
+  // Releases the other GPUs.
+  for (auto& peer : _peers) {
+    cudaSetDevice(peer->_device);
+    peer.reset();
+  }
+  _peers.clear();
+  cudaSetDevice(_device);
+  for (auto* copy : _peer_framebuffers) cudaFree(copy);
+  _peer_framebuffers.clear();
+
   // Releases all the scenes.
+  _optix.release();
+  _encoder.release();
   for (auto& scene : _raw_scenes) scene.release();
   cudaFree(_scenes.scenes);
+  _scenes.scenes = nullptr;
 
   // Releases the textures
-  size_t nb_tex = _scenes.textures.size;
-  scene::Texture *textures = new scene::Texture[nb_tex];
-  cudaMemcpy(
-    textures, _scenes.textures.data,
-    nb_tex * sizeof(scene::Texture), cudaMemcpyDeviceToHost
-  );
-  cudaCheckError();
-
-  for (size_t i = 0; i < nb_tex; ++i) cudaFree(textures[i].data);
+  for (auto& texture : _textures) releaseTexture(texture);
+  _textures.clear();
   cudaFree(_scenes.textures.data);
-  delete[] textures;
+  _scenes.textures = scene::Buffer<scene::TextureObject>();
 
   // Releases the cubemaps
-  for (const auto& cubemap : _cubemaps) cudaFreeArray(cubemap.cubemap);
+  for (auto& cubemap : _cubemaps) scene::cubemap::release(cubemap);
   _cubemaps.clear();
 
   cudaFree(_d_temporal_framebuffer);
+  _d_temporal_framebuffer = nullptr;
+
+  releaseWavefront(_wavefront);
+  _wavefront = nullptr;
+  releaseReprojection(_reprojection_buffers);
+  _reprojection_buffers = nullptr;
+  releaseDenoiser(_denoiser);
+  _denoiser = nullptr;
+  releaseAdaptive(_adaptive_buffers);
+  _adaptive_buffers = nullptr;
+
+  _profiler.release();
 
   // Releases CPU memory
   scene::MaterialLoader::instance()->release();
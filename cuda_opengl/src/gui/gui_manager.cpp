@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <cfloat>
+#include <cstdio>
+#include <iostream>
 #include <string>
 #include <vector>
 
@@ -5,6 +9,7 @@
 #include <gui/gui_manager.h>
 #include <gui/imgui.h>
 #include <gui/imgui_impl_glfw_gl3.h>
+#include <utils/profiler.h>
 
 namespace gui {
 namespace {
@@ -15,6 +20,58 @@ vectorGetter(void* data, int n, const char** out_text)
   *out_text = (*v)[n].c_str();
   return true;
 }
+
+/// <summary>
+/// Series of the profiler history plotted by `seriesGetter': a stage, the
+/// frame time, or the rays traced per second.
+/// </summary>
+struct Series
+{
+  const std::deque<profiling::FrameStats>* history;
+  int id;
+};
+
+constexpr int SERIES_FRAME = profiling::NB_STAGES;
+constexpr int SERIES_MRAYS = profiling::NB_STAGES + 1;
+
+float
+seriesValue(const profiling::FrameStats& frame, int id)
+{
+  if (id == SERIES_FRAME)
+    return frame.frame_ms;
+  if (id == SERIES_MRAYS) {
+    const float trace_ms = frame.stage_ms[profiling::STAGE_TRACE];
+    return trace_ms > 0.0f ? frame.counters.rays / (trace_ms * 1e3f) : 0.0f;
+  }
+  return frame.stage_ms[id];
+}
+
+float
+seriesGetter(void* data, int n)
+{
+  const Series* series = (const Series*)data;
+  return seriesValue((*series->history)[n], series->id);
+}
+
+/// <summary>
+/// Plots a series as a histogram, overlaid with its mean.
+/// </summary>
+void
+plotSeries(const char* label, const Series& series, const char* unit)
+{
+  constexpr float PLOT_HEIGHT = 40.0f;
+
+  const auto& history = *series.history;
+  float mean = 0.0f;
+  for (const auto& frame : history) mean += seriesValue(frame, series.id);
+  mean /= std::max<size_t>(history.size(), 1);
+
+  char overlay[32];
+  std::snprintf(overlay, sizeof(overlay), "%.2f %s", mean, unit);
+  ImGui::PlotHistogram(label, seriesGetter, (void*)&series,
+                       (int)history.size(), 0, overlay, 0.0f, FLT_MAX,
+                       ImVec2(0, PLOT_HEIGHT));
+}
 }
 
 GUIManager* GUIManager::_instance = nullptr;
@@ -63,6 +120,29 @@ GUIManager::postProcess(int& post_id, const std::vector<std::string>& items)
   ImGui::End();
 }
 
+void
+GUIManager::kernel(int& kernel_id, const std::vector<std::string>& items,
+                   int& sampler_id, const std::vector<std::string>& samplers,
+                   bool& reprojection, bool& denoise, bool& adaptive,
+                   bool& ray_reordering, bool& dynamic_resolution,
+                   float& frame_target_ms)
+{
+  ImGui::Begin("Rendering", NULL, ImGuiWindowFlags_AlwaysAutoResize);
+  ImGui::ListBox("Kernel", &kernel_id, vectorGetter, (void*)&items,
+                 (int)items.size(), -1);
+  ImGui::ListBox("Sampler", &sampler_id, vectorGetter, (void*)&samplers,
+                 (int)samplers.size(), -1);
+  ImGui::Checkbox("Reprojection", &reprojection);
+  ImGui::Checkbox("Denoise", &denoise);
+  ImGui::Checkbox("Adaptive sampling", &adaptive);
+  if (items[kernel_id] == "Wavefront")
+    ImGui::Checkbox("Ray reordering", &ray_reordering);
+  ImGui::Checkbox("Dynamic resolution", &dynamic_resolution);
+  if (dynamic_resolution)
+    ImGui::SliderFloat("Frame time (ms)", &frame_target_ms, 8.0f, 100.0f);
+  ImGui::End();
+}
+
 void
 GUIManager::camera(scene::Camera& cam, float h_offset)
 {
@@ -91,6 +171,42 @@ GUIManager::camera(scene::Camera& cam, float h_offset)
   ImGui::End();
 }
 
+void
+GUIManager::profiler(const profiling::Profiler& profiler,
+                     const std::string& json_path)
+{
+  const auto& history = profiler.history();
+
+  ImGui::Begin("Profiler", NULL, ImGuiWindowFlags_AlwaysAutoResize);
+  for (int s = 0; s < profiling::NB_STAGES; ++s)
+    plotSeries(profiling::stageName((profiling::Stage)s),
+               Series{ &history, s }, "ms");
+  plotSeries("Frame", Series{ &history, SERIES_FRAME }, "ms");
+  ImGui::Separator();
+
+  if (!history.empty() && history.back().has_counters) {
+    const RenderCounters& counters = history.back().counters;
+    plotSeries("Mrays/s", Series{ &history, SERIES_MRAYS }, "Mrays/s");
+    ImGui::Text("Rays: %llu", counters.rays);
+    ImGui::Text("Triangle tests per ray: %.1f",
+                counters.rays ? (double)counters.triangle_tests / counters.rays
+                              : 0.0);
+    ImGui::Text("Bounces per path: %.2f",
+                counters.paths ? (double)counters.bounces / counters.paths
+                               : 0.0);
+  } else
+    ImGui::TextDisabled("Device counters need ARTRACER_COUNTERS.");
+
+  if (ImGui::Button("Save JSON")) {
+    if (profiler.writeJSON(json_path))
+      std::cout << "Profile written to " << json_path << "." << std::endl;
+    else
+      std::cerr << "artracer: failed to write `" << json_path << "'."
+                << std::endl;
+  }
+  ImGui::End();
+}
+
 void
 GUIManager::render()
 {
@@ -7,9 +7,17 @@
 
 #include <cuda_gl_interop.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <thread>
 
+#include <benchmark.h>
 #include <driver/cuda_helper.h>
 #include <driver/gpu_info.h>
 #include <driver/interop.h>
@@ -17,6 +25,9 @@
 #include <gui/gui_manager.h>
 #include <scene/scene.h>
 #include <shaders/raytrace.h>
+#include <utils/accumulation.h>
+#include <utils/image_writer.h>
+#include <utils/stream_server.h>
 #include <utils/utils.h>
 
 constexpr unsigned int CUBEMAP_IDX = 2;
@@ -104,41 +115,631 @@ glfw_mouse_callback(GLFWwindow* window, double xpos, double ypos)
 }
 
 /// <summary>
-/// Builds an array containing all the scene names.
+/// Command line options, given before or after the positional arguments.
+/// </summary>
+struct Options
+{
+  /// <summary>
+  /// Uploads meshes using shared vertices, instead of copying
+  /// the vertices in each face.
+  /// </summary>
+  bool indexed = false;
+
+  /// <summary>
+  /// Stores material textures with 8 bits per channel.
+  /// </summary>
+  bool rgba8 = false;
+
+  /// <summary>
+  /// Stores the cubemaps with 16 bits floats.
+  /// </summary>
+  bool half_cubemaps = false;
+
+  /// <summary>
+  /// Layout of the temporal framebuffers, and format of the framebuffers
+  /// the colors are written to.
+  /// </summary>
+  AccumulationFormat accumulation = ACCUMULATION_FLOAT3;
+  OutputFormat output = OUTPUT_RGBA8;
+
+  /// <summary>
+  /// VRAM, in MB, resident scenes can use. 0 for the default budget.
+  /// </summary>
+  size_t vram_budget = 0;
+
+  /// <summary>
+  /// VRAM, in MB, the meshes of a scene can take before being streamed. 0
+  /// for the default cache.
+  /// </summary>
+  size_t geometry_cache = 0;
+
+  /// <summary>
+  /// Number of GPUs rendering each frame, 0 for all of them.
+  /// </summary>
+  unsigned int gpus = 0;
+
+  /// <summary>
+  /// Presents each frame while the next one renders.
+  /// </summary>
+  bool pipelined = false;
+
+  /// <summary>
+  /// Reloads the current scene whenever its files are saved.
+  /// </summary>
+  bool watch = false;
+
+  /// <summary>
+  /// Sampler drawing the random numbers of the paths: 0 for Sobol, 1 for
+  /// rank-1 and 2 for random.
+  /// </summary>
+  int sampler = 0;
+
+  /// <summary>
+  /// JSON report of the profiler, written when the window is closed if
+  /// given, or on demand from the GUI.
+  /// </summary>
+  std::string profile;
+
+  /// <summary>
+  /// Renders offscreen without opening any window, until `spp' samples
+  /// per pixel are done or `time' seconds passed, and writes the image.
+  /// </summary>
+  bool headless = false;
+  unsigned int spp = 0;
+  double time = 0.0;
+  std::string out = "render.exr";
+
+  /// <summary>
+  /// Renders this number of views orbiting the camera target instead,
+  /// all traced by the same launches, and writes them next to `out'.
+  /// </summary>
+  unsigned int turntable = 0;
+
+  /// <summary>
+  /// Streams the frames encoded with `codec', at `bitrate' Mbps, to a
+  /// client connecting to this port, and reads back its input. 0 to not
+  /// stream. Headless, frames are only rendered for the client.
+  /// </summary>
+  unsigned short stream_port = 0;
+  driver::VideoCodec codec = driver::VIDEO_H264;
+  unsigned int bitrate = 20;
+
+  /// <summary>
+  /// Node of a render farm, among `nb_nodes': renders its share of the
+  /// samples, starting from `sample_offset'. Computed from the node when
+  /// not given.
+  /// </summary>
+  unsigned int node = 0;
+  unsigned int nb_nodes = 0;
+  long long sample_offset = -1;
+
+  /// <summary>
+  /// Merges the partial accumulations given as arguments into `out',
+  /// instead of rendering.
+  /// </summary>
+  bool merge = false;
+
+  /// <summary>
+  /// Renders the scenes given as arguments, or the bundled ones, headless
+  /// at each of `sizes', writes the measures to `report', and compares the
+  /// images with the references of `references'. `spp' overrides the
+  /// samples per pixel.
+  /// </summary>
+  bool benchmark = false;
+  std::vector<benchmark::Resolution> sizes;
+  std::string references;
+  bool update_references = false;
+  std::string report = "benchmark.json";
+};
+
+/// <summary>
+/// Parses a list of resolutions given as `WxH,WxH...'.
+/// </summary>
+/// <returns>False if one of them is invalid.</returns>
+bool
+parseSizes(const std::string& value,
+           std::vector<benchmark::Resolution>& out_sizes)
+{
+  const char* it = value.c_str();
+  while (*it) {
+    char* end = nullptr;
+    benchmark::Resolution size;
+    size.width = std::strtoul(it, &end, 10);
+    if (*end != 'x')
+      return false;
+    size.height = std::strtoul(end + 1, &end, 10);
+    if (size.width == 0 || size.height == 0 || (*end && *end != ','))
+      return false;
+    out_sizes.push_back(size);
+    it = *end ? end + 1 : end;
+  }
+  return !out_sizes.empty();
+}
+
+/// <summary>
+/// Extracts the value of an option given as `--name=value' or
+/// `--name value', the latter consuming the next argument.
+/// </summary>
+/// <returns>False if `arg' is not the option `name'.</returns>
+bool
+optionValue(const std::string& arg, const std::string& name, int& i, int argc,
+            char* argv[], std::string& out_value)
+{
+  if (arg == name) {
+    if (i + 1 < argc)
+      out_value = argv[++i];
+    else
+      std::cerr << "artracer: missing value for `" << name << "'."
+                << std::endl;
+    return true;
+  }
+
+  if (arg.compare(0, name.size() + 1, name + "=") == 0) {
+    out_value = arg.substr(name.size() + 1);
+    return true;
+  }
+
+  return false;
+}
+
+/// <summary>
+/// Extracts the options from the arguments given to the main.
 /// </summary>
 /// <param name="argc">The number of arguments given to the main.</param>
 /// <param name="argv">The arguments given to the main.</param>
-/// <param name="start">The first index at which first scene is located</param>
-/// <returns></returns>
-std::vector<std::string>
-buildScenesList(int argc, char* argv[], unsigned int start)
+/// <param name="out_args">Contains the positional arguments.</param>
+/// <returns>The parsed options.</returns>
+Options
+parseOptions(int argc, char* argv[], std::vector<std::string>& out_args)
+{
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    std::string value;
+    if (arg == "--indexed")
+      options.indexed = true;
+    else if (arg == "--rgba8")
+      options.rgba8 = true;
+    else if (arg == "--pipelined")
+      options.pipelined = true;
+    else if (arg == "--watch")
+      options.watch = true;
+    else if (arg == "--headless")
+      options.headless = true;
+    else if (optionValue(arg, "--vram-budget", i, argc, argv, value))
+      options.vram_budget = std::strtoul(value.c_str(), nullptr, 10);
+    else if (optionValue(arg, "--geometry-cache", i, argc, argv, value))
+      options.geometry_cache = std::strtoul(value.c_str(), nullptr, 10);
+    else if (optionValue(arg, "--gpus", i, argc, argv, value))
+      options.gpus = std::strtoul(value.c_str(), nullptr, 10);
+    else if (optionValue(arg, "--spp", i, argc, argv, value))
+      options.spp = std::strtoul(value.c_str(), nullptr, 10);
+    else if (optionValue(arg, "--time", i, argc, argv, value))
+      options.time = std::strtod(value.c_str(), nullptr);
+    else if (optionValue(arg, "--out", i, argc, argv, value))
+      options.out = value;
+    else if (optionValue(arg, "--turntable", i, argc, argv, value))
+      options.turntable = std::strtoul(value.c_str(), nullptr, 10);
+    else if (optionValue(arg, "--stream", i, argc, argv, value))
+      options.stream_port = std::strtoul(value.c_str(), nullptr, 10);
+    else if (optionValue(arg, "--bitrate", i, argc, argv, value))
+      options.bitrate = std::strtoul(value.c_str(), nullptr, 10);
+    else if (optionValue(arg, "--codec", i, argc, argv, value)) {
+      if (value == "h264")
+        options.codec = driver::VIDEO_H264;
+      else if (value == "hevc")
+        options.codec = driver::VIDEO_HEVC;
+      else
+        std::cerr << "artracer: unknown codec `" << value << "'."
+                  << std::endl;
+    }
+    else if (optionValue(arg, "--profile", i, argc, argv, value))
+      options.profile = value;
+    else if (optionValue(arg, "--sampler", i, argc, argv, value)) {
+      if (value == "sobol")
+        options.sampler = 0;
+      else if (value == "rank1")
+        options.sampler = 1;
+      else if (value == "random")
+        options.sampler = 2;
+      else
+        std::cerr << "artracer: unknown sampler `" << value << "'."
+                  << std::endl;
+    }
+    else if (optionValue(arg, "--accumulation", i, argc, argv, value)) {
+      if (value == "float3")
+        options.accumulation = ACCUMULATION_FLOAT3;
+      else if (value == "float4")
+        options.accumulation = ACCUMULATION_FLOAT4;
+      else if (value == "half")
+        options.accumulation = ACCUMULATION_HALF4;
+      else
+        std::cerr << "artracer: unknown accumulation format `" << value
+                  << "'." << std::endl;
+    } else if (optionValue(arg, "--output", i, argc, argv, value)) {
+      if (value == "rgba8")
+        options.output = OUTPUT_RGBA8;
+      else if (value == "rgba16f")
+        options.output = OUTPUT_RGBA16F;
+      else
+        std::cerr << "artracer: unknown output format `" << value << "'."
+                  << std::endl;
+    } else if (optionValue(arg, "--cubemap", i, argc, argv, value)) {
+      if (value == "rgba32f")
+        options.half_cubemaps = false;
+      else if (value == "rgba16f")
+        options.half_cubemaps = true;
+      else
+        std::cerr << "artracer: unknown cubemap format `" << value << "'."
+                  << std::endl;
+    }
+    else if (optionValue(arg, "--sample-offset", i, argc, argv, value))
+      options.sample_offset = std::strtoll(value.c_str(), nullptr, 10);
+    else if (optionValue(arg, "--node", i, argc, argv, value)) {
+      // Given as K/N, K being in [0, N[.
+      char* end = nullptr;
+      options.node = std::strtoul(value.c_str(), &end, 10);
+      options.nb_nodes = *end == '/' ? std::strtoul(end + 1, nullptr, 10) : 0;
+      if (options.node >= options.nb_nodes) {
+        std::cerr << "artracer: invalid node `" << value << "'." << std::endl;
+        options.nb_nodes = 0;
+      }
+    } else if (arg == "--merge")
+      options.merge = true;
+    else if (arg == "--benchmark")
+      options.benchmark = true;
+    else if (arg == "--update-references")
+      options.update_references = true;
+    else if (optionValue(arg, "--size", i, argc, argv, value)) {
+      options.sizes.clear();
+      if (!parseSizes(value, options.sizes))
+        std::cerr << "artracer: invalid size `" << value << "'." << std::endl;
+    } else if (optionValue(arg, "--references", i, argc, argv, value))
+      options.references = value;
+    else if (optionValue(arg, "--report", i, argc, argv, value))
+      options.report = value;
+    else if (arg.compare(0, 2, "--") == 0)
+      std::cerr << "artracer: unknown option `" << arg << "'." << std::endl;
+    else if (!arg.empty())
+      out_args.push_back(arg);
+  }
+
+  return options;
+}
+
+/// <summary>
+/// Renders views of the first scene turning around the point the camera
+/// looks at, at its focus distance, and writes them as `<out>_<view>.exr',
+/// or as partial accumulations `<out>_<view>.acc' for an .acc output.
+/// </summary>
+bool
+renderTurntable(processor::GPUProcessor& processor, unsigned int nb_views,
+                unsigned int spp, const std::string& out)
+{
+  constexpr float TWO_PI = 6.28318530718f;
+
+  const scene::Camera& camera = processor.getCamera();
+  const float3 target = camera.position + camera.dir * camera.focus_dist;
+  std::vector<scene::Camera> cameras(nb_views, camera);
+  for (unsigned int i = 0; i < nb_views; ++i) {
+    const float angle = TWO_PI * i / nb_views;
+    const float c = std::cos(angle);
+    const float s = std::sin(angle);
+    // Rotates the camera around the vertical axis of the target.
+    const float3 offset = camera.position - target;
+    cameras[i].position =
+      target + make_float3(c * offset.x + s * offset.z, offset.y,
+                           c * offset.z - s * offset.x);
+    cameras[i].dir = make_float3(c * camera.dir.x + s * camera.dir.z,
+                                 camera.dir.y,
+                                 c * camera.dir.z - s * camera.dir.x);
+  }
+
+  std::vector<image::Accumulation> views =
+    processor.accumulateViews(cameras, spp);
+  if (views.size() != nb_views)
+    return false;
+
+  const size_t dot = out.find_last_of('.');
+  const std::string stem = out.substr(0, dot);
+  const std::string ext = out.substr(dot);
+  const bool partial = utils::hasExtension(out, ".acc");
+  for (unsigned int i = 0; i < nb_views; ++i) {
+    image::Accumulation& acc = views[i];
+    std::ostringstream path;
+    path << stem << '_' << std::setw(3) << std::setfill('0') << i << ext;
+
+    // Partial accumulations keep the sum, to be merged with others.
+    bool written;
+    if (partial)
+      written = image::writeAccumulation(path.str(), acc);
+    else {
+      const float scale = 1.0f / std::max<uint64_t>(acc.nb_samples, 1);
+      for (auto& v : acc.rgb) v *= scale;
+      written = image::writeEXR(path.str(), acc.width, acc.height, &acc.rgb[0]);
+    }
+    if (!written) {
+      std::cerr << "artracer: failed to write `" << path.str() << "'."
+                << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/// <summary>
+/// Starts encoding the frames of the processor, and listens for the
+/// stream client.
+/// </summary>
+bool
+startStream(const Options& options, processor::GPUProcessor& processor,
+            remote::StreamServer& server)
+{
+  return processor.startStreaming(options.codec, options.bitrate * 1000000) &&
+         server.listen(options.stream_port);
+}
+
+/// <summary>
+/// Accepts a new stream client, and feeds the input of the client to the
+/// processor.
+/// </summary>
+/// <returns>False once the client ended the session.</returns>
+bool
+applyRemoteInput(remote::StreamServer& server,
+                 processor::GPUProcessor& processor)
+{
+  if (server.accept())
+    processor.requestKeyframe();
+
+  std::vector<remote::InputEvent> events;
+  server.poll(events);
+  // Frames are only encoded for a connected client, the key frame requested
+  // on accept restarting the stream.
+  processor.setStreaming(server.connected());
+  const driver::Interop& interop = processor.getInterop();
+  for (const auto& event : events) {
+    switch (event.type) {
+      case remote::InputEvent::KEY:
+        if (event.key >= 0 && event.key < 1024)
+          processor.setKeyState(event.key, event.pressed);
+        break;
+      case remote::InputEvent::MOUSE:
+        // Moves are relative to the center of the screen, where the local
+        // cursor is held.
+        processor.setMoved(true);
+        processor.setMousePos(interop.half_width() + event.dx,
+                              interop.half_height() + event.dy);
+        break;
+      case remote::InputEvent::QUIT:
+        return false;
+    }
+  }
+  return true;
+}
+
+/// <summary>
+/// Renders interactively for the stream clients, until one of them ends
+/// the session.
+/// </summary>
+void
+serveStream(processor::GPUProcessor& processor, remote::StreamServer& server)
+{
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point last_time = Clock::now();
+  while (applyRemoteInput(server, processor)) {
+    // Nothing is rendered while nobody watches.
+    if (!server.connected()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      last_time = Clock::now();
+      continue;
+    }
+
+    const Clock::time_point curr_time = Clock::now();
+    processor.update(
+      std::chrono::duration<float>(curr_time - last_time).count());
+    last_time = curr_time;
+
+    processor.render();
+    server.send(processor.getVideoPacket());
+  }
+}
+
+/// <summary>
+/// Renders the first scene offscreen, without creating any window or
+/// OpenGL context, and writes the image to `options.out', or streams the
+/// frames to a remote client.
+/// </summary>
+/// <returns>The exit code of the program.</returns>
+int
+renderHeadless(const Options& options, const std::vector<std::string>& args,
+               int width, int height)
+{
+  // Without any budget, renders a converged enough image.
+  constexpr unsigned int DEFAULT_SPP = 256;
+  unsigned int spp = options.spp;
+  if (spp == 0 && options.time <= 0.0)
+    spp = DEFAULT_SPP;
+
+  // Nodes of a farm render consecutive ranges of samples. Without a
+  // sample count, each one gets a range of this size.
+  constexpr unsigned int NODE_SAMPLE_STRIDE = 1 << 16;
+  unsigned int sample_offset = 0;
+  if (options.nb_nodes > 0) {
+    const unsigned int nb_nodes = options.nb_nodes;
+    // Every node takes at least one sample, a sample count of 0 meaning
+    // that only the time budget bounds the render.
+    if (spp > 0 && nb_nodes > spp) {
+      std::cerr << "artracer: --node=K/N needs at least N samples per pixel."
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (spp > 0) {
+      sample_offset = spp / nb_nodes * options.node +
+                      std::min(options.node, spp % nb_nodes);
+      spp = spp / nb_nodes + (options.node < spp % nb_nodes);
+    } else
+      sample_offset = options.node * NODE_SAMPLE_STRIDE;
+  }
+  if (options.sample_offset >= 0)
+    sample_offset = options.sample_offset;
+
+  // Views are read back as accumulations, with no tone mapped image, and
+  // all of them take the same number of samples.
+  if (options.turntable > 0 && !options.stream_port) {
+    if (!utils::hasExtension(options.out, ".exr") &&
+        !utils::hasExtension(options.out, ".acc")) {
+      std::cerr << "artracer: --turntable only writes .exr or .acc files."
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (options.time > 0.0) {
+      std::cerr << "artracer: --turntable takes --spp, not --time."
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  bool written = false;
+  {
+    std::vector<std::string> scenes(args.begin() + 1, args.end());
+    processor::GPUProcessor processor(args[0], scenes, width, height, true);
+    processor.setIndexed(options.indexed);
+    processor.setRGBA8Textures(options.rgba8);
+    processor.setHalfCubemaps(options.half_cubemaps);
+    processor.setAccumulationFormat(options.accumulation);
+    processor.setOutputFormat(options.output);
+    processor.setVRAMBudget(options.vram_budget);
+    processor.setGeometryCache(options.geometry_cache);
+    processor.setGPUCount(options.gpus);
+    processor.setSampleOffset(sample_offset);
+    processor.setSamplerId(options.sampler);
+    processor.setHotReload(options.watch);
+    processor.init();
+
+    if (options.stream_port) {
+      remote::StreamServer server;
+      written = startStream(options, processor, server);
+      if (written)
+        serveStream(processor, server);
+    }
+    // Turntables render a fixed number of samples of every view, --time
+    // being rejected above.
+    else if (options.turntable > 0)
+      written =
+        renderTurntable(processor, options.turntable, spp, options.out);
+    else
+      written = processor.renderOffline(spp, options.time, options.out);
+    processor.release();
+  }
+
+  cudaDeviceReset();
+
+  return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/// <summary>
+/// Merges the partial accumulations rendered by the nodes of a farm, one
+/// file at a time, and writes the average to `options.out', or their sum
+/// for an .acc output.
+/// </summary>
+/// <returns>The exit code of the program.</returns>
+int
+mergeAccumulations(const Options& options,
+                   const std::vector<std::string>& files)
 {
-  std::vector<std::string> scenes;
+  image::Accumulation acc;
+  for (const auto& file : files) {
+    if (!image::addAccumulation(file, acc))
+      return EXIT_FAILURE;
+  }
 
-  int nb_scenes = argc - start;
-  for (int i = 0; i < nb_scenes; ++i) {
-    std::string file = argv[i + start];
-    if (!file.empty())
-      scenes.push_back(file);
+  std::cout << "Merged " << files.size() << " files, " << acc.nb_samples
+            << " spp." << std::endl;
+
+  const std::string& out = options.out;
+  bool written;
+  if (utils::hasExtension(out, ".acc"))
+    written = image::writeAccumulation(out, acc);
+  else {
+    const float scale = 1.0f / std::max<uint64_t>(acc.nb_samples, 1);
+    for (auto& v : acc.rgb) v *= scale;
+    written = image::writeEXR(out, acc.width, acc.height, &acc.rgb[0]);
   }
 
-  return scenes;
+  if (!written)
+    std::cerr << "artracer: failed to write `" << out << "'." << std::endl;
+  return written ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int
 main(int argc, char* argv[])
 {
-  if (argc < 3) {
+  std::vector<std::string> args;
+  Options options = parseOptions(argc, argv, args);
+
+  if (options.merge) {
+    if (args.empty()) {
+      std::cerr << "artracer: missing accumulation argument." << std::endl;
+      return 1;
+    }
+    return mergeAccumulations(options, args);
+  }
+
+  if (options.benchmark) {
+    if (args.empty()) {
+      std::cerr << "artracer: missing asset folder argument." << std::endl;
+      return 1;
+    }
+
+    benchmark::Settings settings;
+    settings.asset_folder = args[0];
+    if (args.size() > 1)
+      settings.scenes.assign(args.begin() + 1, args.end());
+    if (!options.sizes.empty())
+      settings.resolutions = options.sizes;
+    if (options.spp > 0)
+      settings.spp = options.spp;
+    settings.references = options.references;
+    settings.update_references = options.update_references;
+    settings.report = options.report;
+    return benchmark::run(settings);
+  }
+
+  if (args.size() < 2) {
     std::cerr << "artracer: missing scene argument.\n";
-    std::cerr << "usage: artracer ASSET_FOLDER [SCENE 1] [SCENE2] ..."
+    std::cerr << "usage: artracer [--indexed] [--rgba8] [--vram-budget=MB] "
+                 "[--geometry-cache=MB]\n"
+                 "                [--gpus=N] [--pipelined] "
+                 "[--sampler=sobol|rank1|random]\n"
+                 "                [--profile=FILE.json] "
+                 "[--accumulation=float3|float4|half]\n"
+                 "                [--output=rgba8|rgba16f] "
+                 "[--stream=PORT] [--codec=h264|hevc]\n"
+                 "                [--bitrate=MBPS] [--watch] "
+                 "[--cubemap=rgba32f|rgba16f]\n"
+                 "                ASSET_FOLDER [SCENE 1] [SCENE2] ...\n"
+                 "       artracer --headless [--spp N] [--time SECONDS] "
+                 "[--out FILE.exr|FILE.acc|FILE.png]\n"
+                 "                [--node=K/N] [--sample-offset=S] "
+                 "ASSET_FOLDER SCENE\n"
+                 "       artracer --headless --turntable=N [--spp N] "
+                 "[--out FILE.exr|FILE.acc] ASSET_FOLDER SCENE\n"
+                 "       artracer --merge [--out FILE.exr|FILE.acc] "
+                 "PARTIAL.acc ...\n"
+                 "       artracer --benchmark [--spp N] [--size=WxH,...] "
+                 "[--report=FILE.json]\n"
+                 "                [--references=DIR] [--update-references] "
+                 "ASSET_FOLDER [SCENE] ..."
               << std::endl;
     return 1;
   }
 
-  constexpr int ASSET_FOLDER_IDX = 1;
   constexpr int WINDOW_W = 960;
   constexpr int WINDOW_H = 540;
 
+  if (options.headless)
+    return renderHeadless(options, args, WINDOW_W, WINDOW_H);
+
   GLFWwindow* window;
   glfw_init(&window, WINDOW_W, WINDOW_H);
 
@@ -152,23 +753,38 @@ main(int argc, char* argv[])
   glfwSetKeyCallback(window, glfw_key_callback);
   glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
 
-  auto asset_folder = argv[ASSET_FOLDER_IDX];
-  auto scenes = buildScenesList(argc, argv, ASSET_FOLDER_IDX + 1);
+  auto asset_folder = args[0];
+  std::vector<std::string> scenes(args.begin() + 1, args.end());
   // Creates the processor in charge of loading the assets, by creating
   // the scenes from the command line, and running the kernel each loop.
   processor::GPUProcessor processor(asset_folder, scenes, WINDOW_W, WINDOW_H);
+  processor.setIndexed(options.indexed);
+  processor.setRGBA8Textures(options.rgba8);
+  processor.setHalfCubemaps(options.half_cubemaps);
+  processor.setAccumulationFormat(options.accumulation);
+  processor.setOutputFormat(options.output);
+  processor.setVRAMBudget(options.vram_budget);
+  processor.setGeometryCache(options.geometry_cache);
+  processor.setGPUCount(options.gpus);
+  processor.setPipelined(options.pipelined);
+  processor.setSamplerId(options.sampler);
+  processor.setHotReload(options.watch);
   processor.init(); // This will upload the data.
   glfwSetWindowUserPointer(window, &processor);
 
+  // The window keeps rendering when the stream cannot start.
+  remote::StreamServer server;
+  if (options.stream_port && !startStream(options, processor, server))
+    std::cerr << "artracer: streaming is disabled." << std::endl;
+
   const auto& interop = processor.getInterop();
+  const std::string profile_path =
+    options.profile.empty() ? "profile.json" : options.profile;
   double last_time = 0.0;
   double curr_time = 0.0;
   double delta = 0.0;
   double elapsed = 0.0;
 
-  // Binds post processing functions from the Kernel to the host
-  setupFunctionTables();
-
   while (!glfwWindowShouldClose(window)) {
     curr_time = glfwGetTime();
     delta = curr_time - last_time;
@@ -178,6 +794,9 @@ main(int argc, char* argv[])
     ////      Update      //////
     ////////////////////////////
 
+    if (!applyRemoteInput(server, processor))
+      glfwSetWindowShouldClose(window, GLFW_TRUE);
+
     processor.update(delta);
     // Binds data to GUI.
     gui::GUIManager::inst()->begin();
@@ -186,7 +805,18 @@ main(int argc, char* argv[])
       processor.getSceneItems(), processor.getCubemapItems());
     gui::GUIManager::inst()->postProcess(processor.getPostProcessId(),
                                          processor.getPostProcessItems());
+    gui::GUIManager::inst()->kernel(processor.getKernelId(),
+                                    processor.getKernelItems(),
+                                    processor.getSamplerId(),
+                                    processor.getSamplerItems(),
+                                    processor.getReprojection(),
+                                    processor.getDenoise(),
+                                    processor.getAdaptive(),
+                                    processor.getRayReordering(),
+                                    processor.getDynamicResolution(),
+                                    processor.getFrameTarget());
     gui::GUIManager::inst()->camera(processor.getCamera(), 0);
+    gui::GUIManager::inst()->profiler(processor.getProfiler(), profile_path);
 
     if (g_mouse_trapped)
       glfwSetCursorPos(window, (double)interop.half_width(),
@@ -199,12 +829,19 @@ main(int argc, char* argv[])
     ////////////////////////////
 
     processor.render();
+    // The client gets the frame without the GUI.
+    server.send(processor.getVideoPacket());
     gui::GUIManager::inst()->render();
 
     glfwSwapBuffers(window);
     glfwPollEvents();
   }
 
+  if (!options.profile.empty() &&
+      !processor.getProfiler().writeJSON(options.profile))
+    std::cerr << "artracer: failed to write `" << options.profile << "'."
+              << std::endl;
+
   processor.release();
 
   gui::GUIManager::inst()->release();
@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <cfloat>
+
+#include <scene/bvh.h>
+#include <shaders/cutils_math.h>
+
+namespace scene {
+namespace bvh {
+namespace {
+constexpr unsigned int NB_BINS = 16;
+constexpr unsigned int MAX_LEAF_SIZE = 4;
+constexpr float TRAVERSAL_COST = 1.0f;
+constexpr float INTERSECTION_COST = 1.0f;
+
+inline float
+area(const AABB& box)
+{
+  float3 d = box.max - box.min;
+  if (d.x < 0.0f || d.y < 0.0f || d.z < 0.0f)
+    return 0.0f;
+
+  return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+inline float
+axis(const float3& v, int a)
+{
+  return a == 0 ? v.x : (a == 1 ? v.y : v.z);
+}
+
+inline unsigned int
+binIndex(const float3& centroid, int a, float c_min, float scale)
+{
+  unsigned int b = (unsigned int)((axis(centroid, a) - c_min) * scale);
+  return std::min(NB_BINS - 1, b);
+}
+
+struct Bin
+{
+  AABB box = emptyBox();
+  unsigned int count = 0;
+};
+
+/// <summary>
+/// Recursively builds the subtree of the node `node_id', containing
+/// the primitives referenced by `order[begin, end['.
+/// </summary>
+void
+buildNode(unsigned int node_id, unsigned int begin, unsigned int end,
+          int depth, const std::vector<AABB>& boxes,
+          const std::vector<float3>& centroids, std::vector<BVHNode>& nodes,
+          std::vector<unsigned int>& order)
+{
+  AABB box = emptyBox();
+  AABB centroid_box = emptyBox();
+  for (unsigned int i = begin; i < end; ++i) {
+    grow(box, boxes[order[i]]);
+    grow(centroid_box, centroids[order[i]]);
+  }
+
+  nodes[node_id].min = box.min;
+  nodes[node_id].max = box.max;
+
+  const unsigned int nb_prims = end - begin;
+  if (nb_prims <= MAX_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1) {
+    nodes[node_id].left = begin;
+    nodes[node_id].right = -(int)nb_prims;
+    return;
+  }
+
+  // Looks for the best split plane among every bin boundaries,
+  // on each of the three axis.
+  float best_cost = FLT_MAX;
+  int best_axis = -1;
+  unsigned int best_split = 0;
+
+  for (int a = 0; a < 3; ++a) {
+    float c_min = axis(centroid_box.min, a);
+    float c_max = axis(centroid_box.max, a);
+    if (c_max - c_min <= 0.0f)
+      continue;
+
+    Bin bins[NB_BINS];
+    float scale = NB_BINS / (c_max - c_min);
+    for (unsigned int i = begin; i < end; ++i) {
+      unsigned int b = binIndex(centroids[order[i]], a, c_min, scale);
+      bins[b].count++;
+      grow(bins[b].box, boxes[order[i]]);
+    }
+
+    // Sweeps from the right to compute the right side areas,
+    // and then sweeps from the left to evaluate each split.
+    float right_area[NB_BINS];
+    unsigned int right_count[NB_BINS];
+    AABB acc = emptyBox();
+    unsigned int count = 0;
+    for (unsigned int b = NB_BINS - 1; b > 0; --b) {
+      grow(acc, bins[b].box);
+      count += bins[b].count;
+      right_area[b] = area(acc);
+      right_count[b] = count;
+    }
+
+    acc = emptyBox();
+    count = 0;
+    for (unsigned int b = 0; b < NB_BINS - 1; ++b) {
+      grow(acc, bins[b].box);
+      count += bins[b].count;
+      float cost = count * area(acc) + right_count[b + 1] * right_area[b + 1];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = a;
+        best_split = b + 1;
+      }
+    }
+  }
+
+  unsigned int mid = begin + nb_prims / 2;
+  if (best_axis >= 0) {
+    float leaf_cost = nb_prims * INTERSECTION_COST;
+    best_cost = TRAVERSAL_COST +
+                INTERSECTION_COST * best_cost / std::max(area(box), FLT_MIN);
+
+    float c_min = axis(centroid_box.min, best_axis);
+    float scale = NB_BINS / (axis(centroid_box.max, best_axis) - c_min);
+
+    auto* it =
+      std::partition(&order[begin], &order[0] + end, [&](unsigned int p) {
+        return binIndex(centroids[p], best_axis, c_min, scale) < best_split;
+      });
+    mid = (unsigned int)(it - &order[0]);
+
+    // Splitting is not worth it, the node stays a leaf.
+    if (best_cost >= leaf_cost && nb_prims <= 4 * MAX_LEAF_SIZE) {
+      nodes[node_id].left = begin;
+      nodes[node_id].right = -(int)nb_prims;
+      return;
+    }
+  }
+
+  // Every centroids are at the same position, or the binning
+  // failed to separate them: falls back to a median split.
+  if (mid == begin || mid == end)
+    mid = begin + nb_prims / 2;
+
+  // Children are allocated next to each other, which is
+  // slightly friendlier for the cache during traversal.
+  unsigned int left = nodes.size();
+  nodes.emplace_back();
+  nodes.emplace_back();
+
+  nodes[node_id].left = left;
+  nodes[node_id].right = left + 1;
+
+  buildNode(left, begin, mid, depth + 1, boxes, centroids, nodes, order);
+  buildNode(left + 1, mid, end, depth + 1, boxes, centroids, nodes, order);
+}
+}
+
+AABB
+emptyBox()
+{
+  return { make_float3(FLT_MAX), make_float3(-FLT_MAX) };
+}
+
+void
+grow(AABB& box, const float3& p)
+{
+  box.min = make_float3(std::min(box.min.x, p.x), std::min(box.min.y, p.y),
+                        std::min(box.min.z, p.z));
+  box.max = make_float3(std::max(box.max.x, p.x), std::max(box.max.y, p.y),
+                        std::max(box.max.z, p.z));
+}
+
+void
+grow(AABB& box, const AABB& b)
+{
+  box.min = make_float3(std::min(box.min.x, b.min.x),
+                        std::min(box.min.y, b.min.y),
+                        std::min(box.min.z, b.min.z));
+  box.max = make_float3(std::max(box.max.x, b.max.x),
+                        std::max(box.max.y, b.max.y),
+                        std::max(box.max.z, b.max.z));
+}
+
+void
+build(const std::vector<AABB>& boxes, std::vector<BVHNode>& out_nodes,
+      std::vector<unsigned int>& out_order)
+{
+  out_nodes.clear();
+  out_order.resize(boxes.size());
+
+  if (boxes.size() == 0)
+    return;
+
+  std::vector<float3> centroids(boxes.size());
+  for (size_t i = 0; i < boxes.size(); ++i) {
+    centroids[i] = (boxes[i].min + boxes[i].max) * 0.5f;
+    out_order[i] = i;
+  }
+
+  // A binary tree with leaves of at least one primitive
+  // can not have more than 2N - 1 nodes.
+  out_nodes.reserve(2 * boxes.size() - 1);
+  out_nodes.emplace_back();
+
+  buildNode(0, 0, boxes.size(), 0, boxes, centroids, out_nodes, out_order);
+}
+} // namespace bvh
+} // namespace scene
@@ -0,0 +1,296 @@
+#include <cuda_fp16.h>
+#include <cuda_runtime.h>
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <driver/cuda_helper.h>
+#include <scene/cubemap.h>
+#include <scene/environment.h>
+#include <shaders/cubemap.cuh>
+
+namespace scene {
+namespace cubemap {
+namespace {
+constexpr unsigned int NB_FACES = 6;
+constexpr unsigned int BLOCK_SIZE = 16;
+constexpr float PI = 3.14159265358979f;
+
+/// <summary>
+/// Largest finite fp16 value, HDR texels being clamped to it.
+/// </summary>
+constexpr float HALF_MAX = 65504.0f;
+
+/// <summary>
+/// Taps per side of the filter of a prefiltered level, spread over one and
+/// a half of its texels.
+/// </summary>
+constexpr int FILTER_TAPS = 4;
+
+enum Layout
+{
+  LAYOUT_CROSS = 0,
+  LAYOUT_EQUIRECT
+};
+
+/// <summary>
+/// Position of the faces (+x, -x, +y, -y, +z, -z) in a cube cross, in
+/// faces.
+/// </summary>
+__constant__ int2 CROSS_OFFSETS[NB_FACES] = { { 2, 1 }, { 0, 1 }, { 1, 0 },
+                                              { 1, 2 }, { 1, 1 }, { 3, 1 } };
+
+/// <summary>
+/// Environment image copied to the GPU.
+/// </summary>
+struct Image
+{
+  const float* pixels;
+  unsigned int width;
+  unsigned int height;
+  unsigned int nb_chan;
+};
+
+__device__ inline float4
+fetchPixel(const Image& image, unsigned int x, unsigned int y)
+{
+  const float* p = image.pixels + ((size_t)y * image.width + x) * image.nb_chan;
+  if (image.nb_chan < 3)
+    return make_float4(p[0], p[0], p[0], 0.0f);
+  return make_float4(p[0], p[1], p[2], 0.0f);
+}
+
+/// <summary>
+/// Bilinearly samples a panorama in the direction `c', given in the space
+/// of cubemap fetches. The panorama wraps around horizontally, and its top
+/// row looks up.
+/// </summary>
+__device__ inline float4
+sampleEquirect(const Image& image, const float3& c)
+{
+  // Cubemap fetches are made with a flipped z axis.
+  const float3 dir = normalize(make_float3(c.x, c.y, -c.z));
+  const float u = 0.5f + atan2f(dir.x, -dir.z) / (2.0f * PI);
+  const float v = acosf(fminf(fmaxf(dir.y, -1.0f), 1.0f)) / PI;
+
+  const float x = u * image.width - 0.5f;
+  const float y = fminf(fmaxf(v * image.height - 0.5f, 0.0f),
+                        (float)(image.height - 1));
+  const float fx = x - floorf(x);
+  const float fy = y - floorf(y);
+  const int w = image.width;
+  const unsigned int x0 = (((int)floorf(x) % w) + w) % w;
+  const unsigned int x1 = (x0 + 1) % w;
+  const unsigned int y0 = (unsigned int)y;
+  const unsigned int y1 = min(y0 + 1, image.height - 1);
+
+  const float4 top = lerp(fetchPixel(image, x0, y0), fetchPixel(image, x1, y0),
+                          fx);
+  const float4 bottom =
+    lerp(fetchPixel(image, x0, y1), fetchPixel(image, x1, y1), fx);
+  return lerp(top, bottom, fy);
+}
+
+__device__ inline void
+writeTexel(cudaSurfaceObject_t surface, bool half_float, unsigned int x,
+           unsigned int y, unsigned int face, const float4& texel)
+{
+  if (!half_float) {
+    surfCubemapwrite(texel, surface, x * sizeof(float4), y, face);
+    return;
+  }
+
+  const ushort4 bits =
+    make_ushort4(__half_as_ushort(__float2half_rn(fminf(texel.x, HALF_MAX))),
+                 __half_as_ushort(__float2half_rn(fminf(texel.y, HALF_MAX))),
+                 __half_as_ushort(__float2half_rn(fminf(texel.z, HALF_MAX))),
+                 __half_as_ushort(__float2half_rn(fminf(texel.w, HALF_MAX))));
+  surfCubemapwrite(bits, surface, x * sizeof(ushort4), y, face);
+}
+
+/// <summary>
+/// Writes the first level of the cubemap, one thread per texel, and the
+/// float texels the distribution is built from.
+/// </summary>
+__global__ void
+facesKernel(Image image, Layout layout, unsigned int size,
+            cudaSurfaceObject_t surface, bool half_float, float4* out_texels)
+{
+  const unsigned int x = blockIdx.x * blockDim.x + threadIdx.x;
+  const unsigned int y = blockIdx.y * blockDim.y + threadIdx.y;
+  const unsigned int face = blockIdx.z;
+  if (x >= size || y >= size)
+    return;
+
+  float4 texel;
+  if (layout == LAYOUT_CROSS) {
+    const int2 offset = CROSS_OFFSETS[face];
+    texel = fetchPixel(image, offset.x * size + x, offset.y * size + y);
+  } else {
+    const float s = 2.0f * (x + 0.5f) / size - 1.0f;
+    const float t = 2.0f * (y + 0.5f) / size - 1.0f;
+    texel = sampleEquirect(image, cubemapDirection(face, s, t));
+  }
+
+  out_texels[((size_t)face * size + y) * size + x] = texel;
+  writeTexel(surface, half_float, x, y, face, texel);
+}
+
+/// <summary>
+/// Writes a level of `size' texels per side, filtering the previous one
+/// with a tent of taps weighted by their solid angle. Taps are made in
+/// direction, so that the ones past an edge of a face read the next face.
+/// </summary>
+__global__ void
+filterKernel(cudaTextureObject_t source, float source_level,
+             unsigned int size, cudaSurfaceObject_t surface, bool half_float)
+{
+  const unsigned int x = blockIdx.x * blockDim.x + threadIdx.x;
+  const unsigned int y = blockIdx.y * blockDim.y + threadIdx.y;
+  const unsigned int face = blockIdx.z;
+  if (x >= size || y >= size)
+    return;
+
+  float4 sum = make_float4(0.0f);
+  float total = 0.0f;
+  for (int j = 0; j < FILTER_TAPS; ++j) {
+    for (int i = 0; i < FILTER_TAPS; ++i) {
+      const float du = (i + 0.5f) / FILTER_TAPS * 2.0f - 1.0f;
+      const float dv = (j + 0.5f) / FILTER_TAPS * 2.0f - 1.0f;
+      const float s = 2.0f * (x + 0.5f + du * 0.75f) / size - 1.0f;
+      const float t = 2.0f * (y + 0.5f + dv * 0.75f) / size - 1.0f;
+
+      const float d2 = 1.0f + s * s + t * t;
+      const float weight =
+        (1.0f - 0.5f * fabsf(du)) * (1.0f - 0.5f * fabsf(dv)) *
+        rsqrtf(d2 * d2 * d2);
+      const float3 c = cubemapDirection(face, s, t);
+      sum += texCubemapLod<float4>(source, c.x, c.y, c.z, source_level) *
+             weight;
+      total += weight;
+    }
+  }
+  writeTexel(surface, half_float, x, y, face, sum / total);
+}
+
+cudaSurfaceObject_t
+createSurface(cudaMipmappedArray_t array, unsigned int level)
+{
+  cudaArray_t level_array;
+  cudaGetMipmappedArrayLevel(&level_array, array, level);
+  cudaThrowError();
+
+  cudaResourceDesc res_desc;
+  std::memset(&res_desc, 0, sizeof(res_desc));
+  res_desc.resType = cudaResourceTypeArray;
+  res_desc.res.array.array = level_array;
+
+  cudaSurfaceObject_t surface = 0;
+  cudaCreateSurfaceObject(&surface, &res_desc);
+  cudaThrowError();
+  return surface;
+}
+
+dim3
+levelBlocks(unsigned int size)
+{
+  return dim3((size + BLOCK_SIZE - 1) / BLOCK_SIZE,
+              (size + BLOCK_SIZE - 1) / BLOCK_SIZE, NB_FACES);
+}
+}
+
+bool
+create(const float* pixels, unsigned int width, unsigned int height,
+       unsigned int nb_chan, bool half_float, Cubemap& out,
+       cudaStream_t stream)
+{
+  Layout layout;
+  unsigned int size;
+  if (width * 3 == height * 4 && width >= 4) {
+    layout = LAYOUT_CROSS;
+    size = width / 4;
+  } else if (width == height * 2) {
+    layout = LAYOUT_EQUIRECT;
+    size = std::max(1u, width / 4);
+  } else
+    return false;
+
+  unsigned int nb_levels = 1;
+  while ((size >> nb_levels) > 0) ++nb_levels;
+
+  out.cubemap_desc = half_float ? cudaCreateChannelDescHalf4()
+                                : cudaCreateChannelDesc<float4>();
+  cudaMallocMipmappedArray(&out.cubemap, &out.cubemap_desc,
+                           make_cudaExtent(size, size, NB_FACES), nb_levels,
+                           cudaArrayCubemap | cudaArraySurfaceLoadStore);
+  cudaThrowError();
+
+  cudaResourceDesc res_desc;
+  std::memset(&res_desc, 0, sizeof(res_desc));
+  res_desc.resType = cudaResourceTypeMipmappedArray;
+  res_desc.res.mipmap.mipmap = out.cubemap;
+
+  cudaTextureDesc tex_desc;
+  std::memset(&tex_desc, 0, sizeof(tex_desc));
+  tex_desc.addressMode[0] = cudaAddressModeWrap;
+  tex_desc.addressMode[1] = cudaAddressModeWrap;
+  tex_desc.filterMode = cudaFilterModeLinear;
+  tex_desc.mipmapFilterMode = cudaFilterModeLinear;
+  tex_desc.readMode = cudaReadModeElementType;
+  tex_desc.normalizedCoords = 1;
+  tex_desc.maxMipmapLevelClamp = (float)(nb_levels - 1);
+
+  cudaCreateTextureObject(&out.tex, &res_desc, &tex_desc, nullptr);
+  cudaThrowError();
+
+  // Only the image goes through the bus, the faces are made on the GPU.
+  const size_t image_size = (size_t)width * height * nb_chan * sizeof(float);
+  float* d_pixels = nullptr;
+  float4* d_texels = nullptr;
+  cudaMalloc(&d_pixels, image_size);
+  cudaMalloc(&d_texels, (size_t)NB_FACES * size * size * sizeof(float4));
+  cudaThrowError();
+  cudaMemcpyAsync(d_pixels, pixels, image_size, cudaMemcpyHostToDevice,
+                  stream);
+
+  const Image image = { d_pixels, width, height, nb_chan };
+  const dim3 threads(BLOCK_SIZE, BLOCK_SIZE);
+  cudaSurfaceObject_t surface = createSurface(out.cubemap, 0);
+  facesKernel<<<levelBlocks(size), threads, 0, stream>>>(
+    image, layout, size, surface, half_float, d_texels);
+  cudaThrowError();
+  cudaStreamSynchronize(stream);
+  cudaDestroySurfaceObject(surface);
+  cudaFree(d_pixels);
+
+  // Each level is filtered from the previous one, read through the
+  // texture while the next one is written.
+  for (unsigned int l = 1; l < nb_levels; ++l) {
+    const unsigned int level_size = size >> l;
+    surface = createSurface(out.cubemap, l);
+    filterKernel<<<levelBlocks(level_size), threads, 0, stream>>>(
+      out.tex, (float)(l - 1), level_size, surface, half_float);
+    cudaThrowError();
+    cudaStreamSynchronize(stream);
+    cudaDestroySurfaceObject(surface);
+  }
+
+  // Allows to importance sample the cubemap from the renderer.
+  out.distribution = environment::build(&d_texels[0].x, size, stream);
+  cudaFree(d_texels);
+  return true;
+}
+
+void
+release(Cubemap& cubemap)
+{
+  cudaDestroyTextureObject(cubemap.tex);
+  cudaFreeMipmappedArray(cubemap.cubemap);
+  environment::release(cubemap.distribution);
+  cubemap.tex = 0;
+  cubemap.cubemap = nullptr;
+}
+} // namespace cubemap
+} // namespace scene
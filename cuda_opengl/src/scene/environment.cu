@@ -0,0 +1,124 @@
+#include <cuda_runtime.h>
+
+#include <sstream>
+#include <stdexcept>
+
+#include <thrust/device_ptr.h>
+#include <thrust/execution_policy.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
+#include <thrust/scan.h>
+
+#include <driver/cuda_helper.h>
+#include <scene/environment.h>
+
+namespace scene {
+namespace environment {
+namespace {
+constexpr unsigned int NB_THREADS = 256;
+constexpr unsigned int NB_FACES = 6;
+constexpr unsigned int NB_COMP = 4;
+
+inline unsigned int
+nbBlocks(unsigned int nb_elt)
+{
+  return (nb_elt + NB_THREADS - 1) / NB_THREADS;
+}
+
+/// <summary>
+/// Gives the row of a texel, used as the key of the scan
+/// computing the CDF of each row.
+/// </summary>
+struct RowOf
+{
+  unsigned int size;
+
+  __host__ __device__ unsigned int operator()(unsigned int i) const
+  {
+    return i / size;
+  }
+};
+
+__global__ void
+weightsKernel(const float* texels, unsigned int size, float* weights)
+{
+  const unsigned int nb_texels = NB_FACES * size * size;
+  const unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= nb_texels)
+    return;
+
+  const float* texel = texels + i * NB_COMP;
+  float luminance =
+    0.2126f * texel[0] + 0.7152f * texel[1] + 0.0722f * texel[2];
+
+  // Solid angle covered by the texel, up to a constant factor.
+  float s = 2.0f * ((i % size) + 0.5f) / size - 1.0f;
+  float t = 2.0f * (((i / size) % size) + 0.5f) / size - 1.0f;
+  float d2 = 1.0f + s * s + t * t;
+  float solid_angle = rsqrtf(d2 * d2 * d2);
+
+  weights[i] = fmaxf(luminance, 0.0f) * solid_angle;
+}
+
+__global__ void
+rowTotalsKernel(const float* conditional, unsigned int size, float* marginal)
+{
+  const unsigned int row = blockIdx.x * blockDim.x + threadIdx.x;
+  if (row >= NB_FACES * size)
+    return;
+
+  marginal[row] = conditional[row * size + size - 1];
+}
+}
+
+EnvironmentDistribution
+build(const float* texels, unsigned int size, cudaStream_t stream)
+{
+  EnvironmentDistribution distribution;
+  distribution.size = size;
+  distribution.total = 0.0f;
+
+  const unsigned int nb_rows = NB_FACES * size;
+  const unsigned int nb_texels = nb_rows * size;
+
+  cudaMalloc(&distribution.conditional, nb_texels * sizeof(float));
+  cudaMalloc(&distribution.marginal, nb_rows * sizeof(float));
+  cudaThrowError();
+
+  weightsKernel<<<nbBlocks(nb_texels), NB_THREADS, 0, stream>>>(
+    texels, size, distribution.conditional);
+  cudaThrowError();
+
+  // CDF of each row, then CDF of the rows from their totals.
+  auto policy = thrust::cuda::par.on(stream);
+  auto keys = thrust::make_transform_iterator(
+    thrust::make_counting_iterator(0u), RowOf{ size });
+  thrust::device_ptr<float> conditional(distribution.conditional);
+  thrust::inclusive_scan_by_key(policy, keys, keys + nb_texels, conditional,
+                                conditional);
+
+  rowTotalsKernel<<<nbBlocks(nb_rows), NB_THREADS, 0, stream>>>(
+    distribution.conditional, size, distribution.marginal);
+  cudaThrowError();
+
+  thrust::device_ptr<float> marginal(distribution.marginal);
+  thrust::inclusive_scan(policy, marginal, marginal + nb_rows, marginal);
+
+  cudaMemcpyAsync(&distribution.total, distribution.marginal + nb_rows - 1,
+                  sizeof(float), cudaMemcpyDeviceToHost, stream);
+  cudaStreamSynchronize(stream);
+  cudaThrowError();
+  return distribution;
+}
+
+void
+release(EnvironmentDistribution& distribution)
+{
+  cudaFree(distribution.conditional);
+  cudaFree(distribution.marginal);
+  distribution.conditional = nullptr;
+  distribution.marginal = nullptr;
+  distribution.total = 0.0f;
+}
+} // namespace environment
+} // namespace scene
@@ -0,0 +1,308 @@
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+#include <driver/cuda_helper.h>
+#include <driver/device_arena.h>
+
+#include <scene/geometry_stream.h>
+
+namespace scene {
+namespace {
+/// <summary>
+/// Bytes paged in after a frame at most, so that a camera turning towards
+/// new geometry does not stall the next frame behind a large copy.
+/// </summary>
+constexpr size_t MAX_PAGE_IN = 64 << 20;
+
+/// <summary>
+/// Moves a buffer from the range starting at `from' to the same offset of
+/// the range starting at `to'.
+/// </summary>
+template <typename T>
+void
+rebase(Buffer<T>& buffer, const char* from, char* to)
+{
+  if (buffer.data)
+    buffer.data = reinterpret_cast<T*>(
+      to + (reinterpret_cast<const char*>(buffer.data) - from));
+}
+
+Mesh
+rebase(Mesh mesh, const char* from, char* to)
+{
+  rebase(mesh.triangles, from, to);
+  rebase(mesh.faces, from, to);
+  rebase(mesh.indices, from, to);
+  rebase(mesh.positions, from, to);
+  rebase(mesh.normals, from, to);
+  rebase(mesh.texcoords, from, to);
+  rebase(mesh.bvh, from, to);
+  return mesh;
+}
+}
+
+GeometryStream::GeometryStream()
+  : _host(nullptr)
+  , _cache(nullptr)
+  , _capacity(0)
+  , _d_meshes(nullptr)
+  , _d_states(nullptr)
+  , _h_states(nullptr)
+  , _states_read(nullptr)
+  , _pending(false)
+  , _frame(0)
+{
+}
+
+void
+GeometryStream::init(const std::vector<size_t>& sizes, size_t capacity)
+{
+  release();
+
+  _pages.resize(sizes.size());
+  size_t total = 0;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    Page& page = _pages[i];
+    page.host_offset = total;
+    page.size = driver::DeviceArena::alignedSize(sizes[i]);
+    page.cache_offset = 0;
+    page.resident = false;
+    page.last_use = 0;
+    total += page.size;
+  }
+
+  cudaHostAlloc(&_host, std::max<size_t>(total, 1), cudaHostAllocMapped);
+  cudaThrowError();
+
+  _capacity = driver::DeviceArena::alignedSize(capacity);
+  cudaMalloc(&_cache, _capacity);
+  cudaThrowError();
+  _free[0] = _capacity;
+
+  cudaHostAlloc(&_h_states, std::max<size_t>(sizes.size(), 1) *
+                              sizeof(unsigned int),
+                cudaHostAllocDefault);
+  cudaEventCreateWithFlags(&_states_read, cudaEventDisableTiming);
+  cudaThrowError();
+}
+
+char*
+GeometryStream::hostRange(unsigned int mesh_id) const
+{
+  return _host + _pages[mesh_id].host_offset;
+}
+
+void
+GeometryStream::bind(const std::vector<Mesh>& meshes, Mesh* d_meshes,
+                     unsigned int* d_states)
+{
+  _host_meshes = meshes;
+  _table = meshes;
+  _d_meshes = d_meshes;
+  _d_states = d_states;
+  _pending = false;
+}
+
+void
+GeometryStream::update(cudaStream_t stream)
+{
+  if (!_host || _pages.empty())
+    return;
+
+  ++_frame;
+
+  // The states read back after a previous frame are only handled once
+  // they arrived, without waiting for the frames queued since. Handling
+  // them resets the states on the stream, so the next read back is only
+  // issued by the following call: it then observes the marks of the frames
+  // queued between the two calls, instead of the reset values.
+  if (_pending) {
+    if (cudaEventQuery(_states_read) == cudaErrorNotReady)
+      return;
+    _pending = false;
+    process(stream);
+    return;
+  }
+
+  cudaMemcpyAsync(_h_states, _d_states, _pages.size() * sizeof(unsigned int),
+                  cudaMemcpyDeviceToHost, stream);
+  cudaEventRecord(_states_read, stream);
+  cudaThrowError();
+  _pending = true;
+}
+
+void
+GeometryStream::process(cudaStream_t stream)
+{
+  std::vector<unsigned int> requested;
+  for (size_t i = 0; i < _pages.size(); ++i) {
+    if (_h_states[i] == MESH_USED)
+      _pages[i].last_use = _frame;
+    else if (_h_states[i] == MESH_REQUESTED)
+      requested.push_back(i);
+  }
+
+  // The first page-in of a frame is always made, so that meshes larger
+  // than the budget still get in. Meshes that do not fit are skipped for
+  // smaller ones, and requested again by the next frames.
+  size_t budget = MAX_PAGE_IN;
+  bool first = true;
+  for (unsigned int id : requested) {
+    if (!first && _pages[id].size > budget)
+      continue;
+    if (pageIn(id, stream)) {
+      budget -= std::min(budget, _pages[id].size);
+      first = false;
+    }
+  }
+
+  // Every state is written back, so that the meshes used by the next frames
+  // are marked again. Marks made by the frames queued since the read back
+  // are lost, and made again by the following ones.
+  for (size_t i = 0; i < _pages.size(); ++i)
+    _h_states[i] = _pages[i].resident ? MESH_RESIDENT : MESH_PAGED_OUT;
+  cudaMemcpyAsync(_d_states, _h_states, _pages.size() * sizeof(unsigned int),
+                  cudaMemcpyHostToDevice, stream);
+
+  // Pageable copies are staged before returning, the table can change.
+  if (!requested.empty())
+    cudaMemcpyAsync(_d_meshes, &_table[0], _table.size() * sizeof(Mesh),
+                    cudaMemcpyHostToDevice, stream);
+  cudaThrowError();
+}
+
+bool
+GeometryStream::pageIn(unsigned int mesh_id, cudaStream_t stream)
+{
+  Page& page = _pages[mesh_id];
+  if (page.size > _capacity)
+    return false;
+
+  // Empty meshes have nothing to copy.
+  if (page.size == 0) {
+    page.resident = true;
+    return true;
+  }
+
+  size_t offset;
+  while (!allocate(page.size, offset)) {
+    int lru = -1;
+    for (size_t i = 0; i < _pages.size(); ++i) {
+      if (_pages[i].resident && _pages[i].last_use < _frame &&
+          (lru < 0 || _pages[i].last_use < _pages[lru].last_use))
+        lru = i;
+    }
+    // Everything resident is in use, the mesh stays on the host.
+    if (lru < 0)
+      return false;
+    pageOut(lru);
+  }
+
+  // Frames are queued on the same stream, the previous ones are done with
+  // the meshes paged out before the copy overwrites them.
+  cudaMemcpyAsync(_cache + offset, _host + page.host_offset, page.size,
+                  cudaMemcpyHostToDevice, stream);
+  cudaThrowError();
+
+  page.cache_offset = offset;
+  page.resident = true;
+  page.last_use = _frame;
+  _table[mesh_id] =
+    rebase(_host_meshes[mesh_id], _host + page.host_offset, _cache + offset);
+  return true;
+}
+
+void
+GeometryStream::pageOut(unsigned int mesh_id)
+{
+  Page& page = _pages[mesh_id];
+  if (page.size)
+    free(page.cache_offset, page.size);
+  page.resident = false;
+  _table[mesh_id] = _host_meshes[mesh_id];
+}
+
+void
+GeometryStream::invalidate()
+{
+  if (!_host || _pages.empty())
+    return;
+
+  cudaDeviceSynchronize();
+  for (size_t i = 0; i < _pages.size(); ++i) {
+    if (_pages[i].resident)
+      pageOut(i);
+    _h_states[i] = MESH_PAGED_OUT;
+  }
+  _pending = false;
+
+  cudaMemcpy(_d_states, _h_states, _pages.size() * sizeof(unsigned int),
+             cudaMemcpyHostToDevice);
+  cudaMemcpy(_d_meshes, &_table[0], _table.size() * sizeof(Mesh),
+             cudaMemcpyHostToDevice);
+  cudaThrowError();
+}
+
+bool
+GeometryStream::allocate(size_t size, size_t& out_offset)
+{
+  for (auto it = _free.begin(); it != _free.end(); ++it) {
+    if (it->second < size)
+      continue;
+
+    out_offset = it->first;
+    if (it->second > size)
+      _free[it->first + size] = it->second - size;
+    _free.erase(it);
+    return true;
+  }
+  return false;
+}
+
+void
+GeometryStream::free(size_t offset, size_t size)
+{
+  // Merges the range with its free neighbours.
+  auto next = _free.lower_bound(offset);
+  if (next != _free.end() && offset + size == next->first) {
+    size += next->second;
+    next = _free.erase(next);
+  }
+  if (next != _free.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      prev->second += size;
+      return;
+    }
+  }
+  _free[offset] = size;
+}
+
+void
+GeometryStream::release()
+{
+  if (_states_read) {
+    // The last read back may still be writing the states.
+    cudaEventSynchronize(_states_read);
+    cudaEventDestroy(_states_read);
+  }
+  cudaFreeHost(_h_states);
+  cudaFree(_cache);
+  cudaFreeHost(_host);
+
+  _host = nullptr;
+  _cache = nullptr;
+  _capacity = 0;
+  _h_states = nullptr;
+  _states_read = nullptr;
+  _d_meshes = nullptr;
+  _d_states = nullptr;
+  _pending = false;
+  _pages.clear();
+  _free.clear();
+  _host_meshes.clear();
+  _table.clear();
+}
+} // namespace scene
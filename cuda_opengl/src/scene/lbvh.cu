@@ -0,0 +1,479 @@
+#include <cuda_runtime.h>
+
+#include <cfloat>
+#include <sstream>
+#include <stdexcept>
+
+#include <thrust/device_ptr.h>
+#include <thrust/execution_policy.h>
+#include <thrust/reduce.h>
+#include <thrust/sort.h>
+
+#include <driver/cuda_helper.h>
+#include <scene/bvh.h>
+#include <scene/lbvh.h>
+#include <shaders/cutils_math.h>
+
+namespace scene {
+namespace lbvh {
+namespace {
+constexpr unsigned int NB_THREADS = 256;
+
+inline unsigned int
+nbBlocks(unsigned int nb_elt)
+{
+  return (nb_elt + NB_THREADS - 1) / NB_THREADS;
+}
+
+struct MergeBox
+{
+  __host__ __device__ AABB operator()(const AABB& a, const AABB& b) const
+  {
+    return { make_float3(fminf(a.min.x, b.min.x), fminf(a.min.y, b.min.y),
+                         fminf(a.min.z, b.min.z)),
+             make_float3(fmaxf(a.max.x, b.max.x), fmaxf(a.max.y, b.max.y),
+                         fmaxf(a.max.z, b.max.z)) };
+  }
+};
+
+__device__ inline AABB
+triangleBox(const float3& v0, const float3& v1, const float3& v2)
+{
+  MergeBox merge;
+  AABB box = merge({ v0, v0 }, { v1, v1 });
+  return merge(box, { v2, v2 });
+}
+
+__device__ inline AABB
+triangleBox(const Triangle& tri)
+{
+  float3 v0 = make_float3(tri.v0);
+  return triangleBox(v0, v0 + make_float3(tri.e1), v0 + make_float3(tri.e2));
+}
+
+/// <summary>
+/// Spreads the 10 lowest bits of `v' so that two zeros
+/// separate each of them.
+/// </summary>
+__device__ inline unsigned int
+expandBits(unsigned int v)
+{
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+/// <summary>
+/// Computes the 30-bit Morton code of a point inside the unit cube.
+/// </summary>
+__device__ inline unsigned int
+morton3D(float3 p)
+{
+  p = clamp(p * 1024.0f, 0.0f, 1023.0f);
+  return (expandBits((unsigned int)p.x) << 2) +
+         (expandBits((unsigned int)p.y) << 1) + expandBits((unsigned int)p.z);
+}
+
+/// <summary>
+/// Length of the common prefix between the keys `i' and `j'.
+/// Duplicated Morton codes are disambiguated by their index.
+/// </summary>
+__device__ inline int
+delta(const unsigned int* codes, int nb_codes, int i, int j)
+{
+  if (j < 0 || j >= nb_codes)
+    return -1;
+
+  unsigned int a = codes[i];
+  unsigned int b = codes[j];
+  if (a == b)
+    return 32 + __clz(i ^ j);
+
+  return __clz(a ^ b);
+}
+
+/// <summary>
+/// Reads the bounds of a node written by another thread, bypassing
+/// the L1 cache which is not coherent between SMs.
+/// </summary>
+__device__ inline AABB
+loadBox(const BVHNode* node)
+{
+  const volatile BVHNode* v = node;
+  return { make_float3(v->min.x, v->min.y, v->min.z),
+           make_float3(v->max.x, v->max.y, v->max.z) };
+}
+
+__global__ void
+mortonKernel(const AABB* boxes, unsigned int nb_faces, AABB bounds,
+             unsigned int* codes, unsigned int* indices)
+{
+  unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= nb_faces)
+    return;
+
+  float3 extent = bounds.max - bounds.min;
+  extent = make_float3(fmaxf(extent.x, FLT_MIN), fmaxf(extent.y, FLT_MIN),
+                       fmaxf(extent.z, FLT_MIN));
+
+  float3 centroid = (boxes[i].min + boxes[i].max) * 0.5f;
+  codes[i] = morton3D((centroid - bounds.min) / extent);
+  indices[i] = i;
+}
+
+template <typename T>
+__global__ void
+gatherKernel(const T* in, const unsigned int* indices, unsigned int nb_elt,
+             T* out)
+{
+  unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= nb_elt)
+    return;
+
+  out[i] = in[indices[i]];
+}
+
+/// <summary>
+/// Sorts `buffer' in place according to `indices'.
+/// </summary>
+template <typename T>
+void
+gather(Buffer<T>& buffer, const unsigned int* indices, cudaStream_t stream)
+{
+  T* sorted = nullptr;
+  cudaMalloc(&sorted, buffer.size * sizeof(T));
+  cudaThrowError();
+
+  gatherKernel<<<nbBlocks(buffer.size), NB_THREADS, 0, stream>>>(
+    buffer.data, indices, buffer.size, sorted);
+  cudaMemcpyAsync(buffer.data, sorted, buffer.size * sizeof(T),
+                  cudaMemcpyDeviceToDevice, stream);
+  cudaThrowError();
+
+  cudaStreamSynchronize(stream);
+  cudaFree(sorted);
+}
+
+/// <summary>
+/// Emits internal node `i' of the hierarchy. Internal nodes are stored
+/// first, so that the root is the first node, and are followed by leaves.
+/// </summary>
+__global__ void
+hierarchyKernel(const unsigned int* codes, int nb_faces, BVHNode* nodes)
+{
+  int i = blockIdx.x * blockDim.x + threadIdx.x;
+
+  // Leaves reference exactly one face each.
+  if (i < nb_faces) {
+    BVHNode& leaf = nodes[nb_faces - 1 + i];
+    leaf.left = i;
+    leaf.right = -1;
+  }
+
+  if (i >= nb_faces - 1)
+    return;
+
+  // Finds the direction of the range covered by the node.
+  int d = delta(codes, nb_faces, i, i + 1) - delta(codes, nb_faces, i, i - 1);
+  d = d > 0 ? 1 : -1;
+
+  // Finds an upper bound of the range length, and then
+  // the other end using a binary search.
+  int delta_min = delta(codes, nb_faces, i, i - d);
+  int l_max = 2;
+  while (delta(codes, nb_faces, i, i + l_max * d) > delta_min)
+    l_max *= 2;
+
+  int l = 0;
+  for (int t = l_max / 2; t >= 1; t /= 2)
+    if (delta(codes, nb_faces, i, i + (l + t) * d) > delta_min)
+      l += t;
+
+  int j = i + l * d;
+
+  // Finds the split position using a binary search.
+  int delta_node = delta(codes, nb_faces, i, j);
+  int s = 0;
+  int t = l;
+  do {
+    t = (t + 1) / 2;
+    if (delta(codes, nb_faces, i, i + (s + t) * d) > delta_node)
+      s += t;
+  } while (t > 1);
+
+  int split = i + s * d + min(d, 0);
+
+  BVHNode& node = nodes[i];
+  node.left = min(i, j) == split ? nb_faces - 1 + split : split;
+  node.right = max(i, j) == split + 1 ? nb_faces + split : split + 1;
+}
+
+__global__ void
+parentsKernel(const BVHNode* nodes, unsigned int nb_nodes, int* parents)
+{
+  unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= nb_nodes)
+    return;
+
+  if (i == 0)
+    parents[0] = -1;
+
+  const BVHNode& node = nodes[i];
+  if (node.right < 0)
+    return;
+
+  parents[node.left] = i;
+  parents[node.right] = i;
+}
+
+/// <summary>
+/// Bounds of the leaves of a mesh BVH.
+/// </summary>
+struct TriangleBounds
+{
+  const Triangle* triangles;
+
+  __device__ inline AABB operator()(int first, int count) const
+  {
+    MergeBox merge;
+    AABB box = triangleBox(triangles[first]);
+    for (int i = first + 1; i < first + count; ++i)
+      box = merge(box, triangleBox(triangles[i]));
+    return box;
+  }
+};
+
+/// <summary>
+/// Bounds of the leaves of an indexed mesh BVH.
+/// </summary>
+struct IndexedBounds
+{
+  const uint4* indices;
+  const float4* positions;
+
+  __device__ inline AABB face(int i) const
+  {
+    uint4 idx = indices[i];
+    return triangleBox(make_float3(positions[idx.x]),
+                       make_float3(positions[idx.y]),
+                       make_float3(positions[idx.z]));
+  }
+
+  __device__ inline AABB operator()(int first, int count) const
+  {
+    MergeBox merge;
+    AABB box = face(first);
+    for (int i = first + 1; i < first + count; ++i)
+      box = merge(box, face(i));
+    return box;
+  }
+};
+
+/// <summary>
+/// Bounds of the leaves of a top-level BVH: the root of the mesh of each
+/// instance, moved to the scene.
+/// </summary>
+struct InstanceBounds
+{
+  const Instance* instances;
+  const Mesh* meshes;
+
+  __device__ inline AABB instance(int i) const
+  {
+    const Instance& inst = instances[i];
+    return bvh::transformBox(loadBox(meshes[inst.mesh_id].bvh.data),
+                             inst.to_world);
+  }
+
+  __device__ inline AABB operator()(int first, int count) const
+  {
+    MergeBox merge;
+    AABB box = instance(first);
+    for (int i = first + 1; i < first + count; ++i)
+      box = merge(box, instance(i));
+    return box;
+  }
+};
+
+/// <summary>
+/// Computes the bounds of each face, seen as a leaf of its own.
+/// </summary>
+template <typename LeafBounds>
+__global__ void
+boxesKernel(LeafBounds bounds, unsigned int nb_faces, AABB* boxes)
+{
+  unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= nb_faces)
+    return;
+
+  boxes[i] = bounds(i, 1);
+}
+
+/// <summary>
+/// Computes the bounds of every leaf, and propagates them to the root.
+/// The second child reaching a node merges both boxes and goes up,
+/// the first one stops there.
+/// </summary>
+template <typename LeafBounds>
+__global__ void
+refitKernel(BVHNode* nodes, unsigned int nb_nodes, const int* parents,
+            unsigned int* flags, LeafBounds bounds)
+{
+  unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= nb_nodes || nodes[i].right >= 0)
+    return;
+
+  AABB box = bounds(nodes[i].left, -nodes[i].right);
+  nodes[i].min = box.min;
+  nodes[i].max = box.max;
+
+  MergeBox merge;
+  int current = parents[i];
+  while (current >= 0) {
+    // Makes sure the bounds written are visible
+    // before the other child reads them.
+    __threadfence();
+    if (atomicAdd(&flags[current], 1) == 0)
+      return;
+
+    BVHNode& node = nodes[current];
+    box = merge(loadBox(&nodes[node.left]), loadBox(&nodes[node.right]));
+    node.min = box.min;
+    node.max = box.max;
+
+    current = parents[current];
+  }
+}
+
+template <typename LeafBounds>
+void
+refitNodes(BVHNode* nodes, unsigned int nb_nodes, LeafBounds bounds,
+           const RefitScratch& scratch, cudaStream_t stream)
+{
+  if (!scratch.data || scratch.nb_nodes < nb_nodes)
+    throw std::runtime_error("lbvh::refit: the scratch is smaller than the "
+                             "BVH.");
+
+  // Parents and flags share the scratch.
+  int* parents = scratch.data;
+  unsigned int* flags = (unsigned int*)(scratch.data + nb_nodes);
+  cudaMemsetAsync(flags, 0, nb_nodes * sizeof(unsigned int), stream);
+
+  parentsKernel<<<nbBlocks(nb_nodes), NB_THREADS, 0, stream>>>(
+    nodes, nb_nodes, parents);
+  refitKernel<<<nbBlocks(nb_nodes), NB_THREADS, 0, stream>>>(
+    nodes, nb_nodes, parents, flags, bounds);
+  cudaThrowError();
+}
+}
+
+void
+build(Mesh& mesh, std::vector<unsigned int>& out_order, cudaStream_t stream)
+{
+  const bool indexed = mesh.indices.size > 0;
+  const unsigned int nb_faces =
+    indexed ? mesh.indices.size : mesh.triangles.size;
+  out_order.clear();
+  if (nb_faces == 0)
+    return;
+
+  const unsigned int nb_nodes = 2 * nb_faces - 1;
+  if (mesh.bvh.size != nb_nodes || !mesh.bvh.data)
+    throw std::runtime_error("lbvh::build: the BVH must have 2 * N - 1 "
+                             "nodes.");
+
+  AABB* boxes = nullptr;
+  unsigned int* codes = nullptr;
+  unsigned int* indices = nullptr;
+  RefitScratch scratch;
+  scratch.nb_nodes = nb_nodes;
+  cudaMalloc(&boxes, nb_faces * sizeof(AABB));
+  cudaMalloc(&codes, nb_faces * sizeof(unsigned int));
+  cudaMalloc(&indices, nb_faces * sizeof(unsigned int));
+  cudaMalloc(&scratch.data, RefitScratch::bytes(nb_nodes));
+  cudaThrowError();
+
+  // Morton codes are computed inside the bounds of the whole mesh.
+  if (indexed)
+    boxesKernel<<<nbBlocks(nb_faces), NB_THREADS, 0, stream>>>(
+      IndexedBounds{ mesh.indices.data, mesh.positions.data }, nb_faces,
+      boxes);
+  else
+    boxesKernel<<<nbBlocks(nb_faces), NB_THREADS, 0, stream>>>(
+      TriangleBounds{ mesh.triangles.data }, nb_faces, boxes);
+  cudaThrowError();
+
+  thrust::device_ptr<AABB> boxes_ptr(boxes);
+  AABB bounds = thrust::reduce(thrust::cuda::par.on(stream), boxes_ptr,
+                               boxes_ptr + nb_faces, bvh::emptyBox(),
+                               MergeBox());
+
+  mortonKernel<<<nbBlocks(nb_faces), NB_THREADS, 0, stream>>>(
+    boxes, nb_faces, bounds, codes, indices);
+  cudaThrowError();
+
+  // Thrust dispatches to a radix sort for integral keys.
+  thrust::device_ptr<unsigned int> codes_ptr(codes);
+  thrust::device_ptr<unsigned int> indices_ptr(indices);
+  thrust::sort_by_key(thrust::cuda::par.on(stream), codes_ptr,
+                      codes_ptr + nb_faces, indices_ptr);
+
+  out_order.resize(nb_faces);
+  cudaMemcpyAsync(&out_order[0], indices, nb_faces * sizeof(unsigned int),
+                  cudaMemcpyDeviceToHost, stream);
+  cudaThrowError();
+
+  // Shared vertices stay where they are, only the faces are sorted.
+  if (indexed)
+    gather(mesh.indices, indices, stream);
+  else {
+    gather(mesh.triangles, indices, stream);
+    gather(mesh.faces, indices, stream);
+  }
+
+  hierarchyKernel<<<nbBlocks(nb_faces), NB_THREADS, 0, stream>>>(
+    codes, nb_faces, mesh.bvh.data);
+  cudaThrowError();
+
+  // The hierarchy only contains the topology for now,
+  // bounds are computed by a bottom-up refit.
+  refit(mesh, scratch, stream);
+
+  // Builds are made once per mesh, their scratch is freed with the rest.
+  cudaStreamSynchronize(stream);
+  cudaFree(boxes);
+  cudaFree(codes);
+  cudaFree(indices);
+  cudaFree(scratch.data);
+}
+
+void
+refit(const Mesh& mesh, const RefitScratch& scratch, cudaStream_t stream)
+{
+  if (mesh.bvh.size == 0)
+    return;
+
+  if (mesh.indices.size > 0)
+    refitNodes(mesh.bvh.data, mesh.bvh.size,
+               IndexedBounds{ mesh.indices.data, mesh.positions.data },
+               scratch, stream);
+  else
+    refitNodes(mesh.bvh.data, mesh.bvh.size,
+               TriangleBounds{ mesh.triangles.data }, scratch, stream);
+}
+
+void
+refitTopLevel(const Buffer<Instance>& instances, const Buffer<Mesh>& meshes,
+              const Buffer<BVHNode>& bvh, const RefitScratch& scratch,
+              cudaStream_t stream)
+{
+  if (bvh.size == 0)
+    return;
+
+  refitNodes(bvh.data, bvh.size, InstanceBounds{ instances.data, meshes.data },
+             scratch, stream);
+}
+} // namespace lbvh
+} // namespace scene
@@ -9,6 +9,7 @@
 #include <stb/stb_image_resize.h>
 
 #include <scene/material_loader.h>
+#include <utils/utils.h>
 
 namespace scene {
 namespace {
@@ -74,23 +75,13 @@ pack(const Texture& tex, float default_v)
 }
 
 /// <summary>
-/// Checks if a texture is loaded, and if it is not,
-/// it will load it and add it to the tracked list.
+/// Decodes a texture from the disk.
 /// </summary>
-/// <param name="tex">Name of the texture to load.</param>
-/// <param name="base_folder">Path to the folder of resources.</param>
-/// <param name="loaded_tex">Map containing all the loaded texture.</param>
-void
-checkAndupload(const std::string& tex, const std::string& base_folder,
-               std::unordered_map<std::string, Texture>& loaded_tex)
+/// <param name="full_path">Path to the texture.</param>
+/// <returns>The decoded texture, or an empty texture on failure.</returns>
+Texture
+decode(const std::string& full_path)
 {
-  if (tex.empty())
-    return;
-
-  if (loaded_tex.count(tex))
-    return;
-
-  std::string full_path = base_folder + "/" + tex;
   int w = 0;
   int h = 0;
   int nb_chan = 0;
@@ -99,8 +90,7 @@ checkAndupload(const std::string& tex, const std::string& base_folder,
     std::cerr << "arttracer: MaterialLoader: failed to open " << full_path
               << std::endl;
 
-    loaded_tex[tex] = Texture{ 0, 0, 0, nullptr };
-    return;
+    return Texture{ 0, 0, 0, nullptr };
   }
 
   // This is actually gross, we duplicate the data in order
@@ -111,7 +101,27 @@ checkAndupload(const std::string& tex, const std::string& base_folder,
 
   stbi_image_free(tmp);
 
-  loaded_tex[tex] = Texture{ w, h, nb_chan, data };
+  return Texture{ w, h, nb_chan, data };
+}
+
+/// <summary>
+/// Checks if a texture is loaded, and if it is not,
+/// it will load it and add it to the tracked list.
+/// </summary>
+/// <param name="tex">Name of the texture to load.</param>
+/// <param name="base_folder">Path to the folder of resources.</param>
+/// <param name="loaded_tex">Map containing all the loaded texture.</param>
+void
+checkAndupload(const std::string& tex, const std::string& base_folder,
+               std::unordered_map<std::string, Texture>& loaded_tex)
+{
+  if (tex.empty())
+    return;
+
+  if (loaded_tex.count(tex))
+    return;
+
+  loaded_tex[tex] = decode(base_folder + "/" + tex);
 }
 
 /// <summary>
@@ -161,6 +171,43 @@ MaterialLoader::set(const std::vector<tinyobj::material_t>* tiny_materials,
   return this;
 }
 
+void
+MaterialLoader::prefetch(
+  const std::vector<const std::vector<tinyobj::material_t>*>& materials,
+  const std::vector<std::string>& mtl_folders)
+{
+  // Lists the textures not loaded yet, each one only once. Textures are
+  // identified by their name, the first folder referencing it being used,
+  // as `checkAndupload' would do.
+  std::vector<std::string> names;
+  std::vector<std::string> paths;
+  std::unordered_set<std::string> listed;
+  for (size_t i = 0; i < materials.size(); ++i) {
+    for (const auto& tiny_mat : *materials[i]) {
+      const std::string* textures[] = { &tiny_mat.diffuse_texname,
+                                        &tiny_mat.specular_texname,
+                                        !tiny_mat.bump_texname.empty()
+                                          ? &tiny_mat.bump_texname
+                                          : &tiny_mat.normal_texname };
+      for (const std::string* tex : textures) {
+        if (tex->empty() || _loaded_tex.count(*tex) || listed.count(*tex))
+          continue;
+
+        listed.insert(*tex);
+        names.push_back(*tex);
+        paths.push_back(mtl_folders[i] + "/" + *tex);
+      }
+    }
+  }
+
+  std::vector<Texture> decoded(names.size());
+  utils::parallelFor(names.size(),
+                     [&](size_t i) { decoded[i] = decode(paths[i]); });
+
+  for (size_t i = 0; i < names.size(); ++i)
+    _loaded_tex[names[i]] = decoded[i];
+}
+
 void
 MaterialLoader::load(std::vector<Material>& out_mat)
 {
@@ -179,6 +226,7 @@ MaterialLoader::load(std::vector<Material>& out_mat)
     mat.diffuse_spec_map =
       getTextureId(tiny_mat.diffuse_texname, tiny_mat.specular_texname,
                    default_diff_rgb, default_spec);
+    _color_tex.insert(mat.diffuse_spec_map);
 
     // Loads normal map, identified either by `norm' or
     // by `bump'.
@@ -215,11 +263,27 @@ MaterialLoader::release()
   }
 
   _packed_tex.clear();
+  _color_tex.clear();
+  _owned_tex.clear();
+  _free_ids.clear();
   _loaded_tex.clear();
   _materials_gpu.clear();
   _textures.clear();
 }
 
+void
+MaterialLoader::recycle(const Material& mat)
+{
+  const int id = mat.diffuse_spec_map;
+  if (id < 0 || !_owned_tex.erase(id))
+    return;
+
+  delete[] _textures[id].data;
+  _textures[id] = Texture();
+  _color_tex.erase(id);
+  _free_ids.push_back(id);
+}
+
 int
 MaterialLoader::getTextureId(std::string tex_rgb)
 {
@@ -232,11 +296,8 @@ MaterialLoader::getTextureId(std::string tex_rgb)
 int
 MaterialLoader::getTextureId(std::string tex_rgb, float3 default_rgb)
 {
-  if (tex_rgb.empty()) {
-    _textures.push_back(createUnitTex(default_rgb));
-    unsigned int curr_id = _id++;
-    return curr_id;
-  }
+  if (tex_rgb.empty())
+    return addOwned(createUnitTex(default_rgb));
   return registerOrGet(tex_rgb);
 }
 
@@ -247,14 +308,10 @@ MaterialLoader::getTextureId(std::string tex_rgb, std::string tex_a,
   // CASE 1: There is no texture provided.
   // We will build a custom texture if the material
   // is not provided any. We will create a 1x1 pixel-wide texture.
-  if (tex_rgb.empty() && tex_a.empty()) {
-    _textures.push_back(createUnitTex(
+  if (tex_rgb.empty() && tex_a.empty())
+    return addOwned(createUnitTex(
       make_float4(default_rgb.x, default_rgb.y, default_rgb.z, default_a)));
 
-    unsigned int curr_id = _id++;
-    return curr_id;
-  }
-
   checkAndupload(tex_rgb, _mtl_folder, _loaded_tex);
   checkAndupload(tex_a, _mtl_folder, _loaded_tex);
 
@@ -263,39 +320,29 @@ MaterialLoader::getTextureId(std::string tex_rgb, std::string tex_a,
   // not find a better way to handle this.
 
   if (tex_rgb.empty() && !tex_a.empty()) {
-    unsigned curr_id = _id++;
     const Texture& tex = _loaded_tex[tex_a];
-    if (tex.nb_chan == 1) {
-      _textures.push_back(pack(tex, default_rgb));
-      return curr_id;
-    }
+    if (tex.nb_chan == 1)
+      return addOwned(pack(tex, default_rgb));
 
     // The texture loading failed, we will send a unit texture.
     std::cerr << "arttracer: MaterialLoader: \n"
               << "- '" << tex_a << "': invalid nb of channels." << std::endl;
 
-    _textures.push_back(createUnitTex(
+    return addOwned(createUnitTex(
       make_float4(default_rgb.x, default_rgb.y, default_rgb.z, default_a)));
-
-    return curr_id;
   }
 
   if (!tex_rgb.empty() && tex_a.empty()) {
-    unsigned curr_id = _id++;
     const Texture& tex = _loaded_tex[tex_rgb];
-    if (tex.nb_chan == 3) {
-      _textures.push_back(pack(tex, default_a));
-      return curr_id;
-    }
+    if (tex.nb_chan == 3)
+      return addOwned(pack(tex, default_a));
 
     // The texture loading failed, we will send a unit texture.
     std::cerr << "arttracer: MaterialLoader: \n"
               << "- '" << tex_rgb << "': invalid nb of channels." << std::endl;
 
-    _textures.push_back(createUnitTex(
+    return addOwned(createUnitTex(
       make_float4(default_rgb.x, default_rgb.y, default_rgb.z, default_a)));
-
-    return curr_id;
   }
 
   // CASE 3: Both textures are provided.
@@ -310,17 +357,16 @@ MaterialLoader::getTextureId(std::string tex_rgb, std::string tex_a,
   // One of the textures, or both could not be loaded.
   // We send a packed texture according to which one is not loaded.
   if (rgb_tex.nb_chan != 3 || a_tex.nb_chan != 1) {
-    unsigned curr_id = _id++;
     // Both failed, we send a unit texture
     if (rgb_tex.nb_chan != 3 && a_tex.nb_chan != 1) {
       std::cerr << "arttracer: MaterialLoader: \n"
                 << "- '" << tex_rgb << "' invalid nb of channels.\n"
                 << "- '" << tex_a << "' invalid nb of channels." << std::endl;
 
-      _textures.push_back(createUnitTex(
+      return addOwned(createUnitTex(
         make_float4(default_rgb.x, default_rgb.y, default_rgb.z, default_a)));
-      return curr_id;
     }
+    unsigned curr_id = _id++;
     // Only one of the two texture fail why loading,
     // we will pack the one that has successfully loaded
     // with the default value of the other.
@@ -381,6 +427,23 @@ MaterialLoader::getTextureId(std::string tex_rgb, std::string tex_a,
   return _packed_tex[token];
 }
 
+int
+MaterialLoader::addOwned(const Texture& tex)
+{
+  int id;
+  if (_free_ids.empty()) {
+    _textures.push_back(tex);
+    id = _id++;
+  } else {
+    id = _free_ids.back();
+    _free_ids.pop_back();
+    _textures[id] = tex;
+  }
+
+  _owned_tex.insert(id);
+  return id;
+}
+
 int
 MaterialLoader::registerOrGet(std::string tex_rgb)
 {
@@ -1,5 +1,6 @@
 #include <algorithm>
 
+#include <cstring>
 #include <ctype.h>
 #include <cuda.h>
 #include <cuda_runtime.h>
@@ -16,7 +17,11 @@
 #include <unordered_map>
 
 #include <driver/cuda_helper.h>
+#include <driver/device_arena.h>
+#include <scene/bvh.h>
+#include <scene/lbvh.h>
 #include <scene/material_loader.h>
+#include <scene/scene_cache.h>
 #include <shaders/cutils_math.h>
 #include <utils/utils.h>
 
@@ -29,6 +34,28 @@ using ShapeVector = std::vector<tinyobj::shape_t>;
 using MaterialVector = std::vector<tinyobj::material_t>;
 using Real = tinyobj::real_t;
 
+/// <summary>
+/// Meshes having at least this number of faces have their BVH built
+/// on the GPU. The SAH build gives better trees, but gets way too slow
+/// on large meshes.
+/// </summary>
+constexpr size_t GPU_BUILD_MIN_FACES = 1 << 16;
+
+/// <summary>
+/// Distance, relative to the size of the shapes, under which the vertices of
+/// a shape moved onto another one are considered the same.
+/// </summary>
+constexpr double INSTANCE_TOLERANCE = 1e-4;
+
+/// <summary>
+/// Affine transform computed on the CPU: a linear part, then a translation.
+/// </summary>
+struct Affine
+{
+  double m[3][3];
+  double t[3];
+};
+
 float
 parse_float(std::stringstream& iss, float default_val)
 {
@@ -84,7 +111,7 @@ parse_camera(scene::Camera& cam, std::stringstream& iss)
 }
 
 void
-parse_scene(std::string filename, scene::SceneData& out_scene,
+parse_scene(std::string filename, std::vector<LightProp>& light_vec,
             scene::Camera& cam, std::string& objfile, std::string& cubemap)
 {
   std::ifstream file;
@@ -101,10 +128,6 @@ parse_scene(std::string filename, scene::SceneData& out_scene,
   cam.fov_x = (90.0 * M_PI) / 180.0;
   cam.dir = cross(cam.u, cam.v);
 
-  // Contains every lights. Because we do not use vector
-  // on CUDA, we will need to make a deep copy of it.
-  std::vector<LightProp> light_vec;
-
   std::string line;
   std::string token;
   while (std::getline(file, line)) {
@@ -153,218 +176,1338 @@ parse_scene(std::string filename, scene::SceneData& out_scene,
       if (iss.peek() != std::char_traits<char>::eof())
         iss >> cubemap;
   }
+}
+
+/// <summary>
+/// Loads every materials, and their textures.
+/// </summary>
+/// <param name="materials">Materials obtained from TinyObjLoader.</param>
+/// <param name="cpu_mat">Materials already loaded by a previous upload,
+/// keeping their textures. If empty, contains the loaded materials.</param>
+void
+load_materials(const MaterialVector& materials, const std::string& base_folder,
+               std::vector<scene::Material>& cpu_mat)
+{
+  if (cpu_mat.empty()) {
+    auto* mat_loader = MaterialLoader::instance();
+    mat_loader->set(&materials, base_folder);
+    mat_loader->load(cpu_mat);
+  }
+}
+
+/// <summary>
+/// Reorders `values' so that the i-th value becomes `values[order[i]]'.
+/// </summary>
+template <typename T>
+void
+reorder(std::vector<T>& values, const std::vector<unsigned int>& order)
+{
+  std::vector<T> sorted(values.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    sorted[i] = values[order[i]];
+
+  values.swap(sorted);
+}
+
+/// <summary>
+/// Builds the BVH of the light spheres, and sorts `lights' to match its
+/// leaves. Each node gets the power of the lights it contains, from which
+/// the lights are picked proportionally to their contribution.
+/// </summary>
+void
+make_light_bvh(std::vector<LightProp>& lights, std::vector<BVHNode>& nodes,
+               std::vector<LightPower>& powers)
+{
+  std::vector<AABB> boxes(lights.size());
+  for (size_t i = 0; i < lights.size(); ++i) {
+    const float3 radius = make_float3(lights[i].radius);
+    boxes[i] = { lights[i].vec - radius, lights[i].vec + radius };
+  }
+
+  std::vector<unsigned int> order;
+  bvh::build(boxes, nodes, order);
+  reorder(lights, order);
+
+  // Children are always stored after their parent, so that walking the
+  // nodes backwards sums the subtrees before their root.
+  powers.resize(nodes.size());
+  for (size_t n = nodes.size(); n-- > 0;) {
+    const BVHNode& node = nodes[n];
+    LightPower& power = powers[n];
+    if (node.right < 0) {
+      power.power = 0.0f;
+      power.count = -node.right;
+      for (int i = node.left; i < node.left - node.right; ++i)
+        power.power += lightPower(lights[i]);
+    } else {
+      power.power = powers[node.left].power + powers[node.right].power;
+      power.count = powers[node.left].count + powers[node.right].count;
+    }
+  }
+}
 
-  out_scene.lights.size = 0;
-  if (light_vec.size() == 0)
+/// <summary>
+/// Size taken by `values' in a device arena.
+/// </summary>
+template <typename T>
+size_t
+arena_size(const std::vector<T>& values)
+{
+  return driver::DeviceArena::alignedSize(values.size() * sizeof(T));
+}
+
+/// <summary>
+/// Allocates `out' in `arena', and stages `values' to be copied into it.
+/// </summary>
+template <typename T>
+void
+stage_buffer(driver::DeviceArena& arena, const std::vector<T>& values,
+             Buffer<T>& out)
+{
+  out.size = values.size();
+  out.data = nullptr;
+  if (out.size)
+    out.data =
+      static_cast<T*>(arena.stage(&values[0], values.size() * sizeof(T)));
+}
+
+/// <summary>
+/// Copies a GPU buffer back into `out'.
+/// </summary>
+template <typename T>
+void
+download_buffer(const Buffer<T>& buffer, std::vector<T>& out)
+{
+  out.resize(buffer.size);
+  if (buffer.size == 0)
     return;
 
-  // Copies lights back to CUDA
-  const LightProp* lights = &light_vec[0];
-  size_t nb_bytes_lights = light_vec.size() * sizeof(LightProp);
-  out_scene.lights.size = light_vec.size();
-  cudaMalloc(&out_scene.lights.data, nb_bytes_lights);
-  cudaThrowError();
-  cudaMemcpy(out_scene.lights.data, lights, nb_bytes_lights,
-             cudaMemcpyHostToDevice);
+  cudaMemcpy(&out[0], buffer.data, buffer.size * sizeof(T),
+             cudaMemcpyDeviceToHost);
   cudaThrowError();
 }
 
+inline AABB
+triangle_box(const float3& v0, const float3& v1, const float3& v2)
+{
+  AABB box = bvh::emptyBox();
+  bvh::grow(box, v0);
+  bvh::grow(box, v1);
+  bvh::grow(box, v2);
+  return box;
+}
+
+inline float3
+read_float3(const std::vector<Real>& values, int idx)
+{
+  return make_float3(values[3 * idx], values[3 * idx + 1],
+                     values[3 * idx + 2]);
+}
+
+inline float2
+read_float2(const std::vector<Real>& values, int idx)
+{
+  return make_float2(values[2 * idx], values[2 * idx + 1]);
+}
+
 /// <summary>
-/// Uploads every materials.
+/// Determinant of the linear part of `a'.
 /// </summary>
-/// <param name="materials">Materials obtained from TinyObjLoader.</param>
-/// <param name="d_materials">Materials storage for the GPU.</param>
-void
-upload_materials(const MaterialVector& materials, scene::SceneData* scene,
-                 const std::string& base_folder)
+double
+determinant(const Affine& a)
+{
+  const double(&m)[3][3] = a.m;
+  return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+         m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+         m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+}
+
+/// <summary>
+/// Inverts the affine transform `a'.
+/// </summary>
+/// <returns>False if `a' is degenerate.</returns>
+bool
+invert(const Affine& a, Affine& out)
+{
+  const double(&m)[3][3] = a.m;
+  const double det = determinant(a);
+  if (fabs(det) < 1e-12)
+    return false;
+
+  // Inverse of the linear part, made of the cofactors of `m'.
+  for (int r = 0; r < 3; ++r) {
+    for (int c = 0; c < 3; ++c) {
+      const int r1 = (c + 1) % 3, r2 = (c + 2) % 3;
+      const int c1 = (r + 1) % 3, c2 = (r + 2) % 3;
+      out.m[r][c] = (m[r1][c1] * m[r2][c2] - m[r1][c2] * m[r2][c1]) / det;
+    }
+  }
+  for (int r = 0; r < 3; ++r)
+    out.t[r] = -(out.m[r][0] * a.t[0] + out.m[r][1] * a.t[1] +
+                 out.m[r][2] * a.t[2]);
+  return true;
+}
+
+/// <summary>
+/// Creates the instance of the mesh `mesh_id' placed by `to_world'.
+/// </summary>
+Instance
+make_instance(const Affine& to_world, unsigned int mesh_id)
+{
+  Affine to_object;
+  invert(to_world, to_object);
+
+  Instance instance;
+  for (int r = 0; r < 3; ++r) {
+    instance.to_world[r] =
+      make_float4(to_world.m[r][0], to_world.m[r][1], to_world.m[r][2],
+                  to_world.t[r]);
+    instance.to_object[r] =
+      make_float4(to_object.m[r][0], to_object.m[r][1], to_object.m[r][2],
+                  to_object.t[r]);
+  }
+  instance.mesh_id = mesh_id;
+  return instance;
+}
+
+Affine
+identity()
+{
+  Affine a = {};
+  for (int r = 0; r < 3; ++r) a.m[r][r] = 1.0;
+  return a;
+}
+
+/// <summary>
+/// Hashes what stays the same when a shape is moved: its number of faces,
+/// its materials and its texture coordinates. Shapes having the same key
+/// may be copies of each other.
+/// </summary>
+size_t
+shape_key(const tinyobj::mesh_t& mesh, const tinyobj::attrib_t& attrib)
+{
+  size_t h = std::hash<size_t>()(mesh.indices.size());
+  for (int id : mesh.material_ids) h = h * 31 + std::hash<int>()(id);
+  for (const auto& idx : mesh.indices) {
+    if (idx.texcoord_index < 0)
+      continue;
+    const float2 uv = read_float2(attrib.texcoords, idx.texcoord_index);
+    h = h * 31 + std::hash<float>()(uv.x);
+    h = h * 31 + std::hash<float>()(uv.y);
+  }
+  return h;
+}
+
+/// <summary>
+/// Finds the transform moving the shape `proto' onto the shape `mesh', when
+/// `mesh' is a copy of it: every vertex, normal and texture coordinate of
+/// each face should match, once moved. Transforms mirroring the shape are
+/// not looked for, they would turn its faces inside out.
+/// </summary>
+/// <param name="out_to_world">Contains the transform.</param>
+/// <returns>False if `mesh' is not a copy of `proto'. Flat shapes are never
+/// copies, their transform not being fully defined.</returns>
+bool
+find_transform(const tinyobj::mesh_t& proto, const tinyobj::mesh_t& mesh,
+               const tinyobj::attrib_t& attrib, Affine& out_to_world)
+{
+  const size_t nb_indices = proto.indices.size();
+  if (mesh.indices.size() != nb_indices ||
+      mesh.material_ids != proto.material_ids)
+    return false;
+
+  auto p = [&](size_t i) {
+    return read_float3(attrib.vertices, proto.indices[i].vertex_index);
+  };
+  auto q = [&](size_t i) {
+    return read_float3(attrib.vertices, mesh.indices[i].vertex_index);
+  };
+
+  // Picks four vertices of `proto' spanning as much volume as possible,
+  // the transform being given by where they are in `mesh'.
+  size_t a = 0, b = 0, c = 0, d = 0;
+  float best = 0.0f;
+  for (size_t i = 0; i < nb_indices; ++i) {
+    const float dist = length(p(i) - p(a));
+    if (dist > best) {
+      best = dist;
+      b = i;
+    }
+  }
+  const float size = best;
+  best = 0.0f;
+  for (size_t i = 0; i < nb_indices; ++i) {
+    const float area = length(cross(p(b) - p(a), p(i) - p(a)));
+    if (area > best) {
+      best = area;
+      c = i;
+    }
+  }
+  best = 0.0f;
+  const float3 normal = cross(p(b) - p(a), p(c) - p(a));
+  for (size_t i = 0; i < nb_indices; ++i) {
+    const float volume = fabsf(dot(normal, p(i) - p(a)));
+    if (volume > best) {
+      best = volume;
+      d = i;
+    }
+  }
+  if (size == 0.0f || best <= 1e-6f * size * size * size)
+    return false;
+
+  // M * P = Q, the columns of P and Q being the edges from `a'.
+  Affine edges_p = {};
+  Affine edges_q = {};
+  const size_t others[3] = { b, c, d };
+  for (int e = 0; e < 3; ++e) {
+    const float3 ep = p(others[e]) - p(a);
+    const float3 eq = q(others[e]) - q(a);
+    edges_p.m[0][e] = ep.x;
+    edges_p.m[1][e] = ep.y;
+    edges_p.m[2][e] = ep.z;
+    edges_q.m[0][e] = eq.x;
+    edges_q.m[1][e] = eq.y;
+    edges_q.m[2][e] = eq.z;
+  }
+  Affine inv_p;
+  if (!invert(edges_p, inv_p))
+    return false;
+
+  Affine& m = out_to_world;
+  for (int r = 0; r < 3; ++r)
+    for (int k = 0; k < 3; ++k)
+      m.m[r][k] = edges_q.m[r][0] * inv_p.m[0][k] +
+                  edges_q.m[r][1] * inv_p.m[1][k] +
+                  edges_q.m[r][2] * inv_p.m[2][k];
+  const float3 pa = p(a);
+  const float3 qa = q(a);
+  const double qa_d[3] = { qa.x, qa.y, qa.z };
+  for (int r = 0; r < 3; ++r)
+    m.t[r] = qa_d[r] - (m.m[r][0] * pa.x + m.m[r][1] * pa.y +
+                        m.m[r][2] * pa.z);
+
+  if (determinant(m) < 1e-12)
+    return false;
+
+  const Instance instance = make_instance(m, 0);
+  const float tolerance = INSTANCE_TOLERANCE * length(q(b) - q(a));
+  for (size_t i = 0; i < nb_indices; ++i) {
+    const tinyobj::index_t& ip = proto.indices[i];
+    const tinyobj::index_t& iq = mesh.indices[i];
+    if (length(transformPoint(instance.to_world, p(i)) - q(i)) > tolerance)
+      return false;
+
+    if ((ip.texcoord_index < 0) != (iq.texcoord_index < 0) ||
+        (ip.normal_index < 0) != (iq.normal_index < 0))
+      return false;
+    if (ip.texcoord_index >= 0) {
+      const float2 uv = read_float2(attrib.texcoords, ip.texcoord_index) -
+                        read_float2(attrib.texcoords, iq.texcoord_index);
+      if (fabsf(uv.x) > INSTANCE_TOLERANCE || fabsf(uv.y) > INSTANCE_TOLERANCE)
+        return false;
+    }
+    if (ip.normal_index >= 0) {
+      const float3 np = transformNormal(
+        instance, read_float3(attrib.normals, ip.normal_index));
+      const float3 nq = read_float3(attrib.normals, iq.normal_index);
+      const float len = length(np) * length(nq);
+      if (len > 0.0f && dot(np, nq) < (1.0f - 1e-3f) * len)
+        return false;
+    }
+  }
+  return true;
+}
+
+/// <summary>
+/// Uploads a mesh using the de-indexed layout: every face contains
+/// a copy of its vertices.
+/// </summary>
+/// <param name="mesh">Mesh obtained from TinyObjLoader.</param>
+/// <param name="attrib">Attributes obtained from TinyObjLoader.</param>
+/// <param name="gpu_build">If false, the BVH is built in `out_mesh',
+/// otherwise the faces are left unsorted and the BVH empty.</param>
+/// <param name="out_mesh">Contains the buffers of the mesh.</param>
+/// <returns>The bounds of the mesh.</returns>
+AABB
+make_face_mesh(const tinyobj::mesh_t& mesh, const tinyobj::attrib_t& attrib,
+               bool gpu_build, cache::MeshData& out_mesh)
+{
+  auto nb_indices = mesh.indices.size();
+  size_t nb_faces = nb_indices / 3;
+
+  // Creates the faces on the CPU. This is really gross regarding memory
+  // consumption, but this will really speed up the intersection process
+  // thanks to a better cache efficiency.
+  // Triangles only contain what the intersection test needs, and faces
+  // contain the shading attributes, only fetched for the closest hit.
+  std::vector<Triangle>& triangles = out_mesh.triangles;
+  std::vector<Face>& faces = out_mesh.faces;
+  triangles.resize(nb_faces);
+  faces.resize(nb_faces);
+  std::vector<AABB> boxes(nb_faces);
+  AABB bounds = bvh::emptyBox();
+  for (size_t i = 0; i < nb_indices; i += 3) {
+    auto& face = faces[i / 3];
+    float3 vertices[3];
+    for (size_t v = 0; v < 3; ++v) {
+      tinyobj::index_t idx = mesh.indices[i + v];
+      // Saves vertex
+      vertices[v] = read_float3(attrib.vertices, idx.vertex_index);
+      // Saves normal
+      face.normals[v] = read_float3(attrib.normals, idx.normal_index);
+      // Saves texture coordinates
+      face.texcoords[v] = read_float2(attrib.texcoords, idx.texcoord_index);
+    }
+    face.material_id = mesh.material_ids[i / 3];
+
+    // Precomputes the edges used by the intersection test
+    float3 edge1 = vertices[1] - vertices[0];
+    float3 edge2 = vertices[2] - vertices[0];
+
+    auto& tri = triangles[i / 3];
+    tri.v0 = make_float4(vertices[0], 0.0f);
+    tri.e1 = make_float4(edge1, 0.0f);
+    tri.e2 = make_float4(edge2, 0.0f);
+
+    // Computes a unique tangent for the whole face
+    face.tangent =
+      faceTangent(edge1, edge2, face.texcoords[1] - face.texcoords[0],
+                  face.texcoords[2] - face.texcoords[0]);
+
+    boxes[i / 3] = triangle_box(vertices[0], vertices[1], vertices[2]);
+    bvh::grow(bounds, boxes[i / 3]);
+  }
+
+  if (!gpu_build) {
+    std::vector<unsigned int> order;
+    bvh::build(boxes, out_mesh.bvh, order);
+    reorder(triangles, order);
+    reorder(faces, order);
+  }
+
+  return bounds;
+}
+
+/// <summary>
+/// Hashes the attributes referenced by a vertex of a face, so that
+/// vertices sharing all of them are only stored once.
+/// </summary>
+struct IndexHash
 {
-  auto* mat_loader = MaterialLoader::instance();
-  mat_loader->set(&materials, base_folder);
+  size_t operator()(const tinyobj::index_t& idx) const
+  {
+    size_t h = std::hash<int>()(idx.vertex_index);
+    h = h * 31 + std::hash<int>()(idx.normal_index);
+    return h * 31 + std::hash<int>()(idx.texcoord_index);
+  }
+};
 
-  std::vector<scene::Material> cpu_mat;
+struct IndexEqual
+{
+  bool operator()(const tinyobj::index_t& a, const tinyobj::index_t& b) const
+  {
+    return a.vertex_index == b.vertex_index &&
+           a.normal_index == b.normal_index &&
+           a.texcoord_index == b.texcoord_index;
+  }
+};
+
+/// <summary>
+/// Uploads a mesh using the indexed layout: vertices are shared between
+/// faces, which only store the index of their vertices and their material.
+/// </summary>
+/// <param name="mesh">Mesh obtained from TinyObjLoader.</param>
+/// <param name="attrib">Attributes obtained from TinyObjLoader.</param>
+/// <param name="gpu_build">If false, the BVH is built in `out_mesh',
+/// otherwise the faces are left unsorted and the BVH empty.</param>
+/// <param name="out_mesh">Contains the buffers of the mesh.</param>
+/// <returns>The bounds of the mesh.</returns>
+AABB
+make_indexed_mesh(const tinyobj::mesh_t& mesh, const tinyobj::attrib_t& attrib,
+                  bool gpu_build, cache::MeshData& out_mesh)
+{
+  auto nb_indices = mesh.indices.size();
+  size_t nb_faces = nb_indices / 3;
+
+  std::unordered_map<tinyobj::index_t, unsigned int, IndexHash, IndexEqual>
+    vertex_ids;
+
+  std::vector<float4>& positions = out_mesh.positions;
+  std::vector<float3>& normals = out_mesh.normals;
+  std::vector<float2>& texcoords = out_mesh.texcoords;
+  std::vector<uint4>& indices = out_mesh.indices;
+  indices.resize(nb_faces);
+  std::vector<AABB> boxes(nb_faces);
+  AABB bounds = bvh::emptyBox();
+  for (size_t i = 0; i < nb_indices; i += 3) {
+    unsigned int ids[3];
+    for (size_t v = 0; v < 3; ++v) {
+      tinyobj::index_t idx = mesh.indices[i + v];
+      auto it = vertex_ids.find(idx);
+      if (it != vertex_ids.end()) {
+        ids[v] = it->second;
+        continue;
+      }
+
+      ids[v] = positions.size();
+      vertex_ids.emplace(idx, ids[v]);
+      positions.push_back(
+        make_float4(read_float3(attrib.vertices, idx.vertex_index), 0.0f));
+      normals.push_back(read_float3(attrib.normals, idx.normal_index));
+      texcoords.push_back(read_float2(attrib.texcoords, idx.texcoord_index));
+    }
 
-  mat_loader->load(cpu_mat);
+    indices[i / 3] =
+      make_uint4(ids[0], ids[1], ids[2], mesh.material_ids[i / 3]);
+    boxes[i / 3] = triangle_box(make_float3(positions[ids[0]]),
+                                make_float3(positions[ids[1]]),
+                                make_float3(positions[ids[2]]));
+    bvh::grow(bounds, boxes[i / 3]);
+  }
 
-  // Uploads every materials to the GPU
-  if (cpu_mat.size()) {
-    cudaMalloc(&scene->materials.data,
-               cpu_mat.size() * sizeof(scene::Material));
-    cudaThrowError();
-    cudaMemcpy(scene->materials.data, &cpu_mat[0],
-               cpu_mat.size() * sizeof(scene::Material),
-               cudaMemcpyHostToDevice);
-    cudaThrowError();
+  // Only the indices are sorted, vertices are shared between leaves.
+  if (!gpu_build) {
+    std::vector<unsigned int> order;
+    bvh::build(boxes, out_mesh.bvh, order);
+    reorder(indices, order);
   }
 
-  scene->materials.size = cpu_mat.size();
+  return bounds;
 }
 
+/// <summary>
+/// Builds every meshes along with their BVH, and the top-level BVH over
+/// their instances. Shapes that are copies of a previous one, moved by an
+/// affine transform, only get an instance of its mesh, so that the VRAM
+/// stays proportional to the unique geometry. Meshes large enough to be
+/// built on the GPU are left with an empty BVH.
+/// </summary>
+/// <param name="shapes">Shapes obtained from TinyObjLoader.</param>
+/// <param name="attrib">Attributes obtained from TinyObjLoader.</param>
+/// <param name="indexed">Builds meshes using the indexed layout.</param>
+/// <param name="out_meshes">Contains the buffers of the meshes.</param>
+/// <param name="out_instances">Contains the instances, sorted as the
+/// leaves of the top-level BVH.</param>
+/// <param name="out_bvh">Contains the top-level BVH.</param>
 void
-upload_meshes(const ShapeVector& shapes, const tinyobj::attrib_t& attrib,
-              Buffer<Mesh>& out_meshes)
-{
-  /// The Mesh structure looks like:
-  /// {
-  ///    tinyobj::index_t *indices;
-  ///    size_t nb_indices;
-  ///    int *material_ids;
-  /// }
-  /// `indices' and `material_idx' should also be allocated.
-  size_t nb_meshes = shapes.size();
-
-  // Contains inner pointers allocated on the GPU.
-  std::vector<Mesh> gpu_meshes(nb_meshes);
-
-  for (size_t i = 0; i < nb_meshes; ++i) {
+make_meshes(const ShapeVector& shapes, const tinyobj::attrib_t& attrib,
+            bool indexed, std::vector<cache::MeshData>& out_meshes,
+            std::vector<Instance>& out_instances,
+            std::vector<BVHNode>& out_bvh)
+{
+  size_t nb_shapes = shapes.size();
+
+  out_meshes.clear();
+  // Shape each mesh is made of, and its bounds.
+  std::vector<size_t> mesh_shapes;
+  std::vector<AABB> mesh_boxes;
+  // Meshes by the key of their shape, to find the copies among the others.
+  std::unordered_multimap<size_t, unsigned int> meshes_by_key;
+
+  // Contains the bounds of every instance, used to build the top-level BVH.
+  std::vector<Instance>& instances = out_instances;
+  std::vector<AABB> instance_boxes;
+  instances.clear();
+
+  for (size_t i = 0; i < nb_shapes; ++i) {
     auto& mesh = shapes[i].mesh;
-    auto nb_indices = mesh.indices.size();
-
-    size_t nb_faces = nb_indices / 3;
-
-    Mesh& gpu_mesh = gpu_meshes[i];
-    gpu_mesh.faces.size = nb_faces;
-
-    // Creates the faces on the CPU. This is really gross regarding memory
-    // consumption, but this will really speed up the intersection process
-    // thanks to a better cache efficiency.
-    std::vector<Face> faces(nb_faces);
-    for (size_t i = 0; i < nb_indices; i += 3) {
-      auto& face = faces[i / 3];
-      for (size_t v = 0; v < 3; ++v) {
-        tinyobj::index_t idx = mesh.indices[i + v];
-        // Saves vertex
-        face.vertices[v] =
-          make_float3(attrib.vertices[3 * idx.vertex_index],
-                      attrib.vertices[3 * idx.vertex_index + 1],
-                      attrib.vertices[3 * idx.vertex_index + 2]);
-        // Saves normal
-        face.normals[v] = make_float3(attrib.normals[3 * idx.normal_index],
-                                      attrib.normals[3 * idx.normal_index + 1],
-                                      attrib.normals[3 * idx.normal_index + 2]);
-        // Saves normal
-        face.texcoords[v] =
-          make_float2(attrib.texcoords[2 * idx.texcoord_index],
-                      attrib.texcoords[2 * idx.texcoord_index + 1]);
-      }
-      face.material_id = mesh.material_ids[i / 3];
+    size_t nb_faces = mesh.indices.size() / 3;
+
+    // Empty meshes are not uploaded, they would only
+    // make the top-level BVH bigger.
+    if (nb_faces == 0)
+      continue;
+
+    const size_t key = shape_key(mesh, attrib);
+    const auto candidates = meshes_by_key.equal_range(key);
+    bool found = false;
+    for (auto it = candidates.first; it != candidates.second && !found;
+         ++it) {
+      Affine to_world;
+      found = find_transform(shapes[mesh_shapes[it->second]].mesh, mesh,
+                             attrib, to_world);
+      if (found)
+        instances.push_back(make_instance(to_world, it->second));
+    }
+
+    if (!found) {
+      bool gpu_build = nb_faces >= GPU_BUILD_MIN_FACES;
+
+      const unsigned int mesh_id = out_meshes.size();
+      out_meshes.emplace_back();
+      const AABB bounds =
+        indexed ? make_indexed_mesh(mesh, attrib, gpu_build, out_meshes.back())
+                : make_face_mesh(mesh, attrib, gpu_build, out_meshes.back());
+
+      meshes_by_key.emplace(key, mesh_id);
+      mesh_shapes.push_back(i);
+      mesh_boxes.push_back(bounds);
+      instances.push_back(make_instance(identity(), mesh_id));
+    }
+
+    const Instance& instance = instances.back();
+    instance_boxes.push_back(
+      bvh::transformBox(mesh_boxes[instance.mesh_id], instance.to_world));
+  }
+
+  out_bvh.clear();
+  if (instances.size() == 0)
+    return;
+
+  // Builds the top-level BVH, whose leaves reference the instances.
+  // Instances are sorted the same way faces are inside a mesh.
+  std::vector<unsigned int> order;
+  bvh::build(instance_boxes, out_bvh, order);
+  reorder(instances, order);
+}
+
+/// <summary>
+/// Number of nodes of the BVH of a mesh, built on the GPU when it has
+/// none yet.
+/// </summary>
+size_t
+bvh_size(const cache::MeshData& mesh)
+{
+  if (mesh.bvh.size())
+    return mesh.bvh.size();
+
+  const size_t nb_faces =
+    mesh.indices.size() ? mesh.indices.size() : mesh.triangles.size();
+  return nb_faces ? 2 * nb_faces - 1 : 0;
+}
 
-      // Computes a unique tangent for the whole face
-      float3 edge1 = face.vertices[1] - face.vertices[0];
-      float3 edge2 = face.vertices[2] - face.vertices[0];
-      float2 delta_uv1 = face.texcoords[1] - face.texcoords[0];
-      float2 delta_uv2 = face.texcoords[2] - face.texcoords[0];
+/// <summary>
+/// Size taken by the buffers of a mesh and its BVH in a device arena.
+/// </summary>
+size_t
+mesh_size(const cache::MeshData& mesh)
+{
+  return arena_size(mesh.triangles) + arena_size(mesh.faces) +
+         arena_size(mesh.indices) + arena_size(mesh.positions) +
+         arena_size(mesh.normals) + arena_size(mesh.texcoords) +
+         driver::DeviceArena::alignedSize(bvh_size(mesh) * sizeof(BVHNode));
+}
 
-      float f = 1.0f / (delta_uv1.x * delta_uv2.y - delta_uv2.x * delta_uv1.y);
+/// <summary>
+/// Size taken by the meshes of a scene in its device arena.
+/// </summary>
+size_t
+meshes_arena_size(const std::vector<cache::MeshData>& meshes,
+                  const std::vector<Instance>& instances,
+                  const std::vector<BVHNode>& bvh)
+{
+  size_t size = driver::DeviceArena::alignedSize(meshes.size() * sizeof(Mesh));
+  for (const auto& mesh : meshes) size += mesh_size(mesh);
+  return size + arena_size(instances) + arena_size(bvh);
+}
 
-      face.tangent.x = f * (delta_uv2.y * edge1.x - delta_uv1.y * edge2.x);
-      face.tangent.y = f * (delta_uv2.y * edge1.y - delta_uv1.y * edge2.y);
-      face.tangent.z = f * (delta_uv2.y * edge1.z - delta_uv1.y * edge2.z);
+/// <summary>
+/// Copies `values' to `range', at `offset', which is moved past the copy
+/// with the alignment of a device arena.
+/// </summary>
+template <typename T>
+void
+copy_buffer(const std::vector<T>& values, char* range, size_t& offset,
+            Buffer<T>& out)
+{
+  out.size = values.size();
+  out.data = nullptr;
+  if (out.size == 0)
+    return;
+
+  out.data = reinterpret_cast<T*>(range + offset);
+  std::memcpy(out.data, &values[0], values.size() * sizeof(T));
+  offset += driver::DeviceArena::alignedSize(values.size() * sizeof(T));
+}
+
+/// <summary>
+/// Copies the buffers of a mesh to the range of host memory streaming it,
+/// laid out as `stage_meshes' does in the device arena. A mesh without BVH
+/// gets the range of the one built on the GPU.
+/// </summary>
+void
+copy_mesh(const cache::MeshData& mesh, char* range, Mesh& out)
+{
+  size_t offset = 0;
+  copy_buffer(mesh.triangles, range, offset, out.triangles);
+  copy_buffer(mesh.faces, range, offset, out.faces);
+  copy_buffer(mesh.indices, range, offset, out.indices);
+  copy_buffer(mesh.positions, range, offset, out.positions);
+  copy_buffer(mesh.normals, range, offset, out.normals);
+  copy_buffer(mesh.texcoords, range, offset, out.texcoords);
+  if (mesh.bvh.size())
+    copy_buffer(mesh.bvh, range, offset, out.bvh);
+  else {
+    out.bvh.size = bvh_size(mesh);
+    out.bvh.data =
+      out.bvh.size ? reinterpret_cast<BVHNode*>(range + offset) : nullptr;
+  }
+}
+
+/// <summary>
+/// Stages the meshes in the device arena of their scene. Meshes without BVH
+/// get the range of the one built on the GPU, once the arena is uploaded.
+/// </summary>
+/// <param name="meshes">Buffers of the meshes.</param>
+/// <param name="instances">Instances, sorted as the leaves of the
+/// top-level BVH.</param>
+/// <param name="bvh">Top-level BVH.</param>
+/// <param name="out_meshes">GPU storage of the meshes.</param>
+/// <param name="out_instances">GPU storage of the instances.</param>
+/// <param name="out_bvh">GPU storage of the top-level BVH.</param>
+/// <param name="out_cpu_meshes">Contains a CPU copy of the meshes, with
+/// pointers to the GPU memory.</param>
+void
+stage_meshes(driver::DeviceArena& arena,
+             const std::vector<cache::MeshData>& meshes,
+             const std::vector<Instance>& instances,
+             const std::vector<BVHNode>& bvh, Buffer<Mesh>& out_meshes,
+             Buffer<Instance>& out_instances, Buffer<BVHNode>& out_bvh,
+             std::vector<Mesh>& out_cpu_meshes)
+{
+  out_cpu_meshes.resize(meshes.size());
+  for (size_t i = 0; i < meshes.size(); ++i) {
+    const cache::MeshData& mesh = meshes[i];
+    Mesh& gpu_mesh = out_cpu_meshes[i];
+    stage_buffer(arena, mesh.triangles, gpu_mesh.triangles);
+    stage_buffer(arena, mesh.faces, gpu_mesh.faces);
+    stage_buffer(arena, mesh.indices, gpu_mesh.indices);
+    stage_buffer(arena, mesh.positions, gpu_mesh.positions);
+    stage_buffer(arena, mesh.normals, gpu_mesh.normals);
+    stage_buffer(arena, mesh.texcoords, gpu_mesh.texcoords);
+    if (mesh.bvh.size())
+      stage_buffer(arena, mesh.bvh, gpu_mesh.bvh);
+    else {
+      gpu_mesh.bvh.size = bvh_size(mesh);
+      gpu_mesh.bvh.data = static_cast<BVHNode*>(
+        arena.allocate(gpu_mesh.bvh.size * sizeof(BVHNode)));
     }
+  }
 
-    if (faces.size() == 0)
+  stage_buffer(arena, out_cpu_meshes, out_meshes);
+  stage_buffer(arena, instances, out_instances);
+  stage_buffer(arena, bvh, out_bvh);
+}
+
+/// <summary>
+/// Copies back the meshes whose BVH has been built on the GPU, their faces
+/// having been sorted there, so that they can be cached.
+/// </summary>
+void
+download_built_meshes(const std::vector<Mesh>& cpu_meshes,
+                      std::vector<cache::MeshData>& meshes)
+{
+  for (size_t i = 0; i < cpu_meshes.size(); ++i) {
+    const Mesh& gpu_mesh = cpu_meshes[i];
+    cache::MeshData& mesh = meshes[i];
+    if (mesh.bvh.size())
       continue;
 
-    // Uploads faces to the GPU
-    size_t nb_byte_faces = gpu_mesh.faces.size * sizeof(Face);
-    cudaMalloc(&gpu_mesh.faces.data, nb_byte_faces);
-    cudaThrowError();
-    cudaMemcpy(gpu_mesh.faces.data, &faces[0], nb_byte_faces,
-               cudaMemcpyHostToDevice);
-    cudaThrowError();
+    download_buffer(gpu_mesh.triangles, mesh.triangles);
+    download_buffer(gpu_mesh.faces, mesh.faces);
+    download_buffer(gpu_mesh.indices, mesh.indices);
+    download_buffer(gpu_mesh.bvh, mesh.bvh);
+  }
+}
+
+/// <summary>
+/// Lists the MTL files referenced by an OBJ file.
+/// </summary>
+std::vector<std::string>
+mtl_files(const std::string& obj_path, const std::string& mtl_dir)
+{
+  std::vector<std::string> files;
+  std::ifstream file(obj_path);
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.compare(0, 7, "mtllib ") != 0)
+      continue;
+
+    std::stringstream iss(line.substr(7));
+    std::string name;
+    while (iss >> name) files.push_back(mtl_dir + name);
+  }
+  return files;
+}
+
+/// <summary>
+/// Finds the OBJ file of a scene, and the folder of its materials.
+/// </summary>
+/// <param name="objfile">Path of the OBJ, relative to the scene
+/// file.</param>
+void
+obj_paths(const std::string& scene_path, const std::string& objfile,
+          std::string& out_obj_path, std::string& out_mtl_dir)
+{
+  std::string base_dir = "";
+  std::string::size_type pos = scene_path.find_last_of('/');
+  if (pos != std::string::npos) {
+    base_dir = scene_path.substr(0, pos) + "/";
+    out_mtl_dir = base_dir;
+    out_obj_path = base_dir + objfile;
+  }
+
+  // Extracts basedir to find MTL if any.
+  pos = objfile.find_last_of('/');
+  if (pos != std::string::npos)
+    out_mtl_dir = base_dir + "/" + objfile.substr(0, pos) + "/";
+}
+
+/// <summary>
+/// Reads the materials of the given MTL files, as TinyObjLoader does for
+/// the MTL files referenced by an OBJ.
+/// </summary>
+/// <returns>False if a file cannot be opened.</returns>
+bool
+load_mtl_files(const std::vector<std::string>& paths,
+               MaterialVector& out_materials)
+{
+  std::map<std::string, int> material_map;
+  out_materials.clear();
+  for (const auto& path : paths) {
+    std::ifstream file(path);
+    if (!file.is_open())
+      return false;
+
+    std::string warning;
+    tinyobj::LoadMtl(&material_map, &out_materials, &file, &warning);
+  }
+  return true;
+}
+
+/// <summary>
+/// Compares what the materials loaded from `a' and `b' are made of.
+/// </summary>
+bool
+same_material(const tinyobj::material_t& a, const tinyobj::material_t& b)
+{
+  for (int c = 0; c < 3; ++c) {
+    if (a.diffuse[c] != b.diffuse[c] || a.specular[c] != b.specular[c])
+      return false;
+  }
+  return a.ior == b.ior && a.diffuse_texname == b.diffuse_texname &&
+         a.specular_texname == b.specular_texname &&
+         a.bump_texname == b.bump_texname &&
+         a.normal_texname == b.normal_texname;
+}
+
+bool
+same_lights(const std::vector<LightProp>& a, const std::vector<LightProp>& b)
+{
+  return a.size() == b.size() &&
+         (a.empty() ||
+          std::memcmp(&a[0], &b[0], a.size() * sizeof(LightProp)) == 0);
+}
+
+/// <summary>
+/// FNV-1a hash of the buffers of a mesh.
+/// </summary>
+class MeshHash
+{
+public:
+  template <typename T>
+  MeshHash& add(const std::vector<T>& values)
+  {
+    const unsigned char* bytes =
+      reinterpret_cast<const unsigned char*>(values.data());
+    for (size_t i = 0; i < values.size() * sizeof(T); ++i) {
+      _hash ^= bytes[i];
+      _hash *= 1099511628211ull;
+    }
+    return *this;
   }
 
-  size_t nb_byte_meshes = nb_meshes * sizeof(Mesh);
-  out_meshes.size = nb_meshes;
-  cudaMalloc(&out_meshes.data, nb_byte_meshes);
+  inline uint64_t value() const { return _hash; }
+
+private:
+  uint64_t _hash = 14695981039346656037ull;
+};
+
+uint64_t
+hash_mesh(const cache::MeshData& mesh)
+{
+  return MeshHash()
+    .add(mesh.triangles)
+    .add(mesh.faces)
+    .add(mesh.indices)
+    .add(mesh.positions)
+    .add(mesh.normals)
+    .add(mesh.texcoords)
+    .add(mesh.bvh)
+    .value();
+}
+
+/// <summary>
+/// FNV-1a hash of what a refit keeps of a mesh: the indices of an indexed
+/// mesh, or the UVs and materials of the faces otherwise, faces keeping
+/// them being taken as the same faces.
+/// </summary>
+uint64_t
+hash_topology(const cache::MeshData& mesh)
+{
+  if (mesh.indices.size())
+    return MeshHash().add(mesh.indices).value();
+
+  std::vector<float2> texcoords;
+  std::vector<unsigned int> material_ids;
+  texcoords.reserve(3 * mesh.faces.size());
+  material_ids.reserve(mesh.faces.size());
+  for (const auto& face : mesh.faces) {
+    texcoords.insert(texcoords.end(), face.texcoords, face.texcoords + 3);
+    material_ids.push_back(face.material_id);
+  }
+  return MeshHash().add(texcoords).add(material_ids).value();
+}
+
+/// <summary>
+/// Whether a mesh built from the sources has the size of an uploaded one,
+/// and can be copied over it.
+/// </summary>
+bool
+same_layout(const cache::MeshData& mesh, const Mesh& gpu_mesh)
+{
+  return mesh.triangles.size() == gpu_mesh.triangles.size &&
+         mesh.faces.size() == gpu_mesh.faces.size &&
+         mesh.indices.size() == gpu_mesh.indices.size &&
+         mesh.positions.size() == gpu_mesh.positions.size &&
+         mesh.normals.size() == gpu_mesh.normals.size &&
+         mesh.texcoords.size() == gpu_mesh.texcoords.size &&
+         bvh_size(mesh) == gpu_mesh.bvh.size;
+}
+
+/// <summary>
+/// Copies `values' over a buffer of the same size, on the GPU or in the
+/// host memory streaming the meshes.
+/// </summary>
+template <typename T>
+void
+update_buffer(const std::vector<T>& values, const Buffer<T>& out)
+{
+  if (values.empty())
+    return;
+
+  cudaMemcpy(out.data, &values[0], values.size() * sizeof(T),
+             cudaMemcpyDefault);
   cudaThrowError();
-  cudaMemcpy(out_meshes.data, &gpu_meshes[0], nb_byte_meshes,
-             cudaMemcpyHostToDevice);
+}
+
+/// <summary>
+/// Copies a buffer over one of the same size, both being on a GPU or in the
+/// host memory streaming the meshes.
+/// </summary>
+template <typename T>
+void
+copy_buffer(const Buffer<T>& in, const Buffer<T>& out)
+{
+  if (in.size == 0)
+    return;
+
+  cudaMemcpy(out.data, in.data, in.size * sizeof(T), cudaMemcpyDefault);
   cudaThrowError();
 }
+
+/// <summary>
+/// Copies a mesh over the uploaded one having the same layout, and
+/// rebuilds its BVH on the GPU when it has none.
+/// </summary>
+/// <param name="out_order">Contains the order of the faces sorted by the
+/// build, empty when the BVH comes from the CPU.</param>
+void
+update_mesh(const cache::MeshData& mesh, Mesh& gpu_mesh,
+            std::vector<unsigned int>& out_order)
+{
+  update_buffer(mesh.triangles, gpu_mesh.triangles);
+  update_buffer(mesh.faces, gpu_mesh.faces);
+  update_buffer(mesh.indices, gpu_mesh.indices);
+  update_buffer(mesh.positions, gpu_mesh.positions);
+  update_buffer(mesh.normals, gpu_mesh.normals);
+  update_buffer(mesh.texcoords, gpu_mesh.texcoords);
+  if (mesh.bvh.size()) {
+    update_buffer(mesh.bvh, gpu_mesh.bvh);
+    out_order.clear();
+  } else
+    lbvh::build(gpu_mesh, out_order);
+}
+
+/// <summary>
+/// Copies the moved vertices of a mesh over the uploaded one, built on the
+/// GPU from the same faces, and refits its BVH instead of rebuilding it.
+/// The faces are sorted as the build did, the indices of an indexed mesh
+/// are then the uploaded ones.
+/// </summary>
+/// <param name="order">Order of the faces sorted by the build.</param>
+void
+refit_mesh(cache::MeshData& mesh, const std::vector<unsigned int>& order,
+           const lbvh::RefitScratch& scratch, Mesh& gpu_mesh)
+{
+  if (mesh.indices.size()) {
+    update_buffer(mesh.positions, gpu_mesh.positions);
+    update_buffer(mesh.normals, gpu_mesh.normals);
+    update_buffer(mesh.texcoords, gpu_mesh.texcoords);
+  } else {
+    reorder(mesh.triangles, order);
+    reorder(mesh.faces, order);
+    update_buffer(mesh.triangles, gpu_mesh.triangles);
+    update_buffer(mesh.faces, gpu_mesh.faces);
+  }
+  lbvh::refit(gpu_mesh, scratch);
+}
 }
 
 Scene::Scene(const std::string& filepath)
   : _filepath(filepath)
+  , _loaded(false)
+  , _cached(false)
   , _uploaded(false)
   , _ready(false)
+  , _indexed(false)
   , _scene_data(nullptr)
   , _d_scene_data(nullptr)
+  , _geometry_cache(0)
 {
 }
 
 Scene::Scene(const std::string&& filepath)
   : _filepath(filepath)
+  , _loaded(false)
+  , _cached(false)
   , _uploaded(false)
   , _ready(false)
+  , _indexed(false)
   , _scene_data(nullptr)
   , _d_scene_data(nullptr)
+  , _geometry_cache(0)
 {
 }
 
+void
+Scene::load()
+{
+  if (_loaded)
+    return;
+  _loaded = true;
+
+  // A valid cache spares the parsing of all the sources.
+  if (cache::read(_filepath, _indexed, _cache)) {
+    _init_camera = _cache.camera;
+    _cubemap_path = _cache.cubemap_path;
+    _mtl_dir = _cache.mtl_dir;
+    _lights.swap(_cache.lights);
+    _materials.swap(_cache.materials);
+
+    // Only the path of the OBJ is read from the scene file, to list the
+    // sources of the scene.
+    std::string objfilepath;
+    std::string mtl_dir;
+    std::vector<LightProp> lights;
+    scene::Camera camera;
+    std::string cubemap;
+    parse_scene(_filepath, lights, camera, objfilepath, cubemap);
+    obj_paths(_filepath, objfilepath, _obj_path, mtl_dir);
+
+    _cached = true;
+    _ready = true;
+    return;
+  }
+  _cache = cache::SceneCache();
+
+  std::string objfilepath;
+
+  _lights.clear();
+  parse_scene(_filepath, _lights, _init_camera, objfilepath, _cubemap_path);
+  obj_paths(_filepath, objfilepath, _obj_path, _mtl_dir);
+
+  _ready = tinyobj::LoadObj(&_attrib, &_shapes, &_materials, &_load_error,
+                            _obj_path.c_str(), _mtl_dir.c_str());
+
+  if (!_ready)
+    std::cerr << "arttracer: Scene.load(): fail to load OBJ.\n"
+              << _load_error << std::endl;
+}
+
 void
 Scene::upload(scene::Camera* camera)
 {
   if (_uploaded)
     return;
 
-  std::vector<tinyobj::shape_t> shapes;
-  std::vector<tinyobj::material_t> materials;
-  tinyobj::attrib_t attrib;
+  load();
+
+  if (camera)
+    *camera = _init_camera;
+
+  if (!_ready)
+    return;
 
   // _sceneData is allocated on the heap,
   // and allows to handle cudaMalloc & cudaFree
   _scene_data = new scene::SceneData;
 
+  upload_gpu(_shapes, _materials, _attrib, _mtl_dir);
+
+  // The CPU copy is not needed anymore.
+  std::vector<tinyobj::shape_t>().swap(_shapes);
+  std::vector<tinyobj::material_t>().swap(_materials);
+  std::vector<LightProp>().swap(_lights);
+  _attrib = tinyobj::attrib_t();
+  _cache = cache::SceneCache();
+
+  _uploaded = true;
+}
+
+void
+Scene::describe()
+{
   std::string objfilepath;
-  std::string base_dir = "";
-  std::string mtl_dir = "";
-  std::string full_obj_path = "";
+  std::vector<LightProp> lights;
+  parse_scene(_filepath, lights, _init_camera, objfilepath, _cubemap_path);
+}
 
-  parse_scene(_filepath, *_scene_data, _init_camera, objfilepath,
-              _cubemap_path);
+void
+Scene::release()
+{
+  if (!_uploaded || !_ready)
+    return;
 
-  if (camera)
-    *camera = _init_camera;
+  release_gpu();
+  _uploaded = false;
 
-  std::string::size_type pos = _filepath.find_last_of('/');
-  if (pos != std::string::npos) {
-    base_dir = _filepath.substr(0, pos) + "/";
-    mtl_dir = base_dir;
-    full_obj_path = base_dir + objfilepath;
+  // The sources will be read again by the next upload,
+  // most likely from the cache.
+  _loaded = false;
+  _cached = false;
+}
+
+void
+Scene::loadMaterials()
+{
+  load();
+  if (_ready)
+    load_materials(_materials, _mtl_dir, _cpu_materials);
+}
+
+std::vector<int>
+Scene::getTextureIds() const
+{
+  std::vector<int> ids;
+  for (const auto& mat : _cpu_materials) {
+    if (mat.diffuse_spec_map >= 0)
+      ids.push_back(mat.diffuse_spec_map);
+    if (mat.normal_map >= 0)
+      ids.push_back(mat.normal_map);
   }
+  return ids;
+}
 
-  // Extracts basedir to find MTL if any.
-  pos = objfilepath.find_last_of('/');
-  if (pos != std::string::npos)
-    mtl_dir = base_dir + "/" + objfilepath.substr(0, pos) + "/";
+std::vector<std::string>
+Scene::getSources() const
+{
+  std::vector<std::string> sources = mtl_files(_obj_path, _mtl_dir);
+  sources.insert(sources.begin(), _obj_path);
+  sources.insert(sources.begin(), _filepath);
+  return sources;
+}
 
-  _ready = tinyobj::LoadObj(&attrib, &shapes, &materials, &_load_error,
-                            full_obj_path.c_str(), mtl_dir.c_str());
+unsigned int
+Scene::reload(const std::vector<std::string>& modified)
+{
+  if (!_uploaded)
+    return SCENE_UNCHANGED;
 
-  if (!_ready) {
-    std::cerr << "arttracer: Scene.upload(): fail to load OBJ.\n"
-              << _load_error << std::endl;
+  auto is_modified = [&](const std::string& path) {
+    return std::find(modified.begin(), modified.end(), path) !=
+           modified.end();
+  };
 
-    delete _scene_data;
+  std::string objfilepath;
+  std::string cubemap;
+  std::vector<LightProp> lights;
+  scene::Camera camera;
+  parse_scene(_filepath, lights, camera, objfilepath, cubemap);
+  // The scene file may be read while being saved.
+  if (objfilepath.empty())
+    return SCENE_UNCHANGED;
+
+  std::string obj_path;
+  std::string mtl_dir;
+  obj_paths(_filepath, objfilepath, obj_path, mtl_dir);
+  _init_camera = camera;
+
+  const std::vector<std::string> mtl_paths = mtl_files(obj_path, mtl_dir);
+  bool mtl_modified = false;
+  for (const auto& path : mtl_paths) mtl_modified |= is_modified(path);
+
+  // Another OBJ is another scene.
+  bool released = obj_path != _obj_path || mtl_dir != _mtl_dir;
+
+  unsigned int changes = SCENE_UNCHANGED;
+  MaterialVector materials;
+  _reloaded_meshes.clear();
+  if (!released && is_modified(obj_path)) {
+    tinyobj::attrib_t attrib;
+    ShapeVector shapes;
+    std::string error;
+    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &error,
+                          obj_path.c_str(), mtl_dir.c_str())) {
+      std::cerr << "arttracer: Scene.reload(): fail to load OBJ.\n"
+                << error << std::endl;
+      return SCENE_UNCHANGED;
+    }
+    mtl_modified = true;
+
+    std::vector<cache::MeshData> meshes;
+    std::vector<Instance> instances;
+    std::vector<BVHNode> bvh;
+    make_meshes(shapes, attrib, _indexed, meshes, instances, bvh);
+
+    released = meshes.size() != _meshes.size() ||
+               instances.size() != _scene_data->instances.size ||
+               bvh.size() != _scene_data->bvh.size;
+    for (size_t i = 0; i < meshes.size() && !released; ++i)
+      released = !same_layout(meshes[i], _meshes[i]);
+
+    if (!released) {
+      // Only the meshes whose buffers changed are copied. The BVHs built
+      // on the GPU are refit when only the vertices of their faces moved,
+      // and rebuilt otherwise, as are the ones read from the cache since
+      // the order of their faces is unknown.
+      _mesh_hashes.resize(meshes.size(), 0);
+      _topology_hashes.resize(meshes.size(), 0);
+      _face_orders.resize(meshes.size());
+      for (size_t i = 0; i < meshes.size(); ++i) {
+        const uint64_t hash = hash_mesh(meshes[i]);
+        if (hash == _mesh_hashes[i])
+          continue;
+
+        const uint64_t topology = hash_topology(meshes[i]);
+        if (_face_orders[i].size() && topology == _topology_hashes[i])
+          refit_mesh(meshes[i], _face_orders[i], _refit_scratch, _meshes[i]);
+        else
+          update_mesh(meshes[i], _meshes[i], _face_orders[i]);
+        _reloaded_meshes.push_back(i);
+        _mesh_hashes[i] = hash;
+        _topology_hashes[i] = topology;
+      }
+      update_buffer(instances, _scene_data->instances);
+      update_buffer(bvh, _scene_data->bvh);
+
+      // Streamed meshes are updated in host memory, their copies in the
+      // cache are stale.
+      cudaDeviceSynchronize();
+      _geometry.invalidate();
+      changes |= SCENE_GEOMETRY;
+    }
+  } else if (!released && mtl_modified &&
+             !load_mtl_files(mtl_paths, materials))
+    return SCENE_UNCHANGED;
+
+  if (!released && mtl_modified) {
+    // Material ids are indices, another number of materials moves them.
+    released = materials.size() != _source_materials.size();
+
+    MaterialVector changed;
+    std::vector<size_t> ids;
+    for (size_t i = 0; i < materials.size() && !released; ++i) {
+      if (same_material(materials[i], _source_materials[i]))
+        continue;
+      changed.push_back(materials[i]);
+      ids.push_back(i);
+    }
 
-    _scene_data = nullptr;
-    _d_scene_data = nullptr;
-    return;
+    if (!released && ids.size()) {
+      // The textures of the replaced materials are only recycled once the
+      // new ones are loaded, their GPU copies being still resident.
+      MaterialLoader* loader = MaterialLoader::instance();
+      std::vector<Material> loaded;
+      loader->set(&changed, mtl_dir)->load(loaded);
+      for (size_t k = 0; k < ids.size(); ++k) {
+        loader->recycle(_cpu_materials[ids[k]]);
+        _cpu_materials[ids[k]] = loaded[k];
+        cudaMemcpy(_scene_data->materials.data + ids[k], &loaded[k],
+                   sizeof(Material), cudaMemcpyHostToDevice);
+        cudaThrowError();
+      }
+      _source_materials.swap(materials);
+      changes |= SCENE_MATERIALS;
+    }
   }
 
-  upload_gpu(shapes, materials, attrib, mtl_dir);
+  if (!released && !same_lights(lights, _source_lights)) {
+    std::vector<LightProp> sorted = lights;
+    std::vector<BVHNode> light_bvh;
+    std::vector<LightPower> light_power;
+    make_light_bvh(sorted, light_bvh, light_power);
+
+    released = sorted.size() != _scene_data->lights.size ||
+               light_bvh.size() != _scene_data->light_bvh.size;
+    if (!released) {
+      update_buffer(sorted, _scene_data->lights);
+      update_buffer(light_bvh, _scene_data->light_bvh);
+      update_buffer(light_power, _scene_data->light_power);
+      _source_lights.swap(lights);
+      changes |= SCENE_LIGHTS;
+    }
+  }
 
-  _uploaded = true;
+  if (!released)
+    return changes;
+
+  // The next upload reads the sources again, the cache being outdated,
+  // and loads the materials again.
+  release();
+  for (const auto& mat : _cpu_materials)
+    MaterialLoader::instance()->recycle(mat);
+  _cpu_materials.clear();
+  return SCENE_RELEASED;
 }
 
 void
-Scene::release()
+Scene::copyReload(const Scene& source, unsigned int changes)
 {
-  if (!_uploaded || !_ready)
+  if (!_uploaded)
     return;
 
-  release_gpu();
-  _uploaded = false;
+  // The materials are the ones of the source, which recycles their
+  // textures itself.
+  if (changes & SCENE_RELEASED) {
+    release();
+    _cpu_materials.clear();
+    return;
+  }
+
+  const SceneData& in = *source._scene_data;
+  if (changes & SCENE_LIGHTS) {
+    copy_buffer(in.lights, _scene_data->lights);
+    copy_buffer(in.light_bvh, _scene_data->light_bvh);
+    copy_buffer(in.light_power, _scene_data->light_power);
+  }
+
+  // The materials keep the ids of the textures loaded by the source.
+  if (changes & SCENE_MATERIALS) {
+    _cpu_materials = source._cpu_materials;
+    copy_buffer(in.materials, _scene_data->materials);
+  }
+
+  if (changes & SCENE_GEOMETRY) {
+    // The BVHs were rebuilt or refit by the source, and are copied along.
+    for (unsigned int i : source._reloaded_meshes) {
+      const Mesh& mesh = source._meshes[i];
+      copy_buffer(mesh.triangles, _meshes[i].triangles);
+      copy_buffer(mesh.faces, _meshes[i].faces);
+      copy_buffer(mesh.indices, _meshes[i].indices);
+      copy_buffer(mesh.positions, _meshes[i].positions);
+      copy_buffer(mesh.normals, _meshes[i].normals);
+      copy_buffer(mesh.texcoords, _meshes[i].texcoords);
+      copy_buffer(mesh.bvh, _meshes[i].bvh);
+    }
+    copy_buffer(in.instances, _scene_data->instances);
+    copy_buffer(in.bvh, _scene_data->bvh);
+
+    // Streamed meshes were updated in host memory, their copies in the
+    // cache are stale.
+    cudaDeviceSynchronize();
+    _geometry.invalidate();
+  }
 }
 
 void
@@ -373,50 +1516,148 @@ Scene::upload_gpu(const std::vector<tinyobj::shape_t>& shapes,
                   const tinyobj::attrib_t attrib,
                   const std::string& base_folder)
 {
-  //
-  // Lines below copy adresses given by the GPU the stack-allocated
-  // SceneData struct.
-  // Takes also care of making cudaMemcpy of the data.
-  //
-  upload_materials(materials, _scene_data, base_folder);
-  upload_meshes(shapes, attrib, _scene_data->meshes);
-
-  // Now the sceneData struct contains pointers to memory adresses
-  // mapped by the GPU, we can send the whole struct to the GPU.
-  cudaMalloc(&_d_scene_data, sizeof(struct SceneData));
-  cudaThrowError();
-  cudaMemcpy(_d_scene_data, _scene_data, sizeof(struct SceneData),
-             cudaMemcpyHostToDevice);
-  cudaThrowError();
+  load_materials(materials, base_folder, _cpu_materials);
+  // The meshes are built on the CPU first, so that the size of the whole
+  // scene is known before allocating it.
+  _mesh_hashes.clear();
+  _topology_hashes.clear();
+  if (!_cached) {
+    make_meshes(shapes, attrib, _indexed, _cache.meshes, _cache.instances,
+                _cache.bvh);
+    for (const auto& mesh : _cache.meshes) {
+      _mesh_hashes.push_back(hash_mesh(mesh));
+      _topology_hashes.push_back(hash_topology(mesh));
+    }
+  }
+  _source_lights = _lights;
+  _source_materials = materials;
+
+  // The BVH of the lights is cheap enough to be rebuilt at each upload.
+  std::vector<BVHNode> light_bvh;
+  std::vector<LightPower> light_power;
+  make_light_bvh(_lights, light_bvh, light_power);
+
+  // Meshes larger than the geometry cache stay in host memory, and are
+  // streamed through the cache instead of being part of the arena.
+  size_t meshes_size = 0;
+  for (const auto& mesh : _cache.meshes) meshes_size += mesh_size(mesh);
+  const bool streamed = _geometry_cache && meshes_size > _geometry_cache;
+
+  std::vector<unsigned int> mesh_states;
+  size_t size = arena_size(_cpu_materials) + arena_size(_lights) +
+                arena_size(light_bvh) + arena_size(light_power) +
+                driver::DeviceArena::alignedSize(sizeof(SceneData));
+  if (streamed) {
+    std::vector<size_t> sizes;
+    for (const auto& mesh : _cache.meshes) sizes.push_back(mesh_size(mesh));
+    _geometry.init(sizes, _geometry_cache);
+
+    _meshes.resize(_cache.meshes.size());
+    for (size_t i = 0; i < _meshes.size(); ++i)
+      copy_mesh(_cache.meshes[i], _geometry.hostRange(i), _meshes[i]);
+
+    mesh_states.assign(_meshes.size(), MESH_PAGED_OUT);
+    size += arena_size(_meshes) + arena_size(_cache.instances) +
+            arena_size(_cache.bvh) + arena_size(mesh_states);
+  } else
+    size += meshes_arena_size(_cache.meshes, _cache.instances, _cache.bvh);
+
+  // Refits run at each frame of an animation, their scratch is allocated
+  // once for the largest BVH.
+  size_t refit_nodes = _cache.bvh.size();
+  for (const auto& mesh : _cache.meshes)
+    refit_nodes = std::max(refit_nodes, bvh_size(mesh));
+  size += driver::DeviceArena::alignedSize(
+    lbvh::RefitScratch::bytes((unsigned int)refit_nodes));
+
+  // Everything is sub-allocated from a single block of VRAM, and sent to
+  // the GPU with a single copy. SceneData comes last, once it contains
+  // the pointers to the other buffers.
+  _arena.reserve(size);
+  stage_buffer(_arena, _cpu_materials, _scene_data->materials);
+  stage_buffer(_arena, _lights, _scene_data->lights);
+  stage_buffer(_arena, light_bvh, _scene_data->light_bvh);
+  stage_buffer(_arena, light_power, _scene_data->light_power);
+  if (streamed) {
+    stage_buffer(_arena, _meshes, _scene_data->meshes);
+    stage_buffer(_arena, _cache.instances, _scene_data->instances);
+    stage_buffer(_arena, _cache.bvh, _scene_data->bvh);
+  } else
+    stage_meshes(_arena, _cache.meshes, _cache.instances, _cache.bvh,
+                 _scene_data->meshes, _scene_data->instances,
+                 _scene_data->bvh, _meshes);
+  stage_buffer(_arena, mesh_states, _scene_data->mesh_states);
+  _refit_scratch.nb_nodes = (unsigned int)refit_nodes;
+  _refit_scratch.data = static_cast<int*>(
+    _arena.allocate(lbvh::RefitScratch::bytes(_refit_scratch.nb_nodes)));
+  _d_scene_data = static_cast<SceneData*>(
+    _arena.stage(_scene_data, sizeof(struct SceneData)));
+  _arena.upload();
+
+  // Large meshes are sorted and get their BVH on the GPU, directly in
+  // their ranges of the arena, or of the host memory when streamed.
+  _face_orders.assign(_meshes.size(), std::vector<unsigned int>());
+  for (size_t i = 0; i < _meshes.size(); ++i) {
+    if (_cache.meshes[i].bvh.empty())
+      lbvh::build(_meshes[i], _face_orders[i]);
+  }
+  if (streamed) {
+    cudaDeviceSynchronize();
+    _geometry.bind(_meshes, _scene_data->meshes.data,
+                   _scene_data->mesh_states.data);
+  }
+
+  if (!_cached) {
+    // Caches the final buffers, so that the next launches
+    // do not have to parse the sources, nor build the BVHs.
+    download_built_meshes(_meshes, _cache.meshes);
+    _cache.camera = _init_camera;
+    _cache.cubemap_path = _cubemap_path;
+    _cache.lights = _lights;
+    _cache.materials = materials;
+    _cache.mtl_dir = base_folder;
+
+    std::vector<std::string> sources = mtl_files(_obj_path, _mtl_dir);
+    sources.insert(sources.begin(), _obj_path);
+    cache::write(_filepath, _indexed, sources, _cache);
+  }
 }
 
 void
-Scene::release_gpu()
+Scene::streamGeometry(cudaStream_t stream)
 {
-  // First: Frees meshes by first retrieving pointer from the GPU,
-  // and then calling cudaFree to free GPU pointed adress.
-  // Here, we have a depth of 2 regarding the allocation.
+  if (_uploaded)
+    _geometry.update(stream);
+}
 
-  size_t nb_meshes = _scene_data->meshes.size;
-  scene::Mesh* meshes = new scene::Mesh[nb_meshes];
-  cudaMemcpy(meshes, _scene_data->meshes.data, nb_meshes * sizeof(scene::Mesh),
-             cudaMemcpyDeviceToHost);
+void
+Scene::refit()
+{
+  if (!_uploaded)
+    return;
 
-  for (size_t i = 0; i < nb_meshes; ++i) {
-    const Mesh& mesh = meshes[i];
-    cudaFree(mesh.faces.data);
-  }
-  delete[] meshes;
+  // The refits share the scratch, and are ordered by the default stream.
+  for (const auto& mesh : _meshes)
+    lbvh::refit(mesh, _refit_scratch);
+
+  // Streamed meshes are refit in host memory, their copies in the cache
+  // are stale.
+  _geometry.invalidate();
 
-  // Frees meshes
-  cudaFree(_scene_data->meshes.data);
-  // Frees materials
-  cudaFree(_scene_data->materials.data);
-  // Frees lights
-  cudaFree(_scene_data->lights.data);
+  lbvh::refitTopLevel(_scene_data->instances, _scene_data->meshes,
+                      _scene_data->bvh, _refit_scratch);
+}
 
-  // SECOND: we can now delete the struct pointer.
-  cudaFree(_d_scene_data);
+void
+Scene::release_gpu()
+{
+  // Every buffer of the scene, SceneData included, is part of the arena,
+  // but the streamed meshes.
+  _geometry.release();
+  _arena.release();
+  _refit_scratch = lbvh::RefitScratch();
+  _meshes.clear();
+  _d_scene_data = nullptr;
 
   delete _scene_data;
 
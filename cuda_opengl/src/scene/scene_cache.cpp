@@ -0,0 +1,339 @@
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <scene/scene_cache.h>
+
+namespace scene {
+namespace cache {
+namespace {
+/// <summary>
+/// Bumped whenever the content of the cache changes.
+/// </summary>
+constexpr uint32_t VERSION = 2;
+
+/// <summary>
+/// Buffers start on this alignment inside the file, so that they can
+/// be used in place if the file is mapped in memory.
+/// </summary>
+constexpr uint64_t ALIGNMENT = 16;
+
+const char MAGIC[4] = { 'A', 'R', 'T', 'C' };
+
+/// <summary>
+/// Identifies the layout of the cached structures, which depends on the
+/// compiler and the platform.
+/// </summary>
+struct Header
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t indexed;
+  uint32_t sizes[5];
+  uint64_t scene_hash;
+};
+
+/// <summary>
+/// A source of the scene, identified by its size and modification time.
+/// </summary>
+struct Source
+{
+  std::string path;
+  uint64_t size;
+  int64_t mtime;
+};
+
+/// <summary>
+/// Hashes the content of a file, using 64 bits FNV-1a.
+/// </summary>
+/// <returns>False if the file could not be read.</returns>
+bool
+hashFile(const std::string& path, uint64_t& out_hash)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+    return false;
+
+  out_hash = 14695981039346656037ull;
+  char buffer[4096];
+  while (file.read(buffer, sizeof(buffer)) || file.gcount()) {
+    for (std::streamsize i = 0; i < file.gcount(); ++i) {
+      out_hash ^= (unsigned char)buffer[i];
+      out_hash *= 1099511628211ull;
+    }
+  }
+  return true;
+}
+
+bool
+statFile(const std::string& path, Source& out)
+{
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return false;
+
+  out.path = path;
+  out.size = st.st_size;
+  out.mtime = st.st_mtime;
+  return true;
+}
+
+bool
+makeHeader(const std::string& scene_path, bool indexed, Header& out)
+{
+  // Clears the padding, headers being compared as a whole.
+  std::memset(&out, 0, sizeof(Header));
+  std::memcpy(out.magic, MAGIC, sizeof(MAGIC));
+  out.version = VERSION;
+  out.indexed = indexed;
+  out.sizes[0] = sizeof(Triangle);
+  out.sizes[1] = sizeof(Face);
+  out.sizes[2] = sizeof(BVHNode);
+  out.sizes[3] = sizeof(LightProp);
+  out.sizes[4] = sizeof(Instance);
+  return hashFile(scene_path, out.scene_hash);
+}
+
+class Writer
+{
+public:
+  Writer(std::ofstream& out)
+    : _out(out)
+  {}
+
+  template <typename T>
+  void pod(const T& value)
+  {
+    _out.write((const char*)&value, sizeof(T));
+  }
+
+  void string(const std::string& s)
+  {
+    pod((uint64_t)s.size());
+    _out.write(s.data(), s.size());
+  }
+
+  /// <summary>
+  /// Writes the size of a buffer, and its content aligned on `ALIGNMENT'.
+  /// </summary>
+  template <typename T>
+  void buffer(const std::vector<T>& values)
+  {
+    pod((uint64_t)values.size());
+
+    static const char padding[ALIGNMENT] = {};
+    uint64_t offset = (uint64_t)_out.tellp();
+    _out.write(padding, (ALIGNMENT - offset % ALIGNMENT) % ALIGNMENT);
+
+    if (values.size())
+      _out.write((const char*)&values[0], values.size() * sizeof(T));
+  }
+
+  bool good() const { return _out.good(); }
+
+private:
+  std::ofstream& _out;
+};
+
+class Reader
+{
+public:
+  Reader(std::ifstream& in)
+    : _in(in)
+  {}
+
+  template <typename T>
+  bool pod(T& value)
+  {
+    return (bool)_in.read((char*)&value, sizeof(T));
+  }
+
+  bool string(std::string& s)
+  {
+    uint64_t size;
+    if (!pod(size))
+      return false;
+
+    s.resize(size);
+    return size == 0 || _in.read(&s[0], size);
+  }
+
+  template <typename T>
+  bool buffer(std::vector<T>& values)
+  {
+    uint64_t size;
+    if (!pod(size))
+      return false;
+
+    uint64_t offset = (uint64_t)_in.tellg();
+    _in.seekg((ALIGNMENT - offset % ALIGNMENT) % ALIGNMENT, std::ios::cur);
+
+    values.resize(size);
+    return size == 0 ||
+           _in.read((char*)&values[0], values.size() * sizeof(T));
+  }
+
+private:
+  std::ifstream& _in;
+};
+
+void
+writeMaterial(Writer& w, const tinyobj::material_t& mat)
+{
+  for (int c = 0; c < 3; ++c) w.pod(mat.diffuse[c]);
+  for (int c = 0; c < 3; ++c) w.pod(mat.specular[c]);
+  w.pod(mat.ior);
+  w.string(mat.diffuse_texname);
+  w.string(mat.specular_texname);
+  w.string(mat.bump_texname);
+  w.string(mat.normal_texname);
+}
+
+bool
+readMaterial(Reader& r, tinyobj::material_t& mat)
+{
+  for (int c = 0; c < 3; ++c)
+    if (!r.pod(mat.diffuse[c]))
+      return false;
+  for (int c = 0; c < 3; ++c)
+    if (!r.pod(mat.specular[c]))
+      return false;
+
+  return r.pod(mat.ior) && r.string(mat.diffuse_texname) &&
+         r.string(mat.specular_texname) && r.string(mat.bump_texname) &&
+         r.string(mat.normal_texname);
+}
+}
+
+std::string
+path(const std::string& scene_path)
+{
+  return scene_path + ".cache";
+}
+
+bool
+read(const std::string& scene_path, bool indexed, SceneCache& out)
+{
+  std::ifstream file(path(scene_path), std::ios::binary);
+  if (!file.is_open())
+    return false;
+
+  Reader r(file);
+
+  Header expected;
+  Header header;
+  if (!makeHeader(scene_path, indexed, expected) || !r.pod(header) ||
+      std::memcmp(&header, &expected, sizeof(Header)) != 0)
+    return false;
+
+  // Any change in the sources invalidates the cache.
+  uint32_t nb_sources;
+  if (!r.pod(nb_sources))
+    return false;
+  for (uint32_t i = 0; i < nb_sources; ++i) {
+    Source cached;
+    Source current;
+    if (!r.string(cached.path) || !r.pod(cached.size) ||
+        !r.pod(cached.mtime) || !statFile(cached.path, current) ||
+        current.size != cached.size || current.mtime != cached.mtime)
+      return false;
+  }
+
+  uint32_t nb_materials;
+  if (!r.pod(out.camera) || !r.string(out.cubemap_path) ||
+      !r.buffer(out.lights) || !r.string(out.mtl_dir) ||
+      !r.pod(nb_materials))
+    return false;
+
+  out.materials.resize(nb_materials);
+  for (auto& mat : out.materials)
+    if (!readMaterial(r, mat))
+      return false;
+
+  uint32_t nb_meshes;
+  if (!r.pod(nb_meshes))
+    return false;
+
+  out.meshes.resize(nb_meshes);
+  for (auto& mesh : out.meshes) {
+    if (!r.buffer(mesh.triangles) || !r.buffer(mesh.faces) ||
+        !r.buffer(mesh.indices) || !r.buffer(mesh.positions) ||
+        !r.buffer(mesh.normals) || !r.buffer(mesh.texcoords) ||
+        !r.buffer(mesh.bvh))
+      return false;
+  }
+
+  return r.buffer(out.instances) && r.buffer(out.bvh);
+}
+
+void
+write(const std::string& scene_path, bool indexed,
+      const std::vector<std::string>& sources, const SceneCache& scene)
+{
+  Header header;
+  if (!makeHeader(scene_path, indexed, header))
+    return;
+
+  std::vector<Source> stats;
+  for (const auto& source : sources) {
+    Source s;
+    if (!statFile(source, s))
+      return;
+    stats.push_back(s);
+  }
+
+  // The cache is written aside, and only replaces the previous
+  // one when it is complete.
+  const std::string cache_path = path(scene_path);
+  const std::string tmp_path = cache_path + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    Writer w(file);
+
+    w.pod(header);
+    w.pod((uint32_t)stats.size());
+    for (const auto& s : stats) {
+      w.string(s.path);
+      w.pod(s.size);
+      w.pod(s.mtime);
+    }
+
+    w.pod(scene.camera);
+    w.string(scene.cubemap_path);
+    w.buffer(scene.lights);
+    w.string(scene.mtl_dir);
+    w.pod((uint32_t)scene.materials.size());
+    for (const auto& mat : scene.materials) writeMaterial(w, mat);
+
+    w.pod((uint32_t)scene.meshes.size());
+    for (const auto& mesh : scene.meshes) {
+      w.buffer(mesh.triangles);
+      w.buffer(mesh.faces);
+      w.buffer(mesh.indices);
+      w.buffer(mesh.positions);
+      w.buffer(mesh.normals);
+      w.buffer(mesh.texcoords);
+      w.buffer(mesh.bvh);
+    }
+    w.buffer(scene.instances);
+    w.buffer(scene.bvh);
+
+    if (!w.good()) {
+      std::cerr << "arttracer: cache: failed to write " << tmp_path
+                << std::endl;
+      std::remove(tmp_path.c_str());
+      return;
+    }
+  }
+
+  std::remove(cache_path.c_str());
+  if (std::rename(tmp_path.c_str(), cache_path.c_str()) != 0)
+    std::cerr << "arttracer: cache: failed to write " << cache_path
+              << std::endl;
+}
+} // namespace cache
+} // namespace scene
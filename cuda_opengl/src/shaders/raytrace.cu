@@ -1,25 +1,433 @@
+#include <cuda_fp16.h>
 #include <cuda_runtime.h>
-#include <curand.h>
-#include <curand_kernel.h>
 
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <math.h>
+#include <sstream>
 #include <stdbool.h>
+#include <stdexcept>
+#include <utility>
 
 #include <driver/cuda_helper.h>
+#include <driver/gpu_info.h>
 #include <math_functions.h>
 #include <scene/scene_data.h>
 #include <shaders/brdf.cuh>
 #include <shaders/intersection.cuh>
+#include <shaders/lights.cuh>
 #include <shaders/post_process.cuh>
+#include <shaders/raytrace.h>
+#include <shaders/sampler.cuh>
 #include <utils/utils.h>
 
-using post_process_t = float3 (*)(const float3&);
+/// <summary>
+/// Effects applied to the colors written to the screen, indexed by the
+/// `post_id' given to the raytracing functions. Kernels writing colors are
+/// instantiated for each of them, so that the effect is inlined.
+/// </summary>
+enum PostProcess
+{
+  POST_NONE = 0,
+  POST_GRAYSCALE,
+  POST_SEPIA,
+  POST_INVERT,
+  NB_POST_PROCESSES
+};
+
+// Graphs with updatable kernel nodes need CUDA 10.1.
+#if CUDART_VERSION >= 10010
+#define ARTRACER_CUDA_GRAPHS
+#endif
+
+/// <summary>
+/// Framebuffer and environment of a frame, passed to the kernels:
+/// * surface: framebuffer the colors are written to;
+/// * cubemap: environment, sampled in the direction of the escaping paths;
+/// * distribution: luminance of `cubemap', to importance sample it.
+/// </summary>
+struct FrameTargets
+{
+  OutputSurface surface;
+  cudaTextureObject_t cubemap;
+  scene::EnvironmentDistribution distribution;
+};
+
+/// <summary>
+/// First intersection of the path of a pixel, used to find it again in
+/// the previous frames, and to guide the denoiser:
+/// * position: hit point, or direction of the ray when it missed;
+/// * normal: shading normal of the hit;
+/// * albedo: diffuse color of the hit, black when the ray missed;
+/// * dist: distance of the hit, 0 when the ray missed.
+/// </summary>
+struct FirstHit
+{
+  float3 position;
+  float3 normal;
+  float3 albedo;
+  float dist;
+};
+
+/// <summary>
+/// Temporal accumulation of a frame reusing the history of the previous
+/// one, reprojected using the first hit of each pixel. `history' and
+/// `hits' are read from the previous frame, and `next_*' written by this
+/// one. The w component of each history texel is its number of samples,
+/// and the one of each hit its distance.
+/// </summary>
+struct Reprojection
+{
+  bool enabled;
+  bool valid;
+  bool moved;
+  scene::Camera camera;
+  const float4* history;
+  const float4* hits;
+  const float3* normals;
+  float4* next_history;
+  float4* next_hits;
+  float3* next_normals;
+};
+
+/// <summary>
+/// Denoising of a frame: instead of being written to the screen, the
+/// average radiance of each pixel is stored in `color', along with the
+/// features of its first hit, and filtered afterwards. The w component
+/// of each normal is the distance of the hit.
+/// </summary>
+struct Denoising
+{
+  bool enabled;
+  float4* color;
+  float4* normals;
+  float4* albedo;
+};
+
+/// <summary>
+/// Adaptive sampling of a frame: each pixel traces as many paths as the
+/// error of its mean requires, and converged pixels trace none. `moments'
+/// holds, for each texel of the temporal framebuffer, its number of
+/// samples, and the sum of the squared luminance of these samples.
+/// </summary>
+struct Adaptive
+{
+  bool enabled;
+  float2* moments;
+};
+
+/// <summary>
+/// Everything the launches of a frame depend on, besides the camera and
+/// the seed: a captured frame is replayed as long as its key is the same.
+/// </summary>
+struct GraphKey
+{
+  const void* kernel;
+  cudaSurfaceObject_t surface;
+  OutputFormat output_format;
+  cudaTextureObject_t cubemap;
+  scene::Scenes scenes;
+  unsigned int scene_id;
+  unsigned int width;
+  unsigned int height;
+  void* temporal_framebuffer;
+  AccumulationFormat accumulation_format;
+  const void* buffers;
+  const void* reprojection;
+  const void* denoiser;
+  const void* adaptive;
+  bool moved;
+  unsigned int post_id;
+  bool reorder;
+};
+
+/// <summary>
+/// Launches of a frame, captured in a CUDA graph. Only the kernels reading
+/// the camera and the seed are updated before each replay.
+/// </summary>
+struct FrameGraph
+{
+  GraphKey key;
+  unsigned long long last_use = 0;
+#ifdef ARTRACER_CUDA_GRAPHS
+  cudaGraph_t graph = nullptr;
+  cudaGraphExec_t exec = nullptr;
+  cudaGraphNode_t nodes[2] = {};
+#endif
+};
+
+/// <summary>
+/// Number of frames kept captured on each GPU: moving and static frames,
+/// in both framebuffers of the interop.
+/// </summary>
+constexpr size_t MAX_FRAME_GRAPHS = 4;
+
+/// <summary>
+/// State kept on the host for each GPU: addresses of symbols and launches
+/// differ from one GPU to another, and each one counts its frames.
+/// </summary>
+struct DeviceState
+{
+  /// <summary>
+  /// Seed of the current frame, which is also the number of frames
+  /// accumulated since the camera last moved.
+  /// </summary>
+  unsigned int seed = 0;
+
+  /// <summary>
+  /// Added to the seeds, so that render farm nodes draw other samples.
+  /// </summary>
+  unsigned int seed_offset = 0;
+
+  /// <summary>
+  /// Sampler drawing the random numbers of the paths.
+  /// </summary>
+  SamplerType sampler = SAMPLER_SOBOL;
+
+  /// <summary>
+  /// Launch of each variant of the persistent kernel, computed on its
+  /// first use, and the counter of its batches.
+  /// </summary>
+  unsigned int persistent_blocks[2][NB_POST_PROCESSES] = {};
+  dim3 persistent_threads[2][NB_POST_PROCESSES];
+  unsigned int* next_batch = nullptr;
+
+  /// <summary>
+  /// Launch of the kernel of batched views, its counter of batches, and
+  /// the views of the last batch on the GPU.
+  /// </summary>
+  unsigned int views_blocks = 0;
+  dim3 views_threads;
+  unsigned int* next_view_batch = nullptr;
+  RenderView* views = nullptr;
+  size_t views_capacity = 0;
+
+  /// <summary>
+  /// Captured frames, and whether capturing failed on this GPU, in
+  /// which case frames are launched directly.
+  /// </summary>
+  std::vector<FrameGraph> graphs;
+  unsigned long long nb_launches = 0;
+  bool graphs_failed = false;
+};
+
+/// <summary>
+/// Gives the state of the current GPU. Each GPU being driven by a single
+/// thread at a time, states need no locking.
+/// </summary>
+DeviceState&
+deviceState()
+{
+  static DeviceState states[MAX_RENDER_DEVICES];
+
+  int device = 0;
+  cudaGetDevice(&device);
+  return states[std::min(std::max(device, 0), MAX_RENDER_DEVICES - 1)];
+}
+
+GraphKey
+makeGraphKey(const void* kernel, const FrameTargets& targets,
+             const scene::Scenes& scenes, unsigned int scene_id,
+             unsigned int width, unsigned int height,
+             const AccumulationBuffer& temporal_framebuffer,
+             const void* buffers,
+             const void* reprojection, const void* denoiser,
+             const void* adaptive, bool moved, unsigned int post_id)
+{
+  // Keys are compared as a whole, padding included.
+  GraphKey key;
+  std::memset(&key, 0, sizeof(GraphKey));
+  key.kernel = kernel;
+  key.surface = targets.surface.surface;
+  key.output_format = targets.surface.format;
+  key.cubemap = targets.cubemap;
+  key.scenes.scenes = scenes.scenes;
+  key.scenes.textures.data = scenes.textures.data;
+  key.scenes.textures.size = scenes.textures.size;
+  key.scene_id = scene_id;
+  key.width = width;
+  key.height = height;
+  key.temporal_framebuffer = temporal_framebuffer.data;
+  key.accumulation_format = temporal_framebuffer.format;
+  key.buffers = buffers;
+  key.reprojection = reprojection;
+  key.denoiser = denoiser;
+  key.adaptive = adaptive;
+  key.moved = moved;
+  key.post_id = post_id;
+  return key;
+}
+
+#ifdef ARTRACER_CUDA_GRAPHS
+/// <summary>
+/// Replaces the arguments of a kernel node of an instantiated graph. They
+/// must have the exact types of the parameters of the kernel.
+/// </summary>
+template <typename... Args>
+void
+setKernelArgs(const FrameGraph& graph, unsigned int node, const Args&... args)
+{
+  cudaKernelNodeParams params;
+  cudaGraphKernelNodeGetParams(graph.nodes[node], &params);
+
+  void* values[] = { const_cast<void*>((const void*)&args)... };
+  params.kernelParams = values;
+  params.extra = nullptr;
+  cudaGraphExecKernelNodeSetParams(graph.exec, graph.nodes[node], &params);
+}
+
+void
+releaseGraph(FrameGraph& graph)
+{
+  if (graph.exec)
+    cudaGraphExecDestroy(graph.exec);
+  if (graph.graph)
+    cudaGraphDestroy(graph.graph);
+  graph.exec = nullptr;
+  graph.graph = nullptr;
+}
+
+/// <summary>
+/// Captures the launches of a frame, and finds the nodes of the kernels
+/// updated each frame.
+/// </summary>
+/// <returns>False if the frame could not be captured.</returns>
+bool
+captureGraph(FrameGraph& graph, cudaStream_t stream,
+             const std::function<void(cudaStream_t)>& enqueue,
+             const std::vector<const void*>& frame_kernels)
+{
+  if (cudaStreamBeginCapture(stream, cudaStreamCaptureModeThreadLocal) !=
+      cudaSuccess)
+    return false;
+
+  enqueue(stream);
+  if (cudaStreamEndCapture(stream, &graph.graph) != cudaSuccess)
+    return false;
+
+#if CUDART_VERSION >= 12000
+  if (cudaGraphInstantiate(&graph.exec, graph.graph, 0) != cudaSuccess)
+    return false;
+#else
+  if (cudaGraphInstantiate(&graph.exec, graph.graph, nullptr, nullptr, 0) !=
+      cudaSuccess)
+    return false;
+#endif
+
+  size_t nb_nodes = 0;
+  cudaGraphGetNodes(graph.graph, nullptr, &nb_nodes);
+  std::vector<cudaGraphNode_t> nodes(nb_nodes);
+  cudaGraphGetNodes(graph.graph, nodes.data(), &nb_nodes);
+
+  for (size_t k = 0; k < frame_kernels.size(); ++k) {
+    for (auto node : nodes) {
+      cudaGraphNodeType type;
+      cudaGraphNodeGetType(node, &type);
+      if (type != cudaGraphNodeTypeKernel)
+        continue;
+
+      cudaKernelNodeParams params;
+      cudaGraphKernelNodeGetParams(node, &params);
+      if (params.func == frame_kernels[k])
+        graph.nodes[k] = node;
+    }
+    if (!graph.nodes[k])
+      return false;
+  }
+
+  return true;
+}
+#else
+template <typename... Args>
+void
+setKernelArgs(const FrameGraph&, unsigned int, const Args&...)
+{}
+#endif
+
+/// <summary>
+/// Launches a frame on `stream'. Frames are captured in a CUDA graph the
+/// first time they are launched, and then replayed as a single launch, the
+/// kernels reading the camera and the seed being updated by `update'.
+/// </summary>
+/// <param name="key">Identifies the launches of the frame.</param>
+/// <param name="enqueue">Enqueues the launches of the frame.</param>
+/// <param name="frame_kernels">Kernels updated each frame, at most
+/// two.</param>
+/// <param name="update">Sets the arguments of the frame on those
+/// kernels, using `setKernelArgs'.</param>
+void
+launchFrame(const GraphKey& key, cudaStream_t stream,
+            const std::function<void(cudaStream_t)>& enqueue,
+            const std::vector<const void*>& frame_kernels,
+            const std::function<void(const FrameGraph&)>& update)
+{
+#ifdef ARTRACER_CUDA_GRAPHS
+  DeviceState& state = deviceState();
+  if (state.graphs_failed) {
+    enqueue(stream);
+    return;
+  }
+
+  ++state.nb_launches;
+  for (auto& graph : state.graphs) {
+    if (std::memcmp(&graph.key, &key, sizeof(GraphKey)) == 0) {
+      graph.last_use = state.nb_launches;
+      update(graph);
+      cudaGraphLaunch(graph.exec, stream);
+      return;
+    }
+  }
+
+  // Replaces the least recently used graph.
+  if (state.graphs.size() == MAX_FRAME_GRAPHS) {
+    auto lru = std::min_element(
+      state.graphs.begin(), state.graphs.end(),
+      [](const FrameGraph& a, const FrameGraph& b) {
+        return a.last_use < b.last_use;
+      });
+    releaseGraph(*lru);
+    state.graphs.erase(lru);
+  }
 
-post_process_t h_post_process_table[4];
+  // Keys are copied with their padding.
+  state.graphs.reserve(MAX_FRAME_GRAPHS);
+  state.graphs.emplace_back();
+  FrameGraph& graph = state.graphs.back();
+  std::memcpy(&graph.key, &key, sizeof(GraphKey));
+  graph.last_use = state.nb_launches;
+  if (!captureGraph(graph, stream, enqueue, frame_kernels)) {
+    // Frames are launched directly from now on.
+    cudaStreamCaptureStatus status;
+    if (cudaStreamIsCapturing(stream, &status) == cudaSuccess &&
+        status != cudaStreamCaptureStatusNone) {
+      cudaGraph_t aborted = nullptr;
+      cudaStreamEndCapture(stream, &aborted);
+      if (aborted)
+        cudaGraphDestroy(aborted);
+    }
+    releaseGraph(graph);
+    state.graphs.pop_back();
+    cudaGetLastError();
+
+    std::cerr << "artracer: failed to capture the frame, CUDA graphs are "
+                 "disabled."
+              << std::endl;
+    state.graphs_failed = true;
+    enqueue(stream);
+    return;
+  }
 
-surface<void, cudaSurfaceType2D> surf;
-texture<float4, cudaTextureTypeCubemap> cubemap_ref;
+  cudaGraphLaunch(graph.exec, stream);
+#else
+  (void)key;
+  (void)frame_kernels;
+  (void)update;
+  enqueue(stream);
+#endif
+}
 
 union rgba_24
 {
@@ -38,338 +446,2656 @@ union rgba_24
 #define M_PI 3.14159265359f
 #endif
 
+/// <summary>
+/// Maximum number of bounces of a path. The camera moving only gives
+/// a preview, made of a single intersection.
+/// </summary>
+HOST_DEVICE inline int
+maxBounces(int is_static, int static_samples)
+{
+  return 1 + is_static * (static_samples + 1);
+}
+
+/// <summary>
+/// Dimensions of the samples of a path: the position on the lens, and then
+/// the same ones at each bounce, relative to the first dimension of the
+/// bounce. Pairs sampled together start on an even dimension, so that the
+/// samplers stratify them together:
+/// * bsdf: Russian roulette and cosine of the bounce, then its angle, or
+///   the choice between reflection and transmission;
+/// * light: position on the sampled sphere light;
+/// * environment: direction sampled in the environment;
+/// * light_pick: sphere light to sample.
+/// </summary>
+constexpr unsigned int DIM_LENS = 0;
+constexpr unsigned int DIM_FIRST_BOUNCE = 2;
+constexpr unsigned int DIM_BSDF = 0;
+constexpr unsigned int DIM_LIGHT = 2;
+constexpr unsigned int DIM_ENVIRONMENT = 4;
+constexpr unsigned int DIM_LIGHT_PICK = 8;
+constexpr unsigned int DIMS_PER_BOUNCE = 10;
+
+/// <summary>
+/// Moves a sampler to the dimensions of the bounce `bounce'.
+/// </summary>
+__device__ inline void
+startBounce(Sampler& sampler, int bounce)
+{
+  sampler.dimension = DIM_FIRST_BOUNCE + bounce * DIMS_PER_BOUNCE;
+}
+
+/// <summary>
+/// Fetches the environment in the direction `dir', from its prefiltered
+/// level `lod'.
+/// </summary>
+__device__ inline float3
+environment(const FrameTargets& targets, const float3& dir, float lod = 0.0f)
+{
+  // Environment map's contribution (approximated as many far away lights)
+  auto val =
+    texCubemapLod<float4>(targets.cubemap, dir.x, dir.y, -dir.z, lod);
+  return make_float3(val.x, val.y, val.z);
+}
+
+/// <summary>
+/// Prefiltered level of the environment matching the angle of a ray cone,
+/// a texel of the first level covering about 2 / `size' radians.
+/// </summary>
+__device__ inline float
+environmentLod(const scene::EnvironmentDistribution& distribution,
+               const scene::Ray& r)
+{
+  return fmaxf(__log2f(r.cone_spread * distribution.size * 0.5f), 0.0f);
+}
+
+/// <summary>
+/// Offset applied to the origin of shadow rays, avoiding self intersection.
+/// </summary>
+constexpr float SHADOW_EPSILON = 0.03f;
+
+/// <summary>
+/// Angle added to the ray cone by a diffuse bounce. Texture fetches of
+/// indirect hits are blurry anyway, they can use coarser mip levels.
+/// </summary>
+constexpr float DIFFUSE_CONE_SPREAD = 0.2f;
+
+/// <summary>
+/// Next event estimation: samples one of the lights of the scene, and
+/// computes its direct contribution at a diffuse hit point. The contribution
+/// is weighted against the BSDF sampling of the next bounce using MIS.
+/// </summary>
+/// <param name="p">Hit point.</param>
+/// <param name="normal">Normal at the hit point.</param>
+/// <param name="direct_light">BRDF / PDF ratio of the surface.</param>
+/// <param name="kd">Part of the bounces sampled in the diffuse lobe, the
+/// rest being moved towards the specular direction.</param>
+__device__ inline float3
+sampleLights(const float3& p, const float3& normal, const float3& direct_light,
+             float kd, const scene::Scenes& scenes, unsigned int scene_id,
+             const Sampler& sampler)
+{
+  const scene::SceneData* scene = scenes.scenes[scene_id];
+  if (scene->light_bvh.size == 0 || kd <= 0.0f)
+    return make_float3(0.0f);
+
+  // Lights are picked according to their power and distance, so that the
+  // few lights lighting `p' get most of the samples.
+  float pick_pdf;
+  int l = pickLight(*scene, p, sample1D(sampler, DIM_LIGHT_PICK), pick_pdf);
+  if (l < 0)
+    return make_float3(0.0f);
+  const scene::LightProp& light = scene->lights.data[l];
+
+  float3 dir;
+  float dist, light_pdf;
+  float u1 = sample1D(sampler, DIM_LIGHT);
+  float u2 = sample1D(sampler, DIM_LIGHT + 1);
+  if (!sampleSphereLight(light, p, u1, u2, dir, dist, light_pdf))
+    return make_float3(0.0f);
+
+  float cos_t = dot(normal, dir);
+  if (cos_t <= 0.0f)
+    return make_float3(0.0f);
+
+  scene::Ray shadow;
+  shadow.origin = p;
+  shadow.dir = dir;
+  if (occluded(shadow, scenes, scene_id, dist))
+    return make_float3(0.0f);
+
+  // PDF the BSDF sampling would have to pick the same direction.
+  float bsdf_pdf = kd * cos_t / M_PI;
+  light_pdf *= pick_pdf;
+
+  float3 emission = light.color * light.emission;
+  return emission * direct_light * bsdf_pdf *
+         __fdividef(powerHeuristic(light_pdf, bsdf_pdf), light_pdf);
+}
+
+/// <summary>
+/// Next event estimation on the environment: samples a direction according
+/// to the luminance of the cubemap, and computes its contribution at a
+/// diffuse hit point, weighted against the BSDF sampling using MIS.
+/// </summary>
+/// <param name="p">Hit point.</param>
+/// <param name="normal">Normal at the hit point.</param>
+/// <param name="direct_light">BRDF / PDF ratio of the surface.</param>
+/// <param name="kd">Part of the bounces sampled in the diffuse lobe.</param>
+__device__ inline float3
+sampleEnvironmentLight(const float3& p, const float3& normal,
+                       const float3& direct_light, float kd,
+                       const scene::Scenes& scenes, unsigned int scene_id,
+                       const FrameTargets& targets, const Sampler& sampler)
+{
+  if (kd <= 0.0f)
+    return make_float3(0.0f);
+
+  float4 u;
+  u.x = sample1D(sampler, DIM_ENVIRONMENT);
+  u.y = sample1D(sampler, DIM_ENVIRONMENT + 1);
+  u.z = sample1D(sampler, DIM_ENVIRONMENT + 2);
+  u.w = sample1D(sampler, DIM_ENVIRONMENT + 3);
+
+  float3 dir;
+  float env_pdf;
+  if (!sampleEnvironment(targets.distribution, u, dir, env_pdf))
+    return make_float3(0.0f);
+
+  float cos_t = dot(normal, dir);
+  if (cos_t <= 0.0f)
+    return make_float3(0.0f);
+
+  scene::Ray shadow;
+  shadow.origin = p;
+  shadow.dir = dir;
+  if (occluded(shadow, scenes, scene_id, FLT_MAX))
+    return make_float3(0.0f);
+
+  float bsdf_pdf = kd * cos_t / M_PI;
+  return environment(targets, dir) * direct_light * bsdf_pdf *
+         __fdividef(powerHeuristic(env_pdf, bsdf_pdf), env_pdf);
+}
+
+/// <summary>
+/// Radiance gathered by a path escaping the scene along the ray `r'. The
+/// environment may also have been sampled at the previous bounce, and is
+/// thus weighted using MIS. Wide cones, after rough bounces, read the
+/// prefiltered levels of the cubemap, like textures do.
+/// </summary>
+__device__ inline float3
+missRadiance(const FrameTargets& targets, const scene::Ray& r,
+             const float3& throughput, float bsdf_pdf)
+{
+  float weight = 1.0f;
+  if (bsdf_pdf > 0.0f)
+    weight =
+      powerHeuristic(bsdf_pdf, environmentPdf(targets.distribution, r.dir));
+
+  const float lod = environmentLod(targets.distribution, r);
+  return environment(targets, r.dir, lod) * throughput * weight;
+}
+
+/// <summary>
+/// Scatters a path on a diffuse or specular surface, or on a light.
+/// The emission of the light is accumulated, the other lights are sampled
+/// explicitly, and the next direction is sampled in the hemisphere, and then
+/// moved towards the specular direction.
+/// </summary>
+/// <param name="r">Ray that hit the surface, contains the next ray.</param>
+/// <param name="inter">Data of the hit.</param>
+/// <param name="r1">Random number of the current bounce.</param>
+/// <param name="scenes">Scenes, used for the shadow rays.</param>
+/// <param name="scene_id">Scene on which the path is traced.</param>
+/// <param name="targets">Environment of the frame.</param>
+/// <param name="throughput">Throughput of the path.</param>
+/// <param name="acc">Radiance accumulated by the path.</param>
+/// <param name="bsdf_pdf">PDF of the direction of `r', used to weight the
+/// lights hit by chance. 0 if the lights were not sampled explicitly at the
+/// previous bounce. Contains the PDF of the next direction.</param>
+/// <param name="sampler">Sampler of the path, at the current bounce.</param>
+__device__ inline void
+scatterDiffuse(scene::Ray& r, const IntersectionData& inter, float r1,
+               const scene::Scenes& scenes, unsigned int scene_id,
+               const FrameTargets& targets, float3& throughput, float3& acc,
+               float& bsdf_pdf, const Sampler& sampler)
+{
+  float3 oriented_normal = inter.normal;
+  const scene::SceneData* scene = scenes.scenes[scene_id];
+
+  // Specular ray
+  // Computed everytime and then used to simulate roughness by concentrating
+  // rays towards it
+  float3 spec = normalize(reflect(r.dir, inter.normal));
+  float PDF = pdf_lambert(); // Divided by PI
+  // Lambert BRDF/PDF
+  float3 BRDF = brdf_lambert(inter.diffuse_col); // Divided by PI
+  float3 direct_light = BRDF / PDF;
+
+  // Part of the bounces not moved towards the specular direction
+  float kd = 1.0f - inter.specular_col;
+
+  // Accumulate light emission
+  if (inter.light != NULL) {
+    BRDF = make_float3(inter.light->color.x, inter.light->color.y,
+                       inter.light->color.z);
+
+    // This light may also have been sampled at the previous bounce.
+    float weight = 1.0f;
+    if (bsdf_pdf > 0.0f) {
+      float light_pdf =
+        sphereLightPdf(*inter.light, r.origin) *
+        pickLightPdf(*scene, r.origin, inter.light - scene->lights.data);
+      weight = powerHeuristic(bsdf_pdf, light_pdf);
+    }
+
+    acc += BRDF * inter.light->emission * throughput * weight;
+  } else {
+    float3 p = r.origin + r.dir * inter.dist + oriented_normal * SHADOW_EPSILON;
+    acc += sampleLights(p, oriented_normal, direct_light, kd, scenes, scene_id,
+                        sampler) *
+           throughput;
+    acc += sampleEnvironmentLight(p, oriented_normal, direct_light, kd, scenes,
+                                  scene_id, targets, sampler) *
+           throughput;
+  }
+
+  // Sample the hemisphere with a random ray
+  float phi = 2.0f * M_PI * sample1D(sampler, DIM_BSDF + 1);
+
+  float sin_t = __fsqrt_rn(r1);
+  float cos_t = __fsqrt_rn(1.f - r1);
+
+  // u, v and oriented_normal form the base of the hemisphere
+  float3 u = normalize(cross(fabs(oriented_normal.x) > .1
+                               ? make_float3(0.0f, 1.0f, 0.0f)
+                               : make_float3(1.0f, 0.0f, 0.0f),
+                             oriented_normal));
+  float3 v = cross(oriented_normal, u);
+
+  // Diffuse hemishphere reflection
+  float3 d = normalize(v * sin_t * __cosf(phi) + u * __sinf(phi) * sin_t +
+                       oriented_normal * cos_t);
+
+  r.origin += r.dir * inter.dist;
+
+  // The ray cone restarts from the hit, widened by the diffuse lobe.
+  r.cone_width += r.cone_spread * inter.dist;
+  r.cone_spread += kd * DIFFUSE_CONE_SPREAD;
+
+  // Mix the specular and random diffuse ray by the "specular_col" amount
+  // to approximate roughness
+  r.dir = mix(d, spec, inter.specular_col);
+
+  // Avoids self intersection
+  r.origin += r.dir * 0.03f;
+
+  throughput *= direct_light;
+
+  // Lights are only sampled explicitly from surfaces
+  bsdf_pdf = 0.0f;
+  if (inter.light == NULL)
+    bsdf_pdf = kd * fmaxf(dot(normalize(r.dir), oriented_normal), 0.0f) / M_PI;
+}
+
+/// <summary>
+/// Scatters a path on a refractive surface, reflecting or transmitting it
+/// according to the Fresnel-Schlick approximation.
+/// </summary>
+/// <param name="r">Ray that hit the surface, contains the next ray.</param>
+/// <param name="inter">Data of the hit.</param>
+/// <param name="throughput">Throughput of the path.</param>
+/// <param name="bsdf_pdf">Set to 0, the lights not being sampled
+/// explicitly.</param>
+/// <param name="sampler">Sampler of the path, at the current bounce.</param>
+__device__ inline void
+scatterRefract(scene::Ray& r, const IntersectionData& inter,
+               float3& throughput, float& bsdf_pdf, const Sampler& sampler)
+{
+  bsdf_pdf = 0.0f;
+  r.cone_width += r.cone_spread * inter.dist;
+
+  float cos_theta = dot(inter.normal, r.dir);
+  float3 spec = normalize(reflect(r.dir, inter.normal));
+  float3 direct_light = brdf_lambert(inter.diffuse_col) / pdf_lambert();
+
+  // Transmision
+  // n1: IOR of exterior medium
+  float n1 = 1.0f; // sin theta2
+  // n2: IOR of entering medium
+  float n2 = inter.ior; // sin theta1
+  float3 oriented_normal = cos_theta < 0 ? inter.normal : inter.normal * -1.0f;
+  float c1 = dot(oriented_normal, r.dir);
+  bool entering = dot(inter.normal, oriented_normal) > 0;
+  // Snell's Law
+  float eta = entering ? n1 / n2 : n2 / n1;
+  float eta_2 = eta * eta;
+
+  float c2_term = 1.0f - eta_2 * (1.0f - c1 * c1);
+  // Total Internal Reflection
+  if (c2_term < 0.0f) {
+    r.origin += oriented_normal * inter.dist / 100.f;
+    r.dir = spec;
+    return;
+  }
+
+  // Schlick R0
+  float R0 = (n2 - n1) / (n1 + n2);
+  R0 *= R0;
+  float c2 = __fsqrt_rn(c2_term);
+  float3 T = normalize(eta * r.dir + (eta * c1 - c2) * oriented_normal);
+
+  float f_cos_theta = 1.0f - (entering ? -c1 : dot(T, inter.normal));
+  f_cos_theta = powf(cos_theta, 5.0f);
+  // Fresnel-Schlick approximation for the reflection amount
+  float f_r = R0 + (1.0f - R0) * f_cos_theta;
+
+  // If reflection
+  // Not exactly sure why "0.25f" works better than "f_r"...
+  if (sample1D(sampler, DIM_BSDF + 1) < 0.25f) {
+    throughput *= f_r * direct_light;
+
+    r.origin += oriented_normal * inter.dist / 100.f;
+
+    r.dir = spec;
+  } else // Transmission
+  {
+    // Energy conservation
+    float f_t = 1.0f - f_r;
+
+    throughput *= f_t * direct_light;
+
+    // We're inside a mesh doing transmission, so we try to reduce the
+    // bias as much as possible
+    // or the ray could get outside of the mesh which makes no sense
+    r.origin += oriented_normal * inter.dist / 10000.f;
+
+    r.dir = T;
+  }
+}
+
+/// <summary>
+/// Russian roulette for early path termination.
+/// </summary>
+/// <returns>True if the path should go on.</returns>
+__device__ inline bool
+russianRoulette(float r1, int bounce, float3& throughput)
+{
+  float p = fmaxf(throughput.x, fmaxf(throughput.y, throughput.z));
+  if (r1 > p && bounce > 1)
+    return false;
+
+  throughput *= __fdividef(1.0f, p);
+  return true;
+}
+
+/// <summary>
+/// Resets the G-buffer hit of a pixel to a miss along its primary ray.
+/// </summary>
+__device__ inline void
+resetFirstHit(const scene::Ray& r, FirstHit& first_hit)
+{
+  first_hit.position = r.dir;
+  first_hit.normal = make_float3(0.0f);
+  first_hit.albedo = make_float3(0.0f);
+  first_hit.dist = 0.0f;
+}
+
+__device__ inline void
+recordFirstHit(const scene::Ray& r, const IntersectionData& inter,
+               FirstHit& first_hit)
+{
+  first_hit.position = r.origin + r.dir * inter.dist;
+  first_hit.normal = inter.normal;
+  first_hit.albedo = inter.diffuse_col;
+  first_hit.dist = inter.dist;
+}
+
+/// <summary>
+/// Intersects the primary ray of a pixel and fills its G-buffer hit, for
+/// the preview shading of moving frames and for the pixels that trace no
+/// path but are still denoised.
+/// </summary>
+/// <returns>True if the ray hit the scene.</returns>
+__device__ inline bool
+traceFirstHit(const scene::Ray& r, const struct scene::Scenes& scenes,
+              unsigned int scene_id, IntersectionData& inter,
+              FirstHit& first_hit)
+{
+  resetFirstHit(r, first_hit);
+
+  countBounce();
+  if (!intersect(r, scenes, scene_id, inter))
+    return false;
+
+  recordFirstHit(r, inter, first_hit);
+  return true;
+}
+
+__device__ inline void
+traceFirstHit(const scene::Ray& r, const struct scene::Scenes& scenes,
+              unsigned int scene_id, FirstHit& first_hit)
+{
+  IntersectionData inter;
+  traceFirstHit(r, scenes, scene_id, inter, first_hit);
+}
+
 __device__ inline float3
 radiance(scene::Ray& r, const struct scene::Scenes& scenes,
-         unsigned int scene_id, const scene::Camera* const cam,
-         curandState* rand_state, int is_static, int static_samples)
+         unsigned int scene_id, const FrameTargets& targets,
+         const scene::Camera* const cam, Sampler& sampler, int is_static,
+         int static_samples, FirstHit& first_hit)
 {
   float3 acc = make_float3(0.0f);
   // For energy compensation on Russian roulette
   float3 throughput = make_float3(1.0f);
+  // PDF of the last bounce, for MIS on the lights
+  float bsdf_pdf = 0.0f;
 
   // Contains information about each intersection.
   // This will be updated at each call to 'intersect'.
   IntersectionData inter;
 
-  if (!is_static)
-	if (intersect(r, scenes, scene_id, inter))
-	    return inter.diffuse_col;
-	else
-	{
-	    // Accumulate Environment map's contribution (approximated as many far away lights)
-	    auto val = texCubemap(cubemap_ref, r.dir.x, r.dir.y, -r.dir.z);
-	    return make_float3(val.x, val.y, val.z);
-	}
+  countPath();
+  if (!is_static) {
+    if (traceFirstHit(r, scenes, scene_id, inter, first_hit))
+      return inter.diffuse_col;
+    return environment(targets, r.dir);
+  }
+
+  resetFirstHit(r, first_hit);
 
   // Max bounces
   // Bounce more when the camera is not moving
-  const int max_bounces = 1 + is_static * (static_samples + 1);
+  const int max_bounces = maxBounces(is_static, static_samples);
   for (int b = 0; b < max_bounces; b++) {
-    float3 oriented_normal;
-
-    float r1 = curand_uniform(rand_state);
-    if (intersect(r, scenes, scene_id, inter)) {
-      inter.normal = inter.normal;
-      float cos_theta = dot(inter.normal, r.dir);
-      oriented_normal =
-        inter.normal; // cos_theta < 0 ? inter.normal : inter.normal * -1.0f;
-
-      // return oriented_normal;
-
-      float3 up = make_float3(0.0, 1.0, 0.0);
-      float3 right = cross(up, inter.normal);
-      up = cross(inter.normal, right);
-
-      // Oren-Nayar diffuse
-      // BRDF = brdf_oren_nayar(cos_theta, cos_theta, light_dir, r.dir,
-      // oriented_normal, 0.5f, 0.5f, inter.diffuse_col);
-
-      // Specular ray
-      // Computed everytime and then used to simulate roughness by concentrating
-      // rays towards it
-      float3 spec = normalize(reflect(r.dir, inter.normal));
-      float PDF = pdf_lambert(); // Divided by PI
-      // Lambert BRDF/PDF
-      float3 BRDF = brdf_lambert(inter.diffuse_col); // Divided by PI
-      float3 direct_light = BRDF / PDF;
-      // Default IOR (Index Of Refraction) is 1.0f
-      if (inter.ior == 1.0f || inter.light != NULL) {
-        // Accumulate light emission
-        if (inter.light != NULL) {
-          BRDF = make_float3(inter.light->color.x, inter.light->color.y,
-                             inter.light->color.z);
-
-          acc += BRDF * inter.light->emission * throughput;
-        }
-
-        // Sample the hemisphere with a random ray
-        float phi = 2.0f * M_PI *
-                    curand_uniform(rand_state); // glm::mix(1.0f -
-                                                // inter.specular_col,
-                                                // inter.specular_col, 0.1f);
-
-        float sin_t = __fsqrt_rn(r1);
-        float cos_t = __fsqrt_rn(1.f - r1);
-
-        // u, v and oriented_normal form the base of the hemisphere
-        float3 u = normalize(cross(fabs(oriented_normal.x) > .1
-                                     ? make_float3(0.0f, 1.0f, 0.0f)
-                                     : make_float3(1.0f, 0.0f, 0.0f),
-                                   oriented_normal));
-        float3 v = cross(oriented_normal, u);
-
-        // Diffuse hemishphere reflection
-        float3 d = normalize(v * sin_t * __cosf(phi) + u * __sinf(phi) * sin_t +
-                             oriented_normal * cos_t);
-
-        r.origin += r.dir * inter.dist;
-
-        // Mix the specular and random diffuse ray by the "specular_col" amount
-        // to approximate roughness
-        r.dir = mix(d, spec, inter.specular_col);
-
-        // Avoids self intersection
-        r.origin += r.dir * 0.03f;
-
-        throughput *= direct_light;
-      } else {
-        // Transmision
-        // n1: IOR of exterior medium
-        float n1 = 1.0f; // sin theta2
-        // n2: IOR of entering medium
-        float n2 = inter.ior; // sin theta1
-        oriented_normal = cos_theta < 0 ? inter.normal : inter.normal * -1.0f;
-        float c1 = dot(oriented_normal, r.dir);
-        bool entering = dot(inter.normal, oriented_normal) > 0;
-        // Snell's Law
-        float eta = entering ? n1 / n2 : n2 / n1;
-        float eta_2 = eta * eta;
-
-        float c2_term = 1.0f - eta_2 * (1.0f - c1 * c1);
-        // Total Internal Reflection
-        if (c2_term < 0.0f) {
-          r.origin += oriented_normal * inter.dist / 100.f;
-
-          // return make_float3(1.0f, 0.0f, 0.0f);
-          r.dir = spec;
-        } else {
-          // Schlick R0
-          float R0 = (n2 - n1) / (n1 + n2);
-          R0 *= R0;
-          float c2 = __fsqrt_rn(c2_term);
-          float3 T = normalize(eta * r.dir + (eta * c1 - c2) * oriented_normal);
-
-          float f_cos_theta = 1.0f - (entering ? -c1 : dot(T, inter.normal));
-          f_cos_theta = powf(cos_theta, 5.0f);
-          // Fresnel-Schlick approximation for the reflection amount
-          float f_r = R0 + (1.0f - R0) * f_cos_theta;
-
-          // If reflection
-          // Not exactly sure why "0.25f" works better than "f_r"...
-          if (curand_uniform(rand_state) < 0.25f) {
-            throughput *= f_r * direct_light;
-
-            r.origin += oriented_normal * inter.dist / 100.f;
-
-            r.dir = spec; // mix(d, spec, inter.specular_col);
-
-            // return make_float3(0.0f, 1.0f, 0.0f);
-          } else // Transmission
-          {
-            // Energy conservation
-            float f_t = 1.0f - f_r;
-
-            throughput *= f_t * direct_light;
-
-            // We're inside a mesh doing transmission, so we try to reduce the
-            // bias as much as possible
-            // or the ray could get outside of the mesh which makes no sense
-            r.origin += oriented_normal * inter.dist / 10000.f;
-
-            r.dir = T;
-            // return make_float3(0.0f, 0.0f, 1.0f);
-          }
-        }
-      }
-    } else {
-      // Accumulate Environment map's contribution (approximated as many far
-      // away lights)
-      auto val = texCubemap(cubemap_ref, r.dir.x, r.dir.y, -r.dir.z);
-      acc += make_float3(val.x, val.y, val.z) * throughput;
-    }
+    countBounce();
+    startBounce(sampler, b);
+    float r1 = sample1D(sampler, DIM_BSDF);
 
-    // Russian roulette for early path termination
-    float p = fmaxf(throughput.x, fmaxf(throughput.y, throughput.z));
-    if (r1 > p && b > 1)
+    // The path escaped the scene, it only gets the environment.
+    if (!intersect(r, scenes, scene_id, inter)) {
+      acc += missRadiance(targets, r, throughput, bsdf_pdf);
       return acc;
+    }
+
+    if (b == 0)
+      recordFirstHit(r, inter, first_hit);
 
-    throughput *= __fdividef(1.0f, p);
+    // Default IOR (Index Of Refraction) is 1.0f
+    if (inter.ior == 1.0f || inter.light != NULL)
+      scatterDiffuse(r, inter, r1, scenes, scene_id, targets, throughput, acc,
+                     bsdf_pdf, sampler);
+    else
+      scatterRefract(r, inter, throughput, bsdf_pdf, sampler);
+
+    if (!russianRoulette(r1, b, throughput))
+      return acc;
   }
 
   return acc;
 }
 
-__global__ void
-kernel(const unsigned int width, const unsigned int height,
-       const scene::Scenes scenes, unsigned int scene_id, scene::Camera cam,
-       unsigned int hash_seed, int frame_nb, float3* temporal_framebuffer,
-       bool moved, post_process_t post)
+__device__ inline float3
+grayscale(const float3& color)
 {
-  const unsigned int half_w = width / 2;
-  const unsigned int half_h = height / 2;
-
-  const int x = blockDim.x * blockIdx.x + threadIdx.x;
-  const int y = blockDim.y * blockIdx.y + threadIdx.y;
-
-  if (x >= width || y >= height)
-    return;
-
-  const unsigned int tid =
-    (blockIdx.x + blockIdx.y * gridDim.x) * (blockDim.x * blockDim.y) +
-    (threadIdx.y * blockDim.x) + threadIdx.x;
-
-  union rgba_24 rgbx;
-  rgbx.a = 0.0;
+  const float gray = color.x * 0.3 + color.y * 0.59 + color.z * 0.11;
+  return make_float3(gray, gray, gray);
+}
 
-  curandState rand_state;
-  curand_init(hash_seed + tid, 0, 0, &rand_state);
+__device__ inline float3
+sepia(const float3& color)
+{
+  return make_float3(color.x * 0.393 + color.y * 0.769 + color.z * 0.189,
+                     color.x * 0.349 + color.y * 0.686 + color.z * 0.168,
+                     color.x * 0.272 + color.y * 0.534 + color.z * 0.131);
+}
 
-  scene::Ray r = generateRay(x, y, half_w, half_h, cam);
+__device__ inline float3
+invert(const float3& color)
+{
+  return make_float3(1.0 - color.x, 1.0 - color.y, 1.0 - color.z);
+}
 
-  // Depth-Of-Field
-  camera_dof(r, cam, &rand_state);
+/// <summary>
+/// Applies the post process `Post' to a tone mapped color.
+/// </summary>
+template <int Post>
+__device__ inline float3
+postProcess(const float3& color)
+{
+  switch (Post) {
+    case POST_GRAYSCALE:
+      return grayscale(color);
+    case POST_SEPIA:
+      return sepia(color);
+    case POST_INVERT:
+      return invert(color);
+    default:
+      return color;
+  }
+}
 
-  int is_static = !moved;
-  int static_samples = 1;
+/// <summary>
+/// Packs a color in four fp16 channels, the last one being zero.
+/// </summary>
+__device__ inline uint2
+packHalf4(const float3& v)
+{
+  const unsigned int r = __half_as_ushort(__float2half_rn(v.x));
+  const unsigned int g = __half_as_ushort(__float2half_rn(v.y));
+  const unsigned int b = __half_as_ushort(__float2half_rn(v.z));
+  return make_uint2(r | (g << 16), b);
+}
 
-  float3 rad =
-    radiance(r, scenes, scene_id, &cam, &rand_state, is_static, static_samples);
+__device__ inline float3
+unpackHalf4(const uint2& v)
+{
+  return make_float3(__half2float(__ushort_as_half(v.x & 0xFFFF)),
+                     __half2float(__ushort_as_half(v.x >> 16)),
+                     __half2float(__ushort_as_half(v.y & 0xFFFF)));
+}
 
+/// <summary>
+/// Writes the color of a pixel to the screen, from its average radiance,
+/// clamped to [0, 1] before being tone mapped. Half float surfaces are not
+/// clamped after it.
+/// </summary>
+template <int Post>
+__device__ inline void
+writeColor(const OutputSurface& surface, int x, int y, float3 rad)
+{
+  // The accumulation is in high dynamic range, the display is not.
   rad = clamp(rad, 0.0f, 1.0f);
-
-  // Accumulation buffer for when the camera is static
-  // This makes the image converge
-  int i = (height - y - 1) * width + x;
-
-  // Zero-out if the camera is moving to reset the buffer
-  temporal_framebuffer[i] *= is_static;
-  temporal_framebuffer[i] += rad;
-
-  rad = temporal_framebuffer[i] / (float)frame_nb;
-
   // Tone Mapping + White Balance
   rad = exposure(rad);
   // Gamma Correction
   rad = pow(rad, 1.0f / 2.2f);
-  rad = (*post)(rad);
+  rad = postProcess<Post>(rad);
 
+  if (surface.format == OUTPUT_RGBA16F) {
+    surf2Dwrite(packHalf4(rad), surface.surface, x * sizeof(uint2), y,
+                cudaBoundaryModeZero);
+    return;
+  }
+
+  union rgba_24 rgbx;
+  rgbx.a = 0.0;
   rgbx.r = rad.x * 255;
   rgbx.g = rad.y * 255;
   rgbx.b = rad.z * 255;
 
-  surf2Dwrite(rgbx.b32, surf, x * sizeof(rgbx), y, cudaBoundaryModeZero);
+  surf2Dwrite(rgbx.b32, surface.surface, x * sizeof(rgbx), y,
+              cudaBoundaryModeZero);
 }
 
-// Very nice and fast PRNG
-// Credit: Thomas Wang
-inline unsigned int
-WangHash(unsigned int a)
+/// <summary>
+/// Reads the pixel `i' of a temporal framebuffer: a sum, or a mean for
+/// ACCUMULATION_HALF4.
+/// </summary>
+__device__ inline float3
+loadAccumulated(const AccumulationBuffer& acc, int i)
 {
-  a = (a ^ 61) ^ (a >> 16);
-  a = a + (a << 3);
-  a = a ^ (a >> 4);
-  a = a * 0x27d4eb2d;
-  a = a ^ (a >> 15);
-
-  return a;
+  switch (acc.format) {
+    case ACCUMULATION_FLOAT4:
+      return make_float3(static_cast<const float4*>(acc.data)[i]);
+    case ACCUMULATION_HALF4:
+      return unpackHalf4(static_cast<const uint2*>(acc.data)[i]);
+    default:
+      return static_cast<const float3*>(acc.data)[i];
+  }
 }
 
-cudaError_t
-raytrace(cudaArray_const_t array, const scene::Scenes& scenes,
-         unsigned int scene_id, const std::vector<scene::Cubemap>& cubemaps,
-         int cubemap_id, const scene::Camera* const cam,
-         const unsigned int width, const unsigned int height,
-         cudaStream_t stream, float3* temporal_framebuffer, bool moved,
-         unsigned int post_id)
+__device__ inline void
+storeAccumulated(const AccumulationBuffer& acc, int i, const float3& value)
 {
-  // Seed for the Wang Hash
-  static unsigned int seed = 0;
-
-  if (moved)
-    seed = 0;
-  seed++;
+  switch (acc.format) {
+    case ACCUMULATION_FLOAT4:
+      static_cast<float4*>(acc.data)[i] = make_float4(value, 0.0f);
+      break;
+    case ACCUMULATION_HALF4:
+      static_cast<uint2*>(acc.data)[i] = packHalf4(value);
+      break;
+    default:
+      static_cast<float3*>(acc.data)[i] = value;
+  }
+}
 
-  cudaBindSurfaceToArray(surf, array);
+/// <summary>
+/// Gives the average radiance of the pixel `i', which holds `nb_samples'.
+/// </summary>
+__device__ inline float3
+loadMean(const AccumulationBuffer& acc, int i, float nb_samples)
+{
+  const float3 value = loadAccumulated(acc, i);
+  return acc.format == ACCUMULATION_HALF4 ? value
+                                          : value / fmaxf(nb_samples, 1.0f);
+}
 
-  const scene::Cubemap& cubemap = cubemaps[cubemap_id];
-  cubemap_ref.addressMode[0] = cudaAddressModeWrap;
-  cubemap_ref.addressMode[1] = cudaAddressModeWrap;
-  cubemap_ref.filterMode = cudaFilterModeLinear;
-  cubemap_ref.normalized = true;
-  cudaBindTextureToArray(cubemap_ref, cubemap.cubemap, cubemap.cubemap_desc);
+/// <summary>
+/// Gives the sum of the radiance of the pixel `i', which holds `nb_samples'.
+/// </summary>
+__device__ inline float3
+loadSum(const AccumulationBuffer& acc, int i, float nb_samples)
+{
+  const float3 value = loadAccumulated(acc, i);
+  return acc.format == ACCUMULATION_HALF4 ? value * nb_samples : value;
+}
 
-  // Register occupancy : nb_threads = regs_per_block / 32
-  // Shared memory occupancy : nb_threads = shared_mem / 32
-  // Block size occupancy
+/// <summary>
+/// Adds samples to the pixel `i' of a temporal framebuffer.
+/// </summary>
+/// <param name="rad">Sum of the radiance of the samples added.</param>
+/// <param name="nb_added">Number of samples added.</param>
+/// <param name="nb_samples">Number of samples of the pixel, once they are
+/// added.</param>
+/// <param name="is_static">Zero to restart the accumulation.</param>
+/// <returns>The average radiance of the pixel.</returns>
+__device__ inline float3
+accumulate(const AccumulationBuffer& acc, int i, const float3& rad,
+           float nb_added, float nb_samples, int is_static)
+{
+  const float3 previous = loadAccumulated(acc, i) * is_static;
+  if (acc.format == ACCUMULATION_HALF4) {
+    const float nb_previous = (nb_samples - nb_added) * is_static;
+    const float3 mean =
+      (previous * nb_previous + rad) / fmaxf(nb_previous + nb_added, 1.0f);
+    storeAccumulated(acc, i, mean);
+    return mean;
+  }
 
-  dim3 threads_per_block(16, 16);
-  dim3 nb_blocks(width / threads_per_block.x + 1,
-                 height / threads_per_block.y + 1);
+  const float3 sum = previous + rad;
+  storeAccumulated(acc, i, sum);
+  return sum / fmaxf(nb_samples, 1.0f);
+}
 
-  if (nb_blocks.x > 0 && nb_blocks.y > 0)
-    kernel<<<nb_blocks, threads_per_block, 0, stream>>>(
-      width, height, scenes, scene_id, *cam, WangHash(seed), seed,
-      temporal_framebuffer, moved, h_post_process_table[post_id]);
+/// <summary>
+/// Accumulates the radiance of a pixel in the temporal buffer.
+/// </summary>
+/// <returns>The average radiance of the pixel.</returns>
+__device__ inline float3
+accumulatePixel(int x, int y, unsigned int width, unsigned int height,
+                float3 rad, const AccumulationBuffer& temporal_framebuffer,
+                int is_static, int frame_nb)
+{
+  // Accumulation buffer for when the camera is static
+  // This makes the image converge
+  int i = (height - y - 1) * width + x;
 
-  return cudaSuccess;
+  // Zero-out if the camera is moving to reset the buffer
+  return accumulate(temporal_framebuffer, i, rad, 1.0f, (float)frame_nb,
+                    is_static);
 }
 
-__device__ float3
-no_post_process(const float3& color)
+/// <summary>
+/// Number of samples a pixel takes before its error is estimated.
+/// </summary>
+constexpr float ADAPTIVE_MIN_SAMPLES = 16.0f;
+
+/// <summary>
+/// Relative standard error of the mean under which a pixel has converged.
+/// </summary>
+constexpr float ADAPTIVE_THRESHOLD = 0.02f;
+
+/// <summary>
+/// Luminance added to the mean when computing the relative error, so that
+/// dark pixels converge as well.
+/// </summary>
+constexpr float ADAPTIVE_BLACK_LEVEL = 0.05f;
+
+/// <summary>
+/// Maximum number of paths traced by a pixel in a frame.
+/// </summary>
+constexpr int ADAPTIVE_MAX_PATHS = 4;
+
+__device__ inline float
+luminance(const float3& color)
 {
-  return color;
+  return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
 }
 
-__device__ float3
-grayscale(const float3& color)
+/// <summary>
+/// Luminance samples are scaled down to, so that the rare paths reaching a
+/// small light do not leave fireflies in the accumulation.
+/// </summary>
+constexpr float MAX_SAMPLE_LUMINANCE = 64.0f;
+
+/// <summary>
+/// Clamps the radiance of a sample before it is accumulated. It stays in
+/// high dynamic range, only the display clamps it to [0, 1].
+/// </summary>
+__device__ inline float3
+clampSample(float3 rad)
 {
-  const float gray = color.x * 0.3 + color.y * 0.59 + color.z * 0.11;
-  return make_float3(gray, gray, gray);
+  rad = fmaxf(rad, make_float3(0.0f));
+  const float lum = luminance(rad);
+  return lum > MAX_SAMPLE_LUMINANCE ? rad * (MAX_SAMPLE_LUMINANCE / lum)
+                                    : rad;
 }
 
-__device__ float3
-sepia(const float3& color)
+/// <summary>
+/// Gives the number of paths the pixel (x, y) traces this frame: one while
+/// its error is unknown, none once it converged, and more the further its
+/// error is above the threshold.
+/// </summary>
+__device__ inline int
+adaptivePaths(const Adaptive& ada, int x, int y, unsigned int width,
+              unsigned int height,
+              const AccumulationBuffer& temporal_framebuffer, int is_static)
 {
-  return make_float3(color.x * 0.393 + color.y * 0.769 + color.z * 0.189,
-                     color.x * 0.349 + color.y * 0.686 + color.z * 0.168,
-                     color.x * 0.272 + color.y * 0.534 + color.z * 0.131);
+  if (!ada.enabled || !is_static)
+    return 1;
+
+  const int i = (height - y - 1) * width + x;
+  const float2 moments = ada.moments[i];
+  if (moments.x < ADAPTIVE_MIN_SAMPLES)
+    return 1;
+
+  const float mean =
+    luminance(loadMean(temporal_framebuffer, i, moments.x));
+  const float variance = fmaxf(moments.y / moments.x - mean * mean, 0.0f);
+  const float error =
+    sqrtf(variance / moments.x) / (mean + ADAPTIVE_BLACK_LEVEL);
+  if (error <= ADAPTIVE_THRESHOLD)
+    return 0;
+
+  return min(ADAPTIVE_MAX_PATHS, __float2int_ru(error / ADAPTIVE_THRESHOLD));
 }
 
-__device__ float3
-invert(const float3& color)
+/// <summary>
+/// Gives the index of the first sample the pixel (x, y) draws this frame:
+/// the number of the frame, or with adaptive sampling, the number of
+/// samples the pixel already has.
+/// </summary>
+__device__ inline unsigned int
+firstSample(const SamplerFrame& samples, const Adaptive& ada, int x, int y,
+            unsigned int width, unsigned int height, int is_static)
 {
-  return make_float3(1.0 - color.x, 1.0 - color.y, 1.0 - color.z);
+  if (!ada.enabled || !is_static)
+    return samples.offset + samples.frame;
+
+  const int i = (height - y - 1) * width + x;
+  return samples.offset + (unsigned int)ada.moments[i].x;
+}
+
+/// <summary>
+/// Accumulates the samples of a pixel in the temporal buffer, along with
+/// their moments.
+/// </summary>
+/// <param name="rad">Sum of the radiance of the samples.</param>
+/// <param name="rad_sq">Sum of their squared luminance.</param>
+/// <returns>The average radiance of the pixel.</returns>
+__device__ inline float3
+accumulateAdaptive(const Adaptive& ada, int x, int y, unsigned int width,
+                   unsigned int height, const float3& rad, float rad_sq,
+                   int nb_paths, const AccumulationBuffer& temporal_framebuffer,
+                   int is_static)
+{
+  const int i = (height - y - 1) * width + x;
+  float2 moments = ada.moments[i];
+  if (nb_paths > 0 || !is_static) {
+    // Zero-out if the camera is moving to reset the buffer
+    moments.x = moments.x * is_static + nb_paths;
+    moments.y = moments.y * is_static + rad_sq;
+    ada.moments[i] = moments;
+    return accumulate(temporal_framebuffer, i, rad, (float)nb_paths,
+                      moments.x, is_static);
+  }
+
+  return loadMean(temporal_framebuffer, i, moments.x);
+}
+
+/// <summary>
+/// Distance, relative to the distance of the hit, under which two first
+/// hits of a pixel are considered to be the same surface.
+/// </summary>
+constexpr float REPROJECTION_DEPTH_TOLERANCE = 0.05f;
+
+/// <summary>
+/// Cosine of the angle under which two first hits of a pixel are
+/// considered to have the same normal.
+/// </summary>
+constexpr float REPROJECTION_NORMAL_TOLERANCE = 0.9f;
+
+/// <summary>
+/// Number of samples the history is limited to while the camera moves,
+/// so that reprojection errors fade out quickly.
+/// </summary>
+constexpr float MAX_MOVING_HISTORY = 32.0f;
+
+/// <summary>
+/// Finds the pixel of the previous frame showing the same surface as the
+/// first hit `hit', and checks that it does: the previous first hit must be
+/// close enough, with a similar normal, or must have missed as well.
+/// </summary>
+/// <returns>False if the surface was not visible in the previous
+/// frame.</returns>
+__device__ inline bool
+findPreviousPixel(const Reprojection& rep, const FirstHit& hit,
+                  unsigned int width, unsigned int height,
+                  unsigned int& out_i)
+{
+  // Missed rays are reprojected as points at infinity.
+  const float3 p =
+    hit.dist > 0.0f ? hit.position : rep.camera.position + hit.position;
+
+  float x, y;
+  if (!projectPoint(p, width / 2, height / 2, rep.camera, x, y))
+    return false;
+
+  const int px = __float2int_rd(x + 0.5f);
+  const int py = __float2int_rd(y + 0.5f);
+  if (px < 0 || py < 0 || px >= width || py >= height)
+    return false;
+
+  out_i = py * width + px;
+  const float4 prev = rep.hits[out_i];
+  if (hit.dist <= 0.0f)
+    return prev.w <= 0.0f;
+
+  const float3 offset = make_float3(prev) - hit.position;
+  return prev.w > 0.0f &&
+         dot(offset, offset) <= hit.dist * hit.dist *
+                                  REPROJECTION_DEPTH_TOLERANCE *
+                                  REPROJECTION_DEPTH_TOLERANCE &&
+         dot(rep.normals[out_i], hit.normal) >= REPROJECTION_NORMAL_TOLERANCE;
+}
+
+/// <summary>
+/// Accumulates the radiance of a pixel with the history of the surface it
+/// shows, reprojected from the previous frame. Pixels showing surfaces that
+/// were not visible start a new history.
+/// </summary>
+/// <returns>The average radiance of the pixel.</returns>
+__device__ inline float3
+accumulateReprojected(const Reprojection& rep, int x, int y,
+                      unsigned int width, unsigned int height, float3 rad,
+                      const FirstHit& hit)
+{
+  const unsigned int i = y * width + x;
+  float4 history = make_float4(0.0f);
+  if (rep.valid) {
+    unsigned int prev_i = i;
+    if (!rep.moved || findPreviousPixel(rep, hit, width, height, prev_i))
+      history = rep.history[prev_i];
+    if (rep.moved)
+      history.w = fminf(history.w, MAX_MOVING_HISTORY);
+  }
+
+  const float nb_samples = history.w + 1.0f;
+  const float3 mean =
+    make_float3(history) + (rad - make_float3(history)) / nb_samples;
+
+  rep.next_history[i] = make_float4(mean, nb_samples);
+  rep.next_hits[i] = make_float4(hit.position, hit.dist);
+  rep.next_normals[i] = hit.normal;
+
+  return mean;
+}
+
+/// <summary>
+/// Writes the color of a pixel to the screen, or keeps it along with the
+/// features of its first hit when the frame is denoised.
+/// </summary>
+template <int Post>
+__device__ inline void
+outputPixel(const OutputSurface& surface, const Denoising& den, int x, int y,
+            unsigned int width, const float3& mean, const FirstHit& hit)
+{
+  if (!den.enabled) {
+    // Batched views are only accumulated.
+    if (surface.surface)
+      writeColor<Post>(surface, x, y, mean);
+    return;
+  }
+
+  const unsigned int i = y * width + x;
+  den.color[i] = make_float4(mean, 0.0f);
+  den.normals[i] = make_float4(hit.normal, hit.dist);
+  den.albedo[i] = make_float4(hit.albedo, 0.0f);
+}
+
+/// <summary>
+/// Traces the path of the pixel (x, y), and writes its color. Previews
+/// restart the accumulation, and only show the color of the first hit.
+/// </summary>
+template <bool Preview, int Post>
+__device__ inline void
+renderPixel(const int x, const int y, const unsigned int width,
+            const unsigned int height, const scene::Scenes& scenes,
+            unsigned int scene_id, const FrameTargets& targets,
+            scene::Camera cam, const SamplerFrame& samples, int frame_nb,
+            const AccumulationBuffer& temporal_framebuffer,
+            const Reprojection& rep,
+            const Denoising& den, const Adaptive& ada)
+{
+  const unsigned int half_w = width / 2;
+  const unsigned int half_h = height / 2;
+
+  int is_static = !Preview;
+  int static_samples = 1;
+
+  const int nb_paths = adaptivePaths(ada, x, y, width, height,
+                                     temporal_framebuffer, is_static);
+  Sampler sampler = makeSampler(
+    samples.type, x, y,
+    firstSample(samples, ada, x, y, width, height, is_static));
+
+  FirstHit hit;
+  float3 rad = make_float3(0.0f);
+  float rad_sq = 0.0f;
+  for (int p = 0; p < nb_paths; ++p, ++sampler.index) {
+    sampler.dimension = DIM_LENS;
+    scene::Ray r = generateRay(x, y, half_w, half_h, cam);
+
+    // Depth-Of-Field
+    camera_dof(r, cam, sampler);
+
+    const float3 sample =
+      clampSample(radiance(r, scenes, scene_id, targets, &cam, sampler,
+                           is_static, static_samples, hit));
+    rad += sample;
+    rad_sq += luminance(sample) * luminance(sample);
+  }
+
+  // Converged pixels still give their first hit to the denoiser.
+  if (nb_paths == 0 && den.enabled)
+    traceFirstHit(generateRay(x, y, half_w, half_h, cam), scenes, scene_id,
+                  hit);
+
+  const float3 mean =
+    rep.enabled
+      ? accumulateReprojected(rep, x, y, width, height, rad, hit)
+      : ada.enabled
+          ? accumulateAdaptive(ada, x, y, width, height, rad, rad_sq,
+                               nb_paths, temporal_framebuffer, is_static)
+          : accumulatePixel(x, y, width, height, rad, temporal_framebuffer,
+                            is_static, frame_nb);
+
+  outputPixel<Post>(targets.surface, den, x, y, width, mean, hit);
+}
+
+/// <summary>
+/// Arguments of a frame rendered with OptiX, the same as the megakernel's,
+/// given to its programs as their launch parameters.
+/// </summary>
+struct OptixFrame
+{
+  unsigned long long traversable;
+  unsigned int width;
+  unsigned int height;
+  scene::Scenes scenes;
+  unsigned int scene_id;
+  FrameTargets targets;
+  scene::Camera cam;
+  SamplerFrame samples;
+  int frame_nb;
+  AccumulationBuffer temporal_framebuffer;
+  Reprojection rep;
+  Denoising den;
+  Adaptive ada;
+  int preview;
+  unsigned int post;
+  RenderCounters* counters;
+};
+
+#ifdef ARTRACER_OPTIX_PROGRAMS
+////////////////////////////////////////////////////////////////////////////////
+// OptiX programs
+//
+// This file is also compiled to PTX for OptiX, with only the path tracing
+// above it. The ray generation program renders a pixel like the megakernel,
+// its rays being traced by the programs of optix_trace.cuh.
+////////////////////////////////////////////////////////////////////////////////
+
+extern "C" __constant__ OptixFrame optix_frame;
+
+__device__ inline OptixTraversableHandle
+sceneTraversable()
+{
+  return optix_frame.traversable;
 }
 
-__device__ post_process_t p_none = no_post_process;
-__device__ post_process_t p_gray = grayscale;
-__device__ post_process_t p_sepia = sepia;
-__device__ post_process_t p_invert = invert;
+#ifdef ARTRACER_COUNTERS
+__device__ inline RenderCounters*
+deviceCounters()
+{
+  return optix_frame.counters;
+}
+#endif
+
+template <bool Preview, int Post>
+__device__ inline void
+renderOptixPixel(const uint3& idx)
+{
+  const OptixFrame& f = optix_frame;
+  renderPixel<Preview, Post>(idx.x, idx.y, f.width, f.height, f.scenes,
+                             f.scene_id, f.targets, f.cam, f.samples,
+                             f.frame_nb, f.temporal_framebuffer, f.rep, f.den,
+                             f.ada);
+}
+
+template <bool Preview>
+__device__ inline void
+renderOptixPixel(const uint3& idx, unsigned int post)
+{
+  switch (post) {
+    case POST_GRAYSCALE:
+      renderOptixPixel<Preview, POST_GRAYSCALE>(idx);
+      break;
+    case POST_SEPIA:
+      renderOptixPixel<Preview, POST_SEPIA>(idx);
+      break;
+    case POST_INVERT:
+      renderOptixPixel<Preview, POST_INVERT>(idx);
+      break;
+    default:
+      renderOptixPixel<Preview, POST_NONE>(idx);
+  }
+}
+
+extern "C" __global__ void
+__raygen__render()
+{
+  const uint3 idx = optixGetLaunchIndex();
+  if (optix_frame.preview)
+    renderOptixPixel<true>(idx, optix_frame.post);
+  else
+    renderOptixPixel<false>(idx, optix_frame.post);
+}
+#else
+template <bool Preview, int Post>
+__global__ void
+kernel(const unsigned int width, const unsigned int height,
+       const scene::Scenes scenes, unsigned int scene_id,
+       const FrameTargets targets, scene::Camera cam,
+       const SamplerFrame samples, int frame_nb,
+       const AccumulationBuffer temporal_framebuffer, const Reprojection rep,
+       const Denoising den, const Adaptive ada)
+{
+  const int x = blockDim.x * blockIdx.x + threadIdx.x;
+  const int y = blockDim.y * blockIdx.y + threadIdx.y;
+
+  if (x >= width || y >= height)
+    return;
+
+  renderPixel<Preview, Post>(x, y, width, height, scenes, scene_id, targets,
+                             cam, samples, frame_nb, temporal_framebuffer,
+                             rep, den, ada);
+}
+
+/// <summary>
+/// Size of the tile of pixels fetched at once by a warp
+/// of the persistent kernel.
+/// </summary>
+constexpr unsigned int BATCH_W = 8;
+constexpr unsigned int BATCH_H = 4;
+
+/// <summary>
+/// Counter of the next batch of pixels to render by the persistent kernel.
+/// </summary>
+__device__ unsigned int g_next_batch;
+
+/// <summary>
+/// Runs as many threads as the GPU can keep resident. Each warp fetches
+/// a tile of pixels using a global counter, and fetches the next one as soon
+/// as it is done, until the whole screen is rendered. Warps getting cheap
+/// tiles thus render more of them, instead of waiting for slower blocks.
+/// </summary>
+template <bool Preview, int Post>
+__global__ void
+persistentKernel(const unsigned int width, const unsigned int height,
+                 const scene::Scenes scenes, unsigned int scene_id,
+                 const FrameTargets targets, scene::Camera cam,
+                 const SamplerFrame samples, int frame_nb,
+                 const AccumulationBuffer temporal_framebuffer,
+                 const Reprojection rep,
+                 const Denoising den, const Adaptive ada)
+{
+  const unsigned int lane = threadIdx.x % warpSize;
+  const unsigned int nb_batches_x = (width + BATCH_W - 1) / BATCH_W;
+  const unsigned int nb_batches =
+    nb_batches_x * ((height + BATCH_H - 1) / BATCH_H);
+
+  while (true) {
+    // The first lane fetches the batch for the whole warp.
+    unsigned int batch = 0;
+    if (lane == 0)
+      batch = atomicAdd(&g_next_batch, 1);
+    batch = __shfl_sync(0xFFFFFFFF, batch, 0);
+
+    if (batch >= nb_batches)
+      return;
+
+    const unsigned int x = (batch % nb_batches_x) * BATCH_W + lane % BATCH_W;
+    const unsigned int y = (batch / nb_batches_x) * BATCH_H + lane / BATCH_W;
+    if (x < width && y < height)
+      renderPixel<Preview, Post>(x, y, width, height, scenes, scene_id,
+                                 targets, cam, samples, frame_nb,
+                                 temporal_framebuffer, rep, den, ada);
+  }
+}
+
+/// <summary>
+/// Counter of the next batch of pixels of `viewsKernel', apart from the one
+/// of the frames so that both can run at the same time.
+/// </summary>
+__device__ unsigned int g_next_view_batch;
+
+/// <summary>
+/// Renders a sample per pixel of several views with persistent threads, as
+/// `persistentKernel' does for a single one. Batches are numbered view
+/// after view, so that the warps render neighbouring tiles of the same view
+/// together and share the nodes and texels they fetch, and a warp done with
+/// the last batches of a view moves on to the next one.
+/// </summary>
+__global__ void
+viewsKernel(const unsigned int width, const unsigned int height,
+            const scene::Scenes scenes, unsigned int scene_id,
+            const FrameTargets targets, const RenderView* views,
+            unsigned int nb_views, const SamplerFrame samples, int frame_nb)
+{
+  const unsigned int lane = threadIdx.x % warpSize;
+  const unsigned int nb_batches_x = (width + BATCH_W - 1) / BATCH_W;
+  const unsigned int nb_view_batches =
+    nb_batches_x * ((height + BATCH_H - 1) / BATCH_H);
+  const unsigned int nb_batches = nb_view_batches * nb_views;
+
+  while (true) {
+    unsigned int batch = 0;
+    if (lane == 0)
+      batch = atomicAdd(&g_next_view_batch, 1);
+    batch = __shfl_sync(0xFFFFFFFF, batch, 0);
+
+    if (batch >= nb_batches)
+      return;
+
+    const RenderView& view = views[batch / nb_view_batches];
+    batch %= nb_view_batches;
+    const unsigned int x = (batch % nb_batches_x) * BATCH_W + lane % BATCH_W;
+    const unsigned int y = (batch / nb_batches_x) * BATCH_H + lane / BATCH_W;
+    if (x < width && y < height)
+      renderPixel<false, POST_NONE>(x, y, width, height, scenes, scene_id,
+                                    targets, view.camera, samples, frame_nb,
+                                    view.framebuffer, Reprojection(),
+                                    Denoising(), Adaptive());
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Wavefront path tracing
+//
+// Instead of following a whole path in a single thread, each stage of a
+// bounce is run by its own kernel, over a queue of the paths needing it.
+// Paths that ended are not part of the next queues, so warps stay full, and
+// each shading kernel only runs a single material branch.
+////////////////////////////////////////////////////////////////////////////////
+
+constexpr unsigned int WAVEFRONT_NB_THREADS = 256;
+
+/// <summary>
+/// State of a path between two stages, one per pixel.
+/// </summary>
+struct __align__(16) Path
+{
+  scene::Ray ray;
+  float3 throughput;
+  float3 acc;
+  float bsdf_pdf;
+  FirstHit first_hit;
+  Sampler sampler;
+};
+
+/// <summary>
+/// Compacted list of path ids, filled using an atomic counter.
+/// </summary>
+struct Queue
+{
+  unsigned int* items;
+  unsigned int* size;
+};
+
+enum QueueId
+{
+  QUEUE_RAYS = 0,
+  QUEUE_NEXT_RAYS,
+  QUEUE_MISS,
+  QUEUE_DIFFUSE,
+  QUEUE_REFRACT,
+  NB_QUEUES
+};
+
+__device__ inline void
+pushPath(const Queue& queue, unsigned int path_id)
+{
+  queue.items[atomicAdd(queue.size, 1)] = path_id;
+}
+
+/// <summary>
+/// Gets the path id handled by the current thread, if any.
+/// Kernels are launched for the whole screen, because the
+/// size of the queues is only known on the device.
+/// </summary>
+__device__ inline bool
+popPath(const Queue& queue, unsigned int& path_id)
+{
+  unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= *queue.size)
+    return false;
+
+  path_id = queue.items[i];
+  return true;
+}
+
+inline unsigned int
+wavefrontBlocks(unsigned int nb_elt)
+{
+  return (nb_elt + WAVEFRONT_NB_THREADS - 1) / WAVEFRONT_NB_THREADS;
+}
+
+/// <summary>
+/// Creates the camera ray of every pixel, and fills the ray queue. With
+/// adaptive sampling, converged pixels are left out of the queue, and the
+/// others trace a single path, there being one path per pixel.
+/// </summary>
+__global__ void
+generateKernel(const unsigned int width, const unsigned int height,
+               scene::Camera cam, const SamplerFrame samples, Path* paths,
+               Queue rays, const AccumulationBuffer temporal_framebuffer,
+               bool preview, const Adaptive ada)
+{
+  const unsigned int nb_pixels = width * height;
+  const unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= nb_pixels)
+    return;
+
+  const unsigned int x = i % width;
+  const unsigned int y = i / width;
+  if (ada.enabled) {
+    if (adaptivePaths(ada, x, y, width, height, temporal_framebuffer,
+                      !preview) == 0)
+      return;
+  } else if (i == 0)
+    *rays.size = nb_pixels;
+
+  countPath();
+  Path path;
+  path.sampler = makeSampler(
+    samples.type, x, y,
+    firstSample(samples, ada, x, y, width, height, !preview));
+
+  path.ray = generateRay(x, y, width / 2, height / 2, cam);
+  camera_dof(path.ray, cam, path.sampler);
+
+  path.throughput = make_float3(1.0f);
+  path.acc = make_float3(0.0f);
+  path.bsdf_pdf = 0.0f;
+  // Not intersected yet.
+  path.first_hit.dist = -1.0f;
+
+  paths[i] = path;
+  if (ada.enabled)
+    pushPath(rays, i);
+  else
+    rays.items[i] = i;
+}
+
+/// <summary>
+/// Intersects every queued ray with the scene, and sorts the paths
+/// in the queue of the stage they now need.
+/// </summary>
+__global__ void
+extendKernel(const scene::Scenes scenes, unsigned int scene_id, Path* paths,
+             IntersectionData* hits, Queue rays, Queue miss, Queue diffuse,
+             Queue refract, bool preview)
+{
+  unsigned int id;
+  if (!popPath(rays, id))
+    return;
+
+  countBounce();
+  Path& path = paths[id];
+  IntersectionData inter;
+  if (!intersect(path.ray, scenes, scene_id, inter)) {
+    if (path.first_hit.dist < 0.0f)
+      resetFirstHit(path.ray, path.first_hit);
+    pushPath(miss, id);
+    return;
+  }
+
+  if (path.first_hit.dist < 0.0f)
+    recordFirstHit(path.ray, inter, path.first_hit);
+
+  // The preview only shows the color of the first hit.
+  if (preview) {
+    path.acc = inter.diffuse_col;
+    return;
+  }
+
+  hits[id] = inter;
+  // Default IOR (Index Of Refraction) is 1.0f
+  if (inter.ior == 1.0f || inter.light != NULL)
+    pushPath(diffuse, id);
+  else
+    pushPath(refract, id);
+}
+
+__global__ void
+missKernel(const FrameTargets targets, Path* paths, Queue miss)
+{
+  unsigned int id;
+  if (!popPath(miss, id))
+    return;
+
+  Path& path = paths[id];
+  path.acc += missRadiance(targets, path.ray, path.throughput, path.bsdf_pdf);
+}
+
+__global__ void
+shadeDiffuseKernel(const scene::Scenes scenes, unsigned int scene_id,
+                   const FrameTargets targets, Path* paths,
+                   const IntersectionData* hits, Queue diffuse,
+                   Queue next_rays, int bounce)
+{
+  unsigned int id;
+  if (!popPath(diffuse, id))
+    return;
+
+  Path path = paths[id];
+  startBounce(path.sampler, bounce);
+  float r1 = sample1D(path.sampler, DIM_BSDF);
+  scatterDiffuse(path.ray, hits[id], r1, scenes, scene_id, targets,
+                 path.throughput, path.acc, path.bsdf_pdf, path.sampler);
+
+  if (russianRoulette(r1, bounce, path.throughput))
+    pushPath(next_rays, id);
+
+  paths[id] = path;
+}
+
+__global__ void
+shadeRefractKernel(Path* paths, const IntersectionData* hits, Queue refract,
+                   Queue next_rays, int bounce)
+{
+  unsigned int id;
+  if (!popPath(refract, id))
+    return;
+
+  Path path = paths[id];
+  startBounce(path.sampler, bounce);
+  float r1 = sample1D(path.sampler, DIM_BSDF);
+  scatterRefract(path.ray, hits[id], path.throughput, path.bsdf_pdf,
+                 path.sampler);
+
+  if (russianRoulette(r1, bounce, path.throughput))
+    pushPath(next_rays, id);
+
+  paths[id] = path;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Ray reordering
+//
+// Between two stages, a queue can be binned so that neighbouring threads
+// handle similar paths: hit points by material before shading, and bounce
+// rays by direction octant and origin cell before intersection. Bins are
+// counted, their offsets scanned, and the path ids scattered, the sizes of
+// the queues never leaving the device.
+////////////////////////////////////////////////////////////////////////////////
+
+/// <summary>
+/// Number of bins of a reordered queue. Rays use 8 direction octants times
+/// a grid of REORDER_CELLS^3 cells over the bounds of the scene, and hits
+/// one bin per material, the last one being kept for the lights.
+/// </summary>
+constexpr unsigned int NB_REORDER_BINS = 512;
+constexpr unsigned int REORDER_CELLS = 4;
+
+__device__ inline unsigned int
+materialBin(const IntersectionData& inter)
+{
+  if (inter.light)
+    return NB_REORDER_BINS - 1;
+  return inter.material_id % (NB_REORDER_BINS - 1);
+}
+
+__device__ inline unsigned int
+reorderCell(float v, float min, float max)
+{
+  const float t = (v - min) / fmaxf(max - min, 1e-6f);
+  return (unsigned int)fminf(fmaxf(t * REORDER_CELLS, 0.0f),
+                             REORDER_CELLS - 1.0f);
+}
+
+__device__ inline unsigned int
+rayBin(const scene::Ray& r, const scene::BVHNode& root)
+{
+  const unsigned int octant =
+    (r.dir.x < 0.0f) | ((r.dir.y < 0.0f) << 1) | ((r.dir.z < 0.0f) << 2);
+  const unsigned int cell =
+    (reorderCell(r.origin.z, root.min.z, root.max.z) * REORDER_CELLS +
+     reorderCell(r.origin.y, root.min.y, root.max.y)) *
+      REORDER_CELLS +
+    reorderCell(r.origin.x, root.min.x, root.max.x);
+  return octant * REORDER_CELLS * REORDER_CELLS * REORDER_CELLS + cell;
+}
+
+/// <summary>
+/// Adds the bins of the threads of a block to the counts. Most threads of
+/// a block fall in a few bins, so they are first counted in shared memory.
+/// </summary>
+__device__ inline void
+countBin(bool valid, unsigned int bin, unsigned int* counts)
+{
+  __shared__ unsigned int block_counts[NB_REORDER_BINS];
+  for (unsigned int b = threadIdx.x; b < NB_REORDER_BINS; b += blockDim.x)
+    block_counts[b] = 0;
+  __syncthreads();
+
+  if (valid)
+    atomicAdd(&block_counts[bin], 1);
+  __syncthreads();
+
+  for (unsigned int b = threadIdx.x; b < NB_REORDER_BINS; b += blockDim.x) {
+    if (block_counts[b])
+      atomicAdd(&counts[b], block_counts[b]);
+  }
+}
+
+/// <summary>
+/// Bins the paths of the queue by the material they hit.
+/// </summary>
+__global__ void
+hitBinsKernel(const IntersectionData* hits, Queue queue, unsigned int* keys,
+              unsigned int* counts)
+{
+  unsigned int id = 0;
+  const bool valid = popPath(queue, id);
+  const unsigned int bin = valid ? materialBin(hits[id]) : 0;
+  if (valid)
+    keys[blockIdx.x * blockDim.x + threadIdx.x] = bin;
+  countBin(valid, bin, counts);
+}
+
+/// <summary>
+/// Bins the paths of the queue by the octant of their direction and the
+/// cell of their origin.
+/// </summary>
+__global__ void
+rayBinsKernel(const scene::Scenes scenes, unsigned int scene_id,
+              const Path* paths, Queue queue, unsigned int* keys,
+              unsigned int* counts)
+{
+  const scene::SceneData* scene = scenes.scenes[scene_id];
+  unsigned int id = 0;
+  const bool valid = popPath(queue, id);
+  const unsigned int bin =
+    valid && scene->bvh.size ? rayBin(paths[id].ray, scene->bvh.data[0]) : 0;
+  if (valid)
+    keys[blockIdx.x * blockDim.x + threadIdx.x] = bin;
+  countBin(valid, bin, counts);
+}
+
+/// <summary>
+/// Replaces the counts of the bins by their exclusive scan, giving the
+/// first slot of each bin. Launched as a single block of NB_REORDER_BINS
+/// threads.
+/// </summary>
+__global__ void
+binOffsetsKernel(unsigned int* counts)
+{
+  __shared__ unsigned int scan[NB_REORDER_BINS];
+  const unsigned int b = threadIdx.x;
+  const unsigned int count = counts[b];
+  scan[b] = count;
+  __syncthreads();
+
+  for (unsigned int offset = 1; offset < NB_REORDER_BINS; offset <<= 1) {
+    const unsigned int v = b >= offset ? scan[b - offset] : 0;
+    __syncthreads();
+    scan[b] += v;
+    __syncthreads();
+  }
+  counts[b] = scan[b] - count;
+}
+
+/// <summary>
+/// Writes the ids of the queue to the slots of their bins. Each block
+/// reserves the slots of its threads at once, one atomic per bin.
+/// </summary>
+__global__ void
+binScatterKernel(Queue queue, const unsigned int* keys,
+                 unsigned int* offsets, unsigned int* out_items)
+{
+  __shared__ unsigned int block_counts[NB_REORDER_BINS];
+  __shared__ unsigned int block_bases[NB_REORDER_BINS];
+  const unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  const bool valid = i < *queue.size;
+  for (unsigned int b = threadIdx.x; b < NB_REORDER_BINS; b += blockDim.x)
+    block_counts[b] = 0;
+  __syncthreads();
+
+  unsigned int bin = 0;
+  unsigned int rank = 0;
+  if (valid) {
+    bin = keys[i];
+    rank = atomicAdd(&block_counts[bin], 1);
+  }
+  __syncthreads();
+
+  for (unsigned int b = threadIdx.x; b < NB_REORDER_BINS; b += blockDim.x) {
+    if (block_counts[b])
+      block_bases[b] = atomicAdd(&offsets[b], block_counts[b]);
+  }
+  __syncthreads();
+
+  if (valid)
+    out_items[block_bases[bin] + rank] = queue.items[i];
+}
+
+/// <summary>
+/// Writes the radiance gathered by each path to the screen.
+/// </summary>
+template <bool Preview, int Post>
+__global__ void
+resolveKernel(const unsigned int width, const unsigned int height,
+              const OutputSurface surface, const Path* paths, int frame_nb,
+              const AccumulationBuffer temporal_framebuffer,
+              const Reprojection rep,
+              const Denoising den, const Adaptive ada)
+{
+  const unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= width * height)
+    return;
+
+  const unsigned int x = i % width;
+  const unsigned int y = i / width;
+  const Path& path = paths[i];
+  const float3 sample = clampSample(path.acc);
+
+  // Left out pixels keep the first hit of their last path.
+  if (ada.enabled) {
+    const int nb_paths = min(1, adaptivePaths(ada, x, y, width, height,
+                                              temporal_framebuffer, !Preview));
+    const float3 rad = nb_paths ? sample : make_float3(0.0f);
+    const float3 mean =
+      accumulateAdaptive(ada, x, y, width, height, rad,
+                         luminance(rad) * luminance(rad), nb_paths,
+                         temporal_framebuffer, !Preview);
+    outputPixel<Post>(surface, den, x, y, width, mean, path.first_hit);
+    return;
+  }
+
+  const float3 mean =
+    rep.enabled
+      ? accumulateReprojected(rep, x, y, width, height, sample,
+                              path.first_hit)
+      : accumulatePixel(x, y, width, height, sample, temporal_framebuffer,
+                        !Preview, frame_nb);
+
+  outputPixel<Post>(surface, den, x, y, width, mean, path.first_hit);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Denoising
+//
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010): a 5x5
+// B3-spline filter is applied several times, its taps being twice as far
+// apart at each pass. Taps are weighted by how close their color and the
+// first hit they show (normal, distance, albedo) are to the ones of the
+// center, so edges and texture details are kept.
+////////////////////////////////////////////////////////////////////////////////
+
+/// <summary>
+/// Number of passes of the filter, covering a footprint of 61x61 pixels.
+/// </summary>
+constexpr int DENOISE_NB_PASSES = 5;
+
+/// <summary>
+/// Color difference allowed by the first pass, halved at each pass: the
+/// first passes smooth the noise, the last ones only keep the details.
+/// </summary>
+constexpr float DENOISE_SIGMA_COLOR = 1.0f;
+
+/// <summary>
+/// Exponent applied to the cosine between two normals.
+/// </summary>
+constexpr float DENOISE_SIGMA_NORMAL = 64.0f;
+
+/// <summary>
+/// Distance difference allowed per pixel of the tap offset, relative to the
+/// distance of the hit.
+/// </summary>
+constexpr float DENOISE_SIGMA_DEPTH = 0.02f;
+
+/// <summary>
+/// Albedo difference allowed, keeping the edges of the textures.
+/// </summary>
+constexpr float DENOISE_SIGMA_ALBEDO = 0.1f;
+
+/// <summary>
+/// Weight of a tap of the filter, depending on how similar its first hit is
+/// to the one of the center. Rays that missed only match each other.
+/// </summary>
+__device__ inline float
+featureWeight(const float4& n_p, const float4& n_q, const float3& a_p,
+              const float3& a_q, float offset)
+{
+  if (n_p.w <= 0.0f || n_q.w <= 0.0f)
+    return n_p.w <= 0.0f && n_q.w <= 0.0f ? 1.0f : 0.0f;
+
+  const float cos_n = fmaxf(0.0f, dot(make_float3(n_p), make_float3(n_q)));
+  const float w_n = __powf(cos_n, DENOISE_SIGMA_NORMAL);
+
+  const float w_z = __expf(-fabsf(n_p.w - n_q.w) /
+                           (DENOISE_SIGMA_DEPTH * n_p.w * offset + 1e-4f));
+
+  const float3 da = a_p - a_q;
+  const float w_a = __expf(-dot(da, da) /
+                           (DENOISE_SIGMA_ALBEDO * DENOISE_SIGMA_ALBEDO));
+
+  return w_n * w_z * w_a;
+}
+
+/// <summary>
+/// Runs one pass of the filter over `in'. The last pass writes the color to
+/// the screen, the other ones to `out'.
+/// </summary>
+/// <param name="step">Distance between two taps, in pixels.</param>
+/// <param name="sigma_color">Color difference allowed by this pass.</param>
+template <int Post>
+__global__ void
+atrousKernel(const unsigned int width, const unsigned int height,
+             const float4* in, float4* out, const float4* normals,
+             const float4* albedo, int step, float sigma_color,
+             const OutputSurface surface)
+{
+  const int x = blockDim.x * blockIdx.x + threadIdx.x;
+  const int y = blockDim.y * blockIdx.y + threadIdx.y;
+  if (x >= width || y >= height)
+    return;
+
+  const float weights[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+  const int p = y * width + x;
+  const float3 c_p = make_float3(in[p]);
+  const float4 n_p = normals[p];
+  const float3 a_p = make_float3(albedo[p]);
+  const float inv_sigma2 = 1.0f / (sigma_color * sigma_color);
+
+  float3 sum = make_float3(0.0f);
+  float total = 0.0f;
+  for (int j = -2; j <= 2; ++j) {
+    const int qy = y + j * step;
+    if (qy < 0 || qy >= height)
+      continue;
+
+    for (int i = -2; i <= 2; ++i) {
+      const int qx = x + i * step;
+      if (qx < 0 || qx >= width)
+        continue;
+
+      const int q = qy * width + qx;
+      const float3 c_q = make_float3(in[q]);
+      const float3 dc = c_p - c_q;
+
+      const float offset = step * sqrtf((float)(i * i + j * j));
+      float w = weights[abs(i)] * weights[abs(j)];
+      w *= __expf(-dot(dc, dc) * inv_sigma2);
+      w *= featureWeight(n_p, normals[q], a_p, make_float3(albedo[q]), offset);
+
+      sum += c_q * w;
+      total += w;
+    }
+  }
+
+  // The center always has a weight, unless it is degenerate.
+  const float3 color = total > 0.0f ? sum / total : c_p;
+  if (out)
+    out[p] = make_float4(color, 0.0f);
+  else
+    writeColor<Post>(surface, x, y, color);
+}
+
+/// <summary>
+/// Accumulation buffers of several GPUs, copied on the one merging them.
+/// </summary>
+struct MergedFramebuffers
+{
+  AccumulationBuffer framebuffers[MAX_RENDER_DEVICES];
+  float nb_frames[MAX_RENDER_DEVICES];
+  unsigned int count;
+};
+
+/// <summary>
+/// Writes to the screen the average of the frames accumulated by each GPU.
+/// </summary>
+template <int Post>
+__global__ void
+mergeKernel(const unsigned int width, const unsigned int height,
+            const OutputSurface surface, MergedFramebuffers merged,
+            float inv_nb_frames)
+{
+  const int x = blockDim.x * blockIdx.x + threadIdx.x;
+  const int y = blockDim.y * blockIdx.y + threadIdx.y;
+  if (x >= width || y >= height)
+    return;
+
+  const int i = (height - y - 1) * width + x;
+  float3 sum = make_float3(0.0f);
+  for (unsigned int k = 0; k < merged.count; ++k)
+    sum += loadSum(merged.framebuffers[k], i, merged.nb_frames[k]);
+
+  writeColor<Post>(surface, x, y, sum * inv_nb_frames);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Kernel variants
+//
+// Kernels are instantiated for each post process, and for preview and
+// converging frames, so that neither is a branch nor an indirect call in the
+// inner loops. The host picks the variant of each frame from these tables,
+// indexed by [preview][post process].
+////////////////////////////////////////////////////////////////////////////////
+
+using Megakernel = decltype(&kernel<false, POST_NONE>);
+using ResolveKernel = decltype(&resolveKernel<false, POST_NONE>);
+using AtrousKernel = decltype(&atrousKernel<POST_NONE>);
+using MergeKernel = decltype(&mergeKernel<POST_NONE>);
+
+const Megakernel MEGAKERNELS[2][NB_POST_PROCESSES] = {
+  { kernel<false, POST_NONE>, kernel<false, POST_GRAYSCALE>,
+    kernel<false, POST_SEPIA>, kernel<false, POST_INVERT> },
+  { kernel<true, POST_NONE>, kernel<true, POST_GRAYSCALE>,
+    kernel<true, POST_SEPIA>, kernel<true, POST_INVERT> }
+};
+
+const Megakernel PERSISTENT_KERNELS[2][NB_POST_PROCESSES] = {
+  { persistentKernel<false, POST_NONE>,
+    persistentKernel<false, POST_GRAYSCALE>,
+    persistentKernel<false, POST_SEPIA>,
+    persistentKernel<false, POST_INVERT> },
+  { persistentKernel<true, POST_NONE>, persistentKernel<true, POST_GRAYSCALE>,
+    persistentKernel<true, POST_SEPIA>, persistentKernel<true, POST_INVERT> }
+};
+
+const ResolveKernel RESOLVE_KERNELS[2][NB_POST_PROCESSES] = {
+  { resolveKernel<false, POST_NONE>, resolveKernel<false, POST_GRAYSCALE>,
+    resolveKernel<false, POST_SEPIA>, resolveKernel<false, POST_INVERT> },
+  { resolveKernel<true, POST_NONE>, resolveKernel<true, POST_GRAYSCALE>,
+    resolveKernel<true, POST_SEPIA>, resolveKernel<true, POST_INVERT> }
+};
+
+const AtrousKernel ATROUS_KERNELS[NB_POST_PROCESSES] = {
+  atrousKernel<POST_NONE>, atrousKernel<POST_GRAYSCALE>,
+  atrousKernel<POST_SEPIA>, atrousKernel<POST_INVERT>
+};
+
+const MergeKernel MERGE_KERNELS[NB_POST_PROCESSES] = {
+  mergeKernel<POST_NONE>, mergeKernel<POST_GRAYSCALE>,
+  mergeKernel<POST_SEPIA>, mergeKernel<POST_INVERT>
+};
+
+/// <summary>
+/// Gives the index of a post process in the tables of variants, unknown ones
+/// being left out.
+/// </summary>
+unsigned int
+postIndex(unsigned int post_id)
+{
+  return post_id < NB_POST_PROCESSES ? post_id : POST_NONE;
+}
+
+struct WavefrontBuffers
+{
+  unsigned int capacity;
+  Path* paths;
+  IntersectionData* hits;
+  unsigned int* items[NB_QUEUES];
+  unsigned int* sizes;
+
+  /// <summary>
+  /// Keys of the queue being reordered, counts of its bins, and the
+  /// reordered ids, read by the next stage instead of the queue.
+  /// </summary>
+  unsigned int* bin_keys;
+  unsigned int* bin_counts;
+  unsigned int* binned;
+
+  inline Queue queue(QueueId id) const { return { items[id], sizes + id }; }
+};
+
+struct ReprojectionBuffers
+{
+  unsigned int width;
+  unsigned int height;
+  float4* history[2];
+  float4* hits[2];
+  float3* normals[2];
+
+  /// <summary>
+  /// Buffers written by the last frame, and what this frame showed.
+  /// The history is only valid for the same scene and environment.
+  /// </summary>
+  unsigned int current;
+  bool valid;
+  scene::Camera camera;
+  unsigned int scene_id;
+  cudaTextureObject_t cubemap;
+};
+
+ReprojectionBuffers*
+createReprojection(unsigned int width, unsigned int height)
+{
+  auto* buffers = new ReprojectionBuffers;
+  buffers->width = width;
+  buffers->height = height;
+  buffers->current = 0;
+  buffers->valid = false;
+
+  const size_t nb_pixels = width * height;
+  for (int k = 0; k < 2; ++k) {
+    cudaMalloc(&buffers->history[k], nb_pixels * sizeof(float4));
+    cudaMalloc(&buffers->hits[k], nb_pixels * sizeof(float4));
+    cudaMalloc(&buffers->normals[k], nb_pixels * sizeof(float3));
+  }
+  cudaThrowError();
+
+  return buffers;
+}
+
+void
+releaseReprojection(ReprojectionBuffers* buffers)
+{
+  if (!buffers)
+    return;
+
+  for (int k = 0; k < 2; ++k) {
+    cudaFree(buffers->history[k]);
+    cudaFree(buffers->hits[k]);
+    cudaFree(buffers->normals[k]);
+  }
+
+  delete buffers;
+}
+
+struct DenoiserBuffers
+{
+  unsigned int width;
+  unsigned int height;
+  float4* color[2];
+  float4* normals;
+  float4* albedo;
+};
+
+DenoiserBuffers*
+createDenoiser(unsigned int width, unsigned int height)
+{
+  auto* buffers = new DenoiserBuffers;
+  buffers->width = width;
+  buffers->height = height;
+
+  const size_t nb_pixels = width * height;
+  for (int k = 0; k < 2; ++k)
+    cudaMalloc(&buffers->color[k], nb_pixels * sizeof(float4));
+  cudaMalloc(&buffers->normals, nb_pixels * sizeof(float4));
+  cudaMalloc(&buffers->albedo, nb_pixels * sizeof(float4));
+  cudaThrowError();
+
+  return buffers;
+}
+
+void
+releaseDenoiser(DenoiserBuffers* buffers)
+{
+  if (!buffers)
+    return;
+
+  for (int k = 0; k < 2; ++k)
+    cudaFree(buffers->color[k]);
+  cudaFree(buffers->normals);
+  cudaFree(buffers->albedo);
+
+  delete buffers;
+}
+
+struct AdaptiveBuffers
+{
+  unsigned int width;
+  unsigned int height;
+  float2* moments;
+};
+
+AdaptiveBuffers*
+createAdaptive(unsigned int width, unsigned int height)
+{
+  auto* buffers = new AdaptiveBuffers;
+  buffers->width = width;
+  buffers->height = height;
+
+  const size_t nb_pixels = width * height;
+  cudaMalloc(&buffers->moments, nb_pixels * sizeof(float2));
+  cudaMemset(buffers->moments, 0, nb_pixels * sizeof(float2));
+  cudaThrowError();
+
+  return buffers;
+}
+
+void
+releaseAdaptive(AdaptiveBuffers* buffers)
+{
+  if (!buffers)
+    return;
+
+  cudaFree(buffers->moments);
+  delete buffers;
+}
+
+/// <summary>
+/// Gives the denoising of a frame, made in `buffers'.
+/// </summary>
+/// <returns>A disabled denoising if there are no buffers of the size of the
+/// frame.</returns>
+Denoising
+denoisingOf(const DenoiserBuffers* buffers, unsigned int width,
+            unsigned int height)
+{
+  Denoising den = Denoising();
+  if (!buffers || buffers->width != width || buffers->height != height)
+    return den;
+
+  den.enabled = true;
+  den.color = buffers->color[0];
+  den.normals = buffers->normals;
+  den.albedo = buffers->albedo;
+  return den;
+}
+
+/// <summary>
+/// Gives the adaptive sampling of a frame, whose moments are in `buffers'.
+/// </summary>
+/// <returns>A disabled adaptive sampling if there are no buffers of the
+/// size of the frame, or if the frame is reprojected.</returns>
+Adaptive
+adaptiveOf(const AdaptiveBuffers* buffers, unsigned int width,
+           unsigned int height, const Reprojection& rep)
+{
+  Adaptive ada = Adaptive();
+  if (!buffers || buffers->width != width || buffers->height != height ||
+      rep.enabled)
+    return ada;
+
+  ada.enabled = true;
+  ada.moments = buffers->moments;
+  return ada;
+}
+
+/// <summary>
+/// Filters the colors stored by a denoised frame, and writes the result to
+/// the screen.
+/// </summary>
+void
+enqueueDenoise(const Denoising& den, const DenoiserBuffers* buffers,
+               const OutputSurface& surface, unsigned int width,
+               unsigned int height, unsigned int post_id,
+               cudaStream_t stream)
+{
+  if (!den.enabled)
+    return;
+
+  const AtrousKernel atrous = ATROUS_KERNELS[postIndex(post_id)];
+
+  dim3 threads_per_block(16, 16);
+  dim3 nb_blocks((width + threads_per_block.x - 1) / threads_per_block.x,
+                 (height + threads_per_block.y - 1) / threads_per_block.y);
+
+  float sigma_color = DENOISE_SIGMA_COLOR;
+  for (int pass = 0; pass < DENOISE_NB_PASSES; ++pass) {
+    const bool last = pass == DENOISE_NB_PASSES - 1;
+    atrous<<<nb_blocks, threads_per_block, 0, stream>>>(
+      width, height, buffers->color[pass % 2],
+      last ? nullptr : buffers->color[(pass + 1) % 2], den.normals,
+      den.albedo, 1 << pass, sigma_color, surface);
+    sigma_color *= 0.5f;
+  }
+}
+
+/// <summary>
+/// Gives the reprojection of the next frame, reading the buffers written
+/// by the last one, and writing the other ones.
+/// </summary>
+/// <returns>A disabled reprojection if there are no buffers of the size
+/// of the frame.</returns>
+Reprojection
+nextReprojection(ReprojectionBuffers* buffers, unsigned int width,
+                 unsigned int height, unsigned int scene_id,
+                 const FrameTargets& targets, const scene::Camera& cam,
+                 bool moved)
+{
+  Reprojection rep = Reprojection();
+  if (!buffers || buffers->width != width || buffers->height != height)
+    return rep;
+
+  const unsigned int prev = buffers->current;
+  const unsigned int next = 1 - prev;
+
+  rep.enabled = true;
+  rep.valid = buffers->valid && buffers->scene_id == scene_id &&
+              buffers->cubemap == targets.cubemap;
+  rep.moved = moved;
+  rep.camera = buffers->camera;
+  rep.history = buffers->history[prev];
+  rep.hits = buffers->hits[prev];
+  rep.normals = buffers->normals[prev];
+  rep.next_history = buffers->history[next];
+  rep.next_hits = buffers->hits[next];
+  rep.next_normals = buffers->normals[next];
+
+  buffers->current = next;
+  buffers->valid = true;
+  buffers->camera = cam;
+  buffers->scene_id = scene_id;
+  buffers->cubemap = targets.cubemap;
+  return rep;
+}
+
+/// <summary>
+/// Gives the seed of the current frame, and the number of frames
+/// accumulated since the camera last moved, on the current GPU.
+/// </summary>
+unsigned int
+nextSeed(bool moved)
+{
+  unsigned int& seed = deviceState().seed;
+
+  if (moved)
+    seed = 0;
+  seed++;
+
+  return seed;
+}
+
+/// <summary>
+/// Distance between the samples of two GPUs: each one can render this many
+/// samples per pixel before drawing the samples of the next one.
+/// </summary>
+constexpr unsigned int DEVICE_SEED_STRIDE = 0x01000000u;
+
+/// <summary>
+/// Gives the samples of the frame `seed'. GPUs rendering the same frame
+/// draw other samples of the sequence of each pixel.
+/// </summary>
+SamplerFrame
+frameSamples(unsigned int seed)
+{
+  int device = 0;
+  cudaGetDevice(&device);
+
+  SamplerFrame samples;
+  samples.type = deviceState().sampler;
+  samples.offset =
+    deviceState().seed_offset + (unsigned int)device * DEVICE_SEED_STRIDE;
+  samples.frame = seed - 1;
+  return samples;
+}
+
+void
+setSeedOffset(unsigned int offset)
+{
+  deviceState().seed_offset = offset;
+  deviceState().seed = 0;
+}
+
+void
+setSampler(unsigned int sampler_id)
+{
+  deviceState().sampler = (SamplerType)std::min(
+    sampler_id, (unsigned int)NB_SAMPLERS - 1);
+}
+
+#ifdef ARTRACER_COUNTERS
+__device__ RenderCounters g_counters;
+#endif
+
+/// <summary>
+/// Device address of the counters, for the OptiX programs.
+/// </summary>
+RenderCounters*
+countersAddress()
+{
+  RenderCounters* counters = nullptr;
+#ifdef ARTRACER_COUNTERS
+  cudaGetSymbolAddress(reinterpret_cast<void**>(&counters), g_counters);
+  cudaThrowError();
+#endif
+  return counters;
+}
+
+bool
+readCounters(RenderCounters& out, cudaStream_t stream)
+{
+#ifdef ARTRACER_COUNTERS
+  static const RenderCounters zero = RenderCounters();
+  cudaMemcpyFromSymbolAsync(&out, g_counters, sizeof(RenderCounters), 0,
+                            cudaMemcpyDeviceToHost, stream);
+  cudaMemcpyToSymbolAsync(g_counters, &zero, sizeof(RenderCounters), 0,
+                          cudaMemcpyHostToDevice, stream);
+  cudaStreamSynchronize(stream);
+  cudaThrowError();
+  return true;
+#else
+  (void)stream;
+  out = RenderCounters();
+  return false;
+#endif
+}
+
+/// <summary>
+/// Gathers the framebuffer and the environment of a frame.
+/// </summary>
+FrameTargets
+makeTargets(const OutputSurface& surface, const scene::Cubemap& cubemap)
+{
+  FrameTargets targets;
+  targets.surface = surface;
+  targets.cubemap = cubemap.tex;
+  targets.distribution = cubemap.distribution;
+  return targets;
+}
+
+cudaError_t
+raytrace(const OutputSurface& surface, const scene::Scenes& scenes,
+         unsigned int scene_id, const std::vector<scene::Cubemap>& cubemaps,
+         int cubemap_id, const scene::Camera* const cam,
+         const unsigned int width, const unsigned int height,
+         cudaStream_t stream, const AccumulationBuffer& temporal_framebuffer,
+         bool moved, unsigned int post_id, ReprojectionBuffers* reprojection,
+         DenoiserBuffers* denoiser, AdaptiveBuffers* adaptive)
+{
+  if (width == 0 || height == 0)
+    return cudaSuccess;
+
+  const FrameTargets targets = makeTargets(surface, cubemaps[cubemap_id]);
+  const scene::Camera camera = *cam;
+  const Reprojection rep = nextReprojection(reprojection, width, height,
+                                            scene_id, targets, camera, moved);
+  const Denoising den = denoisingOf(denoiser, width, height);
+  const Adaptive ada = adaptiveOf(adaptive, width, height, rep);
+
+  // Reprojected frames keep drawing new samples when the camera moves.
+  unsigned int seed = nextSeed(moved && !rep.enabled);
+
+  // Register occupancy : nb_threads = regs_per_block / 32
+  // Shared memory occupancy : nb_threads = shared_mem / 32
+  // Block size occupancy
+
+  dim3 threads_per_block(16, 16);
+  dim3 nb_blocks(width / threads_per_block.x + 1,
+                 height / threads_per_block.y + 1);
+
+  const scene::Scenes frame_scenes = scenes;
+  const SamplerFrame samples = frameSamples(seed);
+  const int frame_nb = seed;
+  // Reprojected frames are never previews.
+  const bool preview = moved && !rep.enabled;
+  const Megakernel frame_kernel = MEGAKERNELS[preview][postIndex(post_id)];
+
+  launchFrame(
+    makeGraphKey((const void*)frame_kernel, targets, scenes, scene_id, width,
+                 height, temporal_framebuffer, nullptr, reprojection,
+                 denoiser, adaptive, moved, post_id),
+    stream,
+    [&](cudaStream_t s) {
+      frame_kernel<<<nb_blocks, threads_per_block, 0, s>>>(
+        width, height, frame_scenes, scene_id, targets, camera, samples,
+        frame_nb, temporal_framebuffer, rep, den, ada);
+      enqueueDenoise(den, denoiser, surface, width, height, post_id, s);
+    },
+    { (const void*)frame_kernel },
+    [&](const FrameGraph& graph) {
+      setKernelArgs(graph, 0, width, height, frame_scenes, scene_id, targets,
+                    camera, samples, frame_nb, temporal_framebuffer, rep, den,
+                    ada);
+    });
+
+  return cudaSuccess;
+}
+
+cudaError_t
+raytraceOptix(driver::OptixBackend& optix, const OutputSurface& surface,
+              const scene::Scenes& scenes, unsigned int scene_id,
+              const std::vector<scene::Cubemap>& cubemaps, int cubemap_id,
+              const scene::Camera* const cam, const unsigned int width,
+              const unsigned int height, cudaStream_t stream,
+              const AccumulationBuffer& temporal_framebuffer, bool moved,
+              unsigned int post_id, ReprojectionBuffers* reprojection,
+              DenoiserBuffers* denoiser, AdaptiveBuffers* adaptive)
+{
+  // Software traversal, on GPUs or builds without OptiX, and for the
+  // scenes without acceleration structures, whose meshes are streamed.
+  if (!optix.available() || !optix.traversable(scene_id))
+    return raytrace(surface, scenes, scene_id, cubemaps, cubemap_id, cam,
+                    width, height, stream, temporal_framebuffer, moved,
+                    post_id, reprojection, denoiser, adaptive);
+
+  if (width == 0 || height == 0)
+    return cudaSuccess;
+
+  OptixFrame frame;
+  frame.traversable = optix.traversable(scene_id);
+  frame.width = width;
+  frame.height = height;
+  frame.scenes = scenes;
+  frame.scene_id = scene_id;
+  frame.targets = makeTargets(surface, cubemaps[cubemap_id]);
+  frame.cam = *cam;
+  frame.rep = nextReprojection(reprojection, width, height, scene_id,
+                               frame.targets, frame.cam, moved);
+  frame.den = denoisingOf(denoiser, width, height);
+  frame.ada = adaptiveOf(adaptive, width, height, frame.rep);
+
+  const unsigned int seed = nextSeed(moved && !frame.rep.enabled);
+  frame.samples = frameSamples(seed);
+  frame.frame_nb = seed;
+  frame.preview = moved && !frame.rep.enabled;
+  frame.post = postIndex(post_id);
+  frame.counters = countersAddress();
+
+  optix.launch(&frame, sizeof(OptixFrame), width, height, stream);
+  enqueueDenoise(frame.den, denoiser, surface, width, height, post_id,
+                 stream);
+  return cudaSuccess;
+}
+
+/// <summary>
+/// Computes the launch of the persistent kernel. The block size is the
+/// biggest multiple of the warp size whose registers fit in a block, and
+/// just enough blocks are launched to fill every multiprocessor. Variants
+/// of the kernel use more or less registers, so each one gets its own.
+/// </summary>
+dim3
+persistentLaunch(const driver::GPUInfo::GPU& gpu, const void* kernel,
+                 unsigned int& out_nb_blocks)
+{
+  cudaFuncAttributes attr;
+  cudaFuncGetAttributes(&attr, kernel);
+  cudaThrowError();
+
+  int nb_threads = gpu.regs_per_block / std::max(attr.numRegs, 1);
+  nb_threads = std::min(nb_threads, gpu.max_threads_per_block);
+  nb_threads = std::min(nb_threads, attr.maxThreadsPerBlock);
+  nb_threads =
+    std::max(gpu.warp_size, nb_threads / gpu.warp_size * gpu.warp_size);
+
+  int blocks_per_sm = 0;
+  cudaOccupancyMaxActiveBlocksPerMultiprocessor(&blocks_per_sm, kernel,
+                                                nb_threads, 0);
+  cudaThrowError();
+
+  out_nb_blocks = gpu.multiproc_count * std::max(blocks_per_sm, 1);
+  return dim3(nb_threads);
+}
+
+cudaError_t
+raytracePersistent(const OutputSurface& surface, const scene::Scenes& scenes,
+                   unsigned int scene_id,
+                   const std::vector<scene::Cubemap>& cubemaps,
+                   int cubemap_id, const scene::Camera* const cam,
+                   const unsigned int width, const unsigned int height,
+                   cudaStream_t stream,
+                   const AccumulationBuffer& temporal_framebuffer, bool moved,
+                   unsigned int post_id, const driver::GPUInfo::GPU& gpu,
+                   ReprojectionBuffers* reprojection, DenoiserBuffers* denoiser,
+                   AdaptiveBuffers* adaptive)
+{
+  if (width == 0 || height == 0)
+    return cudaSuccess;
+
+  DeviceState& state = deviceState();
+  unsigned int*& next_batch = state.next_batch;
+  if (!next_batch) {
+    cudaGetSymbolAddress((void**)&next_batch, g_next_batch);
+    cudaThrowError();
+  }
+
+  const FrameTargets targets = makeTargets(surface, cubemaps[cubemap_id]);
+  const scene::Camera camera = *cam;
+  const Reprojection rep = nextReprojection(reprojection, width, height,
+                                            scene_id, targets, camera, moved);
+  const Denoising den = denoisingOf(denoiser, width, height);
+  const Adaptive ada = adaptiveOf(adaptive, width, height, rep);
+
+  // Reprojected frames keep drawing new samples when the camera moves.
+  unsigned int seed = nextSeed(moved && !rep.enabled);
+
+  const scene::Scenes frame_scenes = scenes;
+  const SamplerFrame samples = frameSamples(seed);
+  const int frame_nb = seed;
+  // Reprojected frames are never previews.
+  const bool preview = moved && !rep.enabled;
+  const unsigned int post = postIndex(post_id);
+  const Megakernel frame_kernel = PERSISTENT_KERNELS[preview][post];
+
+  // The launch only depends on the variant and the GPU.
+  unsigned int& nb_blocks = state.persistent_blocks[preview][post];
+  dim3& threads_per_block = state.persistent_threads[preview][post];
+  if (nb_blocks == 0)
+    threads_per_block =
+      persistentLaunch(gpu, (const void*)frame_kernel, nb_blocks);
+
+  launchFrame(
+    makeGraphKey((const void*)frame_kernel, targets, scenes, scene_id, width,
+                 height, temporal_framebuffer, nullptr, reprojection,
+                 denoiser, adaptive, moved, post_id),
+    stream,
+    [&](cudaStream_t s) {
+      cudaMemsetAsync(next_batch, 0, sizeof(unsigned int), s);
+      frame_kernel<<<nb_blocks, threads_per_block, 0, s>>>(
+        width, height, frame_scenes, scene_id, targets, camera, samples,
+        frame_nb, temporal_framebuffer, rep, den, ada);
+      enqueueDenoise(den, denoiser, surface, width, height, post_id, s);
+    },
+    { (const void*)frame_kernel },
+    [&](const FrameGraph& graph) {
+      setKernelArgs(graph, 0, width, height, frame_scenes, scene_id, targets,
+                    camera, samples, frame_nb, temporal_framebuffer, rep, den,
+                    ada);
+    });
+
+  return cudaGetLastError();
+}
+
+cudaError_t
+raytraceViews(const std::vector<RenderView>& views,
+              const scene::Scenes& scenes, unsigned int scene_id,
+              const std::vector<scene::Cubemap>& cubemaps, int cubemap_id,
+              const unsigned int width, const unsigned int height,
+              unsigned int frame_nb, cudaStream_t stream,
+              const driver::GPUInfo::GPU& gpu)
+{
+  if (width == 0 || height == 0 || views.empty() || frame_nb == 0)
+    return cudaSuccess;
+
+  DeviceState& state = deviceState();
+  if (!state.next_view_batch) {
+    cudaGetSymbolAddress((void**)&state.next_view_batch, g_next_view_batch);
+    cudaThrowError();
+  }
+  if (state.views_blocks == 0)
+    state.views_threads =
+      persistentLaunch(gpu, (const void*)viewsKernel, state.views_blocks);
+
+  // The views of the previous batch may still be read by its launch.
+  if (views.size() > state.views_capacity) {
+    cudaStreamSynchronize(stream);
+    cudaFree(state.views);
+    cudaMalloc(&state.views, views.size() * sizeof(RenderView));
+    cudaThrowError();
+    state.views_capacity = views.size();
+  }
+
+  // Pageable copies are staged before returning, and ordered with the
+  // launches reading the previous views.
+  cudaMemcpyAsync(state.views, &views[0], views.size() * sizeof(RenderView),
+                  cudaMemcpyHostToDevice, stream);
+
+  // No surface: the views are only accumulated.
+  const FrameTargets targets =
+    makeTargets(OutputSurface(), cubemaps[cubemap_id]);
+  const SamplerFrame samples = frameSamples(frame_nb);
+
+  // Every sample is added to the framebuffers, which are cleared first.
+  if (frame_nb == 1) {
+    for (const auto& view : views)
+      cudaMemsetAsync(view.framebuffer.data, 0,
+                      (size_t)width * height *
+                        accumulationPixelSize(view.framebuffer.format),
+                      stream);
+  }
+
+  cudaMemsetAsync(state.next_view_batch, 0, sizeof(unsigned int), stream);
+  viewsKernel<<<state.views_blocks, state.views_threads, 0, stream>>>(
+    width, height, scenes, scene_id, targets, state.views, views.size(),
+    samples, frame_nb);
+
+  return cudaGetLastError();
+}
+
+WavefrontBuffers*
+createWavefront(unsigned int width, unsigned int height)
+{
+  auto* buffers = new WavefrontBuffers;
+  buffers->capacity = width * height;
+
+  cudaMalloc(&buffers->paths, buffers->capacity * sizeof(Path));
+  cudaMalloc(&buffers->hits, buffers->capacity * sizeof(IntersectionData));
+  for (unsigned int q = 0; q < NB_QUEUES; ++q)
+    cudaMalloc(&buffers->items[q], buffers->capacity * sizeof(unsigned int));
+  cudaMalloc(&buffers->sizes, NB_QUEUES * sizeof(unsigned int));
+  cudaMalloc(&buffers->bin_keys, buffers->capacity * sizeof(unsigned int));
+  cudaMalloc(&buffers->bin_counts, NB_REORDER_BINS * sizeof(unsigned int));
+  cudaMalloc(&buffers->binned, buffers->capacity * sizeof(unsigned int));
+  cudaThrowError();
+
+  return buffers;
+}
 
-// Copy the pointers from the function tables to the host side.
 void
-setupFunctionTables()
-{
-  cudaMemcpyFromSymbol(&h_post_process_table[0], p_none,
-                       sizeof(post_process_t));
-  cudaCheckError();
-  cudaMemcpyFromSymbol(&h_post_process_table[1], p_gray,
-                       sizeof(post_process_t));
-  cudaCheckError();
-  cudaMemcpyFromSymbol(&h_post_process_table[2], p_sepia,
-                       sizeof(post_process_t));
-  cudaCheckError();
-  cudaMemcpyFromSymbol(&h_post_process_table[3], p_invert,
-                       sizeof(post_process_t));
-  cudaCheckError();
+releaseWavefront(WavefrontBuffers* buffers)
+{
+  if (!buffers)
+    return;
+
+  cudaFree(buffers->paths);
+  cudaFree(buffers->hits);
+  for (unsigned int q = 0; q < NB_QUEUES; ++q)
+    cudaFree(buffers->items[q]);
+  cudaFree(buffers->sizes);
+  cudaFree(buffers->bin_keys);
+  cudaFree(buffers->bin_counts);
+  cudaFree(buffers->binned);
+
+  delete buffers;
+}
+
+cudaError_t
+raytraceWavefront(WavefrontBuffers* buffers, const OutputSurface& surface,
+                  const scene::Scenes& scenes, unsigned int scene_id,
+                  const std::vector<scene::Cubemap>& cubemaps, int cubemap_id,
+                  const scene::Camera* const cam, const unsigned int width,
+                  const unsigned int height, cudaStream_t stream,
+                  const AccumulationBuffer& temporal_framebuffer, bool moved,
+                  unsigned int post_id, ReprojectionBuffers* reprojection,
+                  DenoiserBuffers* denoiser, AdaptiveBuffers* adaptive,
+                  bool reorder)
+{
+  const unsigned int nb_pixels = width * height;
+  if (nb_pixels == 0)
+    return cudaSuccess;
+  if (!buffers || buffers->capacity < nb_pixels)
+    return cudaErrorInvalidValue;
+
+  const FrameTargets targets = makeTargets(surface, cubemaps[cubemap_id]);
+  const scene::Camera camera = *cam;
+  const Reprojection rep = nextReprojection(reprojection, width, height,
+                                            scene_id, targets, camera, moved);
+  const Denoising den = denoisingOf(denoiser, width, height);
+  const Adaptive ada = adaptiveOf(adaptive, width, height, rep);
+
+  // Reprojected frames keep drawing new samples when the camera moves.
+  unsigned int seed = nextSeed(moved && !rep.enabled);
+
+  const unsigned int nb_blocks = wavefrontBlocks(nb_pixels);
+  const unsigned int nb_threads = WAVEFRONT_NB_THREADS;
+
+  const SamplerFrame samples = frameSamples(seed);
+  const int frame_nb = seed;
+  const Queue first_rays = buffers->queue(QUEUE_RAYS);
+  Path* const paths = buffers->paths;
+  const Path* const resolved_paths = buffers->paths;
+  // Reprojected frames are never previews.
+  const bool preview = moved && !rep.enabled;
+  const ResolveKernel resolve = RESOLVE_KERNELS[preview][postIndex(post_id)];
+
+  // Previews stop at the first hit, there are no bounces to reorder.
+  const bool reorder_bounces = reorder && !preview;
+  const size_t bins_size = NB_REORDER_BINS * sizeof(unsigned int);
+  auto scatterBins = [&](const Queue& queue, cudaStream_t s) {
+    binOffsetsKernel<<<1, NB_REORDER_BINS, 0, s>>>(buffers->bin_counts);
+    binScatterKernel<<<nb_blocks, nb_threads, 0, s>>>(
+      queue, buffers->bin_keys, buffers->bin_counts, buffers->binned);
+    return Queue{ buffers->binned, queue.size };
+  };
+
+  auto enqueue = [&](cudaStream_t s) {
+    Queue rays = first_rays;
+    Queue next_rays = buffers->queue(QUEUE_NEXT_RAYS);
+    Queue miss = buffers->queue(QUEUE_MISS);
+    Queue diffuse = buffers->queue(QUEUE_DIFFUSE);
+    Queue refract = buffers->queue(QUEUE_REFRACT);
+
+    // Converged pixels are left out of the first queue.
+    if (ada.enabled)
+      cudaMemsetAsync(rays.size, 0, sizeof(unsigned int), s);
+    generateKernel<<<nb_blocks, nb_threads, 0, s>>>(
+      width, height, camera, samples, paths, rays, temporal_framebuffer,
+      preview, ada);
+
+    // The number of bounces is fixed, so that the host never
+    // has to wait for the size of the queues.
+    const int max_bounces = maxBounces(!preview, 1);
+    for (int b = 0; b < max_bounces; ++b) {
+      // Miss, diffuse and refract queues are next to each other.
+      cudaMemsetAsync(miss.size, 0, 3 * sizeof(unsigned int), s);
+      cudaMemsetAsync(next_rays.size, 0, sizeof(unsigned int), s);
+
+      // Camera rays are already coherent, only the bounces are binned.
+      Queue extend_rays = rays;
+      if (reorder_bounces && b > 0) {
+        cudaMemsetAsync(buffers->bin_counts, 0, bins_size, s);
+        rayBinsKernel<<<nb_blocks, nb_threads, 0, s>>>(
+          scenes, scene_id, buffers->paths, rays, buffers->bin_keys,
+          buffers->bin_counts);
+        extend_rays = scatterBins(rays, s);
+      }
+
+      extendKernel<<<nb_blocks, nb_threads, 0, s>>>(
+        scenes, scene_id, buffers->paths, buffers->hits, extend_rays, miss,
+        diffuse, refract, preview);
+      missKernel<<<nb_blocks, nb_threads, 0, s>>>(targets, buffers->paths,
+                                                  miss);
+
+      Queue shaded = diffuse;
+      if (reorder_bounces) {
+        cudaMemsetAsync(buffers->bin_counts, 0, bins_size, s);
+        hitBinsKernel<<<nb_blocks, nb_threads, 0, s>>>(
+          buffers->hits, diffuse, buffers->bin_keys, buffers->bin_counts);
+        shaded = scatterBins(diffuse, s);
+      }
+      shadeDiffuseKernel<<<nb_blocks, nb_threads, 0, s>>>(
+        scenes, scene_id, targets, buffers->paths, buffers->hits, shaded,
+        next_rays, b);
+      shadeRefractKernel<<<nb_blocks, nb_threads, 0, s>>>(
+        buffers->paths, buffers->hits, refract, next_rays, b);
+
+      std::swap(rays, next_rays);
+    }
+
+    resolve<<<nb_blocks, nb_threads, 0, s>>>(width, height, surface,
+                                             resolved_paths, frame_nb,
+                                             temporal_framebuffer, rep, den,
+                                             ada);
+    enqueueDenoise(den, denoiser, surface, width, height, post_id, s);
+  };
+
+  // The reordering stages are part of the captured graph.
+  GraphKey key = makeGraphKey((const void*)generateKernel, targets, scenes,
+                              scene_id, width, height, temporal_framebuffer,
+                              buffers, reprojection, denoiser, adaptive, moved,
+                              post_id);
+  key.reorder = reorder_bounces;
+
+  launchFrame(
+    key, stream, enqueue, { (const void*)generateKernel, (const void*)resolve },
+    [&](const FrameGraph& graph) {
+      setKernelArgs(graph, 0, width, height, camera, samples, paths,
+                    first_rays, temporal_framebuffer, preview, ada);
+      setKernelArgs(graph, 1, width, height, surface, resolved_paths,
+                    frame_nb, temporal_framebuffer, rep, den, ada);
+    });
+
+  return cudaGetLastError();
+}
+
+cudaError_t
+mergeFrames(const OutputSurface& surface,
+            const std::vector<AccumulationBuffer>& framebuffers,
+            const std::vector<unsigned int>& nb_frames,
+            const unsigned int width, const unsigned int height,
+            cudaStream_t stream, unsigned int post_id)
+{
+  if (framebuffers.size() > MAX_RENDER_DEVICES ||
+      framebuffers.size() != nb_frames.size())
+    return cudaErrorInvalidValue;
+
+  MergedFramebuffers merged;
+  merged.count = framebuffers.size();
+  unsigned int total = 0;
+  for (unsigned int k = 0; k < merged.count; ++k) {
+    merged.framebuffers[k] = framebuffers[k];
+    merged.nb_frames[k] = nb_frames[k];
+    total += nb_frames[k];
+  }
+  if (width == 0 || height == 0 || total == 0)
+    return cudaSuccess;
+
+  dim3 threads_per_block(16, 16);
+  dim3 nb_blocks(width / threads_per_block.x + 1,
+                 height / threads_per_block.y + 1);
+  const MergeKernel merge = MERGE_KERNELS[postIndex(post_id)];
+  merge<<<nb_blocks, threads_per_block, 0, stream>>>(width, height, surface,
+                                                     merged, 1.0f / total);
+
+  return cudaGetLastError();
+}
+
+/// <summary>
+/// Converts a temporal framebuffer to the sums of its pixels.
+/// </summary>
+__global__ void
+sumsKernel(const AccumulationBuffer framebuffer, float nb_frames,
+           unsigned int nb_pixels, float3* sums)
+{
+  const unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i < nb_pixels)
+    sums[i] = loadSum(framebuffer, i, nb_frames);
+}
+
+cudaError_t
+readSums(const AccumulationBuffer& framebuffer, unsigned int nb_frames,
+         size_t nb_pixels, float3* out_sums, cudaStream_t stream)
+{
+  if (nb_pixels == 0)
+    return cudaSuccess;
+
+  const size_t size = nb_pixels * sizeof(float3);
+  if (framebuffer.format == ACCUMULATION_FLOAT3) {
+    cudaMemcpyAsync(out_sums, framebuffer.data, size, cudaMemcpyDeviceToHost,
+                    stream);
+    return cudaStreamSynchronize(stream);
+  }
+
+  float3* sums = nullptr;
+  cudaError_t error = cudaMalloc(&sums, size);
+  if (error != cudaSuccess)
+    return error;
+
+  const unsigned int nb_threads = 256;
+  const unsigned int nb_blocks = (nb_pixels + nb_threads - 1) / nb_threads;
+  sumsKernel<<<nb_blocks, nb_threads, 0, stream>>>(framebuffer, nb_frames,
+                                                   nb_pixels, sums);
+  cudaMemcpyAsync(out_sums, sums, size, cudaMemcpyDeviceToHost, stream);
+  error = cudaStreamSynchronize(stream);
+  cudaFree(sums);
+  return error;
 }
+#endif // ARTRACER_OPTIX_PROGRAMS
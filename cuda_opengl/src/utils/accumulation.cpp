@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <utils/accumulation.h>
+
+namespace image {
+namespace {
+/// <summary>
+/// Bumped whenever the layout of the file or the range of its radiance
+/// changes: since version 2, samples are no longer clamped to [0, 1].
+/// </summary>
+constexpr uint32_t VERSION = 2;
+
+/// <summary>
+/// Number of rows read at once when merging a file.
+/// </summary>
+constexpr unsigned int BLOCK_ROWS = 64;
+
+const char MAGIC[4] = { 'A', 'R', 'T', 'A' };
+
+struct Header
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint64_t nb_samples;
+};
+}
+
+bool
+writeAccumulation(const std::string& path, const Accumulation& acc)
+{
+  if (acc.rgb.size() != (size_t)acc.width * acc.height * 3)
+    return false;
+
+  Header header;
+  std::memset(&header, 0, sizeof(Header));
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.width = acc.width;
+  header.height = acc.height;
+  header.nb_samples = acc.nb_samples;
+
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write((const char*)&header, sizeof(Header));
+  file.write((const char*)&acc.rgb[0], acc.rgb.size() * sizeof(float));
+  return file.good();
+}
+
+bool
+addAccumulation(const std::string& path, Accumulation& out)
+{
+  std::ifstream file(path, std::ios::binary);
+  Header header;
+  if (!file.read((char*)&header, sizeof(Header)) ||
+      std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.version != VERSION) {
+    std::cerr << "artracer: `" << path << "' is not an accumulation file."
+              << std::endl;
+    return false;
+  }
+
+  if (out.rgb.empty()) {
+    out.width = header.width;
+    out.height = header.height;
+    out.nb_samples = 0;
+    out.rgb.assign((size_t)out.width * out.height * 3, 0.0f);
+  } else if (header.width != out.width || header.height != out.height) {
+    std::cerr << "artracer: `" << path << "' has another size ("
+              << header.width << "x" << header.height << ")." << std::endl;
+    return false;
+  }
+
+  const size_t row_size = (size_t)out.width * 3;
+  std::vector<float> block(row_size * BLOCK_ROWS);
+  for (unsigned int y = 0; y < out.height; y += BLOCK_ROWS) {
+    const size_t nb_values = row_size * std::min(BLOCK_ROWS, out.height - y);
+    if (!file.read((char*)&block[0], nb_values * sizeof(float))) {
+      std::cerr << "artracer: `" << path << "' is truncated." << std::endl;
+      return false;
+    }
+
+    float* dst = &out.rgb[y * row_size];
+    for (size_t i = 0; i < nb_values; ++i) dst[i] += block[i];
+  }
+
+  out.nb_samples += header.nb_samples;
+  return true;
+}
+}
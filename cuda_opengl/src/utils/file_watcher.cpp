@@ -0,0 +1,74 @@
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <utils/file_watcher.h>
+
+namespace utils {
+namespace {
+/// <summary>
+/// Reads the size and modification time of a file, -1 when it is missing.
+/// Times keep their sub-second part, saves made within the same second
+/// being told apart: in nanoseconds, or in 100 nanoseconds on Windows.
+/// </summary>
+void
+statFile(const std::string& path, int64_t& out_size, int64_t& out_mtime)
+{
+  out_size = -1;
+  out_mtime = -1;
+#ifdef _WIN32
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data))
+    return;
+  out_size = ((int64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+  out_mtime = ((int64_t)data.ftLastWriteTime.dwHighDateTime << 32) |
+              data.ftLastWriteTime.dwLowDateTime;
+#else
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return;
+#ifdef __APPLE__
+  const int64_t nsec = st.st_mtimespec.tv_nsec;
+#else
+  const int64_t nsec = st.st_mtim.tv_nsec;
+#endif
+  out_size = st.st_size;
+  out_mtime = (int64_t)st.st_mtime * 1000000000 + nsec;
+#endif
+}
+}
+
+void
+FileWatcher::watch(const std::vector<std::string>& paths)
+{
+  _files.resize(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    _files[i].path = paths[i];
+    statFile(paths[i], _files[i].size, _files[i].mtime);
+  }
+}
+
+std::vector<std::string>
+FileWatcher::poll()
+{
+  std::vector<std::string> modified;
+  for (auto& file : _files) {
+    int64_t size = 0;
+    int64_t mtime = 0;
+    statFile(file.path, size, mtime);
+    if (size == file.size && mtime == file.mtime)
+      continue;
+
+    // A file being replaced is only reported once it is back.
+    file.size = size;
+    file.mtime = mtime;
+    if (size >= 0)
+      modified.push_back(file.path);
+  }
+  return modified;
+}
+}
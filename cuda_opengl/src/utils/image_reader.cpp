@@ -0,0 +1,217 @@
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include <utils/image_reader.h>
+
+namespace image {
+namespace {
+enum PixelType
+{
+  PIXEL_UINT = 0,
+  PIXEL_HALF,
+  PIXEL_FLOAT
+};
+
+/// <summary>
+/// Reads values in little endian, as OpenEXR stores them. Reading past the
+/// end of the data flags the reader instead of throwing.
+/// </summary>
+class LEReader
+{
+public:
+  explicit LEReader(const std::vector<uint8_t>& data)
+    : _data(data)
+  {}
+
+  bool failed() const { return _failed; }
+
+  size_t offset() const { return _offset; }
+
+  void seek(size_t offset)
+  {
+    _failed = _failed || offset > _data.size();
+    _offset = offset;
+  }
+
+  const uint8_t* bytes(size_t size)
+  {
+    if (_failed || _offset + size > _data.size()) {
+      _failed = true;
+      return nullptr;
+    }
+    const uint8_t* out = &_data[_offset];
+    _offset += size;
+    return out;
+  }
+
+  uint8_t u8()
+  {
+    const uint8_t* b = bytes(1);
+    return b ? b[0] : 0;
+  }
+
+  uint32_t u32()
+  {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) v |= (uint32_t)u8() << (8 * i);
+    return v;
+  }
+
+  uint64_t u64()
+  {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v |= (uint64_t)u8() << (8 * i);
+    return v;
+  }
+
+  std::string str()
+  {
+    std::string s;
+    for (uint8_t c = u8(); c != 0 && !_failed; c = u8()) s.push_back(c);
+    return s;
+  }
+
+private:
+  const std::vector<uint8_t>& _data;
+  size_t _offset = 0;
+  bool _failed = false;
+};
+
+struct Channel
+{
+  std::string name;
+  uint32_t type;
+};
+
+float
+halfToFloat(uint16_t h)
+{
+  const int sign = h >> 15 ? -1 : 1;
+  const int exponent = (h >> 10) & 0x1F;
+  const int mantissa = h & 0x3FF;
+  if (exponent == 0)
+    return sign * std::ldexp((float)mantissa, -24);
+  if (exponent == 31)
+    return mantissa ? NAN : sign * INFINITY;
+  return sign * std::ldexp((float)(mantissa | 0x400), exponent - 25);
+}
+
+float
+readSample(const uint8_t* p, uint32_t type)
+{
+  if (type == PIXEL_HALF)
+    return halfToFloat(p[0] | (p[1] << 8));
+
+  const uint32_t bits = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+  float v;
+  std::memcpy(&v, &bits, sizeof(v));
+  return v;
+}
+
+/// <summary>
+/// Index of the RGB component a channel is read into, -1 to skip it and 3
+/// for a luminance channel, copied into the three components.
+/// </summary>
+int
+componentOf(const std::string& name)
+{
+  if (name == "R")
+    return 0;
+  if (name == "G")
+    return 1;
+  if (name == "B")
+    return 2;
+  if (name == "Y")
+    return 3;
+  return -1;
+}
+}
+
+bool
+readEXR(const std::string& path, unsigned int& out_width,
+        unsigned int& out_height, std::vector<float>& out_rgb)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+  const std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                                  std::istreambuf_iterator<char>());
+
+  LEReader r(data);
+  if (r.u32() != 20000630)
+    return false;
+  // Tiled, deep or multipart files set flags after the version.
+  if ((r.u32() & ~0x400u) != 2)
+    return false;
+
+  std::vector<Channel> channels;
+  int32_t box[4] = { 0, 0, -1, -1 };
+  int compression = -1;
+  for (std::string name = r.str(); !name.empty() && !r.failed();
+       name = r.str()) {
+    const std::string type = r.str();
+    const uint32_t size = r.u32();
+    const size_t end = r.offset() + size;
+    if (name == "channels" && type == "chlist") {
+      for (std::string c = r.str(); !c.empty() && !r.failed(); c = r.str()) {
+        channels.push_back({ c, r.u32() });
+        r.bytes(12); // pLinear, reserved bytes and sampling
+      }
+    } else if (name == "compression")
+      compression = r.u8();
+    else if (name == "dataWindow") {
+      for (int i = 0; i < 4; ++i) box[i] = (int32_t)r.u32();
+    }
+    r.seek(end);
+  }
+
+  if (r.failed() || compression != 0 || channels.empty() ||
+      box[2] < box[0] || box[3] < box[1])
+    return false;
+
+  const unsigned int width = box[2] - box[0] + 1;
+  const unsigned int height = box[3] - box[1] + 1;
+  size_t pixel_size = 0;
+  for (const auto& c : channels) {
+    if (c.type != PIXEL_HALF && c.type != PIXEL_FLOAT &&
+        componentOf(c.name) >= 0)
+      return false;
+    pixel_size += c.type == PIXEL_HALF ? 2 : 4;
+  }
+
+  // Uncompressed files use one scanline per chunk, each one made of its
+  // y, its size, and its channels one after the other.
+  out_rgb.assign((size_t)width * height * 3, 0.0f);
+  const size_t table = r.offset();
+  for (unsigned int i = 0; i < height; ++i) {
+    r.seek(table + (size_t)i * sizeof(uint64_t));
+    r.seek(r.u64());
+    const int32_t y = (int32_t)r.u32() - box[1];
+    if (y < 0 || y >= (int32_t)height || r.u32() != pixel_size * width)
+      return false;
+
+    float* row = &out_rgb[(size_t)y * width * 3];
+    for (const auto& c : channels) {
+      const size_t sample_size = c.type == PIXEL_HALF ? 2 : 4;
+      const uint8_t* samples = r.bytes(sample_size * width);
+      const int comp = componentOf(c.name);
+      if (!samples)
+        return false;
+      if (comp < 0)
+        continue;
+      for (unsigned int x = 0; x < width; ++x) {
+        const float v = readSample(samples + x * sample_size, c.type);
+        for (int k = comp == 3 ? 0 : comp; k <= (comp == 3 ? 2 : comp); ++k)
+          row[x * 3 + k] = v;
+      }
+    }
+  }
+
+  out_width = width;
+  out_height = height;
+  return true;
+}
+}
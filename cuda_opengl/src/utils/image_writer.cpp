@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <utils/image_writer.h>
+
+namespace image {
+namespace {
+/// <summary>
+/// Appends values in little endian, as OpenEXR stores them.
+/// </summary>
+class LEWriter
+{
+public:
+  void u8(uint8_t v) { data.push_back(v); }
+
+  void u32(uint32_t v)
+  {
+    for (int i = 0; i < 4; ++i) u8((v >> (8 * i)) & 0xFF);
+  }
+
+  void u64(uint64_t v)
+  {
+    for (int i = 0; i < 8; ++i) u8((v >> (8 * i)) & 0xFF);
+  }
+
+  void f32(float v)
+  {
+    uint32_t bits;
+    static_assert(sizeof(bits) == sizeof(v), "float must be 32 bits");
+    std::memcpy(&bits, &v, sizeof(v));
+    u32(bits);
+  }
+
+  void str(const char* s)
+  {
+    while (*s) u8(*s++);
+    u8(0);
+  }
+
+  /// <summary>
+  /// Starts an attribute of the header, whose value is `size' bytes.
+  /// </summary>
+  void attribute(const char* name, const char* type, uint32_t size)
+  {
+    str(name);
+    str(type);
+    u32(size);
+  }
+
+  std::vector<uint8_t> data;
+};
+
+bool
+writeFile(const std::string& path, const std::vector<uint8_t>& data)
+{
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write((const char*)&data[0], data.size());
+  return file.good();
+}
+
+uint32_t
+crc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+{
+  static uint32_t table[256] = {};
+  if (table[1] == 0) {
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k)
+        c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      table[n] = c;
+    }
+  }
+
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i)
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+/// <summary>
+/// Appends the big endian values PNG uses.
+/// </summary>
+void
+be32(std::vector<uint8_t>& out, uint32_t v)
+{
+  for (int i = 3; i >= 0; --i) out.push_back((v >> (8 * i)) & 0xFF);
+}
+
+void
+pngChunk(std::vector<uint8_t>& out, const char* type,
+         const std::vector<uint8_t>& data)
+{
+  be32(out, data.size());
+  const size_t start = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), data.begin(), data.end());
+  be32(out, crc32(&out[start], out.size() - start));
+}
+}
+
+bool
+writeEXR(const std::string& path, unsigned int width, unsigned int height,
+         const float* rgb)
+{
+  if (width == 0 || height == 0)
+    return false;
+
+  LEWriter w;
+  w.u32(20000630); // Magic number
+  w.u32(2);        // Version 2, single part scanline file
+
+  // Channels are sorted by name, and stored as 32 bits floats.
+  const char* channels[] = { "B", "G", "R" };
+  w.attribute("channels", "chlist", 3 * 18 + 1);
+  for (const char* name : channels) {
+    w.str(name);
+    w.u32(2); // FLOAT
+    w.u32(0); // pLinear and reserved bytes
+    w.u32(1); // x sampling
+    w.u32(1); // y sampling
+  }
+  w.u8(0);
+
+  w.attribute("compression", "compression", 1);
+  w.u8(0);
+  for (const char* window : { "dataWindow", "displayWindow" }) {
+    w.attribute(window, "box2i", 16);
+    w.u32(0);
+    w.u32(0);
+    w.u32(width - 1);
+    w.u32(height - 1);
+  }
+  w.attribute("lineOrder", "lineOrder", 1);
+  w.u8(0);
+  w.attribute("pixelAspectRatio", "float", 4);
+  w.f32(1.0f);
+  w.attribute("screenWindowCenter", "v2f", 8);
+  w.f32(0.0f);
+  w.f32(0.0f);
+  w.attribute("screenWindowWidth", "float", 4);
+  w.f32(1.0f);
+  w.u8(0);
+
+  // Uncompressed files use one scanline per chunk, each one made of its
+  // y, its size, and its channels one after the other.
+  const uint32_t line_size = width * 3 * sizeof(float);
+  const uint64_t table_end = w.data.size() + height * sizeof(uint64_t);
+  for (unsigned int y = 0; y < height; ++y)
+    w.u64(table_end + (uint64_t)y * (8 + line_size));
+
+  for (unsigned int y = 0; y < height; ++y) {
+    w.u32(y);
+    w.u32(line_size);
+    for (int c = 2; c >= 0; --c) {
+      for (unsigned int x = 0; x < width; ++x)
+        w.f32(rgb[(y * width + x) * 3 + c]);
+    }
+  }
+
+  return writeFile(path, w.data);
+}
+
+bool
+writePNG(const std::string& path, unsigned int width, unsigned int height,
+         const unsigned char* rgba)
+{
+  if (width == 0 || height == 0)
+    return false;
+
+  // Scanlines, each one starting with the `None' filter.
+  std::vector<uint8_t> raw;
+  raw.reserve((width * 3 + 1) * height);
+  for (unsigned int y = 0; y < height; ++y) {
+    raw.push_back(0);
+    for (unsigned int x = 0; x < width; ++x) {
+      const unsigned char* texel = rgba + (y * width + x) * 4;
+      raw.insert(raw.end(), texel, texel + 3);
+    }
+  }
+
+  // Zlib stream made of stored deflate blocks.
+  constexpr size_t MAX_BLOCK = 65535;
+  std::vector<uint8_t> zlib = { 0x78, 0x01 };
+  for (size_t offset = 0; offset < raw.size(); offset += MAX_BLOCK) {
+    const size_t size = std::min(MAX_BLOCK, raw.size() - offset);
+    zlib.push_back(offset + size == raw.size());
+    zlib.push_back(size & 0xFF);
+    zlib.push_back(size >> 8);
+    zlib.push_back(~size & 0xFF);
+    zlib.push_back((~size >> 8) & 0xFF);
+    zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + size);
+  }
+
+  uint32_t a = 1;
+  uint32_t b = 0;
+  for (uint8_t v : raw) {
+    a = (a + v) % 65521;
+    b = (b + a) % 65521;
+  }
+  be32(zlib, (b << 16) | a);
+
+  std::vector<uint8_t> header;
+  be32(header, width);
+  be32(header, height);
+  header.push_back(8); // Bit depth
+  header.push_back(2); // RGB
+  header.push_back(0); // Compression
+  header.push_back(0); // Filter
+  header.push_back(0); // No interlacing
+
+  std::vector<uint8_t> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  pngChunk(png, "IHDR", header);
+  pngChunk(png, "IDAT", zlib);
+  pngChunk(png, "IEND", {});
+
+  return writeFile(path, png);
+}
+}
@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <cfloat>
+#include <fstream>
+#include <iostream>
+
+#ifdef ARTRACER_NVTX
+#include <nvToolsExt.h>
+#endif
+
+#include <utils/profiler.h>
+
+namespace profiling {
+namespace {
+const char* const STAGE_NAMES[NB_STAGES] = { "Map",    "Trace", "Merge",
+                                             "Encode", "Unmap", "Blit" };
+
+/// <summary>
+/// Summary of a series of timings.
+/// </summary>
+struct Summary
+{
+  float mean = 0.0f;
+  float min = 0.0f;
+  float max = 0.0f;
+};
+
+template <typename Getter>
+Summary
+summarize(const std::deque<FrameStats>& history, Getter get)
+{
+  Summary summary;
+  if (history.empty())
+    return summary;
+
+  double sum = 0.0;
+  summary.min = FLT_MAX;
+  summary.max = 0.0f;
+  for (const auto& frame : history) {
+    const float value = get(frame);
+    sum += value;
+    summary.min = std::min(summary.min, value);
+    summary.max = std::max(summary.max, value);
+  }
+  summary.mean = (float)(sum / history.size());
+  return summary;
+}
+
+/// <summary>
+/// Writes the summary of a series, and the value of each frame.
+/// </summary>
+template <typename Getter>
+void
+writeSeries(std::ofstream& out, const std::deque<FrameStats>& history,
+            Getter get)
+{
+  const Summary summary = summarize(history, get);
+  out << "\"mean_ms\": " << summary.mean << ", \"min_ms\": " << summary.min
+      << ", \"max_ms\": " << summary.max << ", \"history_ms\": [";
+  for (size_t i = 0; i < history.size(); ++i)
+    out << (i ? ", " : "") << get(history[i]);
+  out << "]";
+}
+}
+
+const char*
+stageName(Stage stage)
+{
+  return STAGE_NAMES[stage];
+}
+
+Profiler::Profiler()
+  : _initialized(false)
+  , _gl(false)
+  , _current(0)
+  , _started(false)
+{
+}
+
+Profiler::~Profiler()
+{
+  release();
+}
+
+void
+Profiler::init(bool gl)
+{
+  release();
+
+  _gl = gl;
+  for (auto& slot : _slots) {
+    for (unsigned int s = 0; s < NB_STAGES; ++s) {
+      cudaEventCreate(&slot.begin[s]);
+      cudaEventCreate(&slot.end[s]);
+      slot.recorded[s] = false;
+    }
+    slot.query = 0;
+    if (_gl)
+      glGenQueries(1, &slot.query);
+    slot.pending = false;
+  }
+
+  _current = 0;
+  _started = false;
+  _history.clear();
+  _initialized = true;
+}
+
+void
+Profiler::release()
+{
+  if (!_initialized)
+    return;
+
+  for (auto& slot : _slots) {
+    for (unsigned int s = 0; s < NB_STAGES; ++s) {
+      cudaEventDestroy(slot.begin[s]);
+      cudaEventDestroy(slot.end[s]);
+    }
+    if (_gl)
+      glDeleteQueries(1, &slot.query);
+  }
+  _initialized = false;
+}
+
+void
+Profiler::beginFrame()
+{
+  if (!_initialized)
+    return;
+
+  // The CPU time of a frame is only known once the next one starts.
+  const auto now = std::chrono::steady_clock::now();
+  if (_started) {
+    Slot& previous =
+      _slots[(_current + FRAMES_IN_FLIGHT - 1) % FRAMES_IN_FLIGHT];
+    previous.stats.frame_ms =
+      std::chrono::duration<float, std::milli>(now - _frame_start).count();
+  }
+  _frame_start = now;
+  _started = true;
+
+  Slot& slot = _slots[_current];
+  if (slot.pending)
+    collect(slot);
+
+  for (unsigned int s = 0; s < NB_STAGES; ++s) slot.recorded[s] = false;
+  slot.stats = FrameStats();
+
+#ifdef ARTRACER_NVTX
+  nvtxRangePushA("Frame");
+#endif
+}
+
+void
+Profiler::begin(Stage stage, cudaStream_t stream)
+{
+  if (!_initialized)
+    return;
+
+#ifdef ARTRACER_NVTX
+  nvtxRangePushA(STAGE_NAMES[stage]);
+#endif
+
+  Slot& slot = _slots[_current];
+  if (stage == STAGE_BLIT) {
+    if (_gl)
+      glBeginQuery(GL_TIME_ELAPSED, slot.query);
+  } else
+    cudaEventRecord(slot.begin[stage], stream);
+}
+
+void
+Profiler::end(Stage stage, cudaStream_t stream)
+{
+  if (!_initialized)
+    return;
+
+  Slot& slot = _slots[_current];
+  if (stage == STAGE_BLIT) {
+    if (_gl)
+      glEndQuery(GL_TIME_ELAPSED);
+    slot.recorded[stage] = _gl;
+  } else {
+    cudaEventRecord(slot.end[stage], stream);
+    slot.recorded[stage] = true;
+  }
+
+#ifdef ARTRACER_NVTX
+  nvtxRangePop();
+#endif
+}
+
+void
+Profiler::setCounters(const RenderCounters& counters)
+{
+  if (!_initialized)
+    return;
+
+  Slot& slot = _slots[_current];
+  slot.stats.has_counters = true;
+  slot.stats.counters = counters;
+}
+
+void
+Profiler::endFrame()
+{
+  if (!_initialized)
+    return;
+
+#ifdef ARTRACER_NVTX
+  nvtxRangePop();
+#endif
+
+  _slots[_current].pending = true;
+  _current = (_current + 1) % FRAMES_IN_FLIGHT;
+}
+
+void
+Profiler::collect(Slot& slot)
+{
+  slot.pending = false;
+
+  for (unsigned int s = 0; s < NB_STAGES; ++s) {
+    float ms = 0.0f;
+    if (slot.recorded[s] && s == STAGE_BLIT) {
+      GLuint64 ns = 0;
+      glGetQueryObjectui64v(slot.query, GL_QUERY_RESULT, &ns);
+      ms = ns * 1e-6f;
+    } else if (slot.recorded[s]) {
+      // Frames this old are normally done, this does not wait.
+      cudaEventSynchronize(slot.end[s]);
+      if (cudaEventElapsedTime(&ms, slot.begin[s], slot.end[s]) !=
+          cudaSuccess)
+        ms = 0.0f;
+    }
+    slot.stats.stage_ms[s] = ms;
+  }
+  cudaGetLastError();
+
+  _history.push_back(slot.stats);
+  if (_history.size() > HISTORY_SIZE)
+    _history.pop_front();
+}
+
+bool
+Profiler::writeJSON(const std::string& path) const
+{
+  std::ofstream out(path, std::ios::trunc);
+  if (!out.is_open())
+    return false;
+
+  out << "{\n  \"frames\": " << _history.size() << ",\n  \"stages\": [\n";
+  for (unsigned int s = 0; s < NB_STAGES; ++s) {
+    out << "    { \"name\": \"" << STAGE_NAMES[s] << "\", ";
+    writeSeries(out, _history,
+                [s](const FrameStats& frame) { return frame.stage_ms[s]; });
+    out << " }" << (s + 1 < NB_STAGES ? "," : "") << "\n";
+  }
+  out << "  ],\n  \"frame\": { ";
+  writeSeries(out, _history,
+              [](const FrameStats& frame) { return frame.frame_ms; });
+  out << " },\n  \"counters\": ";
+
+  // Averages of the frames having counters, rays per second being
+  // measured against the time of the kernels.
+  RenderCounters sum = RenderCounters();
+  double trace_ms = 0.0;
+  size_t nb_counted = 0;
+  for (const auto& frame : _history) {
+    if (!frame.has_counters)
+      continue;
+    sum.rays += frame.counters.rays;
+    sum.triangle_tests += frame.counters.triangle_tests;
+    sum.paths += frame.counters.paths;
+    sum.bounces += frame.counters.bounces;
+    trace_ms += frame.stage_ms[STAGE_TRACE];
+    ++nb_counted;
+  }
+
+  if (nb_counted == 0)
+    out << "null";
+  else {
+    out << "{ \"rays_per_frame\": " << (double)sum.rays / nb_counted
+        << ", \"mrays_per_s\": "
+        << (trace_ms > 0.0 ? sum.rays / (trace_ms * 1e3) : 0.0)
+        << ", \"triangle_tests_per_ray\": "
+        << (sum.rays ? (double)sum.triangle_tests / sum.rays : 0.0)
+        << ", \"bounces_per_path\": "
+        << (sum.paths ? (double)sum.bounces / sum.paths : 0.0) << " }";
+  }
+  out << "\n}\n";
+
+  return out.good();
+}
+} // namespace profiling
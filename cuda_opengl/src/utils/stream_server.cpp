@@ -0,0 +1,274 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <utils/stream_server.h>
+
+namespace remote {
+namespace {
+/// <summary>
+/// Time a frame can take to be sent before the client is deemed too slow.
+/// </summary>
+constexpr int SEND_TIMEOUT_MS = 500;
+
+/// <summary>
+/// Length of the longest line a client can send, events being far shorter.
+/// </summary>
+constexpr size_t MAX_LINE_SIZE = 256;
+
+#ifdef _WIN32
+typedef SOCKET Socket;
+constexpr Socket NO_SOCKET = INVALID_SOCKET;
+
+bool
+startSockets()
+{
+  static bool started = false;
+  WSADATA data;
+  if (!started)
+    started = WSAStartup(MAKEWORD(2, 2), &data) == 0;
+  return started;
+}
+
+void
+closeSocket(Socket socket)
+{
+  closesocket(socket);
+}
+
+void
+setSendTimeout(Socket socket, int ms)
+{
+  const DWORD timeout = ms;
+  setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout,
+             sizeof(timeout));
+}
+#else
+typedef int Socket;
+constexpr Socket NO_SOCKET = -1;
+
+bool
+startSockets()
+{
+  return true;
+}
+
+void
+closeSocket(Socket socket)
+{
+  ::close(socket);
+}
+
+void
+setSendTimeout(Socket socket, int ms)
+{
+  timeval timeout;
+  timeout.tv_sec = ms / 1000;
+  timeout.tv_usec = (ms % 1000) * 1000;
+  setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+#endif
+
+/// <summary>
+/// Whether a socket can be read without blocking: it has data, a client
+/// waiting to be accepted, or was closed.
+/// </summary>
+bool
+readable(Socket socket)
+{
+  fd_set set;
+  FD_ZERO(&set);
+  FD_SET(socket, &set);
+  timeval timeout = { 0, 0 };
+  return select((int)socket + 1, &set, nullptr, nullptr, &timeout) > 0;
+}
+
+/// <summary>
+/// Parses a line sent by the client, ignoring unknown ones.
+/// </summary>
+bool
+parseEvent(const std::string& line, InputEvent& out_event)
+{
+  std::istringstream in(line);
+  char type = 0;
+  in >> type;
+  out_event = InputEvent();
+  switch (type) {
+    case 'k': {
+      int pressed = 0;
+      out_event.type = InputEvent::KEY;
+      if (!(in >> out_event.key >> pressed))
+        return false;
+      out_event.pressed = pressed != 0;
+      return true;
+    }
+    case 'm':
+      out_event.type = InputEvent::MOUSE;
+      return (bool)(in >> out_event.dx >> out_event.dy);
+    case 'q':
+      out_event.type = InputEvent::QUIT;
+      return true;
+    default:
+      return false;
+  }
+}
+}
+
+StreamServer::StreamServer()
+  : _listener(-1)
+  , _client(-1)
+{
+}
+
+StreamServer::~StreamServer()
+{
+  close();
+}
+
+bool
+StreamServer::listen(unsigned short port)
+{
+  close();
+  if (!startSockets()) {
+    std::cerr << "artracer: failed to start the sockets." << std::endl;
+    return false;
+  }
+
+  Socket listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listener == NO_SOCKET) {
+    std::cerr << "artracer: failed to create a socket." << std::endl;
+    return false;
+  }
+  const int reuse = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse,
+             sizeof(reuse));
+
+  sockaddr_in address;
+  std::memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if (bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 ||
+      ::listen(listener, 1) != 0) {
+    std::cerr << "artracer: failed to listen on port " << port << "."
+              << std::endl;
+    closeSocket(listener);
+    return false;
+  }
+
+  _listener = (long long)listener;
+  std::cout << "Streaming on port " << port << "." << std::endl;
+  return true;
+}
+
+bool
+StreamServer::accept()
+{
+  if (_listener < 0 || !readable((Socket)_listener))
+    return false;
+
+  Socket client = ::accept((Socket)_listener, nullptr, nullptr);
+  if (client == NO_SOCKET)
+    return false;
+
+  // Frames are sent as soon as they are encoded.
+  const int no_delay = 1;
+  setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char*)&no_delay,
+             sizeof(no_delay));
+  setSendTimeout(client, SEND_TIMEOUT_MS);
+
+  disconnect();
+  _client = (long long)client;
+  std::cout << "Stream client connected." << std::endl;
+  return true;
+}
+
+void
+StreamServer::poll(std::vector<InputEvent>& out_events)
+{
+  out_events.clear();
+  char buffer[1024];
+  while (_client >= 0 && readable((Socket)_client)) {
+    const int size = recv((Socket)_client, buffer, sizeof(buffer), 0);
+    if (size <= 0) {
+      disconnect();
+      break;
+    }
+
+    for (int i = 0; i < size && _client >= 0; ++i) {
+      if (buffer[i] != '\n') {
+        _line += buffer[i];
+        // A client never ending its lines is not following the protocol.
+        if (_line.size() > MAX_LINE_SIZE) {
+          std::cerr << "artracer: stream client sent too long a line."
+                    << std::endl;
+          disconnect();
+        }
+        continue;
+      }
+      InputEvent event;
+      if (parseEvent(_line, event))
+        out_events.push_back(event);
+      _line.clear();
+    }
+  }
+}
+
+void
+StreamServer::send(const std::vector<unsigned char>& packet)
+{
+#ifdef _WIN32
+  const int flags = 0;
+#else
+  // A closed connection fails the call instead of raising SIGPIPE.
+  const int flags = MSG_NOSIGNAL;
+#endif
+
+  size_t offset = 0;
+  while (_client >= 0 && offset < packet.size()) {
+    const int size =
+      ::send((Socket)_client, (const char*)&packet[offset],
+             (int)(packet.size() - offset), flags);
+    if (size <= 0) {
+      disconnect();
+      return;
+    }
+    offset += size;
+  }
+}
+
+void
+StreamServer::disconnect()
+{
+  if (_client < 0)
+    return;
+
+  closeSocket((Socket)_client);
+  _client = -1;
+  _line.clear();
+  std::cout << "Stream client disconnected." << std::endl;
+}
+
+void
+StreamServer::close()
+{
+  disconnect();
+  if (_listener >= 0)
+    closeSocket((Socket)_listener);
+  _listener = -1;
+}
+} // namespace remote
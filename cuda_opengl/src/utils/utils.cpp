@@ -1,3 +1,12 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include <utils/utils.h>
 
 namespace utils {
@@ -19,4 +28,49 @@ isHexa(const std::string& s)
   return s.compare(0, 2, "0x") == 0 && s.size() > 2 &&
          s.find_first_not_of("0123456789abcdefABCDEF", 2) == std::string::npos;
 }
+
+bool
+hasExtension(const std::string& path, const char* ext)
+{
+  const size_t size = std::strlen(ext);
+  if (path.size() < size)
+    return false;
+  std::string end = path.substr(path.size() - size);
+  std::transform(end.begin(), end.end(), end.begin(), ::tolower);
+  return end == ext;
+}
+
+void
+parallelFor(size_t count, const std::function<void(size_t)>& task)
+{
+  size_t nb_threads = std::max(1u, std::thread::hardware_concurrency());
+  nb_threads = std::min(nb_threads, count);
+
+  std::atomic<size_t> next(0);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  auto worker = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      try {
+        task(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < nb_threads; ++t)
+    threads.emplace_back(worker);
+
+  worker();
+  for (auto& thread : threads)
+    thread.join();
+
+  if (error)
+    std::rethrow_exception(error);
+}
 }